@@ -0,0 +1,79 @@
+// AST build benchmark: prints the size of a node and times building ASTs of
+// growing size, and reading the line and column of every node
+// compile with:
+// g++ -O2 --std=c++17 bench_ast.cpp -o build/bench_ast
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "peglib.h"
+
+const char *grammar = R"(
+  List   <- Item (',' Item)*
+  Item   <- '[' List ']' / Number
+  Number <- < [0-9]+ >
+  %whitespace <- [ \t\n]*
+)";
+
+// Nested lists of numbers, eight to a line
+std::string make_input(size_t items) {
+  std::string s;
+  for (size_t i = 0; i < items; i++) {
+    if (i) { s += i % 8 == 0 ? ",\n" : ", "; }
+    if (i % 4 == 0) { s += "["; }
+    s += std::to_string(i * 7919 % 10000);
+    if (i % 4 == 3 || i + 1 == items) { s += "]"; }
+  }
+  return s;
+}
+
+size_t count_nodes(const peg::Ast &ast, size_t &lines) {
+  lines += ast.line + ast.column;
+  size_t count = 1;
+  for (const auto &node : ast.nodes) {
+    count += count_nodes(*node, lines);
+  }
+  return count;
+}
+
+template <typename F> double time_of(F fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main() {
+  std::printf("sizeof(peg::Ast): %zu bytes\n", sizeof(peg::Ast));
+  std::printf("%8s %10s %10s %10s\n", "nodes", "build ms", "median",
+              "lines ms");
+
+  peg::parser parser(grammar);
+  parser.enable_ast();
+
+  for (auto items : {10000, 100000, 300000}) {
+    auto input = make_input(static_cast<size_t>(items));
+
+    // Best and median of seven rounds, as a single run is noisy
+    std::vector<double> builds, reads;
+    size_t nodes = 0;
+    for (auto round = 0; round < 7; round++) {
+      std::shared_ptr<peg::Ast> ast;
+      builds.push_back(time_of([&] { parser.parse(input, ast); }));
+      if (!ast) {
+        std::printf("failed to parse %d items\n", items);
+        return 1;
+      }
+      size_t lines = 0;
+      reads.push_back(time_of([&] { nodes = count_nodes(*ast, lines); }));
+    }
+    std::sort(builds.begin(), builds.end());
+    std::sort(reads.begin(), reads.end());
+
+    std::printf("%8zu %10.2f %10.2f %10.2f\n", nodes, builds.front(),
+                builds[builds.size() / 2], reads.front());
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+// Parse cache benchmark: compares a parse with a cache hit, for a value and
+// for an AST, whose hits are copied onto the caller's input
+// compile with:
+// g++ -O2 --std=c++17 bench_cache.cpp -o build/bench_cache
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "peglib.h"
+
+const char *grammar = R"(
+  List   <- Item (',' Item)*
+  Item   <- '[' List ']' / Number
+  Number <- < [0-9]+ >
+  %whitespace <- [ \t]*
+)";
+
+// Nested lists of numbers: `items` numbers, in lists of four
+std::string make_input(size_t items) {
+  std::string s;
+  for (size_t i = 0; i < items; i++) {
+    if (i) { s += ", "; }
+    if (i % 4 == 0) { s += "["; }
+    s += std::to_string(i * 7919 % 10000);
+    if (i % 4 == 3 || i + 1 == items) { s += "]"; }
+  }
+  return s;
+}
+
+// Milliseconds per call of `fn`, best of five batches
+template <typename F> double time_of(size_t runs, F fn) {
+  auto best = 1e300;
+  for (auto batch = 0; batch < 5; batch++) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; i++) {
+      if (!fn()) { return -1; }
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count() / runs);
+  }
+  return best;
+}
+
+int main() {
+  std::printf("%-6s %8s %10s %10s %8s\n", "value", "items", "parse ms",
+              "hit ms", "hit/parse");
+  for (auto items : {100, 1000, 10000}) {
+    auto input = make_input(static_cast<size_t>(items));
+    auto runs = static_cast<size_t>(100000 / items);
+
+    for (auto ast : {false, true}) {
+      peg::parser parser(grammar);
+      if (ast) {
+        parser.enable_ast();
+      } else {
+        parser["List"] = [](const peg::SemanticValues &vs) {
+          long sum = 0;
+          for (const auto &v : vs) {
+            sum += std::any_cast<long>(v);
+          }
+          return sum;
+        };
+        parser["Item"] = [](const peg::SemanticValues &vs) {
+          return std::any_cast<long>(vs[0]);
+        };
+        parser["Number"] = [](const peg::SemanticValues &vs) {
+          return vs.token_to_number<long>();
+        };
+      }
+
+      // A copy, as a caller's input would be
+      auto copy = input;
+      auto run = [&](const std::string &s) {
+        if (ast) {
+          std::shared_ptr<peg::Ast> val;
+          return parser.parse(s, val);
+        }
+        long val = 0;
+        return parser.parse(s, val);
+      };
+
+      auto parse_ms = time_of(runs, [&] { return run(input); });
+      parser.enable_parse_cache();
+      run(input);
+      auto hit_ms = time_of(runs, [&] { return run(copy); });
+      if (parser.parse_cache_stats().hits == 0) {
+        std::printf("no cache hits for %d items\n", items);
+        return 1;
+      }
+
+      std::printf("%-6s %8d %10.4f %10.4f %8.1f%%\n", ast ? "ast" : "long",
+                  items, parse_ms, hit_ms, 100 * hit_ms / parse_ms);
+    }
+  }
+  return 0;
+}
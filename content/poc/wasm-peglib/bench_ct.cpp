@@ -0,0 +1,131 @@
+// Compile-time grammar benchmark: the calculator of parser.cpp written as
+// ct types (without the ^cond label, which ct grammars do not have), checked
+// against the same grammar loaded at runtime
+// compile with:
+// g++ -O2 --std=c++17 bench_ct.cpp -o build/bench_ct
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include "peglib.h"
+
+namespace calc {
+
+using namespace peg::ct;
+
+struct Additive;
+
+struct Number {
+  using expr = tok<oom<cls<rng<'0', '9'>>>>;
+  static int action(const peg::SemanticValues &vs) {
+    return vs.token_to_number<int>();
+  }
+};
+
+struct Primary {
+  using expr = cho<seq<lit<'('>, Additive, lit<')'>>, Number>;
+};
+
+struct Multiplicative {
+  using expr = cho<seq<Primary, lit<'*'>, Multiplicative>, Primary>;
+  static int action(const peg::SemanticValues &vs) {
+    switch (vs.choice()) {
+    case 0: // "Primary '*' Multiplicative"
+      return std::any_cast<int>(vs[0]) * std::any_cast<int>(vs[1]);
+    default: // "Primary"
+      return std::any_cast<int>(vs[0]);
+    }
+  }
+};
+
+struct Additive {
+  using expr = cho<seq<Multiplicative, lit<'+'>, Additive>, Multiplicative>;
+  static int action(const peg::SemanticValues &vs) {
+    switch (vs.choice()) {
+    case 0: // "Multiplicative '+' Additive"
+      return std::any_cast<int>(vs[0]) + std::any_cast<int>(vs[1]);
+    default: // "Multiplicative"
+      return std::any_cast<int>(vs[0]);
+    }
+  }
+};
+
+using Whitespace = zom<cls<set<' ', '\t'>>>;
+
+} // namespace calc
+
+std::string expression(std::mt19937 &rng, size_t depth) {
+  auto pick = [&](size_t n) {
+    return std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+  };
+  std::string s = pick(4) == 0 && depth > 0
+                      ? "(" + expression(rng, depth - 1) + ")"
+                      : std::to_string(pick(100));
+  for (auto i = pick(6); i > 0; i--) {
+    s += pick(2) ? " + " : "*";
+    s += pick(4) == 0 && depth > 0 ? "(" + expression(rng, depth - 1) + ")"
+                                   : std::to_string(pick(100));
+  }
+  return s;
+}
+
+template <typename F> double time_ms(F fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main() {
+  peg::parser runtime(R"(
+    Additive    <- Multiplicative '+' Additive / Multiplicative
+    Multiplicative   <- Primary '*' Multiplicative / Primary
+    Primary     <- '(' Additive ')' / Number
+    Number      <- < [0-9]+ >
+    %whitespace <- [ \t]*
+  )");
+  runtime["Additive"] = calc::Additive::action;
+  runtime["Multiplicative"] = calc::Multiplicative::action;
+  runtime["Number"] = calc::Number::action;
+
+  peg::ct::parser<calc::Additive, calc::Whitespace> compiled;
+
+  std::mt19937 rng(42);
+  std::vector<std::string> inputs;
+  for (auto i = 0; i < 20000; i++) {
+    inputs.push_back(expression(rng, 3));
+  }
+  inputs.push_back("1 + ");
+  inputs.push_back("(2 * 3");
+
+  std::vector<std::pair<bool, int>> expected(inputs.size());
+  std::vector<std::pair<bool, int>> actual(inputs.size());
+  auto runtime_ms = time_ms([&]() {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      expected[i].first = runtime.parse(inputs[i], expected[i].second);
+    }
+  });
+  auto compiled_ms = time_ms([&]() {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      actual[i].first = compiled.parse(inputs[i], actual[i].second);
+    }
+  });
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (expected[i] != actual[i]) {
+      if (mismatches++ == 0) {
+        std::printf("mismatch on '%s': %d %d, %d %d\n", inputs[i].c_str(),
+                    expected[i].first, expected[i].second, actual[i].first,
+                    actual[i].second);
+      }
+    }
+  }
+
+  std::printf("%zu inputs, %zu mismatches\n", inputs.size(), mismatches);
+  std::printf("runtime grammar: %8.3f ms\n", runtime_ms);
+  std::printf("ct grammar:      %8.3f ms\n", compiled_ms);
+  return mismatches == 0 ? 0 : 1;
+}
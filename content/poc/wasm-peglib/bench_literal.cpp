@@ -0,0 +1,72 @@
+// Literal matching benchmark
+// compile with:
+// g++ -O2 --std=c++17 bench_literal.cpp -o build/bench_literal
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "peglib.h"
+
+// The byte by byte loop parse_literal used before
+bool match_bytewise(const char *s, size_t n, const std::string &lit,
+                    bool ignore_case) {
+  for (size_t i = 0; i < lit.size(); i++) {
+    if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
+                               : (s[i] != lit[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool match_folded(const char *s, size_t n, const std::string &lit,
+                  const std::string &folded, bool ignore_case) {
+  auto m = (std::min)(n, lit.size());
+  auto matched = ignore_case ? peg::equal_ignore_case(s, folded.data(), m)
+                             : std::memcmp(s, lit.data(), m) == 0;
+  return matched && m == lit.size();
+}
+
+template <typename F> double time_ns(size_t runs, F fn) {
+  auto start = std::chrono::steady_clock::now();
+  size_t matched = 0;
+  for (size_t i = 0; i < runs; i++) {
+    matched += fn();
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  if (matched != runs) { std::printf("mismatch\n"); }
+  return elapsed.count() / runs;
+}
+
+int main() {
+  const size_t runs = 10000000;
+  std::printf("length  ignore case  bytewise (ns)  folded (ns)\n");
+  for (auto len : {4, 8, 16, 32, 64}) {
+    std::string lit;
+    for (auto i = 0; i < len; i++) {
+      lit += "Element_"[i % 8];
+    }
+    auto folded = peg::fold_ascii_case(lit);
+
+    for (auto ignore_case : {false, true}) {
+      // Mixed case input, so that ignore-case matching has letters to fold
+      auto input = lit;
+      for (size_t i = 0; ignore_case && i < input.size(); i += 2) {
+        input[i] = static_cast<char>(std::toupper(input[i]));
+      }
+      input += " rest of the input";
+
+      // Keep the compiler from hoisting the match out of the loop
+      const char *volatile p = input.data();
+      auto bytewise = time_ns(runs, [&]() {
+        return match_bytewise(p, input.size(), lit, ignore_case);
+      });
+      auto wide = time_ns(runs, [&]() {
+        return match_folded(p, input.size(), lit, folded, ignore_case);
+      });
+      std::printf("%6d  %11s  %13.2f  %11.2f\n", len,
+                  ignore_case ? "yes" : "no", bytewise, wide);
+    }
+  }
+}
@@ -0,0 +1,49 @@
+// Grammar load benchmark
+// compile with:
+// g++ -O2 --std=c++17 bench_load.cpp -o build/bench_load
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "peglib.h"
+
+// An expression grammar with one precedence level per rule, so that every
+// rule reaches all the rules below it before consuming input.
+std::string make_grammar(size_t rules) {
+  std::string g;
+  size_t ops = rules < 20 ? 1 : 8;
+  auto levels = rules - 3 - ops;
+  for (size_t i = 0; i < levels; i++) {
+    auto next = i + 1 < levels ? "Level" + std::to_string(i + 1) : "Primary";
+    g += "Level" + std::to_string(i) + " <- " + next + " (Op" +
+         std::to_string(i % ops) + " " + next + ")*\n";
+  }
+  g += "Primary <- '(' Level0 ')' / Number / '-' Primary\n";
+  g += "Number <- < [0-9]+ >\n";
+  g += "%whitespace <- [ \\t\\r\\n]*\n";
+  for (size_t i = 0; i < ops; i++) {
+    g += "Op" + std::to_string(i) + " <- '" + std::string(1, "+-*/%&|^"[i]) +
+         "'\n";
+  }
+  return g;
+}
+
+int main() {
+  for (auto rules : {10, 100, 1000}) {
+    auto grammar = make_grammar(static_cast<size_t>(rules));
+    auto runs = rules < 1000 ? 100 : 10;
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < runs; i++) {
+      peg::parser parser(grammar);
+      if (!parser) {
+        std::printf("failed to load the %d rule grammar\n", rules);
+        return 1;
+      }
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    std::printf("%5d rules: %8.3f ms per load\n", rules,
+                elapsed.count() / runs);
+  }
+}
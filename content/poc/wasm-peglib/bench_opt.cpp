@@ -0,0 +1,366 @@
+// Grammar optimization check and benchmark: parses random inputs with and
+// without optimize_grammar and compares the results
+// usage: bench_opt [inputs [rounds]]
+// Each change is the median over the rounds, with its range. The control
+// column times a second unoptimized parser, which shows the noise.
+// compile with:
+// g++ -O2 --std=c++17 bench_opt.cpp -o build/bench_opt
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "peglib.h"
+
+using Setup = std::function<void(peg::parser &)>;
+using Run = std::function<std::string(peg::parser &, const std::string &)>;
+
+struct Case {
+  const char *name;
+  const char *grammar;
+  Setup setup;
+  Run run;
+  std::function<std::string(std::mt19937 &)> generate;
+};
+
+// Parse result and value as one comparable string
+Run value_of() {
+  return [](peg::parser &parser, const std::string &input) {
+    long val = 0;
+    if (!parser.parse(input, val)) { return std::string("fail"); }
+    return std::to_string(val);
+  };
+}
+
+Run match_of() {
+  return [](peg::parser &parser, const std::string &input) {
+    return std::string(parser.parse(input) ? "match" : "fail");
+  };
+}
+
+Run ast_of() {
+  return [](peg::parser &parser, const std::string &input) {
+    std::shared_ptr<peg::Ast> ast;
+    if (!parser.parse(input, ast)) { return std::string("fail"); }
+    return peg::ast_to_s(ast);
+  };
+}
+
+size_t pick(std::mt19937 &rng, size_t n) {
+  return std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+}
+
+std::string expression(std::mt19937 &rng, size_t depth) {
+  if (depth == 0 || pick(rng, 3) == 0) {
+    return pick(rng, 5) == 0 ? "-" + std::to_string(pick(rng, 100))
+                             : std::to_string(pick(rng, 1000));
+  }
+  if (pick(rng, 4) == 0) { return "(" + expression(rng, depth - 1) + ")"; }
+  static const char *ops[] = {"+", "-", "*", "/", " + ", " * "};
+  return expression(rng, depth - 1) + ops[pick(rng, 6)] +
+         expression(rng, depth - 1);
+}
+
+std::string statements(std::mt19937 &rng, size_t depth) {
+  static const char *names[] = {"a", "b", "x1", "if_", "whilex", "returned"};
+  std::string s;
+  for (auto i = pick(rng, 4); i > 0; i--) {
+    switch (pick(rng, 4)) {
+    case 0:
+      s += std::string(names[pick(rng, 6)]) + " = " + expression(rng, 2) + ";";
+      break;
+    case 1:
+      s += "return " + expression(rng, 2) + ";";
+      break;
+    default:
+      if (depth == 0) { break; }
+      s += std::string(pick(rng, 2) ? "if" : "while") + " (" +
+           names[pick(rng, 6)] + ") { " + statements(rng, depth - 1) + "}";
+      break;
+    }
+    s += pick(rng, 2) ? "\n" : " ";
+  }
+  return s;
+}
+
+std::string json(std::mt19937 &rng, size_t depth) {
+  static const char *scalars[] = {"true", "false", "null", "\"\"", "\"ab c\"",
+                                  "0", "-12", "3.25"};
+  if (depth == 0 || pick(rng, 3) == 0) { return scalars[pick(rng, 8)]; }
+  auto object = pick(rng, 2) == 0;
+  std::string s = object ? "{" : "[";
+  for (auto i = pick(rng, 4); i > 0; i--) {
+    if (object) { s += "\"k" + std::to_string(i) + "\": "; }
+    s += json(rng, depth - 1) + (i > 1 ? ", " : "");
+  }
+  return s + (object ? "}" : "]");
+}
+
+// Valid inputs, half of them damaged by one inserted or deleted character
+std::string mutate(std::mt19937 &rng, std::string s) {
+  if (s.empty() || pick(rng, 2)) { return s; }
+  auto pos = pick(rng, s.size());
+  if (pick(rng, 2)) {
+    s.erase(pos, 1);
+  } else {
+    s.insert(pos, 1, "+-*/(){};= a1\",:[]"[pick(rng, 17)]);
+  }
+  return s;
+}
+
+std::vector<Case> cases() {
+  return {
+      {"calculator",
+       R"(
+        Additive    <- Multiplicative '+' Additive / Multiplicative '-' Additive / Multiplicative
+        Multiplicative <- Primary '*' Multiplicative / Primary '/' Multiplicative / Primary
+        Primary     <- '(' Additive ')' / Negative / Number
+        Negative    <- '-' Number
+        Number      <- < Digit+ >
+        Digit       <- '0' / '1' / '2' / '3' / '4' / '5' / '6' / '7' / '8' / '9'
+        %whitespace <- [ \t]*
+       )",
+       [](peg::parser &parser) {
+         auto binary = [](const peg::SemanticValues &vs) {
+           auto a = std::any_cast<long>(vs[0]);
+           if (vs.size() == 1) { return a; }
+           auto b = std::any_cast<long>(vs[1]);
+           switch (vs.choice()) {
+           case 0: return a + b;
+           case 1: return a - b;
+           default: return a * b;
+           }
+         };
+         parser["Additive"] = binary;
+         parser["Multiplicative"] = [](const peg::SemanticValues &vs) {
+           auto a = std::any_cast<long>(vs[0]);
+           if (vs.size() == 1) { return a; }
+           auto b = std::any_cast<long>(vs[1]);
+           return vs.choice() == 0 ? a * b : (b == 0 ? 0 : a / b);
+         };
+         parser["Negative"] = [](const peg::SemanticValues &vs) {
+           return -std::any_cast<long>(vs[0]);
+         };
+         parser["Number"] = [](const peg::SemanticValues &vs) {
+           return vs.token_to_number<long>();
+         };
+         parser.enable_packrat_parsing();
+       },
+       value_of(),
+       [](std::mt19937 &rng) { return mutate(rng, expression(rng, 4)); }},
+      {"precedence",
+       R"(
+        Expr     <- Atom (Operator Atom)* {
+                      precedence
+                        L + -
+                        L * /
+                    }
+        Atom     <- Number / '(' Expr ')' / Sign Number
+        Operator <- '+' / '-' / '*' / '/'
+        Sign     <- '-'
+        Number   <- < [0-9]+ >
+        %whitespace <- [ \t]*
+       )",
+       [](peg::parser &parser) {
+         parser["Expr"] = [](const peg::SemanticValues &vs) {
+           if (vs.size() == 1) { return std::any_cast<long>(vs[0]); }
+           auto a = std::any_cast<long>(vs[0]);
+           auto op = std::any_cast<char>(vs[1]);
+           auto b = std::any_cast<long>(vs[2]);
+           switch (op) {
+           case '+': return a + b;
+           case '-': return a - b;
+           case '*': return a * b;
+           default: return b == 0 ? 0 : a / b;
+           }
+         };
+         parser["Atom"] = [](const peg::SemanticValues &vs) {
+           return vs.choice() == 2 ? -std::any_cast<long>(vs[1])
+                                   : std::any_cast<long>(vs[0]);
+         };
+         parser["Operator"] = [](const peg::SemanticValues &vs) {
+           return *vs.sv().data();
+         };
+         parser["Number"] = [](const peg::SemanticValues &vs) {
+           return vs.token_to_number<long>();
+         };
+       },
+       value_of(),
+       [](std::mt19937 &rng) { return mutate(rng, expression(rng, 4)); }},
+      {"statements",
+       R"(
+        Program   <- Statement*
+        Statement <- Block / If / While / Return / Assign
+        Block     <- '{' Statement* '}'
+        If        <- 'if' Cond Statement
+        While     <- 'while' Cond Statement
+        Return    <- 'return' Expr ';'
+        Assign    <- Name '=' Expr ';'
+        Cond      <- '(' Name ')'
+        Expr      <- Term (AddOp Term)*
+        Term      <- Factor (MulOp Factor)*
+        Factor    <- '(' Expr ')' / Number / Name
+        AddOp     <- < '+' / '-' >
+        MulOp     <- < '*' / '/' >
+        Name      <- !Keyword < [a-z_] [a-z0-9_]* >
+        Keyword   <- ('if' / 'while' / 'return') ![a-z0-9_]
+        Number    <- < '-'? [0-9]+ >
+        %whitespace <- [ \t\r\n]*
+       )",
+       [](peg::parser &parser) { parser.enable_ast(); }, ast_of(),
+       [](std::mt19937 &rng) { return mutate(rng, statements(rng, 3)); }},
+      {"json",
+       R"(
+        Json    <- Value
+        Value   <- Object / Array / String / Number / Literal
+        Object  <- '{' (Member (~Comma Member)*)? '}'
+        Member  <- (String ~Colon) Value
+        Array   <- '[' (Value (~Comma Value)*)? ']'
+        String  <- '"' (!Quote .)* '"'
+        Number  <- ~Minus? Digit+ ('.' Digit+)?
+        Digit   <- '0' / '1' / '2' / '3' / '4' / '5' / '6' / '7' / '8' / '9'
+        Literal <- ('true' / 'false') / 'null'
+        Quote   <- '"'
+        Comma   <- ','
+        Colon   <- ':'
+        Minus   <- '-'
+        %whitespace <- [ \t\r\n]*
+       )",
+       [](peg::parser &) {}, match_of(),
+       [](std::mt19937 &rng) { return mutate(rng, json(rng, 4)); }},
+  };
+}
+
+// Median and range of the per round changes, in percent
+struct Change {
+  double median;
+  double min;
+  double max;
+};
+
+Change change_of(const std::vector<double> &before,
+                 const std::vector<double> &after) {
+  std::vector<double> changes;
+  for (size_t i = 0; i < before.size(); i++) {
+    changes.push_back((after[i] / before[i] - 1) * 100);
+  }
+  std::sort(changes.begin(), changes.end());
+  return {changes[changes.size() / 2], changes.front(), changes.back()};
+}
+
+int main(int argc, char **argv) {
+  auto count = argc > 1 ? std::stoul(argv[1]) : 20000ul;
+  auto rounds = argc > 2 ? std::stoul(argv[2]) : 9ul;
+
+  std::printf("%-12s  %7s  %8s  %10s  %9s  %9s  %20s  %20s\n", "grammar",
+              "inputs", "accepted", "mismatches", "before ms", "after ms",
+              "change (range)", "control (range)");
+  auto failed = false;
+  for (auto &c : cases()) {
+    // `control` is a second unoptimized parser: its difference from `plain`
+    // is the noise of the measurement
+    peg::parser plain(c.grammar);
+    peg::parser control(c.grammar);
+    peg::parser optimized(c.grammar);
+    if (!plain || !control || !optimized) {
+      std::printf("failed to load the %s grammar\n", c.name);
+      return 1;
+    }
+    c.setup(plain);
+    c.setup(control);
+    c.setup(optimized);
+    auto report = optimized.optimize_grammar();
+
+    std::mt19937 rng(42);
+    std::vector<std::string> inputs;
+    for (size_t i = 0; i < count; i++) {
+      inputs.push_back(c.generate(rng));
+    }
+
+    std::vector<std::string> expected;
+    std::vector<std::string> actual;
+    auto run_all = [&](peg::parser &parser, std::vector<std::string> &out) {
+      out.clear();
+      for (const auto &input : inputs) {
+        out.push_back(c.run(parser, input));
+      }
+    };
+    auto time_run = [&](peg::parser &parser, std::vector<std::string> &out) {
+      auto start = std::chrono::steady_clock::now();
+      run_all(parser, out);
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      return elapsed.count();
+    };
+
+    // The parsers take turns in a rotating order, so that none is always
+    // timed on a heap another has filled
+    std::vector<double> before(rounds), after(rounds), again(rounds);
+    std::vector<std::string> ignored;
+    for (size_t round = 0; round < rounds; round++) {
+      for (size_t k = 0; k < 3; k++) {
+        switch ((round + k) % 3) {
+        case 0: before[round] = time_run(plain, expected); break;
+        case 1: after[round] = time_run(optimized, actual); break;
+        default: again[round] = time_run(control, ignored); break;
+        }
+      }
+    }
+
+    // Error messages are part of the result, so compare them too. A parse
+    // with a logger runs the rules as written, so it isn't timed.
+    std::string log;
+    for (auto parser : {&plain, &optimized}) {
+      parser->set_logger([&](size_t line, size_t col, const std::string &msg,
+                             const std::string &rule) {
+        log += "\n" + std::to_string(line) + ":" + std::to_string(col) + " " +
+               msg + " [" + rule + "]";
+      });
+    }
+    auto logs_of = [&](peg::parser &parser, std::vector<std::string> &out) {
+      out.clear();
+      for (const auto &input : inputs) {
+        log.clear();
+        c.run(parser, input);
+        out.push_back(log);
+      }
+    };
+    std::vector<std::string> expected_logs;
+    std::vector<std::string> actual_logs;
+    logs_of(plain, expected_logs);
+    logs_of(optimized, actual_logs);
+
+    size_t accepted = 0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (expected[i] != "fail") { accepted++; }
+      auto want = expected[i] + expected_logs[i];
+      auto got = actual[i] + actual_logs[i];
+      if (want != got) {
+        if (mismatches++ == 0) {
+          std::cout << "mismatch on '" << inputs[i] << "':" << std::endl
+                    << want << std::endl
+                    << got << std::endl;
+        }
+      }
+    }
+    failed = failed || mismatches > 0;
+
+    auto change = change_of(before, after);
+    auto noise = change_of(before, again);
+    auto best = [](const std::vector<double> &v) {
+      return *std::min_element(v.begin(), v.end());
+    };
+    std::printf("%-12s  %7zu  %8zu  %10zu  %9.1f  %9.1f  %+6.1f%% (%+.0f..%+.0f)"
+                "  %+6.1f%% (%+.0f..%+.0f)\n",
+                c.name, count, accepted, mismatches, best(before), best(after),
+                change.median, change.min, change.max, noise.median, noise.min,
+                noise.max);
+    std::cout << report;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+// Error message check: parses invalid inputs with the whitespace cache and
+// without it (a verbose trace skips the cache) and compares the logs
+// compile with:
+// g++ -O2 --std=c++17 check_errors.cpp -o build/check_errors
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "peglib.h"
+
+struct Case {
+  const char *grammar;
+  std::vector<const char *> inputs;
+};
+
+std::string log_of(const char *grammar, const char *input, bool packrat,
+                   bool cache) {
+  peg::parser parser;
+  std::string log;
+  parser.set_logger([&](size_t line, size_t col, const std::string &msg,
+                        const std::string &rule) {
+    log += std::to_string(line) + ":" + std::to_string(col) + " " + msg +
+           " [" + rule + "]\n";
+  });
+  if (!parser.load_grammar(grammar)) { return "grammar error\n" + log; }
+  if (packrat) { parser.enable_packrat_parsing(); }
+  if (!cache) {
+    parser.enable_trace([](auto &&...) {}, [](auto &&...) {});
+    parser.set_verbose_trace(true);
+  }
+  log += parser.parse(input) ? "match\n" : "fail\n";
+  return log;
+}
+
+int main() {
+  std::vector<Case> cases = {
+      {R"(
+        S <- X 'a' 'b' / X 'a' 'c' / X 'd'
+        X <- < [0-9]+ >
+        %whitespace <- [ ]*
+       )",
+       {"12 a d", "12 a b", "12 a", "12 x", " 12  a  c  d"}},
+      {R"(
+        List  <- '[' (Item (',' Item)*)? ']'
+        Item  <- List / Number / 'true' / 'false'
+        Number <- < [0-9]+ >
+        %whitespace <- [ \t\n]*
+       )",
+       {"[1, [2, 3], true]", "[1, [2 3]]", "[1,\n [2, ]]", "[ true false ]",
+        "[1, [2, [3, [4, x]]]]"}},
+      {R"(
+        Program   <- Statement*
+        Statement <- 'if' Cond Statement / 'return' Name ';' / Name '=' Name ';'
+        Cond      <- '(' Name ')'
+        Name      <- < [a-z]+ >
+        %whitespace <- [ \t\n]*
+        %word     <- [a-z]+
+       )",
+       {"if (a) return b;", "if (a) return b", "a = b; if a", "ifx = y;",
+        "a = b;\nif (c) d = ;"}},
+  };
+
+  auto failures = 0;
+  for (const auto &c : cases) {
+    for (auto input : c.inputs) {
+      for (auto packrat : {false, true}) {
+        auto cached = log_of(c.grammar, input, packrat, true);
+        auto uncached = log_of(c.grammar, input, packrat, false);
+        if (cached != uncached) {
+          std::printf("'%s'%s:\ncached:\n%suncached:\n%s\n", input,
+                      packrat ? " (packrat)" : "", cached.c_str(),
+                      uncached.c_str());
+          failures++;
+        }
+      }
+    }
+  }
+  std::printf("%d mismatches\n", failures);
+  return failures ? 1 : 0;
+}
@@ -15,28 +15,80 @@
 #define CPPPEGLIB_HEURISTIC_ERROR_TOKEN_MAX_CHAR_COUNT 32
 #endif
 
+#ifndef CPPPEGLIB_PACKRAT_PAGE_SIZE
+#define CPPPEGLIB_PACKRAT_PAGE_SIZE 256
+#endif
+
+#ifndef CPPPEGLIB_WHITESPACE_WINDOW_PAGES
+#define CPPPEGLIB_WHITESPACE_WINDOW_PAGES 16
+#endif
+
+#ifndef CPPPEGLIB_DEADLINE_CHECK_INTERVAL
+#define CPPPEGLIB_DEADLINE_CHECK_INTERVAL 1024
+#endif
+
+// parse_parallel parses on the calling thread only
+#if !defined(CPPPEGLIB_NO_THREADS) && defined(__EMSCRIPTEN__) &&              \
+    !defined(__EMSCRIPTEN_PTHREADS__)
+#define CPPPEGLIB_NO_THREADS
+#endif
+
+#ifndef CPPPEGLIB_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPPPEGLIB_SSE2
+#elif defined(__wasm_simd128__)
+#define CPPPEGLIB_WASM_SIMD
+#endif
+#endif
+
 #include <algorithm>
 #include <any>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #if __has_include(<charconv>)
 #include <charconv>
 #endif
 #include <cstring>
+#include <exception>
+#include <fstream>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
 #include <limits>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#ifndef CPPPEGLIB_NO_THREADS
+#include <thread>
+#endif
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#if defined(CPPPEGLIB_SSE2)
+#include <emmintrin.h>
+#elif defined(CPPPEGLIB_WASM_SIMD)
+#include <wasm_simd128.h>
+#endif
+
+#if !defined(CPPPEGLIB_NO_MMAP) && __has_include(<sys/mman.h>)
+#define CPPPEGLIB_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if !defined(__cplusplus) || __cplusplus < 201703L
 #error "Requires complete C++17 support"
 #endif
@@ -95,14 +147,264 @@ inline size_t codepoint_length(const char *s8, size_t l) {
   return 0;
 }
 
+// Length of `s8` without a codepoint that is cut off at the end
+inline size_t complete_codepoints_length(const char *s8, size_t l) {
+  auto i = l;
+  while (i > 0 && l - i < 3 &&
+         (static_cast<uint8_t>(s8[i - 1]) & 0xC0) == 0x80) {
+    i--;
+  }
+  if (i > 0 && !codepoint_length(s8 + i - 1, l - i + 1)) { return i - 1; }
+  return l;
+}
+
 inline size_t codepoint_count(const char *s8, size_t l) {
+  // Every byte except continuation bytes (10xxxxxx) starts a codepoint
   size_t count = 0;
-  for (size_t i = 0; i < l; i += codepoint_length(s8 + i, l - i)) {
-    count++;
+  size_t i = 0;
+  for (; i + 8 <= l; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, s8 + i, 8);
+    auto cont = w & ~(w << 1) & 0x8080808080808080ull;
+    count += 8 - std::bitset<64>(cont).count();
+  }
+  for (; i < l; i++) {
+    if ((static_cast<uint8_t>(s8[i]) & 0xC0) != 0x80) { count++; }
   }
   return count;
 }
 
+// Length of the ASCII-only prefix of `s8`
+inline size_t ascii_prefix_length(const char *s8, size_t l) {
+  size_t i = 0;
+#if defined(CPPPEGLIB_SSE2)
+  for (; i + 16 <= l; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s8 + i));
+    if (_mm_movemask_epi8(v)) { break; }
+  }
+#elif defined(CPPPEGLIB_WASM_SIMD)
+  for (; i + 16 <= l; i += 16) {
+    auto v = wasm_v128_load(s8 + i);
+    if (wasm_i8x16_bitmask(v)) { break; }
+  }
+#endif
+  for (; i + 8 <= l; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, s8 + i, 8);
+    if (w & 0x8080808080808080ull) { break; }
+  }
+  while (i < l && !(static_cast<uint8_t>(s8[i]) & 0x80)) {
+    i++;
+  }
+  return i;
+}
+
+// Lowercases the ASCII letters of `s`, as std::tolower does in the "C" locale
+inline std::string fold_ascii_case(const std::string &s) {
+  std::string r = s;
+  for (auto &ch : r) {
+    if ('A' <= ch && ch <= 'Z') { ch = static_cast<char>(ch | 0x20); }
+  }
+  return r;
+}
+
+// Whether `s` equals `folded` (see fold_ascii_case) when its ASCII letters are
+// lowercased. Setting bit 0x20 lowercases a letter, so the bytes of `s` are
+// compared a vector at a time with that bit set on 'A'..'Z' only.
+inline bool equal_ignore_case(const char *s, const char *folded, size_t l) {
+  size_t i = 0;
+#if defined(CPPPEGLIB_SSE2)
+  const auto before_a = _mm_set1_epi8('A' - 1);
+  const auto after_z = _mm_set1_epi8('Z' + 1);
+  const auto bit = _mm_set1_epi8(0x20);
+  for (; i + 16 <= l; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+    auto w = _mm_loadu_si128(reinterpret_cast<const __m128i *>(folded + i));
+    auto upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                               _mm_cmplt_epi8(v, after_z));
+    v = _mm_or_si128(v, _mm_and_si128(upper, bit));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, w)) != 0xffff) { return false; }
+  }
+#elif defined(CPPPEGLIB_WASM_SIMD)
+  const auto before_a = wasm_i8x16_splat('A' - 1);
+  const auto after_z = wasm_i8x16_splat('Z' + 1);
+  const auto bit = wasm_i8x16_splat(0x20);
+  for (; i + 16 <= l; i += 16) {
+    auto v = wasm_v128_load(s + i);
+    auto w = wasm_v128_load(folded + i);
+    auto upper = wasm_v128_and(wasm_i8x16_gt(v, before_a),
+                               wasm_i8x16_lt(v, after_z));
+    v = wasm_v128_or(v, wasm_v128_and(upper, bit));
+    if (!wasm_i8x16_all_true(wasm_i8x16_eq(v, w))) { return false; }
+  }
+#endif
+  // In each byte below 0x80, adding 0x80 - 'A' carries into the top bit from
+  // 'A' on, and adding 0x7f - 'Z' from past 'Z' on
+  for (; i + 8 <= l; i += 8) {
+    uint64_t v, w;
+    std::memcpy(&v, s + i, 8);
+    std::memcpy(&w, folded + i, 8);
+    auto low = v & 0x7f7f7f7f7f7f7f7full;
+    auto from_a = low + 0x3f3f3f3f3f3f3f3full;
+    auto past_z = low + 0x2525252525252525ull;
+    auto upper = ~v & from_a & ~past_z & 0x8080808080808080ull;
+    if ((v | (upper >> 2)) != w) { return false; }
+  }
+  for (; i < l; i++) {
+    auto ch = s[i];
+    if ('A' <= ch && ch <= 'Z') { ch = static_cast<char>(ch | 0x20); }
+    if (ch != folded[i]) { return false; }
+  }
+  return true;
+}
+
+struct Hash128 {
+  uint64_t low = 0;
+  uint64_t high = 0;
+
+  bool operator==(const Hash128 &rhs) const {
+    return low == rhs.low && high == rhs.high;
+  }
+};
+
+// A fast 128-bit hash, not a cryptographic one. As in XXH3, each 32-byte
+// stripe is xored with keys and added to four 64-bit lanes as the product of
+// its 32-bit halves (with the input itself, so that no byte is lost to a
+// zero factor). The keys advance with each stripe, so that the order of the
+// stripes matters. Vectors hold two lanes, which gives the same hash.
+inline Hash128 hash128(const char *s, size_t l, uint64_t seed = 0) {
+  uint64_t acc[4] = {0x9e3779b185ebca87ull, 0xc2b2ae3d27d4eb4full,
+                     0x165667b19e3779f9ull, 0x85ebca77c2b2ae63ull};
+  uint64_t keys[4] = {0xbe4ba423396cfeb8ull ^ seed, 0x1cad21f72c81017cull,
+                      0xdb979083e96dd4deull + seed, 0x1f67b3b7a4a44072ull};
+  const uint64_t step[4] = {0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull,
+                            0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull};
+
+  auto stripe = [&](const char *p) {
+    uint64_t d[4];
+    std::memcpy(d, p, sizeof(d));
+    for (auto j = 0; j < 4; j++) {
+      auto x = d[j] ^ keys[j];
+      acc[j] += (x & 0xffffffff) * (x >> 32) + d[j ^ 1];
+      keys[j] += step[j];
+    }
+  };
+
+  size_t i = 0;
+#if defined(CPPPEGLIB_SSE2)
+  if (l >= 32) {
+    auto load = [](const void *p) {
+      return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    };
+    auto a0 = load(acc), a1 = load(acc + 2);
+    auto k0 = load(keys), k1 = load(keys + 2);
+    const auto s0 = load(step), s1 = load(step + 2);
+    auto lane = [](__m128i a, __m128i d, __m128i k) {
+      auto x = _mm_xor_si128(d, k);
+      auto product = _mm_mul_epu32(x, _mm_shuffle_epi32(x, 0x31));
+      return _mm_add_epi64(_mm_add_epi64(a, product),
+                           _mm_shuffle_epi32(d, 0x4e));
+    };
+    for (; i + 32 <= l; i += 32) {
+      a0 = lane(a0, load(s + i), k0);
+      a1 = lane(a1, load(s + i + 16), k1);
+      k0 = _mm_add_epi64(k0, s0);
+      k1 = _mm_add_epi64(k1, s1);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(acc), a0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(acc + 2), a1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(keys), k0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(keys + 2), k1);
+  }
+#elif defined(CPPPEGLIB_WASM_SIMD)
+  if (l >= 32) {
+    auto a0 = wasm_v128_load(acc), a1 = wasm_v128_load(acc + 2);
+    auto k0 = wasm_v128_load(keys), k1 = wasm_v128_load(keys + 2);
+    const auto s0 = wasm_v128_load(step), s1 = wasm_v128_load(step + 2);
+    const auto low = wasm_i64x2_splat(0xffffffff);
+    auto lane = [&](v128_t a, v128_t d, v128_t k) {
+      auto x = wasm_v128_xor(d, k);
+      auto product =
+          wasm_i64x2_mul(wasm_v128_and(x, low), wasm_u64x2_shr(x, 32));
+      return wasm_i64x2_add(wasm_i64x2_add(a, product),
+                            wasm_i64x2_shuffle(d, d, 1, 0));
+    };
+    for (; i + 32 <= l; i += 32) {
+      a0 = lane(a0, wasm_v128_load(s + i), k0);
+      a1 = lane(a1, wasm_v128_load(s + i + 16), k1);
+      k0 = wasm_i64x2_add(k0, s0);
+      k1 = wasm_i64x2_add(k1, s1);
+    }
+    wasm_v128_store(acc, a0);
+    wasm_v128_store(acc + 2, a1);
+    wasm_v128_store(keys, k0);
+    wasm_v128_store(keys + 2, k1);
+  }
+#endif
+  for (; i + 32 <= l; i += 32) {
+    stripe(s + i);
+  }
+  if (i < l) {
+    char tail[32] = {};
+    std::memcpy(tail, s + i, l - i);
+    stripe(tail);
+  }
+
+  // MurmurHash3's finalizer
+  auto mix = [](uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+  };
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+
+  Hash128 h;
+  h.low = mix(acc[0] + rotl(acc[2], 29) + l * 0x9e3779b97f4a7c15ull);
+  h.high = mix(acc[1] + rotl(acc[3], 31) + (h.low ^ seed));
+  return h;
+}
+
+// Validates UTF-8 in one pass (ASCII runs are skipped a vector at a time)
+// and returns the offset of the first malformed sequence, or `l`.
+inline size_t utf8_error_offset(const char *s8, size_t l, bool &is_ascii) {
+  is_ascii = true;
+  size_t i = 0;
+  for (;;) {
+    i += ascii_prefix_length(s8 + i, l - i);
+    if (i == l) { return l; }
+    is_ascii = false;
+
+    // Well-formed byte sequences (Unicode Table 3-7)
+    auto b = static_cast<uint8_t>(s8[i]);
+    size_t len = 0;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+    if (0xC2 <= b && b <= 0xDF) {
+      len = 2;
+    } else if (0xE0 <= b && b <= 0xEF) {
+      len = 3;
+      if (b == 0xE0) { lo = 0xA0; }
+      if (b == 0xED) { hi = 0x9F; }
+    } else if (0xF0 <= b && b <= 0xF4) {
+      len = 4;
+      if (b == 0xF0) { lo = 0x90; }
+      if (b == 0xF4) { hi = 0x8F; }
+    } else {
+      return i;
+    }
+
+    if (l - i < len) { return i; }
+    auto b1 = static_cast<uint8_t>(s8[i + 1]);
+    if (b1 < lo || hi < b1) { return i; }
+    for (size_t j = 2; j < len; j++) {
+      if ((static_cast<uint8_t>(s8[i + j]) & 0xC0) != 0x80) { return i; }
+    }
+    i += len;
+  }
+}
+
 inline size_t encode_codepoint(char32_t cp, char *buff) {
   if (cp < 0x0080) {
     buff[0] = static_cast<char>(cp & 0x7F);
@@ -398,7 +700,8 @@ public:
     }
   }
 
-  size_t match(const char *text, size_t text_len, size_t &id) const {
+  size_t match(const char *text, size_t text_len, size_t &id,
+               bool *reached_end = nullptr) const {
     std::string lower_text;
     if (ignore_case_) {
       lower_text = to_lower(text);
@@ -422,11 +725,20 @@ public:
       }
       len += 1;
     }
+    if (!done && reached_end) { *reached_end = true; }
     return match_len;
   }
 
   size_t size() const { return dic_.size(); }
 
+  bool ignore_case() const { return ignore_case_; }
+
+  template <typename T> void for_each_first_char(T fn) const {
+    for (const auto &[key, _] : dic_) {
+      if (key.size() == 1) { fn(key[0]); }
+    }
+  }
+
 private:
   std::string to_lower(std::string s) const {
     for (char &c : s) {
@@ -473,6 +785,60 @@ inline std::pair<size_t, size_t> line_info(const char *start, const char *cur) {
   return std::pair(no, col);
 }
 
+/*
+ * Line index
+ */
+class LineIndex : public std::enable_shared_from_this<LineIndex> {
+public:
+  LineIndex(const char *path, const char *s, size_t l)
+      : path(path ? path : ""), s_(s), l_(l) {}
+
+  // Line number and column at the byte offset (the index is built lazily)
+  std::pair<size_t, size_t> line_info(size_t pos) const {
+    std::call_once(init_, [this]() {
+      for (size_t i = 0; i < l_; i++) {
+        if (s_[i] == '\n') { index_.push_back(i); }
+      }
+      index_.push_back(l_);
+    });
+
+    auto it = std::lower_bound(
+        index_.begin(), index_.end(), pos,
+        [](size_t element, size_t value) { return element < value; });
+
+    auto id = static_cast<size_t>(std::distance(index_.begin(), it));
+    auto off = pos - (id == 0 ? 0 : index_[id - 1] + 1);
+    return std::pair(id + 1, off + 1);
+  }
+
+  const std::string path;
+
+private:
+  const char *s_;
+  size_t l_;
+  mutable std::once_flag init_;
+  mutable std::vector<size_t> index_;
+};
+
+template <typename Annotation> struct AstBase;
+
+template <typename T> struct is_ast : std::false_type {};
+template <typename Annotation>
+struct is_ast<std::shared_ptr<AstBase<Annotation>>> : std::true_type {};
+
+// AST nodes only point to the line index of their parse, so the root handed
+// out of a parse owns it. Other values are left alone.
+template <typename T>
+void keep_line_index(T &val,
+                     const std::shared_ptr<const LineIndex> &line_index) {
+  if constexpr (is_ast<T>::value) {
+    if (!val || !line_index) { return; }
+    using Owner = std::pair<T, std::shared_ptr<const LineIndex>>;
+    auto root = val.get();
+    val = T(std::make_shared<Owner>(std::move(val), line_index), root);
+  }
+}
+
 /*
  * String tag
  */
@@ -495,11 +861,73 @@ inline constexpr unsigned int operator"" _(const char *s, size_t l) {
 
 } // namespace udl
 
+/*
+ * Memory accounting
+ */
+enum class MemoryCategory {
+  Packrat,     // memo flags
+  CacheValues, // memoized results
+  Whitespace,  // where the whitespace at each position ends
+  ValueStack,  // semantic value scopes
+  Captures,    // back reference captures
+  Ast,         // AST nodes, counted when built
+};
+
+inline constexpr size_t memory_category_count = 6;
+
+inline const char *memory_category_name(MemoryCategory category) {
+  switch (category) {
+  case MemoryCategory::Packrat: return "packrat";
+  case MemoryCategory::CacheValues: return "cache values";
+  case MemoryCategory::Whitespace: return "whitespace";
+  case MemoryCategory::ValueStack: return "value stack";
+  case MemoryCategory::Captures: return "captures";
+  case MemoryCategory::Ast: return "ast";
+  }
+  return "";
+}
+
+// Bytes a parse holds, estimated from element sizes and capacities
+struct MemoryUsage {
+  size_t current[memory_category_count] = {};
+  size_t peak[memory_category_count] = {};
+  size_t total = 0;
+  size_t total_peak = 0;
+
+  size_t current_of(MemoryCategory category) const {
+    return current[static_cast<size_t>(category)];
+  }
+
+  size_t peak_of(MemoryCategory category) const {
+    return peak[static_cast<size_t>(category)];
+  }
+};
+
+// Called whenever a parse takes more memory; returning false aborts it
+using MemoryHook =
+    std::function<bool(MemoryCategory category, const MemoryUsage &usage)>;
+
+/*
+ * Parse limits
+ */
+struct ParseLimits {
+  size_t max_steps = 0;                 // operator invocations
+  size_t max_backtracks = 0;            // failed choice alternatives
+  std::chrono::microseconds timeout{0}; // from the start of the parse
+};
+
+// Why a parse stopped before the input decided its outcome
+enum class AbortReason { None, Memory, Steps, Backtracks, Deadline };
+
 /*
  * Semantic values
  */
 class Context;
 
+namespace ct {
+struct Access;
+} // namespace ct
+
 struct SemanticValues : protected std::vector<std::any> {
   SemanticValues() = default;
   SemanticValues(Context *c) : c_(c) {}
@@ -519,6 +947,15 @@ struct SemanticValues : protected std::vector<std::any> {
   // Line number and column at which the matched string is
   std::pair<size_t, size_t> line_info() const;
 
+  // Line index shared by everything built from this parse
+  const std::shared_ptr<LineIndex> &line_index() const;
+
+  // Adds memory an action allocated to the parse's accounting
+  void account_memory(MemoryCategory category, size_t bytes) const;
+
+  // Nodes the AST builder shares within the parse (see SharedAstNodes)
+  std::any &shared_ast_nodes() const;
+
   // Choice count
   size_t choice_count() const { return choice_count_; }
 
@@ -596,11 +1033,15 @@ private:
   friend class Dictionary;
   friend class Sequence;
   friend class PrioritizedChoice;
+  friend class FactoredChoice;
+  friend class Dfa;
   friend class Repetition;
   friend class Holder;
   friend class PrecedenceClimbing;
+  friend struct ct::Access;
 
   Context *c_ = nullptr;
+  size_t charged_bytes_ = 0; // Charged to the value stack so far
   std::string_view sv_;
   size_t choice_count_ = 0;
   size_t choice_ = 0;
@@ -676,6 +1117,33 @@ inline bool fail(size_t len) { return len == static_cast<size_t>(-1); }
 using Log = std::function<void(size_t line, size_t col, const std::string &msg,
                                const std::string &rule)>;
 
+/*
+ * Event sink
+ */
+struct EventSink {
+  virtual ~EventSink() = default;
+
+  // `rule_id` is Definition::id and offsets are relative to the input start.
+  // A rule that fails is left with `len == static_cast<size_t>(-1)`.
+  virtual void enter(size_t /*rule_id*/, size_t /*offset*/) {}
+  virtual void leave(size_t /*rule_id*/, size_t /*offset*/, size_t /*len*/) {}
+  virtual void token(size_t /*rule_id*/, size_t /*offset*/, size_t /*len*/) {}
+
+  // Events are counted from 0 in the order they are sent. When the parser
+  // gives up what it parsed (a failed alternative, the last iteration of a
+  // repetition, a predicate, an operator of precedence climbing), the events
+  // from number `count` on are abandoned, even those of rules that succeeded,
+  // and the parse goes on as if only the first `count` had been sent.
+  virtual void rollback(size_t /*count*/) {}
+
+  // The first `count` events are final: no rollback will reach them, so a
+  // sink that holds events back for rollback() can release them. It is sent
+  // whenever the outermost point the parser can still backtrack to moves on,
+  // and at the end of the parse, so a sink holds at most the events of the
+  // outermost choice, repetition iteration or predicate in progress.
+  virtual void commit(size_t /*count*/) {}
+};
+
 /*
  * ErrorInfo
  */
@@ -689,12 +1157,14 @@ struct ErrorInfo {
   std::string label;
   const char *last_output_pos = nullptr;
   bool keep_previous_token = false;
+  AbortReason abort_reason = AbortReason::None;
 
   void clear() {
     error_pos = nullptr;
     expected_tokens.clear();
     message_pos = nullptr;
     message.clear();
+    abort_reason = AbortReason::None;
   }
 
   void add(const char *error_literal, const Definition *error_rule) {
@@ -760,6 +1230,17 @@ using TracerLeave = std::function<void(
 
 using TracerStartOrEnd = std::function<void(std::any &trace_data)>;
 
+/*
+ * Semantic values kept outside SemanticValues (see typed_parser). Without
+ * packrat parsing, the parser cuts the arena back to an earlier size when it
+ * gives up what it parsed since.
+ */
+struct ValueArena {
+  virtual ~ValueArena() = default;
+  virtual size_t size() const = 0;
+  virtual void truncate(size_t size) = 0;
+};
+
 class Context {
 public:
   const char *path;
@@ -775,26 +1256,85 @@ public:
   std::vector<Definition *> rule_stack;
   std::vector<std::vector<std::shared_ptr<Ope>>> args_stack;
 
+  std::any shared_ast_nodes;
+
   size_t in_token_boundary_count = 0;
 
+  // Set when the whole input is ASCII, so every byte is a codepoint
+  bool is_ascii = false;
+
+  // Binary operator rule of the innermost precedence climbing loop, and the
+  // token it matched last
+  const Definition *binop_rule = nullptr;
+  std::string_view binop_token;
+
   std::shared_ptr<Ope> whitespaceOpe;
   bool in_whitespace = false;
 
+  // Set when an operator wanted input past the end, so the outcome could
+  // change if the input were longer (see item_streamer)
+  bool reached_end = false;
+
   std::shared_ptr<Ope> wordOpe;
 
-  std::vector<std::map<std::string_view, std::string>> capture_scope_stack;
-  size_t capture_scope_stack_size = 0;
+  // Streaming mode: rules report events here and build no semantic values.
+  // Operators that backtrack take a rollback_mark() before they parse and
+  // roll back to it when they give up. The events before the outermost mark
+  // in use are committed to the sink whenever that mark moves on.
+  EventSink *event_sink = nullptr;
+  size_t event_count = 0;
+  size_t event_committed = 0;
+  std::vector<size_t> event_marks;
+
+  // Values of typed actions, cut back along with the events
+  ValueArena *value_arena = nullptr;
+
+  // Captures are kept in one flat list. Each capture scope is a mark into it,
+  // and lookups search from the innermost scope outward.
+  const bool enableCaptures;
+  std::vector<std::pair<std::string_view, std::string>> captures;
+  std::vector<size_t> capture_scope_marks;
 
   std::vector<bool> cut_stack;
 
   const size_t def_count;
   const bool enablePackratParsing;
-  std::vector<bool> cache_registered;
-  std::vector<bool> cache_success;
+
+  // Memo flags are allocated lazily in pages of CPPPEGLIB_PACKRAT_PAGE_SIZE
+  // positions, so pages below `cache_floor` can be released after a cut.
+  struct CachePage {
+    std::vector<bool> registered;
+    std::vector<bool> success;
+  };
+  std::vector<std::unique_ptr<CachePage>> cache_pages;
 
   std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
       cache_values;
 
+  // Where the whitespace at a position ends, in pages like the memo flags,
+  // as backtracking re-skips it after every literal it parses again. Without
+  // packrat parsing only CPPPEGLIB_WHITESPACE_WINDOW_PAGES pages are kept,
+  // each slot holding the latest page that maps to it, and event mode keeps
+  // none.
+  static constexpr uint32_t whitespace_unknown = 0xffffffff;
+  static constexpr uint32_t whitespace_failed = 0xfffffffe;
+  struct WhitespacePage {
+    size_t index;
+    std::vector<uint32_t> ends;
+  };
+  std::vector<std::unique_ptr<WhitespacePage>> whitespace_pages;
+
+  // Positions the parser may still rewind to (choices, repetitions,
+  // predicates and precedence climbing loops), innermost last. A choice
+  // stops counting once its cut flag is set.
+  struct BacktrackPoint {
+    size_t pos;
+    size_t cut_id;
+  };
+  const bool enableCachePruning;
+  std::vector<BacktrackPoint> backtrack_stack;
+  size_t cache_floor = 0;
+
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
   std::any trace_data;
@@ -802,15 +1342,40 @@ public:
 
   Log log;
 
+  // Memory accounting is on when there is a limit, a hook or a tracer
+  size_t memory_limit = 0;
+  MemoryHook memory_hook;
+  bool account_memory = false;
+  MemoryUsage memory;
+
+  // Set once the parse has to stop: every operator fails from then on, and
+  // the parse reports `abort_message` at `abort_pos`
+  bool aborted = false;
+  AbortReason abort_reason = AbortReason::None;
+  const char *abort_pos = nullptr;
+  std::string abort_message;
+
+  // Ope::parse counts `steps_until_check` down and calls check_limits when
+  // it runs out, which is also how an aborted parse stops
+  size_t steps_until_check = static_cast<size_t>(-1);
+  size_t step_batch = static_cast<size_t>(-1);
+  size_t steps = 0;
+  size_t max_steps = static_cast<size_t>(-1);
+  size_t backtracks = 0;
+  size_t max_backtracks = static_cast<size_t>(-1);
+  bool has_deadline = false;
+  std::chrono::steady_clock::time_point deadline;
+
   Context(const char *path, const char *s, size_t l, size_t def_count,
           std::shared_ptr<Ope> whitespaceOpe, std::shared_ptr<Ope> wordOpe,
-          bool enablePackratParsing, TracerEnter tracer_enter,
+          bool enablePackratParsing, bool enableCaptures,
+          bool enableCachePruning, TracerEnter tracer_enter,
           TracerLeave tracer_leave, std::any trace_data, bool verbose_trace,
           Log log)
       : path(path), s(s), l(l), whitespaceOpe(whitespaceOpe), wordOpe(wordOpe),
-        def_count(def_count), enablePackratParsing(enablePackratParsing),
-        cache_registered(enablePackratParsing ? def_count * (l + 1) : 0),
-        cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
+        enableCaptures(enableCaptures), def_count(def_count),
+        enablePackratParsing(enablePackratParsing),
+        enableCachePruning(enablePackratParsing && enableCachePruning),
         tracer_enter(tracer_enter), tracer_leave(tracer_leave),
         trace_data(trace_data), verbose_trace(verbose_trace), log(log) {
 
@@ -822,14 +1387,161 @@ public:
     pop_capture_scope();
 
     assert(!value_stack_size);
-    assert(!capture_scope_stack_size);
+    assert(capture_scope_marks.empty());
     assert(cut_stack.empty());
+    assert(backtrack_stack.empty());
+    assert(event_marks.empty());
   }
 
   Context(const Context &) = delete;
   Context(Context &&) = delete;
   Context operator=(const Context &) = delete;
 
+  void set_memory_limit(size_t limit, MemoryHook hook) {
+    memory_limit = limit;
+    memory_hook = std::move(hook);
+    account_memory = memory_limit || memory_hook || tracer_leave;
+  }
+
+  // Charges `bytes` allocated while parsing at `a_s`, where the parse stops
+  // if this goes over the limit
+  void allocate(MemoryCategory category, size_t bytes, const char *a_s) {
+    if (!account_memory || !bytes) { return; }
+    auto i = static_cast<size_t>(category);
+    memory.current[i] += bytes;
+    memory.peak[i] = (std::max)(memory.peak[i], memory.current[i]);
+    memory.total += bytes;
+    memory.total_peak = (std::max)(memory.total_peak, memory.total);
+
+    if (aborted) { return; }
+    if (memory_limit && memory.total > memory_limit) {
+      abort(a_s, AbortReason::Memory,
+            "memory limit of " + std::to_string(memory_limit) +
+                " bytes exceeded");
+    } else if (memory_hook && !memory_hook(category, memory)) {
+      abort(a_s, AbortReason::Memory, "memory limit exceeded");
+    }
+  }
+
+  void release(MemoryCategory category, size_t bytes) {
+    if (!account_memory) { return; }
+    auto i = static_cast<size_t>(category);
+    bytes = (std::min)(bytes, memory.current[i]);
+    memory.current[i] -= bytes;
+    memory.total -= bytes;
+  }
+
+  void abort(const char *a_s, AbortReason reason, std::string message) {
+    if (aborted) { return; }
+    aborted = true;
+    abort_reason = reason;
+    abort_pos = a_s;
+    abort_message = std::move(message);
+    steps_until_check = 0;
+  }
+
+  void set_limits(const ParseLimits &limits) {
+    if (limits.max_steps) { max_steps = limits.max_steps; }
+    if (limits.max_backtracks) { max_backtracks = limits.max_backtracks; }
+    if (limits.timeout.count() > 0) {
+      has_deadline = true;
+      deadline = std::chrono::steady_clock::now() + limits.timeout;
+    }
+    refill_steps();
+  }
+
+  void refill_steps() {
+    step_batch = max_steps - steps;
+    if (has_deadline) {
+      step_batch = (std::min)(step_batch,
+                              size_t(CPPPEGLIB_DEADLINE_CHECK_INTERVAL - 1));
+    }
+    steps_until_check = step_batch;
+  }
+
+  // Called on the step after a batch runs out; false stops the parse
+  bool check_limits(const char *a_s) {
+    if (aborted) {
+      steps_until_check = 0;
+      return false;
+    }
+    steps += step_batch + 1;
+    if (steps > max_steps) {
+      abort(a_s, AbortReason::Steps,
+            "step limit of " + std::to_string(max_steps) + " exceeded");
+      return false;
+    }
+    if (has_deadline && std::chrono::steady_clock::now() > deadline) {
+      abort(a_s, AbortReason::Deadline, "deadline exceeded");
+      return false;
+    }
+    refill_steps();
+    return true;
+  }
+
+  // What an operator gives up when it backtracks: the events sent and the
+  // typed values built since the mark. A mark can be rolled back to until it
+  // goes out of scope.
+  class RollbackMark {
+  public:
+    explicit RollbackMark(Context &c)
+        : c_(c), events(c.event_count),
+          values(c.value_arena ? c.value_arena->size() : 0) {
+      if (c_.event_sink) {
+        if (c_.event_marks.empty()) { c_.commit_events(); }
+        c_.event_marks.push_back(events);
+      }
+    }
+
+    ~RollbackMark() {
+      if (c_.event_sink) {
+        c_.event_marks.pop_back();
+        if (c_.event_marks.empty()) { c_.commit_events(); }
+      }
+    }
+
+    RollbackMark(const RollbackMark &) = delete;
+    RollbackMark &operator=(const RollbackMark &) = delete;
+
+  private:
+    friend class Context;
+    Context &c_;
+    const size_t events;
+    const size_t values;
+  };
+
+  RollbackMark rollback_mark() { return RollbackMark(*this); }
+
+  void rollback(const RollbackMark &mark) {
+    if (event_count > mark.events) {
+      event_sink->rollback(mark.events);
+      event_count = mark.events;
+    }
+    if (value_arena) { value_arena->truncate(mark.values); }
+  }
+
+  // Events below the outermost mark in use can no longer be rolled back
+  void commit_events() {
+    auto floor = event_marks.empty() ? event_count : event_marks.front();
+    if (floor > event_committed) {
+      event_sink->commit(floor);
+      event_committed = floor;
+    }
+  }
+
+  void count_backtrack(const char *a_s) {
+    if (++backtracks > max_backtracks) {
+      abort(a_s, AbortReason::Backtracks,
+            "backtrack limit of " + std::to_string(max_backtracks) +
+                " exceeded");
+    }
+  }
+
+  static constexpr size_t cache_value_bytes =
+      sizeof(std::pair<const std::pair<size_t, size_t>,
+                       std::tuple<size_t, std::any>>) +
+      4 * sizeof(void *);
+
   template <typename T>
   void packrat(const char *a_s, size_t def_id, size_t &len, std::any &val,
                T fn) {
@@ -838,11 +1550,31 @@ public:
       return;
     }
 
-    auto col = a_s - s;
-    auto idx = def_count * static_cast<size_t>(col) + def_id;
+    auto col = static_cast<size_t>(a_s - s);
+
+    // Nothing can come back here once a cut has committed past it
+    if (col < cache_floor) {
+      fn(val);
+      return;
+    }
+
+    auto page_index = col / CPPPEGLIB_PACKRAT_PAGE_SIZE;
+    if (page_index >= cache_pages.size()) {
+      cache_pages.resize(page_index + 1);
+    }
+    // The page itself stays put when `fn` grows the page table
+    auto &slot = cache_pages[page_index];
+    if (!slot) {
+      slot = std::make_unique<CachePage>();
+      slot->registered.resize(def_count * CPPPEGLIB_PACKRAT_PAGE_SIZE);
+      slot->success.resize(def_count * CPPPEGLIB_PACKRAT_PAGE_SIZE);
+      allocate(MemoryCategory::Packrat, cache_page_bytes(), a_s);
+    }
+    auto page = slot.get();
+    auto idx = def_count * (col % CPPPEGLIB_PACKRAT_PAGE_SIZE) + def_id;
 
-    if (cache_registered[idx]) {
-      if (cache_success[idx]) {
+    if (page->registered[idx]) {
+      if (page->success[idx]) {
         auto key = std::pair(col, def_id);
         std::tie(len, val) = cache_values[key];
         return;
@@ -852,23 +1584,145 @@ public:
       }
     } else {
       fn(val);
-      cache_registered[idx] = true;
-      cache_success[idx] = success(len);
+      // A cut inside `fn` may have released this page
+      if (col < cache_floor) { return; }
+      page->registered[idx] = true;
+      page->success[idx] = success(len);
       if (success(len)) {
         auto key = std::pair(col, def_id);
         cache_values[key] = std::pair(len, val);
+        allocate(MemoryCategory::CacheValues, cache_value_bytes, a_s);
       }
       return;
     }
   }
 
+  // `fn` skips the whitespace at `a_s` and tells whether the result can be
+  // reused
+  template <typename T> size_t whitespace(const char *a_s, T fn) {
+    auto col = static_cast<size_t>(a_s - s);
+    if (event_sink || col < cache_floor) {
+      auto cacheable = false;
+      return fn(cacheable);
+    }
+
+    auto page_index = col / CPPPEGLIB_PACKRAT_PAGE_SIZE;
+    auto slot_index = enablePackratParsing
+                          ? page_index
+                          : page_index % CPPPEGLIB_WHITESPACE_WINDOW_PAGES;
+    if (slot_index >= whitespace_pages.size()) {
+      whitespace_pages.resize(slot_index + 1);
+    }
+    auto &slot = whitespace_pages[slot_index];
+    if (!slot) {
+      slot = std::make_unique<WhitespacePage>();
+      slot->index = page_index;
+      slot->ends.resize(CPPPEGLIB_PACKRAT_PAGE_SIZE, whitespace_unknown);
+      allocate(MemoryCategory::Whitespace, whitespace_page_bytes, a_s);
+    } else if (slot->index != page_index) {
+      slot->index = page_index;
+      std::fill(slot->ends.begin(), slot->ends.end(), whitespace_unknown);
+    }
+    auto page = slot.get();
+    auto idx = col % CPPPEGLIB_PACKRAT_PAGE_SIZE;
+
+    // A skip adds what it expected at the furthest error to the message,
+    // for the rules being parsed then, so it is only reused when the
+    // furthest error is already past it
+    auto end = page->ends[idx];
+    if (end != whitespace_unknown &&
+        (!log || (end != whitespace_failed && error_info.error_pos > s + end))) {
+      if (end == whitespace_failed) { return static_cast<size_t>(-1); }
+      return end - col;
+    }
+
+    auto cacheable = true;
+    auto len = fn(cacheable);
+    // A cut inside `fn` may have released this page, or a skip further on
+    // may have taken over its slot
+    if (cacheable && col >= cache_floor && page->index == page_index) {
+      if (fail(len)) {
+        page->ends[idx] = whitespace_failed;
+      } else if (col + len < whitespace_failed) {
+        page->ends[idx] = static_cast<uint32_t>(col + len);
+      }
+    }
+    return len;
+  }
+
+  size_t cache_page_bytes() const {
+    return sizeof(CachePage) + def_count * CPPPEGLIB_PACKRAT_PAGE_SIZE / 4;
+  }
+
+  static constexpr size_t whitespace_page_bytes =
+      sizeof(WhitespacePage) + CPPPEGLIB_PACKRAT_PAGE_SIZE * sizeof(uint32_t);
+
+  // Backtrack points
+  void push_backtrack_point(const char *a_s, bool choice = false) {
+    if (!enableCachePruning) { return; }
+    auto cut_id = choice && !cut_stack.empty() ? cut_stack.size() - 1
+                                               : static_cast<size_t>(-1);
+    backtrack_stack.push_back({static_cast<size_t>(a_s - s), cut_id});
+  }
+
+  void update_backtrack_point(const char *a_s) {
+    if (!enableCachePruning) { return; }
+    backtrack_stack.back().pos = static_cast<size_t>(a_s - s);
+  }
+
+  void pop_backtrack_point() {
+    if (!enableCachePruning) { return; }
+    backtrack_stack.pop_back();
+  }
+
+  // Drop memo entries that can no longer be reached after a cut at `a_s`
+  void prune_cache(const char *a_s) {
+    if (!enableCachePruning) { return; }
+
+    auto floor = static_cast<size_t>(a_s - s);
+    for (const auto &bp : backtrack_stack) {
+      auto committed = bp.cut_id != static_cast<size_t>(-1) &&
+                       bp.cut_id < cut_stack.size() && cut_stack[bp.cut_id];
+      if (!committed) {
+        floor = (std::min)(floor, bp.pos);
+        break;
+      }
+    }
+    if (floor <= cache_floor) { return; }
+
+    for (auto i = cache_floor / CPPPEGLIB_PACKRAT_PAGE_SIZE;
+         i < floor / CPPPEGLIB_PACKRAT_PAGE_SIZE && i < cache_pages.size();
+         i++) {
+      if (cache_pages[i]) {
+        cache_pages[i].reset();
+        release(MemoryCategory::Packrat, cache_page_bytes());
+      }
+    }
+    for (auto i = cache_floor / CPPPEGLIB_PACKRAT_PAGE_SIZE;
+         i < floor / CPPPEGLIB_PACKRAT_PAGE_SIZE && i < whitespace_pages.size();
+         i++) {
+      if (whitespace_pages[i]) {
+        whitespace_pages[i].reset();
+        release(MemoryCategory::Whitespace, whitespace_page_bytes);
+      }
+    }
+    auto last = cache_values.lower_bound(std::pair(floor, size_t(0)));
+    if (account_memory) {
+      release(MemoryCategory::CacheValues,
+              cache_value_bytes * static_cast<size_t>(std::distance(
+                                      cache_values.begin(), last)));
+    }
+    cache_values.erase(cache_values.begin(), last);
+    cache_floor = floor;
+  }
+
   SemanticValues &push() {
-    push_capture_scope();
+    if (enableCaptures) { push_capture_scope(); }
     return push_semantic_values_scope();
   }
 
   void pop() {
-    pop_capture_scope();
+    if (enableCaptures) { pop_capture_scope(); }
     pop_semantic_values_scope();
   }
 
@@ -897,6 +1751,20 @@ public:
 
   void pop_semantic_values_scope() { value_stack_size--; }
 
+  // Charges the growth of a scope's values, tokens and tags as they are
+  // added, so that a limit stops a parse that keeps adding to one scope.
+  // `a_s` is where the parse has got to.
+  void charge_values(SemanticValues &vs, const char *a_s) {
+    if (!account_memory || vs.c_ != this) { return; }
+    auto now = sizeof(SemanticValues) + vs.capacity() * sizeof(std::any) +
+               vs.tokens.capacity() * sizeof(std::string_view) +
+               vs.tags.capacity() * sizeof(unsigned int);
+    if (now > vs.charged_bytes_) {
+      allocate(MemoryCategory::ValueStack, now - vs.charged_bytes_, a_s);
+      vs.charged_bytes_ = now;
+    }
+  }
+
   // Arguments
   void push_args(std::vector<std::shared_ptr<Ope>> &&args) {
     args_stack.emplace_back(args);
@@ -909,27 +1777,75 @@ public:
   }
 
   // Capture scope
-  void push_capture_scope() {
-    assert(capture_scope_stack_size <= capture_scope_stack.size());
-    if (capture_scope_stack_size == capture_scope_stack.size()) {
-      capture_scope_stack.emplace_back(
-          std::map<std::string_view, std::string>());
-    } else {
-      auto &cs = capture_scope_stack[capture_scope_stack_size];
-      if (!cs.empty()) { cs.clear(); }
+  void push_capture_scope() { capture_scope_marks.push_back(captures.size()); }
+
+  void pop_capture_scope() {
+    if (account_memory) {
+      release(MemoryCategory::Captures,
+              capture_bytes(capture_scope_marks.back()));
     }
-    capture_scope_stack_size++;
+    captures.erase(captures.begin() + capture_scope_marks.back(),
+                   captures.end());
+    capture_scope_marks.pop_back();
   }
 
-  void pop_capture_scope() { capture_scope_stack_size--; }
+  size_t capture_bytes(size_t from) const {
+    size_t bytes = 0;
+    for (auto i = from; i < captures.size(); i++) {
+      bytes += sizeof(captures[i]) + captures[i].second.capacity();
+    }
+    return bytes;
+  }
 
   void shift_capture_values() {
-    assert(capture_scope_stack_size >= 2);
-    auto curr = &capture_scope_stack[capture_scope_stack_size - 1];
-    auto prev = curr - 1;
-    for (const auto &[k, v] : *curr) {
-      (*prev)[k] = v;
+    if (!enableCaptures) { return; }
+    assert(capture_scope_marks.size() >= 2);
+    auto prev = capture_scope_marks[capture_scope_marks.size() - 2];
+    auto curr = capture_scope_marks.back();
+    auto before = account_memory ? capture_bytes(prev) : 0;
+    auto end = curr;
+    for (auto i = curr; i < captures.size(); i++) {
+      auto it = std::find_if(
+          captures.begin() + prev, captures.begin() + curr,
+          [&](const auto &x) { return x.first == captures[i].first; });
+      if (it != captures.begin() + curr) {
+        it->second = std::move(captures[i].second);
+      } else {
+        if (end != i) { captures[end] = std::move(captures[i]); }
+        end++;
+      }
+    }
+    captures.erase(captures.begin() + end, captures.end());
+    capture_scope_marks.back() = end;
+    if (account_memory) {
+      release(MemoryCategory::Captures, before - capture_bytes(prev));
+    }
+  }
+
+  void set_capture(std::string_view name, const char *a_s, size_t a_n) {
+    auto beg = captures.begin() + capture_scope_marks.back();
+    auto it = std::find_if(beg, captures.end(),
+                           [&](const auto &x) { return x.first == name; });
+    if (it != captures.end()) {
+      auto capacity = it->second.capacity();
+      it->second.assign(a_s, a_n);
+      if (it->second.capacity() > capacity) {
+        allocate(MemoryCategory::Captures, it->second.capacity() - capacity,
+                 a_s);
+      }
+    } else {
+      captures.emplace_back(name, std::string(a_s, a_n));
+      allocate(MemoryCategory::Captures,
+               sizeof(captures.back()) + captures.back().second.capacity(),
+               a_s);
+    }
+  }
+
+  const std::string *find_capture(std::string_view name) const {
+    for (auto it = captures.rbegin(); it != captures.rend(); ++it) {
+      if (it->first == name) { return &it->second; }
     }
+    return nullptr;
   }
 
   // Error
@@ -944,29 +1860,27 @@ public:
 
   // Line info
   std::pair<size_t, size_t> line_info(const char *cur) const {
-    std::call_once(source_line_index_init_, [this]() {
-      for (size_t pos = 0; pos < l; pos++) {
-        if (s[pos] == '\n') { source_line_index.push_back(pos); }
-      }
-      source_line_index.push_back(l);
-    });
-
-    auto pos = static_cast<size_t>(std::distance(s, cur));
+    return line_index()->line_info(static_cast<size_t>(std::distance(s, cur)));
+  }
 
-    auto it = std::lower_bound(
-        source_line_index.begin(), source_line_index.end(), pos,
-        [](size_t element, size_t value) { return element < value; });
+  const std::shared_ptr<LineIndex> &line_index() const {
+    std::call_once(line_index_init_, [this]() {
+      line_index_ = std::make_shared<LineIndex>(path, s, l);
+    });
+    return line_index_;
+  }
 
-    auto id = static_cast<size_t>(std::distance(source_line_index.begin(), it));
-    auto off = pos - (id == 0 ? 0 : source_line_index[id - 1] + 1);
-    return std::pair(id + 1, off + 1);
+  // Uses the index of parses of the same input, before any line is looked up
+  void set_line_index(std::shared_ptr<LineIndex> line_index) {
+    std::call_once(line_index_init_,
+                   [&]() { line_index_ = std::move(line_index); });
   }
 
   size_t next_trace_id = 0;
   std::vector<size_t> trace_ids;
   bool ignore_trace_state = false;
-  mutable std::once_flag source_line_index_init_;
-  mutable std::vector<size_t> source_line_index;
+  mutable std::once_flag line_index_init_;
+  mutable std::shared_ptr<LineIndex> line_index_;
 };
 
 /*
@@ -1003,6 +1917,7 @@ public:
       i += len;
     }
     vs.append(chvs);
+    c.charge_values(vs, s + i);
     return i;
   }
 
@@ -1026,7 +1941,9 @@ public:
     size_t len = static_cast<size_t>(-1);
 
     if (!for_label_) { c.cut_stack.push_back(false); }
+    c.push_backtrack_point(s, true);
     auto se = scope_exit([&]() {
+      c.pop_backtrack_point();
       if (!for_label_) { c.cut_stack.pop_back(); }
     });
 
@@ -1041,18 +1958,21 @@ public:
         c.error_info.keep_previous_token = false;
       });
 
+      auto mark = c.rollback_mark();
       len = ope->parse(s, n, chvs, c, dt);
 
       if (success(len)) {
         vs.append(chvs);
+        c.charge_values(vs, s + len);
         vs.choice_count_ = opes_.size();
         vs.choice_ = id;
         c.shift_capture_values();
         break;
-      } else if (!c.cut_stack.empty() && c.cut_stack.back()) {
-        break;
       }
+      c.rollback(mark);
+      if (!c.cut_stack.empty() && c.cut_stack.back()) { break; }
 
+      c.count_backtrack(s);
       id++;
     }
 
@@ -1067,45 +1987,170 @@ public:
   bool for_label_ = false;
 };
 
-class Repetition : public Ope {
-public:
-  Repetition(const std::shared_ptr<Ope> &ope, size_t min, size_t max)
-      : ope_(ope), min_(min), max_(max) {}
+/*
+ * A choice whose alternatives share leading expressions, parsed once for all
+ * the alternatives they start. Made by left-factoring a PrioritizedChoice, it
+ * reports choice() as the original choice would.
+ */
+class FactoredChoice : public Ope {
+public:
+  struct Node {
+    std::vector<std::shared_ptr<Ope>> opes_; // Parsed in sequence,
+    std::vector<Node> nodes_;                // then tried in order
+    size_t id_ = 0;                          // Alternative, if no nodes_
+  };
+
+  FactoredChoice(std::vector<Node> &&nodes, size_t count)
+      : nodes_(std::move(nodes)), count_(count) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
-    size_t count = 0;
-    size_t i = 0;
-    while (count < min_) {
-      auto &chvs = c.push();
-      auto se = scope_exit([&]() { c.pop(); });
+    c.cut_stack.push_back(false);
+    c.push_backtrack_point(s, true);
+    auto se = scope_exit([&]() {
+      c.pop_backtrack_point();
+      c.cut_stack.pop_back();
+    });
 
-      auto len = ope_->parse(s + i, n - i, chvs, c, dt);
+    size_t id = 0;
+    auto len = parse_nodes(nodes_, s, n, vs, c, dt, id);
+    if (success(len)) {
+      vs.choice_count_ = count_;
+      vs.choice_ = id;
+    }
+    return len;
+  }
+
+  void accept(Visitor &v) override;
+
+  template <typename T> void for_each_ope(T fn) const {
+    for_each_ope(nodes_, fn);
+  }
+
+  // The choice this was factored from, with each shared expression copied
+  // back into the alternatives it starts. For the grammar checks, which
+  // follow the structure of sequences and choices.
+  std::shared_ptr<Ope> unfactored() const {
+    std::vector<std::shared_ptr<Ope>> alts(count_);
+    std::vector<std::shared_ptr<Ope>> path;
+    unfactor(nodes_, path, alts);
+    return std::make_shared<PrioritizedChoice>(std::move(alts));
+  }
+
+  std::vector<Node> nodes_;
+  size_t count_;
+
+private:
+  // A cut in a shared expression commits all the alternatives it starts
+  size_t parse_nodes(const std::vector<Node> &nodes, const char *s, size_t n,
+                     SemanticValues &vs, Context &c, std::any &dt,
+                     size_t &id) const {
+    for (size_t i = 0; i < nodes.size(); i++) {
+      auto &chvs = c.push();
+      c.error_info.keep_previous_token = i > 0;
+      auto se = scope_exit([&]() {
+        c.pop();
+        c.error_info.keep_previous_token = false;
+      });
 
+      auto mark = c.rollback_mark();
+      auto len = parse_node(nodes[i], s, n, chvs, c, dt, id);
       if (success(len)) {
         vs.append(chvs);
+        c.charge_values(vs, s + len);
         c.shift_capture_values();
-      } else {
         return len;
       }
+      c.rollback(mark);
+      if (c.cut_stack.back()) { break; }
+      c.count_backtrack(s);
+    }
+    return static_cast<size_t>(-1);
+  }
+
+  size_t parse_node(const Node &node, const char *s, size_t n,
+                    SemanticValues &vs, Context &c, std::any &dt,
+                    size_t &id) const {
+    size_t i = 0;
+    for (const auto &ope : node.opes_) {
+      auto len = ope->parse(s + i, n - i, vs, c, dt);
+      if (fail(len)) { return len; }
       i += len;
-      count++;
     }
+    if (node.nodes_.empty()) {
+      id = node.id_;
+      return i;
+    }
+    auto len = parse_nodes(node.nodes_, s + i, n - i, vs, c, dt, id);
+    return success(len) ? i + len : len;
+  }
 
-    while (count < max_) {
+  template <typename T>
+  static void for_each_ope(const std::vector<Node> &nodes, T &fn) {
+    for (const auto &node : nodes) {
+      for (const auto &ope : node.opes_) {
+        fn(ope);
+      }
+      for_each_ope(node.nodes_, fn);
+    }
+  }
+
+  static void unfactor(const std::vector<Node> &nodes,
+                       std::vector<std::shared_ptr<Ope>> &path,
+                       std::vector<std::shared_ptr<Ope>> &alts) {
+    for (const auto &node : nodes) {
+      auto size = path.size();
+      path.insert(path.end(), node.opes_.begin(), node.opes_.end());
+      if (node.nodes_.empty()) {
+        alts[node.id_] =
+            path.size() == 1 ? path[0] : std::make_shared<Sequence>(path);
+      } else {
+        unfactor(node.nodes_, path, alts);
+      }
+      path.resize(size);
+    }
+  }
+};
+
+class Repetition : public Ope {
+public:
+  Repetition(const std::shared_ptr<Ope> &ope, size_t min, size_t max)
+      : ope_(ope), min_(min), max_(max) {}
+
+  size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const override {
+    size_t count = 0;
+    size_t i = 0;
+    c.push_backtrack_point(s);
+    auto bp = scope_exit([&]() { c.pop_backtrack_point(); });
+
+    auto iterate = [&]() {
+      c.update_backtrack_point(s + i);
       auto &chvs = c.push();
       auto se = scope_exit([&]() { c.pop(); });
 
+      auto mark = c.rollback_mark();
       auto len = ope_->parse(s + i, n - i, chvs, c, dt);
 
       if (success(len)) {
         vs.append(chvs);
         c.shift_capture_values();
+        i += len;
+        c.charge_values(vs, s + i);
+        count++;
       } else {
-        break;
+        c.rollback(mark);
       }
-      i += len;
-      count++;
+      return len;
+    };
+
+    while (count < min_) {
+      auto len = iterate();
+      if (fail(len)) { return len; }
+    }
+
+    while (count < max_) {
+      if (fail(iterate())) { break; }
     }
     return i;
   }
@@ -1141,10 +2186,16 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any &dt) const override {
+    c.push_backtrack_point(s);
     auto &chvs = c.push();
-    auto se = scope_exit([&]() { c.pop(); });
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.pop_backtrack_point();
+    });
 
+    auto mark = c.rollback_mark();
     auto len = ope_->parse(s, n, chvs, c, dt);
+    c.rollback(mark);
 
     if (success(len)) {
       return 0;
@@ -1164,9 +2215,15 @@ public:
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any &dt) const override {
+    c.push_backtrack_point(s);
     auto &chvs = c.push();
-    auto se = scope_exit([&]() { c.pop(); });
+    auto se = scope_exit([&]() {
+      c.pop();
+      c.pop_backtrack_point();
+    });
+    auto mark = c.rollback_mark();
     auto len = ope_->parse(s, n, chvs, c, dt);
+    c.rollback(mark);
     if (success(len)) {
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
@@ -1197,10 +2254,14 @@ class LiteralString : public Ope,
                       public std::enable_shared_from_this<LiteralString> {
 public:
   LiteralString(std::string &&s, bool ignore_case)
-      : lit_(s), ignore_case_(ignore_case), is_word_(false) {}
+      : lit_(s), ignore_case_(ignore_case), is_word_(false) {
+    if (ignore_case_) { folded_ = fold_ascii_case(lit_); }
+  }
 
   LiteralString(const std::string &s, bool ignore_case)
-      : lit_(s), ignore_case_(ignore_case), is_word_(false) {}
+      : lit_(s), ignore_case_(ignore_case), is_word_(false) {
+    if (ignore_case_) { folded_ = fold_ascii_case(lit_); }
+  }
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override;
@@ -1209,6 +2270,7 @@ public:
 
   std::string lit_;
   bool ignore_case_;
+  std::string folded_; // lit_ with ASCII letters lowercased, if ignore_case_
   mutable std::once_flag init_is_word_;
   mutable bool is_word_;
 };
@@ -1233,17 +2295,28 @@ public:
       }
     }
     assert(!ranges_.empty());
+    init_ascii_bitmap();
   }
 
   CharacterClass(const std::vector<std::pair<char32_t, char32_t>> &ranges,
                  bool negated, bool ignore_case)
       : ranges_(ranges), negated_(negated), ignore_case_(ignore_case) {
     assert(!ranges_.empty());
+    init_ascii_bitmap();
   }
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
     if (n < 1) {
+      c.reached_end = true;
+      c.set_error_pos(s);
+      return static_cast<size_t>(-1);
+    }
+
+    // An ASCII byte is a whole codepoint
+    auto b = static_cast<uint8_t>(s[0]);
+    if (b < 0x80) {
+      if ((ascii_[b >> 6] >> (b & 63)) & 1) { return 1; }
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
     }
@@ -1273,6 +2346,19 @@ public:
   void accept(Visitor &v) override;
 
 private:
+  friend struct ComputeFirstSet;
+  friend struct OptimizeGrammar;
+  friend struct FactorChoices;
+  friend struct CompileDfa;
+
+  void init_ascii_bitmap() {
+    for (char32_t cp = 0; cp < 0x80; cp++) {
+      auto found = std::any_of(ranges_.begin(), ranges_.end(),
+                               [&](const auto &r) { return in_range(r, cp); });
+      if (found != negated_) { ascii_[cp >> 6] |= uint64_t(1) << (cp & 63); }
+    }
+  }
+
   bool in_range(const std::pair<char32_t, char32_t> &range, char32_t cp) const {
     if (ignore_case_) {
       auto cpl = std::tolower(cp);
@@ -1286,6 +2372,7 @@ private:
   std::vector<std::pair<char32_t, char32_t>> ranges_;
   bool negated_;
   bool ignore_case_;
+  uint64_t ascii_[2] = {0, 0};
 };
 
 class Character : public Ope, public std::enable_shared_from_this<Character> {
@@ -1295,6 +2382,7 @@ public:
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
     if (n < 1 || s[0] != ch_) {
+      if (n < 1) { c.reached_end = true; }
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
     }
@@ -1311,8 +2399,9 @@ class AnyCharacter : public Ope,
 public:
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
-    auto len = codepoint_length(s, n);
+    auto len = c.is_ascii ? (n ? 1 : 0) : codepoint_length(s, n);
     if (len < 1) {
+      if (n < 1) { c.reached_end = true; }
       c.set_error_pos(s);
       return static_cast<size_t>(-1);
     }
@@ -1322,6 +2411,70 @@ public:
   void accept(Visitor &v) override;
 };
 
+/*
+ * A token expression compiled into a DFA over bytes (see CompileDfa). Every
+ * choice, option and repetition in the expression is decided by the next
+ * byte, so it has a single path through the input, and it matches the
+ * longest prefix accepted along it. The DFA is only run on ASCII input.
+ * Other input, and every failure (for its error information), is left to
+ * the expression itself. So are matches that reach the farthest error
+ * position when errors are logged, since the expression's failed attempts
+ * there add expected tokens.
+ */
+class Dfa : public Ope, public std::enable_shared_from_this<Dfa> {
+public:
+  static constexpr uint16_t dead = 0xffff;
+  static constexpr uint8_t accepting = 1;
+  static constexpr uint8_t has_next = 2;
+
+  Dfa(const std::shared_ptr<Ope> &ope, std::vector<uint16_t> &&table,
+      std::vector<uint8_t> &&flags, std::vector<uint16_t> &&choices,
+      size_t choice_count)
+      : ope_(ope), table_(std::move(table)), flags_(std::move(flags)),
+        choices_(std::move(choices)), choice_count_(choice_count) {}
+
+  size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
+                    std::any &dt) const override {
+    if (!c.is_ascii) { return ope_->parse(s, n, vs, c, dt); }
+
+    size_t state = 0;
+    auto last = (flags_[0] & accepting) ? 0 : static_cast<size_t>(-1);
+    size_t last_state = 0;
+    size_t i = 0;
+    for (; i < n; i++) {
+      auto next = table_[state * 256 + static_cast<uint8_t>(s[i])];
+      if (next == dead) { break; }
+      state = next;
+      if (flags_[state] & accepting) {
+        last = i + 1;
+        last_state = state;
+      }
+    }
+    if (fail(last) || (c.log && s + i >= c.error_info.error_pos)) {
+      return ope_->parse(s, n, vs, c, dt);
+    }
+
+    if (i == n && (flags_[state] & has_next)) { c.reached_end = true; }
+    if (choice_count_) {
+      vs.choice_count_ = choice_count_;
+      vs.choice_ = choices_[last_state];
+    }
+    return last;
+  }
+
+  void accept(Visitor &v) override;
+
+  size_t state_count() const { return flags_.size(); }
+
+  std::shared_ptr<Ope> ope_;
+
+private:
+  std::vector<uint16_t> table_;   // 256 next states per state
+  std::vector<uint8_t> flags_;    // per state
+  std::vector<uint16_t> choices_; // alternative of a top-level choice
+  size_t choice_count_;
+};
+
 class CaptureScope : public Ope {
 public:
   CaptureScope(const std::shared_ptr<Ope> &ope) : ope_(ope) {}
@@ -1434,6 +2587,9 @@ public:
   const std::string &trace_name() const;
 
   std::shared_ptr<Ope> ope_;
+  // The body as written, if optimize_grammar rewrote it: parses with a
+  // logger run it, so that error messages stay the same
+  std::shared_ptr<Ope> unoptimized_;
   Definition *outer_;
   mutable std::once_flag trace_name_init_;
   mutable std::string trace_name_;
@@ -1499,6 +2655,71 @@ public:
   std::string name_;
 };
 
+/*
+ * Binary operator table for precedence climbing. The hash seed is searched
+ * for when the table is built so that no two operators share a slot (a
+ * perfect hash); a lookup is one hash, one probe and one compare.
+ */
+class BinOpeTable {
+public:
+  struct Entry {
+    std::string name;
+    size_t level = 0; // 0 for empty slots
+    char assoc = 0;
+  };
+
+  BinOpeTable() = default;
+
+  BinOpeTable(const std::map<std::string_view, std::pair<size_t, char>> &info) {
+    if (info.empty()) { return; }
+
+    size_t size = 2;
+    while (size < info.size() * 2) {
+      size *= 2;
+    }
+
+    for (;;) {
+      for (uint32_t seed = 0; seed < 1024; seed++) {
+        if (build(info, size, seed)) { return; }
+      }
+      size *= 2;
+    }
+  }
+
+  const Entry *find(std::string_view name) const {
+    if (entries_.empty()) { return nullptr; }
+    const auto &e = entries_[index(name, seed_, entries_.size())];
+    return e.level && e.name == name ? &e : nullptr;
+  }
+
+private:
+  static size_t index(std::string_view name, uint32_t seed, size_t size) {
+    uint32_t h = 2166136261u ^ seed;
+    for (auto ch : name) {
+      h ^= static_cast<uint8_t>(ch);
+      h *= 16777619u;
+    }
+    h ^= h >> 15;
+    return h & (size - 1);
+  }
+
+  bool build(const std::map<std::string_view, std::pair<size_t, char>> &info,
+             size_t size, uint32_t seed) {
+    std::vector<Entry> entries(size);
+    for (const auto &[name, v] : info) {
+      auto &e = entries[index(name, seed, size)];
+      if (e.level) { return false; }
+      e = Entry{std::string(name), v.first, v.second};
+    }
+    entries_ = std::move(entries);
+    seed_ = seed;
+    return true;
+  }
+
+  std::vector<Entry> entries_;
+  uint32_t seed_ = 0;
+};
+
 class PrecedenceClimbing : public Ope {
 public:
   using BinOpeInfo = std::map<std::string_view, std::pair<size_t, char>>;
@@ -1506,7 +2727,7 @@ public:
   PrecedenceClimbing(const std::shared_ptr<Ope> &atom,
                      const std::shared_ptr<Ope> &binop, const BinOpeInfo &info,
                      const Definition &rule)
-      : atom_(atom), binop_(binop), info_(info), rule_(rule) {}
+      : atom_(atom), binop_(binop), info_(info), table_(info), rule_(rule) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
@@ -1518,6 +2739,7 @@ public:
   std::shared_ptr<Ope> atom_;
   std::shared_ptr<Ope> binop_;
   BinOpeInfo info_;
+  BinOpeTable table_;
   const Definition &rule_;
 
 private:
@@ -1541,9 +2763,12 @@ public:
 
 class Cut : public Ope, public std::enable_shared_from_this<Cut> {
 public:
-  size_t parse_core(const char * /*s*/, size_t /*n*/, SemanticValues & /*vs*/,
+  size_t parse_core(const char *s, size_t /*n*/, SemanticValues & /*vs*/,
                     Context &c, std::any & /*dt*/) const override {
-    if (!c.cut_stack.empty()) { c.cut_stack.back() = true; }
+    if (!c.cut_stack.empty()) {
+      c.cut_stack.back() = true;
+      c.prune_cache(s);
+    }
     return 0;
   }
 
@@ -1689,6 +2914,7 @@ struct Ope::Visitor {
   virtual ~Visitor() {}
   virtual void visit(Sequence &) {}
   virtual void visit(PrioritizedChoice &) {}
+  virtual void visit(FactoredChoice &) {}
   virtual void visit(Repetition &) {}
   virtual void visit(AndPredicate &) {}
   virtual void visit(NotPredicate &) {}
@@ -1697,6 +2923,7 @@ struct Ope::Visitor {
   virtual void visit(CharacterClass &) {}
   virtual void visit(Character &) {}
   virtual void visit(AnyCharacter &) {}
+  virtual void visit(Dfa &) {}
   virtual void visit(CaptureScope &) {}
   virtual void visit(Capture &) {}
   virtual void visit(TokenBoundary &) {}
@@ -1717,6 +2944,8 @@ struct TraceOpeName : public Ope::Visitor {
 
   void visit(Sequence &) override { name_ = "Sequence"; }
   void visit(PrioritizedChoice &) override { name_ = "PrioritizedChoice"; }
+  void visit(FactoredChoice &) override { name_ = "FactoredChoice"; }
+  void visit(Dfa &) override { name_ = "Dfa"; }
   void visit(Repetition &) override { name_ = "Repetition"; }
   void visit(AndPredicate &) override { name_ = "AndPredicate"; }
   void visit(NotPredicate &) override { name_ = "NotPredicate"; }
@@ -1762,6 +2991,10 @@ struct AssignIDToDefinition : public Ope::Visitor {
       op->accept(*this);
     }
   }
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](auto &op) { op->accept(*this); });
+  }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override { ope.ope_->accept(*this); }
   void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
   void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
@@ -1788,6 +3021,8 @@ struct IsLiteralToken : public Ope::Visitor {
     }
     result_ = true;
   }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
 
   void visit(Dictionary &) override { result_ = true; }
   void visit(LiteralString &) override { result_ = true; }
@@ -1815,6 +3050,10 @@ struct TokenChecker : public Ope::Visitor {
       op->accept(*this);
     }
   }
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](auto &op) { op->accept(*this); });
+  }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override { ope.ope_->accept(*this); }
   void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
   void visit(Capture &ope) override { ope.ope_->accept(*this); }
@@ -1884,6 +3123,8 @@ struct DetectLeftRecursion : public Ope::Visitor {
       }
     }
   }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override {
     ope.ope_->accept(*this);
     done_ = ope.min_ > 0;
@@ -1937,6 +3178,8 @@ struct HasEmptyElement : public Ope::Visitor {
       if (is_empty) { return; }
     }
   }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override {
     if (ope.min_ == 0) {
       set_error();
@@ -1999,6 +3242,8 @@ struct DetectInfiniteLoop : public Ope::Visitor {
       if (has_error) { return; }
     }
   }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override {
     if (ope.max_ == std::numeric_limits<size_t>::max()) {
       HasEmptyElement vis(refs_, has_error_cache_);
@@ -2051,6 +3296,10 @@ struct ReferenceChecker : public Ope::Visitor {
       op->accept(*this);
     }
   }
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](auto &op) { op->accept(*this); });
+  }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override { ope.ope_->accept(*this); }
   void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
   void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
@@ -2090,6 +3339,10 @@ struct LinkReferences : public Ope::Visitor {
       op->accept(*this);
     }
   }
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](auto &op) { op->accept(*this); });
+  }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
   void visit(Repetition &ope) override { ope.ope_->accept(*this); }
   void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
   void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
@@ -2104,11 +3357,169 @@ struct LinkReferences : public Ope::Visitor {
   void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
+  // Rules referenced, in order, with repeats
+  std::vector<Definition *> referenced;
+
 private:
   Grammar &grammar_;
   const std::vector<std::string> &params_;
 };
 
+/*
+ * Strongly connected components of a graph, by Tarjan's algorithm. A
+ * component comes after every component its nodes have edges to.
+ */
+inline std::vector<std::vector<size_t>>
+strongly_connected_components(const std::vector<std::vector<size_t>> &edges) {
+  const auto unvisited = static_cast<size_t>(-1);
+  std::vector<size_t> index(edges.size(), unvisited);
+  std::vector<size_t> low(edges.size());
+  std::vector<bool> on_stack(edges.size());
+  std::vector<size_t> stack;
+  std::vector<std::pair<size_t, size_t>> calls; // Node, next edge
+  std::vector<std::vector<size_t>> components;
+  size_t next_index = 0;
+
+  auto enter = [&](size_t v) {
+    index[v] = low[v] = next_index++;
+    stack.push_back(v);
+    on_stack[v] = true;
+    calls.emplace_back(v, 0);
+  };
+
+  for (size_t root = 0; root < edges.size(); root++) {
+    if (index[root] != unvisited) { continue; }
+    enter(root);
+
+    while (!calls.empty()) {
+      auto v = calls.back().first;
+      auto &i = calls.back().second;
+      if (i < edges[v].size()) {
+        auto w = edges[v][i++];
+        if (index[w] == unvisited) {
+          enter(w);
+        } else if (on_stack[w]) {
+          low[v] = (std::min)(low[v], index[w]);
+        }
+        continue;
+      }
+
+      calls.pop_back();
+      if (!calls.empty()) {
+        auto u = calls.back().first;
+        low[u] = (std::min)(low[u], low[v]);
+      }
+
+      if (low[v] == index[v]) {
+        std::vector<size_t> component;
+        size_t w;
+        do {
+          w = stack.back();
+          stack.pop_back();
+          on_stack[w] = false;
+          component.push_back(w);
+        } while (w != v);
+        components.push_back(std::move(component));
+      }
+    }
+  }
+
+  return components;
+}
+
+/*
+ * Summary of a rule body for the grammar checks: whether it can succeed
+ * without consuming input, the rules it may call before consuming input,
+ * and whether it repeats without bound something that can be empty. The
+ * rules it references are looked up in `nullable`, and treated as
+ * consuming until they are in it.
+ */
+struct SummarizeRule : public Ope::Visitor {
+  using Ope::Visitor::visit;
+
+  SummarizeRule(const std::unordered_map<const Definition *, bool> &nullable)
+      : nullable_(nullable) {}
+
+  void visit(Sequence &ope) override {
+    auto left = left_;
+    auto all_nullable = true;
+    for (auto op : ope.opes_) {
+      left_ = left && all_nullable;
+      op->accept(*this);
+      all_nullable = all_nullable && nullable;
+    }
+    left_ = left;
+    nullable = all_nullable;
+  }
+  void visit(PrioritizedChoice &ope) override {
+    auto any_nullable = false;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+      any_nullable = any_nullable || nullable;
+    }
+    nullable = any_nullable;
+  }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
+  void visit(Repetition &ope) override {
+    ope.ope_->accept(*this);
+    if (nullable && ope.max_ == std::numeric_limits<size_t>::max()) {
+      empty_loop = true;
+    }
+    nullable = nullable || ope.min_ == 0;
+  }
+  void visit(AndPredicate &ope) override {
+    ope.ope_->accept(*this);
+    nullable = true;
+  }
+  void visit(NotPredicate &ope) override {
+    ope.ope_->accept(*this);
+    nullable = true;
+  }
+  void visit(Dictionary &) override { nullable = false; }
+  void visit(LiteralString &ope) override { nullable = ope.lit_.empty(); }
+  void visit(CharacterClass &) override { nullable = false; }
+  void visit(Character &) override { nullable = false; }
+  void visit(AnyCharacter &) override { nullable = false; }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(User &) override { nullable = false; }
+  void visit(WeakHolder &) override { nullable = true; }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override {
+    if (!ope.rule_) { // Macro parameter
+      nullable = false;
+      return;
+    }
+    if (left_) { left_referenced.push_back(ope.rule_); }
+
+    auto left = left_;
+    left_ = false;
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+    left_ = left;
+
+    auto it = nullable_.find(ope.rule_);
+    nullable = it != nullable_.end() && it->second;
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(BackReference &) override { nullable = false; }
+  void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+  void visit(Cut &) override { nullable = true; }
+
+  bool nullable = false;
+  bool empty_loop = false;
+  std::vector<Definition *> left_referenced;
+
+private:
+  const std::unordered_map<const Definition *, bool> &nullable_;
+  bool left_ = true;
+};
+
 struct FindReference : public Ope::Visitor {
   using Ope::Visitor::visit;
 
@@ -2132,6 +3543,12 @@ struct FindReference : public Ope::Visitor {
     }
     found_ope = std::make_shared<PrioritizedChoice>(opes);
   }
+  void visit(FactoredChoice &ope) override {
+    found_ope =
+        std::make_shared<FactoredChoice>(substitute(ope.nodes_), ope.count_);
+  }
+  // A DFA only matches bytes, so it has no references to replace
+  void visit(Dfa &ope) override { found_ope = ope.shared_from_this(); }
   void visit(Repetition &ope) override {
     ope.ope_->accept(*this);
     found_ope = rep(found_ope, ope.min_, ope.max_);
@@ -2189,2578 +3606,6810 @@ struct FindReference : public Ope::Visitor {
   std::shared_ptr<Ope> found_ope;
 
 private:
+  std::vector<FactoredChoice::Node>
+  substitute(const std::vector<FactoredChoice::Node> &nodes) {
+    std::vector<FactoredChoice::Node> result;
+    for (const auto &node : nodes) {
+      FactoredChoice::Node copy;
+      for (auto o : node.opes_) {
+        o->accept(*this);
+        copy.opes_.push_back(found_ope);
+      }
+      copy.nodes_ = substitute(node.nodes_);
+      copy.id_ = node.id_;
+      result.push_back(std::move(copy));
+    }
+    return result;
+  }
+
   const std::vector<std::shared_ptr<Ope>> &args_;
   const std::vector<std::string> &params_;
 };
 
 /*
- * Keywords
+ * First set: the bytes an expression can start with, and whether it can
+ * succeed without consuming input. Anything that can't be analyzed (user
+ * operators, back references, macro parameters...) is reported as matching
+ * any byte and as nullable, which is the conservative answer.
  */
-static const char *WHITESPACE_DEFINITION_NAME = "%whitespace";
-static const char *WORD_DEFINITION_NAME = "%word";
-static const char *RECOVER_DEFINITION_NAME = "%recover";
+struct FirstSet {
+  std::bitset<256> chars;
+  bool nullable = false;
+};
 
-/*
- * Definition
- */
-class Definition {
-public:
-  struct Result {
-    bool ret;
-    bool recovered;
-    size_t len;
-    ErrorInfo error_info;
-  };
+struct ComputeFirstSet : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  Definition() : holder_(std::make_shared<Holder>(this)) {}
+  ComputeFirstSet(std::unordered_map<std::string, FirstSet> &cache)
+      : cache_(cache) {}
 
-  Definition(const Definition &rhs) : name(rhs.name), holder_(rhs.holder_) {
-    holder_->outer_ = this;
+  void visit(Sequence &ope) override {
+    FirstSet r;
+    r.nullable = true;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+      r.chars |= first.chars;
+      if (!first.nullable) {
+        r.nullable = false;
+        break;
+      }
+    }
+    first = r;
   }
-
-  Definition(const std::shared_ptr<Ope> &ope)
-      : holder_(std::make_shared<Holder>(this)) {
-    *this <= ope;
+  void visit(PrioritizedChoice &ope) override {
+    FirstSet r;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+      r.chars |= first.chars;
+      r.nullable = r.nullable || first.nullable;
+    }
+    first = r;
   }
-
-  operator std::shared_ptr<Ope>() {
-    return std::make_shared<WeakHolder>(holder_);
+  void visit(FactoredChoice &ope) override { first = nodes(ope.nodes_); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
+  void visit(Repetition &ope) override {
+    ope.ope_->accept(*this);
+    if (ope.min_ == 0) { first.nullable = true; }
   }
-
-  Definition &operator<=(const std::shared_ptr<Ope> &ope) {
-    holder_->ope_ = ope;
-    return *this;
+  void visit(AndPredicate &) override { first = FirstSet{{}, true}; }
+  void visit(NotPredicate &) override { first = FirstSet{{}, true}; }
+  void visit(Dictionary &ope) override {
+    first = FirstSet();
+    auto ignore_case = ope.trie_.ignore_case();
+    ope.trie_.for_each_first_char([&](char ch) { add_char(ch, ignore_case); });
   }
-
-  Result parse(const char *s, size_t n, const char *path = nullptr,
-               Log log = nullptr) const {
-    SemanticValues vs;
-    std::any dt;
-    return parse_core(s, n, vs, dt, path, log);
+  void visit(LiteralString &ope) override {
+    first = FirstSet();
+    if (ope.lit_.empty()) {
+      first.nullable = true;
+    } else {
+      add_char(ope.lit_[0], ope.ignore_case_);
+    }
   }
-
-  Result parse(const char *s, const char *path = nullptr,
-               Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse(s, n, path, log);
+  void visit(CharacterClass &ope) override {
+    if (ope.negated_) {
+      set_any();
+      first.nullable = false;
+      return;
+    }
+    first = FirstSet();
+    for (const auto &[beg, end] : ope.ranges_) {
+      for (auto cp = beg; cp <= (std::min)(end, char32_t(0x7f)); cp++) {
+        add_char(static_cast<char>(cp), ope.ignore_case_);
+      }
+      if (end > 0x7f) {
+        for (auto b = 0xc0; b <= 0xff; b++) {
+          first.chars.set(static_cast<size_t>(b));
+        }
+      }
+    }
   }
-
-  Result parse(const char *s, size_t n, std::any &dt,
-               const char *path = nullptr, Log log = nullptr) const {
-    SemanticValues vs;
-    return parse_core(s, n, vs, dt, path, log);
+  void visit(Character &ope) override {
+    first = FirstSet();
+    add_char(ope.ch_, false);
   }
-
-  Result parse(const char *s, std::any &dt, const char *path = nullptr,
-               Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse(s, n, dt, path, log);
+  void visit(AnyCharacter &) override {
+    set_any();
+    first.nullable = false;
   }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(User &) override { set_any(); }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(BackReference &) override { set_any(); }
+  void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(Recovery &) override { first = FirstSet{{}, true}; }
+  void visit(Cut &) override { first = FirstSet{{}, true}; }
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, size_t n, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    SemanticValues vs;
-    std::any dt;
-    auto r = parse_core(s, n, vs, dt, path, log);
-    if (r.ret && !vs.empty() && vs.front().has_value()) {
-      val = std::any_cast<T>(vs[0]);
+  FirstSet first;
+
+private:
+  void add_char(char ch, bool ignore_case) {
+    auto b = static_cast<unsigned char>(ch);
+    first.chars.set(b);
+    if (ignore_case && b < 0x80) {
+      first.chars.set(static_cast<unsigned char>(std::tolower(b)));
+      first.chars.set(static_cast<unsigned char>(std::toupper(b)));
     }
-    return r;
   }
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, T &val, const char *path = nullptr,
-                             Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse_and_get_value(s, n, val, path, log);
+  void set_any() {
+    first.chars.set();
+    first.nullable = true;
   }
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, size_t n, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    SemanticValues vs;
-    auto r = parse_core(s, n, vs, dt, path, log);
-    if (r.ret && !vs.empty() && vs.front().has_value()) {
-      val = std::any_cast<T>(vs[0]);
+  FirstSet nodes(const std::vector<FactoredChoice::Node> &nodes) {
+    FirstSet r;
+    for (const auto &node : nodes) {
+      FirstSet seq;
+      seq.nullable = true;
+      for (auto op : node.opes_) {
+        op->accept(*this);
+        seq.chars |= first.chars;
+        seq.nullable = first.nullable;
+        if (!seq.nullable) { break; }
+      }
+      if (seq.nullable && !node.nodes_.empty()) {
+        auto rest = this->nodes(node.nodes_);
+        seq.chars |= rest.chars;
+        seq.nullable = rest.nullable;
+      }
+      r.chars |= seq.chars;
+      r.nullable = r.nullable || seq.nullable;
     }
     return r;
   }
 
-  template <typename T>
-  Result parse_and_get_value(const char *s, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    auto n = strlen(s);
-    return parse_and_get_value(s, n, dt, val, path, log);
-  }
+  std::unordered_map<std::string, FirstSet> &cache_;
+  std::unordered_set<std::string> refs_;
+};
 
-#if defined(__cpp_lib_char8_t)
-  Result parse(const char8_t *s, size_t n, const char *path = nullptr,
-               Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), n, path, log);
-  }
+struct CollectChoices : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  Result parse(const char8_t *s, const char *path = nullptr,
-               Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), path, log);
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
   }
-
-  Result parse(const char8_t *s, size_t n, std::any &dt,
-               const char *path = nullptr, Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), n, dt, path, log);
+  void visit(PrioritizedChoice &ope) override {
+    if (!ope.for_label_) { choices.push_back(&ope); }
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
   }
-
-  Result parse(const char8_t *s, std::any &dt, const char *path = nullptr,
-               Log log = nullptr) const {
-    return parse(reinterpret_cast<const char *>(s), dt, path, log);
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](const auto &op) { op->accept(*this); });
   }
-
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, size_t n, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), n, val, *path,
-                               log);
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
   }
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), val, *path,
-                               log);
-  }
+  std::vector<PrioritizedChoice *> choices;
+};
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, size_t n, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), n, dt, val,
-                               *path, log);
+/*
+ * Backtracking hotspots: places where, without packrat parsing, input that a
+ * failed expression went over is parsed again from the same position by what
+ * is tried next. The work multiplies at each level when the expressions
+ * recurse into their own rule, and is repeated for every iteration when they
+ * can consume unbounded input inside a repetition.
+ */
+struct BacktrackingHotspot {
+  enum class Growth { Linear, Exponential };
+
+  std::string rule;
+  size_t line;
+  size_t column;
+  Growth growth;
+  size_t parses; // times the same input may be parsed at each level
+  std::string construct;
+  std::string suggestion;
+
+  std::string cost() const {
+    if (growth == Growth::Exponential) {
+      return "O(" + std::to_string(parses) + "^n) steps";
+    }
+    return std::to_string(parses) + " parses of its input";
   }
+};
 
-  template <typename T>
-  Result parse_and_get_value(const char8_t *s, std::any &dt, T &val,
-                             const char *path = nullptr,
-                             Log log = nullptr) const {
-    return parse_and_get_value(reinterpret_cast<const char *>(s), dt, val,
-                               *path, log);
-  }
-#endif
+// Whether an expression can recurse into the rules of `component`, or
+// consume unbounded input, without looking into the rules it references
+struct ReachRules : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  void operator=(Action a) { action = a; }
+  ReachRules(const std::unordered_set<const Definition *> &component,
+             const std::unordered_map<const Definition *, bool> &unbounded)
+      : component_(component), unbounded_(unbounded) {}
 
-  template <typename T> Definition &operator,(T fn) {
-    operator=(fn);
-    return *this;
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
   }
-
-  Definition &operator~() {
-    ignoreSemanticValue = true;
-    return *this;
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
   }
-
-  void accept(Ope::Visitor &v) { holder_->accept(v); }
-
-  std::shared_ptr<Ope> get_core_operator() const { return holder_->ope_; }
-
-  bool is_token() const {
-    std::call_once(is_token_init_, [this]() {
-      is_token_ = TokenChecker::is_token(*get_core_operator());
-    });
-    return is_token_;
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](const auto &op) { op->accept(*this); });
+  }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
+  void visit(Repetition &ope) override {
+    if (ope.max_ > 1) { unbounded = true; }
+    ope.ope_->accept(*this);
+  }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(User &) override { unbounded = true; }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override {
+    // Macro arguments are only known at parse time
+    if (!ope.rule_ || ope.is_macro_) { unbounded = true; }
+    if (!ope.rule_) { return; }
+    referenced.push_back(ope.rule_);
+    if (component_.count(ope.rule_)) {
+      recursive = unbounded = true;
+    } else {
+      auto it = unbounded_.find(ope.rule_);
+      if (it == unbounded_.end() || it->second) { unbounded = true; }
+    }
   }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    unbounded = true;
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
-  std::string name;
-  const char *s_ = nullptr;
-  std::pair<size_t, size_t> line_ = {1, 1};
+  bool recursive = false;
+  bool unbounded = false;
+  std::vector<const Definition *> referenced;
 
-  std::function<bool(const SemanticValues &vs, const std::any &dt,
-                     std::string &msg)>
-      predicate;
+private:
+  const std::unordered_set<const Definition *> &component_;
+  const std::unordered_map<const Definition *, bool> &unbounded_;
+};
 
-  size_t id = 0;
-  Action action;
-  std::function<void(const Context &c, const char *s, size_t n, std::any &dt)>
-      enter;
-  std::function<void(const Context &c, const char *s, size_t n, size_t matchlen,
-                     std::any &value, std::any &dt)>
-      leave;
-  bool ignoreSemanticValue = false;
-  std::shared_ptr<Ope> whitespaceOpe;
-  std::shared_ptr<Ope> wordOpe;
-  bool enablePackratParsing = false;
-  bool is_macro = false;
-  std::vector<std::string> params;
-  bool disable_action = false;
+// Finds the worst backtracking hotspot in a rule whose callees outside its
+// component have been analyzed already
+struct FindBacktracking : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  TracerEnter tracer_enter;
-  TracerLeave tracer_leave;
-  bool verbose_trace = false;
-  TracerStartOrEnd tracer_start;
-  TracerStartOrEnd tracer_end;
+  FindBacktracking(const std::unordered_set<const Definition *> &component,
+                   const std::unordered_map<const Definition *, bool> &unbounded,
+                   std::unordered_map<std::string, FirstSet> &first_sets)
+      : component_(component), unbounded_(unbounded), first_sets_(first_sets) {}
 
-  std::string error_message;
-  bool no_ast_opt = false;
+  void visit(Sequence &ope) override {
+    // An optional expression that fails part way leaves its input to what
+    // follows it
+    for (size_t i = 0; i + 1 < ope.opes_.size(); i++) {
+      auto rep = dynamic_cast<Repetition *>(ope.opes_[i].get());
+      if (rep && rep->min_ == 0) {
+        check({rep->ope_, ope.opes_[i + 1]},
+              "an optional expression and what follows it start alike");
+      }
+    }
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    if (!ope.for_label_) {
+      for (size_t i = 0; i + 1 < ope.opes_.size(); i++) {
+        check(std::vector<std::shared_ptr<Ope>>(ope.opes_.begin() + i,
+                                                ope.opes_.end()),
+              "alternatives of a choice start alike");
+      }
+    }
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](const auto &op) { op->accept(*this); });
+  }
+  void visit(Repetition &ope) override {
+    if (ope.max_ > 1) { repetitions_++; }
+    ope.ope_->accept(*this);
+    if (ope.max_ > 1) { repetitions_--; }
+  }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    repetitions_++;
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+    repetitions_--;
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
-  bool eoi_check = true;
+  bool found = false;
+  BacktrackingHotspot hotspot;
 
 private:
-  friend class Reference;
-  friend class ParserGenerator;
+  // The first expression may fail after going over input that the others,
+  // tried next, parse again when they start alike
+  void check(std::vector<std::shared_ptr<Ope>> opes, const char *construct) {
+    auto first = first_set(*opes[0]);
+    size_t recursive = 0;
+    size_t unbounded = 0;
+    for (size_t i = 0; i < opes.size(); i++) {
+      if (i > 0 && !(first_set(*opes[i]).chars & first.chars).any()) {
+        continue;
+      }
+      // An alternative that commits with a cut is not given up once decided
+      if (auto seq = dynamic_cast<Sequence *>(opes[i].get())) {
+        if (std::any_of(seq->opes_.begin(), seq->opes_.end(),
+                        [](const auto &op) {
+                          return dynamic_cast<Cut *>(op.get()) != nullptr;
+                        })) {
+          continue;
+        }
+      }
+      ReachRules vis(component_, unbounded_);
+      opes[i]->accept(vis);
+      if (vis.recursive) { recursive++; }
+      if (vis.unbounded) { unbounded++; }
+    }
 
-  Definition &operator=(const Definition &rhs);
-  Definition &operator=(Definition &&rhs);
-
-  void initialize_definition_ids() const {
-    std::call_once(definition_ids_init_, [&]() {
-      AssignIDToDefinition vis;
-      holder_->accept(vis);
-      if (whitespaceOpe) { whitespaceOpe->accept(vis); }
-      if (wordOpe) { wordOpe->accept(vis); }
-      definition_ids_.swap(vis.ids);
-    });
+    if (recursive >= 2) {
+      report(BacktrackingHotspot::Growth::Exponential, recursive, construct,
+             "enable packrat parsing, or left-factor the shared prefix");
+    } else if (unbounded >= 2 && repetitions_ > 0) {
+      report(BacktrackingHotspot::Growth::Linear, unbounded, construct,
+             "commit with a cut once the alternative is decided, or enable "
+             "packrat parsing");
+    }
   }
 
-  Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
-                    const char *path, Log log) const {
-    initialize_definition_ids();
+  void report(BacktrackingHotspot::Growth growth, size_t parses,
+              const char *construct, const char *suggestion) {
+    if (found && std::tie(hotspot.growth, hotspot.parses) >=
+                     std::tie(growth, parses)) {
+      return;
+    }
+    found = true;
+    hotspot.growth = growth;
+    hotspot.parses = parses;
+    hotspot.construct = construct;
+    hotspot.suggestion = suggestion;
+  }
 
-    std::shared_ptr<Ope> ope = holder_;
+  FirstSet first_set(Ope &ope) {
+    ComputeFirstSet vis(first_sets_);
+    ope.accept(vis);
+    return vis.first;
+  }
 
-    std::any trace_data;
-    if (tracer_start) { tracer_start(trace_data); }
-    auto se = scope_exit([&]() {
-      if (tracer_end) { tracer_end(trace_data); }
-    });
+  const std::unordered_set<const Definition *> &component_;
+  const std::unordered_map<const Definition *, bool> &unbounded_;
+  std::unordered_map<std::string, FirstSet> &first_sets_;
+  size_t repetitions_ = 0;
+};
 
-    Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
-              enablePackratParsing, tracer_enter, tracer_leave, trace_data,
-              verbose_trace, log);
+/*
+ * Grammar optimization
+ */
+struct GrammarOptimization {
+  size_t inlined = 0;
+  size_t flattened = 0;
+  size_t dictionaries = 0;
+  size_t char_classes = 0;
+  size_t unwrapped = 0;
+  double before_ms = 0; // Time to parse the sample, if given
+  double after_ms = 0;
+  double speedup = 0;
+  std::vector<std::string> changes; // "Rule: what changed"
+};
 
-    size_t i = 0;
+inline std::ostream &operator<<(std::ostream &os,
+                                const GrammarOptimization &result) {
+  os << "grammar optimization: " << result.inlined << " inlined, "
+     << result.flattened << " flattened, " << result.dictionaries
+     << " dictionaries, " << result.char_classes << " character classes, "
+     << result.unwrapped << " unwrapped" << std::endl;
+  if (result.speedup > 0) {
+    os << "  sample: " << result.before_ms << " ms -> " << result.after_ms
+       << " ms (" << result.speedup << "x)" << std::endl;
+  }
+  for (const auto &change : result.changes) {
+    os << "  " << change << std::endl;
+  }
+  return os;
+}
 
-    if (whitespaceOpe) {
-      auto save_ignore_trace_state = c.ignore_trace_state;
-      c.ignore_trace_state = !c.verbose_trace;
-      auto se =
-          scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+// Size of an expression, and whether it may add semantic values or tokens to
+// the semantic values it is parsed with
+struct MeasureOpe : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-      auto len = whitespaceOpe->parse(s, n, vs, c, dt);
-      if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
+  MeasureOpe(bool whitespace_pushes) : whitespace_pushes_(whitespace_pushes) {}
 
-      i = len;
+  void visit(Sequence &ope) override {
+    count++;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
     }
-
-    auto len = ope->parse(s + i, n - i, vs, c, dt);
-    auto ret = success(len);
-    if (ret) {
-      i += len;
-      if (eoi_check) {
-        if (i < n) {
-          if (c.error_info.error_pos - c.s < s + i - c.s) {
-            c.error_info.message_pos = s + i;
-            c.error_info.message = "expected end of input";
-          }
-          ret = false;
-        }
-      }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    count++;
+    for (auto op : ope.opes_) {
+      op->accept(*this);
     }
-    return Result{ret, c.recovered, i, c.error_info};
   }
+  void visit(Repetition &ope) override {
+    count++;
+    ope.ope_->accept(*this);
+  }
+  void visit(AndPredicate &) override { count++; }
+  void visit(NotPredicate &) override { count++; }
+  void visit(Dictionary &) override {
+    count++;
+    pushes |= whitespace_pushes_;
+  }
+  void visit(LiteralString &) override {
+    count++;
+    pushes |= whitespace_pushes_;
+  }
+  void visit(CharacterClass &) override { count++; }
+  void visit(Character &) override { count++; }
+  void visit(AnyCharacter &) override { count++; }
+  void visit(CaptureScope &ope) override {
+    count++;
+    ope.ope_->accept(*this);
+  }
+  void visit(Capture &ope) override {
+    count++;
+    ope.ope_->accept(*this);
+  }
+  void visit(TokenBoundary &) override {
+    count++;
+    pushes = true;
+  }
+  void visit(Ignore &) override { count++; }
+  void visit(User &) override { set_opaque(); }
+  void visit(WeakHolder &) override { set_opaque(); }
+  void visit(Holder &) override { set_opaque(); }
+  void visit(FactoredChoice &) override { set_opaque(); }
+  void visit(Dfa &) override { set_opaque(); }
+  void visit(Reference &) override { set_opaque(); }
+  void visit(Whitespace &) override { set_opaque(); }
+  void visit(BackReference &) override { set_opaque(); }
+  void visit(PrecedenceClimbing &) override { set_opaque(); }
+  void visit(Recovery &) override { set_opaque(); }
+  void visit(Cut &) override { count++; }
 
-  std::shared_ptr<Holder> holder_;
-  mutable std::once_flag is_token_init_;
-  mutable bool is_token_ = false;
-  mutable std::once_flag assign_id_to_definition_init_;
-  mutable std::once_flag definition_ids_init_;
-  mutable std::unordered_map<void *, size_t> definition_ids_;
+  size_t count = 0;
+  bool pushes = false;
+
+private:
+  void set_opaque() {
+    count++;
+    pushes = true;
+  }
+
+  bool whitespace_pushes_;
 };
 
 /*
- * Implementations
+ * Rewrites a rule body into an equivalent, faster one. A rewrite is only made
+ * where semantic values, tokens and choice() stay the same for the rule's
+ * action. Error messages are derived from the shape of the grammar, so the
+ * body as written is kept for parses with a logger (see Holder).
  */
+struct OptimizeGrammar : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
-                            Context &c, std::any &dt, const std::string &lit,
-                            std::once_flag &init_is_word, bool &is_word,
-                            bool ignore_case) {
-  size_t i = 0;
-  for (; i < lit.size(); i++) {
-    if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
-                               : (s[i] != lit[i]))) {
-      c.set_error_pos(s, lit.data());
-      return static_cast<size_t>(-1);
-    }
-  }
-
-  // Word check
-  if (c.wordOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+  static constexpr size_t max_inline_size = 8;
+  static constexpr size_t min_dictionary_size = 8;
 
-    std::call_once(init_is_word, [&]() {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
+  OptimizeGrammar(const Definition &rule, bool keep_choice, bool keep_tokens,
+                  bool has_whitespace, bool has_word, bool whitespace_pushes,
+                  GrammarOptimization &result)
+      : rule_(rule), keep_choice_(keep_choice), keep_tokens_(keep_tokens),
+        has_whitespace_(has_whitespace), has_word_(has_word),
+        whitespace_pushes_(whitespace_pushes), result_(result) {}
 
-      auto len =
-          c.wordOpe->parse(lit.data(), lit.size(), dummy_vs, dummy_c, dummy_dt);
-      is_word = success(len);
-    });
+  std::shared_ptr<Ope> optimize(const std::shared_ptr<Ope> &ope) {
+    found_ope = ope;
+    ope->accept(*this);
+    return found_ope;
+  }
 
-    if (is_word) {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
+  void visit(Sequence &ope) override {
+    auto self = found_ope;
+    auto top = top_;
+    top_ = false;
 
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) {
-        c.set_error_pos(s, lit.data());
-        return len;
+    std::vector<std::shared_ptr<Ope>> opes;
+    auto changed = false;
+    for (auto op : ope.opes_) {
+      auto o = optimize(op);
+      if (auto seq = dynamic_cast<Sequence *>(o.get())) {
+        opes.insert(opes.end(), seq->opes_.begin(), seq->opes_.end());
+        note(result_.flattened, "flattened a nested sequence");
+        changed = true;
+      } else {
+        opes.push_back(o);
+        changed |= o != op;
       }
-      i += len;
     }
-  }
-
-  // Skip whitespace
-  if (!c.in_token_boundary_count && c.whitespaceOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
-    if (fail(len)) { return len; }
-    i += len;
+    top_ = top;
+    found_ope = changed ? std::make_shared<Sequence>(opes) : self;
   }
 
-  return i;
-}
-
-inline std::pair<size_t, size_t> SemanticValues::line_info() const {
-  assert(c_);
-  return c_->line_info(sv_.data());
-}
-
-inline void ErrorInfo::output_log(const Log &log, const char *s, size_t n) {
-  if (message_pos) {
-    if (message_pos > last_output_pos) {
-      last_output_pos = message_pos;
-      auto line = line_info(s, message_pos);
-      std::string msg;
-      if (auto unexpected_token = heuristic_error_token(s, n, message_pos);
-          !unexpected_token.empty()) {
-        msg = replace_all(message, "%t", unexpected_token);
+  void visit(PrioritizedChoice &ope) override {
+    auto self = found_ope;
+    if (ope.for_label_) { return; }
 
-        auto unexpected_char = unexpected_token.substr(
-            0,
-            codepoint_length(unexpected_token.data(), unexpected_token.size()));
+    // choice() is only visible for the top choice of a rule
+    auto keep_choice = top_ && keep_choice_;
+    auto top = top_;
+    top_ = false;
 
-        msg = replace_all(msg, "%c", unexpected_char);
+    std::vector<std::shared_ptr<Ope>> opes;
+    auto changed = false;
+    auto has_cut = false;
+    for (auto op : ope.opes_) {
+      auto save_has_cut = has_cut_;
+      has_cut_ = false;
+      auto o = optimize(op);
+      auto cut = has_cut_;
+      has_cut_ = save_has_cut || cut;
+      has_cut |= cut;
+
+      // A cut commits to the innermost choice, so it pins its choice
+      auto choice = dynamic_cast<PrioritizedChoice *>(o.get());
+      if (choice && !choice->for_label_ && !cut && !keep_choice) {
+        opes.insert(opes.end(), choice->opes_.begin(), choice->opes_.end());
+        note(result_.flattened, "flattened a nested choice");
+        changed = true;
       } else {
-        msg = message;
+        opes.push_back(o);
+        changed |= o != op;
       }
-      log(line.first, line.second, msg, label);
     }
-  } else if (error_pos) {
-    if (error_pos > last_output_pos) {
-      last_output_pos = error_pos;
-      auto line = line_info(s, error_pos);
+    top_ = top;
 
-      std::string msg;
-      if (expected_tokens.empty()) {
-        msg = "syntax error.";
-      } else {
-        msg = "syntax error";
+    if (!keep_choice) { changed |= merge_alternatives(opes); }
 
-        // unexpected token
-        if (auto unexpected_token = heuristic_error_token(s, n, error_pos);
-            !unexpected_token.empty()) {
-          msg += ", unexpected '";
-          msg += unexpected_token;
-          msg += "'";
-        }
+    if (!changed) {
+      found_ope = self;
+    } else if (opes.size() == 1 && !keep_choice && !has_cut) {
+      note(result_.unwrapped, "removed a single alternative choice");
+      found_ope = opes[0];
+    } else {
+      found_ope = std::make_shared<PrioritizedChoice>(opes);
+    }
+  }
 
-        auto first_item = true;
-        size_t i = 0;
-        while (i < expected_tokens.size()) {
-          auto [error_literal, error_rule] = expected_tokens[i];
+  void visit(Repetition &ope) override {
+    auto self = found_ope;
+    auto top = top_;
+    top_ = false;
+    auto o = optimize(ope.ope_);
+    top_ = top;
+    found_ope = o != ope.ope_ ? rep(o, ope.min_, ope.max_) : self;
+  }
+  void visit(AndPredicate &ope) override {
+    auto self = found_ope;
+    auto o = optimize_discarded(ope.ope_);
+    found_ope = o != ope.ope_ ? apd(o) : self;
+  }
+  void visit(NotPredicate &ope) override {
+    auto self = found_ope;
+    auto o = optimize_discarded(ope.ope_);
+    found_ope = o != ope.ope_ ? npd(o) : self;
+  }
+  void visit(Dictionary &) override {
+    pushes_ |= whitespace_pushes_ && !in_token_;
+  }
+  void visit(LiteralString &) override {
+    pushes_ |= whitespace_pushes_ && !in_token_;
+  }
+  void visit(CaptureScope &ope) override {
+    auto self = found_ope;
+    auto top = top_;
+    top_ = false;
+    auto o = optimize(ope.ope_);
+    top_ = top;
+    found_ope = o != ope.ope_ ? csc(o) : self;
+  }
+  void visit(Capture &ope) override {
+    auto self = found_ope;
+    auto top = top_;
+    top_ = false;
+    auto o = optimize(ope.ope_);
+    top_ = top;
+    found_ope = o != ope.ope_ ? cap(o, ope.match_action_) : self;
+  }
+  void visit(TokenBoundary &ope) override {
+    auto self = found_ope;
+    auto in_token = in_token_;
+    in_token_ = true;
+    auto o = optimize(ope.ope_);
+    in_token_ = in_token;
+
+    // Without whitespace skipping, a token boundary only records a token
+    if (!has_whitespace_ && (discard_ || !keep_tokens_)) {
+      note(result_.unwrapped, "removed an unused token boundary");
+      found_ope = o;
+      return;
+    }
+    pushes_ = true;
+    found_ope = o != ope.ope_ ? tok(o) : self;
+  }
+  void visit(Ignore &ope) override {
+    auto self = found_ope;
+    auto pushes = pushes_;
+    pushes_ = false;
+    auto o = optimize_discarded(ope.ope_);
+    auto child_pushes = pushes_;
+    pushes_ = pushes;
+
+    if (!child_pushes && !(top_ && keep_choice_ && is_choice(*o))) {
+      note(result_.unwrapped, "removed an ignore operator");
+      found_ope = o;
+    } else if (dynamic_cast<Ignore *>(o.get())) {
+      found_ope = o;
+    } else {
+      found_ope = o != ope.ope_ ? ign(o) : self;
+    }
+  }
+  void visit(User &) override { pushes_ = true; }
+  void visit(WeakHolder &) override { pushes_ = true; }
+  void visit(Holder &) override { pushes_ = true; }
+  void visit(FactoredChoice &) override { pushes_ = true; }
+  void visit(Dfa &) override { pushes_ = true; }
+  void visit(Reference &ope) override;
+  void visit(BackReference &) override { pushes_ = true; }
+  void visit(PrecedenceClimbing &) override { pushes_ = true; }
+  void visit(Recovery &) override { pushes_ = true; }
+  void visit(Cut &) override { has_cut_ = true; }
 
-          // Skip rules start with '_'
-          if (!(error_rule && error_rule->name[0] == '_')) {
-            msg += (first_item ? ", expecting " : ", ");
-            if (error_literal) {
-              msg += "'";
-              msg += error_literal;
-              msg += "'";
-            } else {
-              msg += "<" + error_rule->name + ">";
-              if (label.empty()) { label = error_rule->name; }
-            }
-            first_item = false;
-          }
+  std::shared_ptr<Ope> found_ope;
 
-          i++;
-        }
-        msg += ".";
+private:
+  std::shared_ptr<Ope> optimize_discarded(const std::shared_ptr<Ope> &ope) {
+    auto top = top_;
+    auto discard = discard_;
+    top_ = false;
+    discard_ = true;
+    auto o = optimize(ope);
+    top_ = top;
+    discard_ = discard;
+    return o;
+  }
+
+  static bool is_choice(const Ope &ope) {
+    auto p = &ope;
+    if (auto t = dynamic_cast<const TokenBoundary *>(p)) { p = t->ope_.get(); }
+    return dynamic_cast<const PrioritizedChoice *>(p) ||
+           dynamic_cast<const FactoredChoice *>(p) ||
+           dynamic_cast<const Dictionary *>(p);
+  }
+
+  // A single codepoint alternative, as character ranges
+  bool char_ranges(const Ope &ope,
+                   std::vector<std::pair<char32_t, char32_t>> &ranges) const {
+    if (auto ch = dynamic_cast<const Character *>(&ope)) {
+      if (static_cast<uint8_t>(ch->ch_) >= 0x80) { return false; }
+      ranges.emplace_back(ch->ch_, ch->ch_);
+      return true;
+    }
+    if (auto cls = dynamic_cast<const CharacterClass *>(&ope)) {
+      if (cls->negated_ || cls->ignore_case_) { return false; }
+      ranges.insert(ranges.end(), cls->ranges_.begin(), cls->ranges_.end());
+      return true;
+    }
+    // Literals skip whitespace and check word boundaries, classes don't
+    if (auto lit = dynamic_cast<const LiteralString *>(&ope)) {
+      if (lit->ignore_case_ || has_word_ || (has_whitespace_ && !in_token_)) {
+        return false;
       }
-      log(line.first, line.second, msg, label);
+      char32_t cp = 0;
+      if (lit->lit_.empty() ||
+          decode_codepoint(lit->lit_.data(), lit->lit_.size(), cp) !=
+              lit->lit_.size()) {
+        return false;
+      }
+      ranges.emplace_back(cp, cp);
+      return true;
     }
+    return false;
   }
-}
 
-inline void Context::set_error_pos(const char *a_s, const char *literal) {
-  if (log) {
-    if (error_info.error_pos <= a_s) {
-      if (error_info.error_pos < a_s || !error_info.keep_previous_token) {
-        error_info.error_pos = a_s;
-        error_info.expected_tokens.clear();
+  // Replaces runs of single codepoint alternatives with a character class,
+  // and runs of literals with a dictionary. A dictionary takes the longest
+  // match, so a literal must not be a prefix of a later one. Its trie looks up
+  // every prefix of the text, which only beats trying the literals in turn
+  // from about min_dictionary_size of them on.
+  bool merge_alternatives(std::vector<std::shared_ptr<Ope>> &opes) {
+    auto changed = false;
+    std::vector<std::shared_ptr<Ope>> merged;
+
+    size_t i = 0;
+    while (i < opes.size()) {
+      std::vector<std::pair<char32_t, char32_t>> ranges;
+      auto j = i;
+      while (j < opes.size() && char_ranges(*opes[j], ranges)) {
+        j++;
+      }
+      if (j - i >= 2) {
+        merged.push_back(std::make_shared<CharacterClass>(ranges, false, false));
+        note(result_.char_classes, "merged " + std::to_string(j - i) +
+                                       " alternatives into a character class");
+        changed = true;
+        i = j;
+        continue;
       }
 
-      const char *error_literal = nullptr;
-      const Definition *error_rule = nullptr;
+      std::vector<std::string> words;
+      j = i;
+      while (j < opes.size() && !has_word_) {
+        auto lit = dynamic_cast<const LiteralString *>(opes[j].get());
+        if (!lit || lit->ignore_case_ || lit->lit_.empty()) { break; }
+        auto prefix = std::any_of(words.begin(), words.end(), [&](auto &w) {
+          return lit->lit_.compare(0, w.size(), w) == 0;
+        });
+        if (prefix) { break; }
+        words.push_back(lit->lit_);
+        j++;
+      }
+      if (j - i >= min_dictionary_size) {
+        merged.push_back(std::make_shared<Dictionary>(words, false));
+        note(result_.dictionaries, "merged " + std::to_string(j - i) +
+                                       " literals into a dictionary");
+        changed = true;
+        i = j;
+        continue;
+      }
 
-      if (literal) {
-        error_literal = literal;
-      } else if (!rule_stack.empty()) {
-        auto rule = rule_stack.back();
-        auto ope = rule->get_core_operator();
-        if (auto token = FindLiteralToken::token(*ope);
-            token && token[0] != '\0') {
-          error_literal = token;
-        }
-      }
-
-      for (auto r : rule_stack) {
-        error_rule = r;
-        if (r->is_token()) { break; }
-      }
-
-      if (error_literal || error_rule) {
-        error_info.add(error_literal, error_rule);
-      }
+      merged.push_back(opes[i++]);
     }
+
+    if (changed) { opes.swap(merged); }
+    return changed;
   }
-}
 
-inline void Context::trace_enter(const Ope &ope, const char *a_s, size_t n,
-                                 const SemanticValues &vs, std::any &dt) {
-  trace_ids.push_back(next_trace_id++);
-  tracer_enter(ope, a_s, n, vs, *this, dt, trace_data);
-}
+  void note(size_t &counter, const std::string &what);
 
-inline void Context::trace_leave(const Ope &ope, const char *a_s, size_t n,
-                                 const SemanticValues &vs, std::any &dt,
-                                 size_t len) {
-  tracer_leave(ope, a_s, n, vs, *this, dt, len, trace_data);
-  trace_ids.pop_back();
-}
+  const Definition &rule_;
+  const bool keep_choice_;
+  const bool keep_tokens_;
+  const bool has_whitespace_;
+  const bool has_word_;
+  const bool whitespace_pushes_;
+  GrammarOptimization &result_;
+
+  bool top_ = true;
+  bool in_token_ = false;
+  bool discard_ = false;
+  bool pushes_ = false;
+  bool has_cut_ = false;
+  std::unordered_set<const Definition *> inlining_;
+};
 
-inline bool Context::is_traceable(const Ope &ope) const {
-  if (tracer_enter && tracer_leave) {
-    if (ignore_trace_state) { return false; }
-    return !dynamic_cast<const peg::Reference *>(&ope);
-  }
-  return false;
-}
+/*
+ * Left-factoring
+ */
+struct ChoiceFactoring {
+  size_t choices = 0;      // Choices rewritten
+  size_t alternatives = 0; // Their alternatives that share a prefix
+  double before_ms = 0;    // Time to parse the sample, if given
+  double after_ms = 0;
+  double speedup = 0;
+  std::vector<std::string> changes; // "Rule: what changed"
+};
 
-inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
-                         Context &c, std::any &dt) const {
-  if (c.is_traceable(*this)) {
-    c.trace_enter(*this, s, n, vs, dt);
-    auto len = parse_core(s, n, vs, c, dt);
-    c.trace_leave(*this, s, n, vs, dt, len);
-    return len;
-  }
-  return parse_core(s, n, vs, c, dt);
-}
+/*
+ * Rewrites a choice whose consecutive alternatives start with the same
+ * expressions into a FactoredChoice. Parsing is deterministic, so such an
+ * expression matches the same text for each alternative; only the actions of
+ * the rules it references run once instead of once per alternative, as they
+ * do with packrat parsing. Choices with a cut are left alone.
+ */
+struct FactorChoices : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-inline size_t Dictionary::parse_core(const char *s, size_t n,
-                                     SemanticValues &vs, Context &c,
-                                     std::any &dt) const {
-  size_t id;
-  auto i = trie_.match(s, n, id);
+  FactorChoices(const std::string &name, ChoiceFactoring &result)
+      : name_(name), result_(result) {}
 
-  if (i == 0) {
-    c.set_error_pos(s);
-    return static_cast<size_t>(-1);
+  std::shared_ptr<Ope> factor(const std::shared_ptr<Ope> &ope) {
+    found_ope = ope;
+    ope->accept(*this);
+    return found_ope;
   }
 
-  vs.choice_count_ = trie_.size();
-  vs.choice_ = id;
-
-  // Word check
-  if (c.wordOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
-
-    {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
+  void visit(Sequence &ope) override {
+    auto self = found_ope;
+    auto opes = ope.opes_;
+    found_ope = factor_all(opes) ? std::make_shared<Sequence>(opes) : self;
+  }
 
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) {
-        c.set_error_pos(s);
-        return len;
+  void visit(PrioritizedChoice &ope) override {
+    auto self = found_ope;
+    auto has_cut = has_cut_;
+    has_cut_ = false;
+    auto opes = ope.opes_;
+    if (factor_all(opes)) {
+      auto choice = std::make_shared<PrioritizedChoice>(opes);
+      choice->for_label_ = ope.for_label_;
+      found_ope = choice;
+    } else {
+      found_ope = self;
+    }
+    auto cut = has_cut_;
+    has_cut_ = has_cut || cut;
+    if (ope.for_label_ || cut) { return; }
+
+    std::vector<std::vector<std::shared_ptr<Ope>>> alts;
+    for (const auto &op : opes) {
+      if (auto seq = dynamic_cast<Sequence *>(op.get())) {
+        alts.push_back(seq->opes_);
+      } else {
+        alts.push_back({op});
       }
-      i += len;
     }
-  }
 
-  // Skip whitespace
-  if (!c.in_token_boundary_count && c.whitespaceOpe) {
-    auto save_ignore_trace_state = c.ignore_trace_state;
-    c.ignore_trace_state = !c.verbose_trace;
-    auto se =
-        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+    size_t shared = 0;
+    size_t prefixes = 0;
+    auto nodes = build(alts, 0, alts.size(), 0, shared, prefixes);
+    if (prefixes == 0) { return; }
 
-    auto len = c.whitespaceOpe->parse(s + i, n - i, vs, c, dt);
-    if (fail(len)) { return len; }
-    i += len;
+    found_ope = std::make_shared<FactoredChoice>(std::move(nodes), opes.size());
+    result_.choices++;
+    result_.alternatives += shared;
+    result_.changes.push_back(name_ + ": " + std::to_string(prefixes) +
+                              " shared prefixes in " + std::to_string(shared) +
+                              " of " + std::to_string(opes.size()) +
+                              " alternatives");
   }
 
-  return i;
-}
-
-inline size_t LiteralString::parse_core(const char *s, size_t n,
-                                        SemanticValues &vs, Context &c,
-                                        std::any &dt) const {
-  return parse_literal(s, n, vs, c, dt, lit_, init_is_word_, is_word_,
-                       ignore_case_);
-}
-
-inline size_t TokenBoundary::parse_core(const char *s, size_t n,
-                                        SemanticValues &vs, Context &c,
-                                        std::any &dt) const {
-  auto save_ignore_trace_state = c.ignore_trace_state;
-  c.ignore_trace_state = !c.verbose_trace;
-  auto se =
-      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
-
-  size_t len;
-  {
-    c.in_token_boundary_count++;
-    auto se = scope_exit([&]() { c.in_token_boundary_count--; });
-    len = ope_->parse(s, n, vs, c, dt);
+  void visit(Repetition &ope) override {
+    rebuild(ope.ope_, [&](auto o) { return rep(o, ope.min_, ope.max_); });
+  }
+  void visit(AndPredicate &ope) override {
+    rebuild(ope.ope_, [](auto o) { return apd(o); });
+  }
+  void visit(NotPredicate &ope) override {
+    rebuild(ope.ope_, [](auto o) { return npd(o); });
+  }
+  void visit(CaptureScope &ope) override {
+    rebuild(ope.ope_, [](auto o) { return csc(o); });
+  }
+  void visit(Capture &ope) override {
+    rebuild(ope.ope_, [&](auto o) { return cap(o, ope.match_action_); });
   }
+  void visit(TokenBoundary &ope) override {
+    rebuild(ope.ope_, [](auto o) { return tok(o); });
+  }
+  void visit(Ignore &ope) override {
+    rebuild(ope.ope_, [](auto o) { return ign(o); });
+  }
+  void visit(Cut &) override { has_cut_ = true; }
+  // A DFA's choices are decided by the next byte, with nothing to factor
+  void visit(Dfa &) override {}
 
-  if (success(len)) {
-    vs.tokens.emplace_back(std::string_view(s, len));
+  std::shared_ptr<Ope> found_ope;
 
-    if (!c.in_token_boundary_count) {
-      if (c.whitespaceOpe) {
-        auto l = c.whitespaceOpe->parse(s + len, n - len, vs, c, dt);
-        if (fail(l)) { return l; }
-        len += l;
+private:
+  using Alternatives = std::vector<std::vector<std::shared_ptr<Ope>>>;
+
+  bool factor_all(std::vector<std::shared_ptr<Ope>> &opes) {
+    auto changed = false;
+    for (auto &op : opes) {
+      auto o = factor(op);
+      changed |= o != op;
+      op = o;
+    }
+    return changed;
+  }
+
+  template <typename F>
+  void rebuild(const std::shared_ptr<Ope> &ope, F make) {
+    auto self = found_ope;
+    auto o = factor(ope);
+    found_ope = o != ope ? make(o) : self;
+  }
+
+  // Alternatives [beg, end) from their depth-th expression on
+  std::vector<FactoredChoice::Node> build(const Alternatives &alts, size_t beg,
+                                          size_t end, size_t depth,
+                                          size_t &shared, size_t &prefixes) {
+    std::vector<FactoredChoice::Node> nodes;
+    auto i = beg;
+    while (i < end) {
+      const auto &alt = alts[i];
+      auto same_at = [&](size_t j, size_t k) {
+        return k < alt.size() && k < alts[j].size() &&
+               same(*alts[j][k], *alt[k]);
+      };
+
+      auto j = i + 1;
+      while (j < end && same_at(j, depth)) {
+        j++;
+      }
+
+      FactoredChoice::Node node;
+      if (j - i >= 2) {
+        auto k = depth + 1;
+        while (std::all_of(alts.begin() + i + 1, alts.begin() + j,
+                           [&](auto &a) { return same_at(&a - &alts[0], k); })) {
+          k++;
+        }
+        node.opes_.assign(alt.begin() + depth, alt.begin() + k);
+        node.nodes_ = build(alts, i, j, k, shared, prefixes);
+        if (depth == 0) { shared += j - i; }
+        prefixes++;
+        i = j;
+      } else {
+        node.opes_.assign(alt.begin() + depth, alt.end());
+        node.id_ = i++;
       }
+      nodes.push_back(std::move(node));
     }
+    return nodes;
   }
-  return len;
-}
 
-inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
-                                 Context &c, std::any &dt) const {
-  if (!ope_) {
-    throw std::logic_error("Uninitialized definition ope was used...");
+  static bool same(const std::vector<std::shared_ptr<Ope>> &a,
+                   const std::vector<std::shared_ptr<Ope>> &b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [](auto &x, auto &y) { return same(*x, *y); });
   }
 
-  // Macro reference
-  if (outer_->is_macro) {
-    c.rule_stack.push_back(outer_);
-    auto len = ope_->parse(s, n, vs, c, dt);
-    c.rule_stack.pop_back();
-    return len;
+  // Structural equality, for the operators that only depend on the input
+  static bool same(const Ope &a, const Ope &b) {
+    if (&a == &b) { return true; }
+    if (auto x = dynamic_cast<const Sequence *>(&a)) {
+      auto y = dynamic_cast<const Sequence *>(&b);
+      return y && same(x->opes_, y->opes_);
+    }
+    if (auto x = dynamic_cast<const PrioritizedChoice *>(&a)) {
+      auto y = dynamic_cast<const PrioritizedChoice *>(&b);
+      return y && x->for_label_ == y->for_label_ && same(x->opes_, y->opes_);
+    }
+    if (auto x = dynamic_cast<const Repetition *>(&a)) {
+      auto y = dynamic_cast<const Repetition *>(&b);
+      return y && x->min_ == y->min_ && x->max_ == y->max_ &&
+             same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const AndPredicate *>(&a)) {
+      auto y = dynamic_cast<const AndPredicate *>(&b);
+      return y && same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const NotPredicate *>(&a)) {
+      auto y = dynamic_cast<const NotPredicate *>(&b);
+      return y && same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const LiteralString *>(&a)) {
+      auto y = dynamic_cast<const LiteralString *>(&b);
+      return y && x->lit_ == y->lit_ && x->ignore_case_ == y->ignore_case_;
+    }
+    if (auto x = dynamic_cast<const CharacterClass *>(&a)) {
+      auto y = dynamic_cast<const CharacterClass *>(&b);
+      return y && x->ranges_ == y->ranges_ && x->negated_ == y->negated_ &&
+             x->ignore_case_ == y->ignore_case_;
+    }
+    if (auto x = dynamic_cast<const Character *>(&a)) {
+      auto y = dynamic_cast<const Character *>(&b);
+      return y && x->ch_ == y->ch_;
+    }
+    if (dynamic_cast<const AnyCharacter *>(&a)) {
+      return dynamic_cast<const AnyCharacter *>(&b) != nullptr;
+    }
+    if (auto x = dynamic_cast<const CaptureScope *>(&a)) {
+      auto y = dynamic_cast<const CaptureScope *>(&b);
+      return y && same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const TokenBoundary *>(&a)) {
+      auto y = dynamic_cast<const TokenBoundary *>(&b);
+      return y && same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const Ignore *>(&a)) {
+      auto y = dynamic_cast<const Ignore *>(&b);
+      return y && same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const Dfa *>(&a)) {
+      auto y = dynamic_cast<const Dfa *>(&b);
+      return y && same(*x->ope_, *y->ope_);
+    }
+    if (auto x = dynamic_cast<const Reference *>(&a)) {
+      auto y = dynamic_cast<const Reference *>(&b);
+      return y && x->rule_ && x->rule_ == y->rule_ && x->args_.empty() &&
+             y->args_.empty();
+    }
+    return false;
   }
 
-  size_t len;
-  std::any val;
+  const std::string &name_;
+  ChoiceFactoring &result_;
 
-  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
-    if (outer_->enter) { outer_->enter(c, s, n, dt); }
-    auto &chvs = c.push_semantic_values_scope();
-    auto se = scope_exit([&]() {
-      c.pop_semantic_values_scope();
-      if (outer_->leave) { outer_->leave(c, s, n, len, a_val, dt); }
-    });
+  bool has_cut_ = false;
+};
 
-    c.rule_stack.push_back(outer_);
-    len = ope_->parse(s, n, chvs, c, dt);
-    c.rule_stack.pop_back();
+/*
+ * Token DFA compilation. The expression is turned into its position
+ * automaton: a state for each byte set the expression matches, with edges to
+ * the states that may match the next byte. When the edges out of every state
+ * have disjoint byte sets, each choice, option and repetition is decided by
+ * the next byte, and the automaton is a DFA that takes the path the PEG
+ * expression would.
+ */
+struct CompileDfa : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-    // Invoke action
-    if (success(len)) {
-      chvs.sv_ = std::string_view(s, len);
-      chvs.name_ = outer_->name;
+  static constexpr size_t max_states = 1024;
+  static constexpr size_t max_copies = 16; // of a bounded repetition
+
+  // Returns nullptr if the expression can't be compiled, or is a single
+  // operator that wouldn't gain from it. Literals must be left alone when
+  // they check %word or skip whitespace.
+  static std::shared_ptr<Ope> compile(const std::shared_ptr<Ope> &ope,
+                                      bool literals) {
+    auto p = ope.get();
+    if (dynamic_cast<LiteralString *>(p) || dynamic_cast<Character *>(p) ||
+        dynamic_cast<CharacterClass *>(p) || dynamic_cast<AnyCharacter *>(p) ||
+        dynamic_cast<Dfa *>(p)) {
+      return nullptr;
+    }
 
-      auto ope_ptr = ope_.get();
-      {
-        auto tok_ptr = dynamic_cast<const peg::TokenBoundary *>(ope_ptr);
-        if (tok_ptr) { ope_ptr = tok_ptr->ope_.get(); }
-      }
-      if (!dynamic_cast<const peg::PrioritizedChoice *>(ope_ptr) &&
-          !dynamic_cast<const peg::Dictionary *>(ope_ptr)) {
-        chvs.choice_count_ = 0;
-        chvs.choice_ = 0;
-      }
+    // The DFA takes the path of the choice a FactoredChoice was made from
+    std::shared_ptr<Ope> unfactored;
+    if (auto factored = dynamic_cast<FactoredChoice *>(p)) {
+      unfactored = factored->unfactored();
+      p = unfactored.get();
+    }
 
-      std::string msg;
-      if (outer_->predicate && !outer_->predicate(chvs, dt, msg)) {
-        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
-          c.error_info.message_pos = s;
-          c.error_info.message = msg;
-          c.error_info.label = outer_->name;
-        }
-        len = static_cast<size_t>(-1);
-      }
+    // Rules only report choice() of their top-level choice
+    auto choice = dynamic_cast<PrioritizedChoice *>(p);
+    auto top_choice = choice && !choice->for_label_;
 
-      if (success(len)) {
-        if (!c.recovered) { a_val = reduce(chvs, dt); }
-      } else {
-        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
-          c.error_info.message_pos = s;
-          c.error_info.message = msg;
-          c.error_info.label = outer_->name;
+    CompileDfa vis(literals);
+    Fragment top;
+    if (top_choice) {
+      if (!vis.build_choice(*choice, top, true)) { return nullptr; }
+    } else if (!vis.build(*p, top)) {
+      return nullptr;
+    }
+
+    auto count = vis.positions_.size() + 1;
+    std::vector<uint16_t> table(count * 256, Dfa::dead);
+    std::vector<uint8_t> flags(count, 0);
+    std::vector<uint16_t> choices(count, 0);
+    for (size_t state = 0; state < count; state++) {
+      const auto &next = state ? vis.follow_[state - 1] : top.first;
+      for (auto pos : next) {
+        for (size_t b = 0; b < 256; b++) {
+          if (!vis.positions_[pos][b]) { continue; }
+          auto &to = table[state * 256 + b];
+          if (to != Dfa::dead) { return nullptr; } // Not decided by the byte
+          to = static_cast<uint16_t>(pos + 1);
+          flags[state] |= Dfa::has_next;
         }
       }
-    } else {
-      if (c.log && !outer_->error_message.empty() &&
-          c.error_info.message_pos < s) {
-        c.error_info.message_pos = s;
-        c.error_info.message = outer_->error_message;
-        c.error_info.label = outer_->name;
-      }
+      if (state) { choices[state] = vis.alts_[state - 1]; }
     }
-  });
 
-  if (success(len)) {
-    if (!outer_->ignoreSemanticValue) {
-      vs.emplace_back(std::move(val));
-      vs.tags.emplace_back(str2tag(outer_->name));
+    if (top.nullable) {
+      flags[0] |= Dfa::accepting;
+      choices[0] = top_choice ? static_cast<uint16_t>(choice->size() - 1) : 0;
+    }
+    for (auto pos : top.last) {
+      flags[pos + 1] |= Dfa::accepting;
     }
-  }
 
-  return len;
-}
+    return std::make_shared<Dfa>(ope, std::move(table), std::move(flags),
+                                 std::move(choices),
+                                 top_choice ? choice->size() : 0);
+  }
 
-inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
-  if (outer_->action && !outer_->disable_action) {
-    return outer_->action(vs, dt);
-  } else if (vs.empty()) {
-    return std::any();
-  } else {
-    return std::move(vs.front());
+  void visit(Sequence &ope) override {
+    Fragment seq;
+    const auto &opes = ope.opes_;
+    for (size_t i = 0; i < opes.size(); i++) {
+      Fragment f;
+      // '!X Y', where X and Y match a single byte, is Y without X's bytes
+      if (auto pred = dynamic_cast<NotPredicate *>(opes[i].get())) {
+        std::bitset<256> excluded, chars;
+        if (i + 1 == opes.size() || !byte_set(*pred->ope_, excluded) ||
+            !byte_set(*opes[i + 1], chars)) {
+          return;
+        }
+        f = leaf(chars & ~excluded);
+        i++;
+      } else if (!build(*opes[i], f)) {
+        return;
+      }
+      seq = concat(std::move(seq), f);
+    }
+    set(std::move(seq));
   }
-}
+  void visit(PrioritizedChoice &ope) override {
+    if (ope.for_label_) { return; }
+    Fragment f;
+    if (build_choice(ope, f, false)) { set(std::move(f)); }
+  }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Repetition &ope) override {
+    auto unbounded = ope.max_ == std::numeric_limits<size_t>::max();
+    if (ope.min_ > max_copies ||
+        (!unbounded && ope.max_ - ope.min_ > max_copies)) {
+      return;
+    }
 
-inline const std::string &Holder::name() const { return outer_->name; }
+    Fragment rep;
+    for (size_t i = 0; i < ope.min_; i++) {
+      Fragment f;
+      if (!build(*ope.ope_, f)) { return; }
+      rep = concat(std::move(rep), f);
+    }
 
-inline const std::string &Holder::trace_name() const {
-  std::call_once(trace_name_init_,
-                 [this]() { trace_name_ = "[" + outer_->name + "]"; });
-  return trace_name_;
-}
-
-inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
-                                    Context &c, std::any &dt) const {
-  auto save_ignore_trace_state = c.ignore_trace_state;
-  if (rule_ && rule_->ignoreSemanticValue) {
-    c.ignore_trace_state = !c.verbose_trace;
+    // e* loops back to itself, and e{0,k} is (e (e ...)?)?
+    Fragment rest;
+    if (unbounded) {
+      if (!build(*ope.ope_, rest)) { return; }
+      for (auto pos : rest.last) {
+        add_follow(pos, rest.first);
+      }
+      rest.nullable = true;
+    } else {
+      for (auto i = ope.min_; i < ope.max_; i++) {
+        Fragment f;
+        if (!build(*ope.ope_, f)) { return; }
+        rest = concat(std::move(f), rest);
+        rest.nullable = true;
+      }
+    }
+    set(concat(std::move(rep), rest));
+  }
+  void visit(LiteralString &ope) override {
+    if (!literals_) { return; }
+    Fragment lit;
+    for (auto ch : ope.lit_) {
+      std::bitset<256> chars;
+      chars.set(static_cast<uint8_t>(ch));
+      auto lower = static_cast<uint8_t>(ch | 0x20);
+      if (ope.ignore_case_ && 'a' <= lower && lower <= 'z') {
+        chars.set(lower);
+        chars.set(lower & ~0x20);
+      }
+      lit = concat(std::move(lit), leaf(chars));
+    }
+    set(std::move(lit));
+  }
+  void visit(CharacterClass &ope) override {
+    std::bitset<256> chars;
+    for (size_t b = 0; b < 0x80; b++) {
+      if ((ope.ascii_[b >> 6] >> (b & 63)) & 1) { chars.set(b); }
+    }
+    set(leaf(chars));
+  }
+  void visit(Character &ope) override {
+    std::bitset<256> chars;
+    chars.set(static_cast<uint8_t>(ope.ch_));
+    set(leaf(chars));
+  }
+  void visit(AnyCharacter & /*ope*/) override {
+    std::bitset<256> chars;
+    for (size_t b = 0; b < 0x80; b++) {
+      chars.set(b);
+    }
+    set(leaf(chars));
+  }
+  void visit(Ignore &ope) override {
+    Fragment f;
+    if (build(*ope.ope_, f)) { set(std::move(f)); }
   }
-  auto se =
-      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-  if (rule_) {
-    // Reference rule
-    if (rule_->is_macro) {
-      // Macro
-      FindReference vis(c.top_args(), c.rule_stack.back()->params);
+private:
+  // Positions that can match the first and the last byte of a fragment
+  struct Fragment {
+    std::vector<size_t> first;
+    std::vector<size_t> last;
+    bool nullable = true;
+  };
 
-      // Collect arguments
-      std::vector<std::shared_ptr<Ope>> args;
-      for (auto arg : args_) {
-        arg->accept(vis);
-        args.emplace_back(std::move(vis.found_ope));
-      }
+  CompileDfa(bool literals) : literals_(literals) {}
 
-      c.push_args(std::move(args));
-      auto se = scope_exit([&]() { c.pop_args(); });
-      auto ope = get_core_operator();
-      return ope->parse(s, n, vs, c, dt);
-    } else {
-      // Definition
-      c.push_args(std::vector<std::shared_ptr<Ope>>());
-      auto se = scope_exit([&]() { c.pop_args(); });
-      auto ope = get_core_operator();
-      return ope->parse(s, n, vs, c, dt);
-    }
-  } else {
-    // Reference parameter in macro
-    const auto &args = c.top_args();
-    return args[iarg_]->parse(s, n, vs, c, dt);
+  bool build(Ope &ope, Fragment &f) {
+    ok_ = false;
+    ope.accept(*this);
+    if (!ok_ || positions_.size() >= max_states) { return false; }
+    f = std::move(fragment_);
+    return true;
   }
-}
 
-inline std::shared_ptr<Ope> Reference::get_core_operator() const {
-  return rule_->holder_;
-}
+  bool build_choice(const PrioritizedChoice &ope, Fragment &f, bool top) {
+    f.nullable = false;
+    const auto &opes = ope.opes_;
+    for (size_t i = 0; i < opes.size(); i++) {
+      if (top) { alt_ = static_cast<uint16_t>(i); }
+      Fragment alt;
+      if (!build(*opes[i], alt)) { return false; }
+      // An alternative that matches nothing would hide those after it
+      if (alt.nullable && i + 1 < opes.size()) { return false; }
+      f.first.insert(f.first.end(), alt.first.begin(), alt.first.end());
+      f.last.insert(f.last.end(), alt.last.begin(), alt.last.end());
+      f.nullable = alt.nullable;
+    }
+    return true;
+  }
 
-inline size_t BackReference::parse_core(const char *s, size_t n,
-                                        SemanticValues &vs, Context &c,
-                                        std::any &dt) const {
-  auto size = static_cast<int>(c.capture_scope_stack_size);
-  for (auto i = size - 1; i >= 0; i--) {
-    auto index = static_cast<size_t>(i);
-    const auto &cs = c.capture_scope_stack[index];
-    if (cs.find(name_) != cs.end()) {
-      const auto &lit = cs.at(name_);
-      std::once_flag init_is_word;
-      auto is_word = false;
-      return parse_literal(s, n, vs, c, dt, lit, init_is_word, is_word, false);
+  // The bytes of an expression that matches exactly one byte
+  bool byte_set(Ope &ope, std::bitset<256> &chars) {
+    CompileDfa vis(literals_);
+    Fragment f;
+    if (!vis.build(ope, f) || f.nullable ||
+        f.first.size() != vis.positions_.size()) {
+      return false;
+    }
+    for (auto pos : f.first) {
+      if (!vis.follow_[pos].empty()) { return false; }
+      chars |= vis.positions_[pos];
     }
+    return true;
   }
 
-  c.error_info.message_pos = s;
-  c.error_info.message = "undefined back reference '$" + name_ + "'...";
-  return static_cast<size_t>(-1);
-}
+  Fragment leaf(const std::bitset<256> &chars) {
+    auto pos = positions_.size();
+    positions_.push_back(chars);
+    follow_.emplace_back();
+    alts_.push_back(alt_);
+    Fragment f;
+    f.first.push_back(pos);
+    f.last.push_back(pos);
+    f.nullable = false;
+    return f;
+  }
 
-inline Definition &
-PrecedenceClimbing::get_reference_for_binop(Context &c) const {
-  if (rule_.is_macro) {
-    // Reference parameter in macro
-    const auto &args = c.top_args();
-    auto iarg = dynamic_cast<Reference &>(*binop_).iarg_;
-    auto arg = args[iarg];
-    return *dynamic_cast<Reference &>(*arg).rule_;
+  Fragment concat(Fragment a, const Fragment &b) {
+    for (auto pos : a.last) {
+      add_follow(pos, b.first);
+    }
+    if (a.nullable) {
+      a.first.insert(a.first.end(), b.first.begin(), b.first.end());
+    }
+    if (b.nullable) {
+      a.last.insert(a.last.end(), b.last.begin(), b.last.end());
+    } else {
+      a.last = b.last;
+    }
+    a.nullable = a.nullable && b.nullable;
+    return a;
   }
 
-  return *dynamic_cast<Reference &>(*binop_).rule_;
-}
+  void add_follow(size_t pos, const std::vector<size_t> &next) {
+    auto &follow = follow_[pos];
+    for (auto p : next) {
+      if (std::find(follow.begin(), follow.end(), p) == follow.end()) {
+        follow.push_back(p);
+      }
+    }
+  }
 
-inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
-                                                   SemanticValues &vs,
-                                                   Context &c, std::any &dt,
-                                                   size_t min_prec) const {
-  auto len = atom_->parse(s, n, vs, c, dt);
-  if (fail(len)) { return len; }
+  void set(Fragment &&f) {
+    fragment_ = std::move(f);
+    ok_ = true;
+  }
 
-  std::string tok;
-  auto &rule = get_reference_for_binop(c);
-  auto action = std::move(rule.action);
+  bool literals_;
+  uint16_t alt_ = 0;
+  bool ok_ = false;
+  Fragment fragment_;
+  std::vector<std::bitset<256>> positions_;
+  std::vector<std::vector<size_t>> follow_;
+  std::vector<uint16_t> alts_;
+};
 
-  rule.action = [&](SemanticValues &vs2, std::any &dt2) {
-    tok = vs2.token();
-    if (action) {
-      return action(vs2, dt2);
-    } else if (!vs2.empty()) {
-      return vs2[0];
-    }
-    return std::any();
-  };
-  auto action_se = scope_exit([&]() { rule.action = std::move(action); });
+struct CollectTokenBoundaries : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-  auto i = len;
-  while (i < n) {
-    std::vector<std::any> save_values(vs.begin(), vs.end());
-    auto save_tokens = vs.tokens;
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(FactoredChoice &ope) override {
+    ope.for_each_ope([&](const auto &op) { op->accept(*this); });
+  }
+  void visit(Repetition &ope) override { ope.ope_->accept(*this); }
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { boundaries.push_back(&ope); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
 
-    auto chvs = c.push_semantic_values_scope();
-    auto chlen = binop_->parse(s + i, n - i, chvs, c, dt);
-    c.pop_semantic_values_scope();
+  std::vector<TokenBoundary *> boundaries;
+};
 
-    if (fail(chlen)) { break; }
+// Unbounded repetitions a match of an expression can end with
+struct CollectTrailingRepetitions : public Ope::Visitor {
+  using Ope::Visitor::visit;
 
-    auto it = info_.find(tok);
-    if (it == info_.end()) { break; }
+  void visit(Sequence &ope) override {
+    if (!ope.opes_.empty()) { ope.opes_.back()->accept(*this); }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    for (auto op : ope.opes_) {
+      op->accept(*this);
+    }
+  }
+  void visit(FactoredChoice &ope) override { ope.unfactored()->accept(*this); }
+  void visit(Repetition &ope) override {
+    if (ope.max_ == std::numeric_limits<size_t>::max()) {
+      repetitions.push_back(&ope);
+    } else {
+      ope.ope_->accept(*this);
+    }
+  }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override { ope.ope_->accept(*this); }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(Dfa &ope) override { ope.ope_->accept(*this); }
+  void visit(Holder &ope) override { ope.ope_->accept(*this); }
+  void visit(Reference &ope) override;
 
-    auto level = std::get<0>(it->second);
-    auto assoc = std::get<1>(it->second);
+  std::vector<Repetition *> repetitions;
 
-    if (level < min_prec) { break; }
+private:
+  std::unordered_set<const Definition *> visited_;
+};
 
-    vs.emplace_back(std::move(chvs[0]));
-    i += chlen;
+/*
+ * Keywords
+ */
+static const char *WHITESPACE_DEFINITION_NAME = "%whitespace";
+static const char *WORD_DEFINITION_NAME = "%word";
+static const char *RECOVER_DEFINITION_NAME = "%recover";
 
-    auto next_min_prec = level;
-    if (assoc == 'L') { next_min_prec = level + 1; }
+/*
+ * Definition
+ */
+class Definition {
+public:
+  struct Result {
+    bool ret;
+    bool recovered;
+    size_t len;
+    ErrorInfo error_info;
+    bool reached_end = false;
+    // Owner of the line index that AST nodes built by the parse point to
+    std::shared_ptr<LineIndex> line_index = nullptr;
+  };
 
-    chvs = c.push_semantic_values_scope();
-    chlen = parse_expression(s + i, n - i, chvs, c, dt, next_min_prec);
-    c.pop_semantic_values_scope();
+  Definition() : holder_(std::make_shared<Holder>(this)) {}
 
-    if (fail(chlen)) {
-      vs.assign(save_values.begin(), save_values.end());
-      vs.tokens = save_tokens;
-      i = chlen;
-      break;
-    }
+  Definition(const Definition &rhs) : name(rhs.name), holder_(rhs.holder_) {
+    holder_->outer_ = this;
+  }
 
-    vs.emplace_back(std::move(chvs[0]));
-    i += chlen;
+  Definition(const std::shared_ptr<Ope> &ope)
+      : holder_(std::make_shared<Holder>(this)) {
+    *this <= ope;
+  }
 
-    std::any val;
-    if (rule_.action) {
-      vs.sv_ = std::string_view(s, i);
-      val = rule_.action(vs, dt);
-    } else if (!vs.empty()) {
-      val = vs[0];
-    }
-    vs.clear();
-    vs.emplace_back(std::move(val));
+  operator std::shared_ptr<Ope>() {
+    return std::make_shared<WeakHolder>(holder_);
   }
 
-  return i;
-}
+  Definition &operator<=(const std::shared_ptr<Ope> &ope) {
+    holder_->ope_ = ope;
+    holder_->unoptimized_ = nullptr;
+    return *this;
+  }
 
-inline size_t Recovery::parse_core(const char *s, size_t n,
-                                   SemanticValues & /*vs*/, Context &c,
-                                   std::any & /*dt*/) const {
-  const auto &rule = dynamic_cast<Reference &>(*ope_);
+  // Replaces the body with an equivalent one, keeping the body as written
+  // for parses with a logger
+  void optimize(const std::shared_ptr<Ope> &ope) {
+    if (!holder_->unoptimized_) { holder_->unoptimized_ = holder_->ope_; }
+    holder_->ope_ = ope;
+  }
 
-  // Custom error message
-  if (c.log) {
-    auto label = dynamic_cast<Reference *>(rule.args_[0].get());
-    if (label && !label->rule_->error_message.empty()) {
-      c.error_info.message_pos = s;
-      c.error_info.message = label->rule_->error_message;
-      c.error_info.label = label->rule_->name;
-    }
+  Result parse(const char *s, size_t n, const char *path = nullptr,
+               Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
+    return parse_core(s, n, vs, dt, path, log);
   }
 
-  // Recovery
-  auto len = static_cast<size_t>(-1);
-  {
-    auto save_log = c.log;
-    c.log = nullptr;
-    auto se = scope_exit([&]() { c.log = save_log; });
+  Result parse(const char *s, const char *path = nullptr,
+               Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse(s, n, path, log);
+  }
 
-    SemanticValues dummy_vs;
-    std::any dummy_dt;
+  Result parse(const char *s, size_t n, std::any &dt,
+               const char *path = nullptr, Log log = nullptr) const {
+    SemanticValues vs;
+    return parse_core(s, n, vs, dt, path, log);
+  }
 
-    len = rule.parse(s, n, dummy_vs, c, dummy_dt);
+  Result parse(const char *s, std::any &dt, const char *path = nullptr,
+               Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse(s, n, dt, path, log);
   }
 
-  if (success(len)) {
-    c.recovered = true;
+  struct ItemOptions {
+    size_t offset = 0; // where the first item starts
+    size_t until = static_cast<size_t>(-1); // no item starts at or past this
+    bool prefix = false;    // leave an item that looked past the end unparsed
+    bool validated = false; // the input is known to be valid UTF-8
+    const Definition *item = nullptr; // a rule it uses, matched instead
+    std::shared_ptr<LineIndex> line_index; // of the input, if made already
+  };
 
-    if (c.log) {
-      c.error_info.output_log(c.log, c.s, c.l);
-      c.error_info.clear();
-    }
-  }
+  // Parses consecutive matches of the rule (or `opts.item`), as `rule*`
+  // would, in a single context with the whitespace of this rule.
+  // `fn(vs, end)` receives each item and returns false to stop.
+  template <typename F>
+  Result parse_items(const char *s, size_t n, const ItemOptions &opts,
+                     std::any &dt, F fn, const char *path = nullptr,
+                     Log log = nullptr) const {
+    initialize_definition_ids();
 
-  // Cut
-  if (!c.cut_stack.empty()) {
-    c.cut_stack.back() = true;
+    std::shared_ptr<Ope> ope = opts.item ? opts.item->holder_ : holder_;
 
-    if (c.cut_stack.size() == 1) {
-      // TODO: Remove unneeded entries in packrat memoise table
+    std::any trace_data;
+    if (tracer_start) { tracer_start(trace_data); }
+    auto se = scope_exit([&]() {
+      if (tracer_end) { tracer_end(trace_data); }
+    });
+
+    Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
+              enablePackratParsing, enableCaptures, enableCachePruning,
+              tracer_enter, tracer_leave, trace_data, verbose_trace, log);
+    c.set_memory_limit(memory_limit, memory_hook);
+    c.set_limits(limits);
+    if (opts.line_index) { c.set_line_index(opts.line_index); }
+
+    auto i = opts.offset;
+
+    // Rule ids (and the memo table) only cover the rules this one uses
+    auto item_id = static_cast<void *>(const_cast<Definition *>(opts.item));
+    if (opts.item && !definition_ids_.count(item_id)) {
+      c.error_info.message_pos = s + i;
+      c.error_info.message =
+          "'" + opts.item->name + "' is not used by '" + name + "'";
+      return Result{false, false, i, c.error_info};
     }
-  }
 
-  return len;
-}
+    if (!opts.validated) {
+      auto err = utf8_error_offset(s, n, c.is_ascii);
+      if (utf8_check && err < n) {
+        c.error_info.message_pos = s + err;
+        c.error_info.message = "invalid UTF-8 sequence";
+        return Result{false, false, i, c.error_info};
+      }
+    }
 
-inline void Sequence::accept(Visitor &v) { v.visit(*this); }
-inline void PrioritizedChoice::accept(Visitor &v) { v.visit(*this); }
-inline void Repetition::accept(Visitor &v) { v.visit(*this); }
-inline void AndPredicate::accept(Visitor &v) { v.visit(*this); }
-inline void NotPredicate::accept(Visitor &v) { v.visit(*this); }
-inline void Dictionary::accept(Visitor &v) { v.visit(*this); }
-inline void LiteralString::accept(Visitor &v) { v.visit(*this); }
-inline void CharacterClass::accept(Visitor &v) { v.visit(*this); }
-inline void Character::accept(Visitor &v) { v.visit(*this); }
-inline void AnyCharacter::accept(Visitor &v) { v.visit(*this); }
-inline void CaptureScope::accept(Visitor &v) { v.visit(*this); }
-inline void Capture::accept(Visitor &v) { v.visit(*this); }
-inline void TokenBoundary::accept(Visitor &v) { v.visit(*this); }
-inline void Ignore::accept(Visitor &v) { v.visit(*this); }
-inline void User::accept(Visitor &v) { v.visit(*this); }
-inline void WeakHolder::accept(Visitor &v) { v.visit(*this); }
-inline void Holder::accept(Visitor &v) { v.visit(*this); }
-inline void Reference::accept(Visitor &v) { v.visit(*this); }
-inline void Whitespace::accept(Visitor &v) { v.visit(*this); }
-inline void BackReference::accept(Visitor &v) { v.visit(*this); }
-inline void PrecedenceClimbing::accept(Visitor &v) { v.visit(*this); }
-inline void Recovery::accept(Visitor &v) { v.visit(*this); }
-inline void Cut::accept(Visitor &v) { v.visit(*this); }
+    auto reached_end = false;
+    while (i < n && i < opts.until) {
+      c.reached_end = false;
+
+      auto j = i;
+      if (whitespaceOpe) {
+        auto save_ignore_trace_state = c.ignore_trace_state;
+        c.ignore_trace_state = !c.verbose_trace;
+        auto se = scope_exit(
+            [&]() { c.ignore_trace_state = save_ignore_trace_state; });
+
+        SemanticValues vs;
+        auto len = whitespaceOpe->parse(s + j, n - j, vs, c, dt);
+        if (c.aborted) { return aborted_result(c, i); }
+        if (fail(len)) {
+          return Result{false, c.recovered, i, c.error_info, c.reached_end};
+        }
+        j += len;
+      }
+      if (j == n) {
+        if (opts.prefix && c.reached_end) {
+          reached_end = true;
+        } else {
+          i = n;
+        }
+        break;
+      }
 
-inline void AssignIDToDefinition::visit(Holder &ope) {
-  auto p = static_cast<void *>(ope.outer_);
-  if (ids.count(p)) { return; }
-  auto id = ids.size();
-  ids[p] = id;
-  ope.outer_->id = id;
-  ope.ope_->accept(*this);
-}
+      SemanticValues vs;
+      auto len = ope->parse(s + j, n - j, vs, c, dt);
+      if (c.aborted) { return aborted_result(c, j); }
+      if (opts.prefix && c.reached_end) {
+        reached_end = true;
+        break;
+      }
+      if (fail(len)) {
+        return Result{false, c.recovered, j, c.error_info, c.reached_end};
+      }
+      if (j + len == i) { break; }
 
-inline void AssignIDToDefinition::visit(Reference &ope) {
-  if (ope.rule_) {
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
+      i = j + len;
+      if (!fn(vs, i)) { break; }
     }
-    ope.rule_->accept(*this);
+    return Result{true, c.recovered, i, c.error_info, reached_end};
   }
-}
 
-inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
-  ope.atom_->accept(*this);
-  ope.binop_->accept(*this);
-}
+  Result parse_events(const char *s, size_t n, EventSink &sink, std::any &dt,
+                      const char *path = nullptr, Log log = nullptr) const {
+    SemanticValues vs;
+    return parse_core(s, n, vs, dt, path, log, &sink);
+  }
 
-inline void TokenChecker::visit(Reference &ope) {
-  if (ope.is_macro_) {
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
+  template <typename T>
+  Result parse_and_get_value(const char *s, size_t n, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    SemanticValues vs;
+    std::any dt;
+    auto r = parse_core(s, n, vs, dt, path, log);
+    if (r.ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
+      keep_line_index(val, r.line_index);
     }
-  } else {
-    has_rule_ = true;
+    return r;
   }
-}
 
-inline void FindLiteralToken::visit(Reference &ope) {
-  if (ope.is_macro_) {
-    ope.rule_->accept(*this);
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
-    }
+  template <typename T>
+  Result parse_and_get_value(const char *s, T &val, const char *path = nullptr,
+                             Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse_and_get_value(s, n, val, path, log);
   }
-}
 
-inline void DetectLeftRecursion::visit(Reference &ope) {
-  if (ope.name_ == name_) {
-    error_s = ope.s_;
-  } else if (!refs_.count(ope.name_)) {
-    refs_.insert(ope.name_);
-    if (ope.rule_) {
-      ope.rule_->accept(*this);
-      if (done_ == false) { return; }
+  template <typename T>
+  Result parse_and_get_value(const char *s, size_t n, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    SemanticValues vs;
+    auto r = parse_core(s, n, vs, dt, path, log);
+    if (r.ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
+      keep_line_index(val, r.line_index);
     }
+    return r;
   }
-  done_ = true;
-}
 
-inline void HasEmptyElement::visit(Sequence &ope) {
-  auto save_is_empty = false;
-  const char *save_error_s = nullptr;
-  std::string save_error_name;
+  template <typename T>
+  Result parse_and_get_value(const char *s, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    auto n = strlen(s);
+    return parse_and_get_value(s, n, dt, val, path, log);
+  }
 
-  auto it = ope.opes_.begin();
-  while (it != ope.opes_.end()) {
-    (*it)->accept(*this);
-    if (!is_empty) {
-      ++it;
-      while (it != ope.opes_.end()) {
-        DetectInfiniteLoop vis(refs_, has_error_cache_);
-        (*it)->accept(vis);
-        if (vis.has_error) {
-          is_empty = true;
-          error_s = vis.error_s;
-          error_name = vis.error_name;
-        }
-        ++it;
-      }
-      return;
-    }
+#if defined(__cpp_lib_char8_t)
+  Result parse(const char8_t *s, size_t n, const char *path = nullptr,
+               Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), n, path, log);
+  }
 
-    save_is_empty = is_empty;
-    save_error_s = error_s;
-    save_error_name = error_name;
+  Result parse(const char8_t *s, const char *path = nullptr,
+               Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), path, log);
+  }
 
-    is_empty = false;
-    error_name.clear();
-    ++it;
+  Result parse(const char8_t *s, size_t n, std::any &dt,
+               const char *path = nullptr, Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), n, dt, path, log);
   }
 
-  is_empty = save_is_empty;
-  error_s = save_error_s;
-  error_name = save_error_name;
-}
+  Result parse(const char8_t *s, std::any &dt, const char *path = nullptr,
+               Log log = nullptr) const {
+    return parse(reinterpret_cast<const char *>(s), dt, path, log);
+  }
 
-inline void HasEmptyElement::visit(Reference &ope) {
-  auto it = std::find_if(refs_.begin(), refs_.end(),
-                         [&](const std::pair<const char *, std::string> &ref) {
-                           return ope.name_ == ref.second;
-                         });
-  if (it != refs_.end()) { return; }
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, size_t n, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), n, val, *path,
+                               log);
+  }
 
-  if (ope.rule_) {
-    refs_.emplace_back(ope.s_, ope.name_);
-    ope.rule_->accept(*this);
-    refs_.pop_back();
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), val, *path,
+                               log);
   }
-}
 
-inline void DetectInfiniteLoop::visit(Reference &ope) {
-  auto it = std::find_if(refs_.begin(), refs_.end(),
-                         [&](const std::pair<const char *, std::string> &ref) {
-                           return ope.name_ == ref.second;
-                         });
-  if (it != refs_.end()) { return; }
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, size_t n, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), n, dt, val,
+                               *path, log);
+  }
 
-  if (ope.rule_) {
-    auto it = has_error_cache_.find(ope.name_);
-    if (it != has_error_cache_.end()) {
-      has_error = it->second;
-    } else {
-      refs_.emplace_back(ope.s_, ope.name_);
-      ope.rule_->accept(*this);
-      refs_.pop_back();
-      has_error_cache_[ope.name_] = has_error;
-    }
+  template <typename T>
+  Result parse_and_get_value(const char8_t *s, std::any &dt, T &val,
+                             const char *path = nullptr,
+                             Log log = nullptr) const {
+    return parse_and_get_value(reinterpret_cast<const char *>(s), dt, val,
+                               *path, log);
   }
+#endif
 
-  if (ope.is_macro_) {
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
-    }
+  void operator=(Action a) { action = a; }
+
+  template <typename T> Definition &operator,(T fn) {
+    operator=(fn);
+    return *this;
   }
-}
 
-inline void ReferenceChecker::visit(Reference &ope) {
-  auto it = std::find(params_.begin(), params_.end(), ope.name_);
-  if (it != params_.end()) { return; }
+  Definition &operator~() {
+    ignoreSemanticValue = true;
+    return *this;
+  }
 
-  if (!grammar_.count(ope.name_)) {
-    error_s[ope.name_] = ope.s_;
-    error_message[ope.name_] = "'" + ope.name_ + "' is not defined.";
-  } else {
-    if (!referenced.count(ope.name_)) { referenced.insert(ope.name_); }
-    const auto &rule = grammar_.at(ope.name_);
-    if (rule.is_macro) {
-      if (!ope.is_macro_ || ope.args_.size() != rule.params.size()) {
-        error_s[ope.name_] = ope.s_;
-        error_message[ope.name_] = "incorrect number of arguments.";
-      }
-    } else if (ope.is_macro_) {
-      error_s[ope.name_] = ope.s_;
-      error_message[ope.name_] = "'" + ope.name_ + "' is not macro.";
-    }
-    for (auto arg : ope.args_) {
-      arg->accept(*this);
-    }
+  void accept(Ope::Visitor &v) { holder_->accept(v); }
+
+  std::shared_ptr<Ope> get_core_operator() const { return holder_->ope_; }
+
+  // The body before optimize_grammar, which error messages are derived from
+  std::shared_ptr<Ope> get_written_operator() const {
+    return holder_->unoptimized_ ? holder_->unoptimized_ : holder_->ope_;
   }
-}
 
-inline void LinkReferences::visit(Reference &ope) {
-  // Check if the reference is a macro parameter
-  auto found_param = false;
-  for (size_t i = 0; i < params_.size(); i++) {
-    const auto &param = params_[i];
-    if (param == ope.name_) {
-      ope.iarg_ = i;
-      found_param = true;
-      break;
-    }
-  }
-
-  // Check if the reference is a definition rule
-  if (!found_param && grammar_.count(ope.name_)) {
-    auto &rule = grammar_.at(ope.name_);
-    ope.rule_ = &rule;
+  bool is_token() const {
+    std::call_once(is_token_init_, [this]() {
+      is_token_ = TokenChecker::is_token(*get_core_operator());
+    });
+    return is_token_;
   }
 
-  for (auto arg : ope.args_) {
-    arg->accept(*this);
-  }
-}
+  std::string name;
+  const char *s_ = nullptr;
+  std::pair<size_t, size_t> line_ = {1, 1};
 
-inline void FindReference::visit(Reference &ope) {
-  for (size_t i = 0; i < args_.size(); i++) {
-    const auto &name = params_[i];
-    if (name == ope.name_) {
-      found_ope = args_[i];
-      return;
-    }
-  }
-  found_ope = ope.shared_from_this();
-}
+  std::function<bool(const SemanticValues &vs, const std::any &dt,
+                     std::string &msg)>
+      predicate;
 
-/*-----------------------------------------------------------------------------
- *  PEG parser generator
- *---------------------------------------------------------------------------*/
+  size_t id = 0;
+  Action action;
+  std::function<void(const Context &c, const char *s, size_t n, std::any &dt)>
+      enter;
+  std::function<void(const Context &c, const char *s, size_t n, size_t matchlen,
+                     std::any &value, std::any &dt)>
+      leave;
+  bool ignoreSemanticValue = false;
+  std::shared_ptr<Ope> whitespaceOpe;
+  std::shared_ptr<Ope> wordOpe;
+  bool enablePackratParsing = false;
+  bool enableCaptures = true;
+  bool enableCachePruning = false;
+  bool is_macro = false;
+  std::vector<std::string> params;
+  bool disable_action = false;
 
-using Rules = std::unordered_map<std::string, std::shared_ptr<Ope>>;
+  TracerEnter tracer_enter;
+  TracerLeave tracer_leave;
+  bool verbose_trace = false;
+  TracerStartOrEnd tracer_start;
+  TracerStartOrEnd tracer_end;
 
-class ParserGenerator {
-public:
-  struct ParserContext {
-    std::shared_ptr<Grammar> grammar;
-    std::string start;
-    bool enablePackratParsing = false;
-  };
+  std::string error_message;
+  bool no_ast_opt = false;
 
-  static ParserContext parse(const char *s, size_t n, const Rules &rules,
-                             Log log, std::string_view start) {
-    return get_instance().perform_core(s, n, rules, log, std::string(start));
-  }
+  bool eoi_check = true;
+  bool utf8_check = true;
 
-  // For debugging purpose
-  static Grammar &grammar() { return get_instance().g; }
+  size_t memory_limit = 0;
+  MemoryHook memory_hook;
+  ParseLimits limits;
 
 private:
-  static ParserGenerator &get_instance() {
-    static ParserGenerator instance;
-    return instance;
-  }
+  friend class Reference;
+  friend class ParserGenerator;
 
-  ParserGenerator() {
-    make_grammar();
-    setup_actions();
+  Definition &operator=(const Definition &rhs);
+  Definition &operator=(Definition &&rhs);
+
+  void initialize_definition_ids() const {
+    std::call_once(definition_ids_init_, [&]() {
+      AssignIDToDefinition vis;
+      holder_->accept(vis);
+      if (whitespaceOpe) { whitespaceOpe->accept(vis); }
+      if (wordOpe) { wordOpe->accept(vis); }
+      definition_ids_.swap(vis.ids);
+    });
   }
 
-  struct Instruction {
-    std::string type;
-    std::any data;
-    std::string_view sv;
-  };
+  // The parse stopped on a limit, whatever the input held
+  static Result aborted_result(Context &c, size_t i) {
+    c.error_info.clear();
+    c.error_info.message_pos = c.abort_pos;
+    c.error_info.message = c.abort_message;
+    c.error_info.abort_reason = c.abort_reason;
+    return Result{false, c.recovered, i, c.error_info};
+  }
 
-  struct Data {
-    std::shared_ptr<Grammar> grammar;
-    std::string start;
-    const char *start_pos = nullptr;
+  Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
+                    const char *path, Log log,
+                    EventSink *event_sink = nullptr) const {
+    initialize_definition_ids();
 
-    std::vector<std::pair<std::string, const char *>> duplicates_of_definition;
+    std::shared_ptr<Ope> ope = holder_;
 
-    std::vector<std::pair<std::string, const char *>> duplicates_of_instruction;
-    std::map<std::string, std::vector<Instruction>> instructions;
+    std::any trace_data;
+    if (tracer_start) { tracer_start(trace_data); }
+    auto se = scope_exit([&]() {
+      if (tracer_end) { tracer_end(trace_data); }
+    });
 
-    std::vector<std::pair<std::string, const char *>> undefined_back_references;
-    std::vector<std::set<std::string_view>> captures_stack{{}};
+    // The memo table grows with the input, so streaming goes without it
+    Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
+              enablePackratParsing && !event_sink, enableCaptures,
+              enableCachePruning, tracer_enter, tracer_leave, trace_data,
+              verbose_trace, log);
+    c.event_sink = event_sink;
+    // Nothing is rolled back once the parse is over
+    auto commit_events = scope_exit([&]() {
+      if (c.event_sink) { c.commit_events(); }
+    });
+    // Memoized results refer to typed values, so the arena is only cut back
+    // without packrat parsing
+    if (!c.enablePackratParsing) {
+      if (auto arena = std::any_cast<ValueArena *>(&dt)) {
+        c.value_arena = *arena;
+      }
+    }
+    c.set_memory_limit(memory_limit, memory_hook);
+    c.set_limits(limits);
 
-    std::set<std::string_view> captures_in_current_definition;
-    bool enablePackratParsing = true;
+    size_t i = 0;
 
-    Data() : grammar(std::make_shared<Grammar>()) {}
-  };
+    // Input is validated once here, so operators never see malformed UTF-8
+    auto err = utf8_error_offset(s, n, c.is_ascii);
+    if (utf8_check && err < n) {
+      c.error_info.message_pos = s + err;
+      c.error_info.message = "invalid UTF-8 sequence";
+      return Result{false, false, i, c.error_info};
+    }
 
-  void make_grammar() {
-    // Setup PEG syntax parser
-    g["Grammar"] <= seq(g["Spacing"], oom(g["Definition"]), g["EndOfFile"]);
-    g["Definition"] <=
-        cho(seq(g["Ignore"], g["IdentCont"], g["Parameters"], g["LEFTARROW"],
-                g["Expression"], opt(g["Instruction"])),
-            seq(g["Ignore"], g["Identifier"], g["LEFTARROW"], g["Expression"],
-                opt(g["Instruction"])));
-    g["Expression"] <= seq(g["Sequence"], zom(seq(g["SLASH"], g["Sequence"])));
-    g["Sequence"] <= zom(cho(g["CUT"], g["Prefix"]));
-    g["Prefix"] <= seq(opt(cho(g["AND"], g["NOT"])), g["SuffixWithLabel"]);
-    g["SuffixWithLabel"] <=
-        seq(g["Suffix"], opt(seq(g["LABEL"], g["Identifier"])));
-    g["Suffix"] <= seq(g["Primary"], opt(g["Loop"]));
-    g["Loop"] <= cho(g["QUESTION"], g["STAR"], g["PLUS"], g["Repetition"]);
-    g["Primary"] <= cho(seq(g["Ignore"], g["IdentCont"], g["Arguments"],
-                            npd(g["LEFTARROW"])),
-                        seq(g["Ignore"], g["Identifier"],
-                            npd(seq(opt(g["Parameters"]), g["LEFTARROW"]))),
-                        seq(g["OPEN"], g["Expression"], g["CLOSE"]),
-                        seq(g["BeginTok"], g["Expression"], g["EndTok"]),
-                        g["CapScope"],
-                        seq(g["BeginCap"], g["Expression"], g["EndCap"]),
-                        g["BackRef"], g["DictionaryI"], g["LiteralI"],
-                        g["Dictionary"], g["Literal"], g["NegatedClassI"],
-                        g["NegatedClass"], g["ClassI"], g["Class"], g["DOT"]);
+    if (whitespaceOpe) {
+      auto save_ignore_trace_state = c.ignore_trace_state;
+      c.ignore_trace_state = !c.verbose_trace;
+      auto se =
+          scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
-    g["IdentCont"] <= tok(seq(g["IdentStart"], zom(g["IdentRest"])));
+      auto len = whitespaceOpe->parse(s, n, vs, c, dt);
+      if (c.aborted) { return aborted_result(c, i); }
+      if (fail(len)) {
+        return Result{false, c.recovered, i, c.error_info, c.reached_end};
+      }
 
-    const static std::vector<std::pair<char32_t, char32_t>> range = {
-        {0x0080, 0xFFFF}};
-    g["IdentStart"] <= seq(npd(lit(u8(u8"↑"))), npd(lit(u8(u8"⇑"))),
-                           cho(cls("a-zA-Z_%"), cls(range)));
+      i = len;
+    }
 
-    g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
+    auto len = ope->parse(s + i, n - i, vs, c, dt);
+    if (c.aborted) { return aborted_result(c, i); }
+    auto ret = success(len);
+    if (ret) {
+      i += len;
+      if (eoi_check) {
+        if (i < n) {
+          if (c.error_info.error_pos - c.s < s + i - c.s) {
+            c.error_info.message_pos = s + i;
+            c.error_info.message = "expected end of input";
+          }
+          ret = false;
+        }
+      }
+    }
+    return Result{ret, c.recovered, i, c.error_info, c.reached_end,
+                  c.line_index_};
+  }
 
-    g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+  std::shared_ptr<Holder> holder_;
+  mutable std::once_flag is_token_init_;
+  mutable bool is_token_ = false;
+  mutable std::once_flag assign_id_to_definition_init_;
+  mutable std::once_flag definition_ids_init_;
+  mutable std::unordered_map<void *, size_t> definition_ids_;
+};
 
-    g["DictionaryI"] <=
-        seq(g["LiteralID"], oom(seq(g["PIPE"], g["LiteralID"])));
+/*
+ * Implementations
+ */
 
-    auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
-                           cls("'"), g["Spacing"]),
-                       seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
-                           cls("\""), g["Spacing"]));
-    g["Literal"] <= lit_ope;
-    g["LiteralD"] <= lit_ope;
+// The whitespace after a literal or a token. Skipping it again at the same
+// position gives the same result, unless it left values, tokens or captures
+// behind or looked past the end of the input.
+inline size_t skip_whitespace(const char *s, size_t n, SemanticValues &vs,
+                              Context &c, std::any &dt) {
+  auto save_ignore_trace_state = c.ignore_trace_state;
+  c.ignore_trace_state = !c.verbose_trace;
+  auto se =
+      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    auto lit_case_ignore_ope =
-        cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
-                g["Spacing"]),
-            seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
-                g["Spacing"]));
-    g["LiteralI"] <= lit_case_ignore_ope;
-    g["LiteralID"] <= lit_case_ignore_ope;
+  if (c.verbose_trace || s + n != c.s + c.l) {
+    return c.whitespaceOpe->parse(s, n, vs, c, dt);
+  }
 
-    // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
-    g["Class"] <= seq(chr('['), npd(chr('^')),
-                      tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
-                      g["Spacing"]);
-    g["ClassI"] <= seq(chr('['), npd(chr('^')),
-                       tok(oom(seq(npd(chr(']')), g["Range"]))), lit("]i"),
-                       g["Spacing"]);
+  return c.whitespace(s, [&](bool &cacheable) {
+    auto values = vs.size();
+    auto tokens = vs.tokens.size();
+    auto captures = c.captures.size();
+    auto reached_end = c.reached_end;
+    c.reached_end = false;
 
-    g["NegatedClass"] <= seq(lit("[^"),
-                             tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
-                             g["Spacing"]);
-    g["NegatedClassI"] <= seq(lit("[^"),
-                              tok(oom(seq(npd(chr(']')), g["Range"]))),
-                              lit("]i"), g["Spacing"]);
+    auto len = c.whitespaceOpe->parse(s, n, vs, c, dt);
 
-    // NOTE: This is different from The original Brian Ford's paper, and this
-    // modification allows us to specify `[+-]` as a valid char class.
-    g["Range"] <=
-        cho(seq(g["Char"], chr('-'), npd(chr(']')), g["Char"]), g["Char"]);
+    cacheable = vs.size() == values && vs.tokens.size() == tokens &&
+                c.captures.size() == captures && !c.reached_end;
+    c.reached_end |= reached_end;
+    return len;
+  });
+}
 
-    g["Char"] <=
-        cho(seq(chr('\\'), cls("fnrtv'\"[]\\^")),
-            seq(chr('\\'), cls("0-3"), cls("0-7"), cls("0-7")),
-            seq(chr('\\'), cls("0-7"), opt(cls("0-7"))),
-            seq(lit("\\x"), cls("0-9a-fA-F"), opt(cls("0-9a-fA-F"))),
-            seq(lit("\\u"),
-                cho(seq(cho(seq(chr('0'), cls("0-9a-fA-F")), lit("10")),
-                        rep(cls("0-9a-fA-F"), 4, 4)),
-                    rep(cls("0-9a-fA-F"), 4, 5))),
-            seq(npd(chr('\\')), dot()));
+inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
+                            Context &c, std::any &dt, const std::string &lit,
+                            const std::string &folded,
+                            std::once_flag &init_is_word, bool &is_word,
+                            bool ignore_case) {
+  auto m = (std::min)(n, lit.size());
+  auto matched = ignore_case ? equal_ignore_case(s, folded.data(), m)
+                             : std::memcmp(s, lit.data(), m) == 0;
+  if (!matched || m < lit.size()) {
+    if (matched) { c.reached_end = true; }
+    c.set_error_pos(s, lit.data());
+    return static_cast<size_t>(-1);
+  }
+  auto i = m;
 
-    g["Repetition"] <=
-        seq(g["BeginBracket"], g["RepetitionRange"], g["EndBracket"]);
-    g["RepetitionRange"] <= cho(seq(g["Number"], g["COMMA"], g["Number"]),
-                                seq(g["Number"], g["COMMA"]), g["Number"],
-                                seq(g["COMMA"], g["Number"]));
-    g["Number"] <= seq(oom(cls("0-9")), g["Spacing"]);
-
-    g["CapScope"] <= seq(g["BeginCapScope"], g["Expression"], g["EndCapScope"]);
-
-    g["LEFTARROW"] <= seq(cho(lit("<-"), lit(u8(u8"←"))), g["Spacing"]);
-    ~g["SLASH"] <= seq(chr('/'), g["Spacing"]);
-    ~g["PIPE"] <= seq(chr('|'), g["Spacing"]);
-    g["AND"] <= seq(chr('&'), g["Spacing"]);
-    g["NOT"] <= seq(chr('!'), g["Spacing"]);
-    g["QUESTION"] <= seq(chr('?'), g["Spacing"]);
-    g["STAR"] <= seq(chr('*'), g["Spacing"]);
-    g["PLUS"] <= seq(chr('+'), g["Spacing"]);
-    ~g["OPEN"] <= seq(chr('('), g["Spacing"]);
-    ~g["CLOSE"] <= seq(chr(')'), g["Spacing"]);
-    g["DOT"] <= seq(chr('.'), g["Spacing"]);
+  // Word check
+  if (c.wordOpe) {
+    auto save_ignore_trace_state = c.ignore_trace_state;
+    c.ignore_trace_state = !c.verbose_trace;
+    auto se =
+        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    g["CUT"] <= seq(lit(u8(u8"↑")), g["Spacing"]);
-    ~g["LABEL"] <= seq(cho(chr('^'), lit(u8(u8"⇑"))), g["Spacing"]);
+    std::call_once(init_is_word, [&]() {
+      SemanticValues dummy_vs;
+      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, false,
+                      false, nullptr, nullptr, nullptr, false, nullptr);
+      std::any dummy_dt;
 
-    ~g["Spacing"] <= zom(cho(g["Space"], g["Comment"]));
-    g["Comment"] <=
-        seq(chr('#'), zom(seq(npd(g["EndOfLine"]), dot())), g["EndOfLine"]);
-    g["Space"] <= cho(chr(' '), chr('\t'), g["EndOfLine"]);
-    g["EndOfLine"] <= cho(lit("\r\n"), chr('\n'), chr('\r'));
-    g["EndOfFile"] <= npd(dot());
+      auto len =
+          c.wordOpe->parse(lit.data(), lit.size(), dummy_vs, dummy_c, dummy_dt);
+      is_word = success(len);
+    });
 
-    ~g["BeginTok"] <= seq(chr('<'), g["Spacing"]);
-    ~g["EndTok"] <= seq(chr('>'), g["Spacing"]);
+    if (is_word) {
+      if (i == n) { c.reached_end = true; }
 
-    ~g["BeginCapScope"] <= seq(chr('$'), chr('('), g["Spacing"]);
-    ~g["EndCapScope"] <= seq(chr(')'), g["Spacing"]);
+      SemanticValues dummy_vs;
+      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, false,
+                      false, nullptr, nullptr, nullptr, false, nullptr);
+      std::any dummy_dt;
 
-    g["BeginCap"] <= seq(chr('$'), tok(g["IdentCont"]), chr('<'), g["Spacing"]);
-    ~g["EndCap"] <= seq(chr('>'), g["Spacing"]);
+      NotPredicate ope(c.wordOpe);
+      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
+      if (fail(len)) {
+        c.set_error_pos(s, lit.data());
+        return len;
+      }
+      i += len;
+    }
+  }
 
-    g["BackRef"] <= seq(chr('$'), tok(g["IdentCont"]), g["Spacing"]);
+  // Skip whitespace
+  if (!c.in_token_boundary_count && c.whitespaceOpe) {
+    auto len = skip_whitespace(s + i, n - i, vs, c, dt);
+    if (fail(len)) { return len; }
+    i += len;
+  }
 
-    g["IGNORE"] <= chr('~');
+  return i;
+}
 
-    g["Ignore"] <= opt(g["IGNORE"]);
-    g["Parameters"] <= seq(g["OPEN"], g["Identifier"],
-                           zom(seq(g["COMMA"], g["Identifier"])), g["CLOSE"]);
-    g["Arguments"] <= seq(g["OPEN"], g["Expression"],
-                          zom(seq(g["COMMA"], g["Expression"])), g["CLOSE"]);
-    ~g["COMMA"] <= seq(chr(','), g["Spacing"]);
+inline std::pair<size_t, size_t> SemanticValues::line_info() const {
+  assert(c_);
+  return c_->line_info(sv_.data());
+}
 
-    // Instruction grammars
-    g["Instruction"] <=
-        seq(g["BeginBracket"],
-            opt(seq(g["InstructionItem"], zom(seq(g["InstructionItemSeparator"],
-                                                  g["InstructionItem"])))),
-            g["EndBracket"]);
-    g["InstructionItem"] <=
-        cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"]);
-    ~g["InstructionItemSeparator"] <= seq(chr(';'), g["Spacing"]);
+inline const std::shared_ptr<LineIndex> &SemanticValues::line_index() const {
+  assert(c_);
+  return c_->line_index();
+}
 
-    ~g["SpacesZom"] <= zom(g["Space"]);
-    ~g["SpacesOom"] <= oom(g["Space"]);
-    ~g["BeginBracket"] <= seq(chr('{'), g["Spacing"]);
-    ~g["EndBracket"] <= seq(chr('}'), g["Spacing"]);
+inline void SemanticValues::account_memory(MemoryCategory category,
+                                           size_t bytes) const {
+  // Actions run once the match is known, so the parse is at its end
+  if (c_) {
+    c_->allocate(category, bytes,
+                 sv_.data() ? sv_.data() + sv_.size() : c_->s);
+  }
+}
 
-    // PrecedenceClimbing instruction
-    g["PrecedenceClimbing"] <=
-        seq(lit("precedence"), g["SpacesOom"], g["PrecedenceInfo"],
-            zom(seq(g["SpacesOom"], g["PrecedenceInfo"])), g["SpacesZom"]);
-    g["PrecedenceInfo"] <=
-        seq(g["PrecedenceAssoc"],
-            oom(seq(ign(g["SpacesOom"]), g["PrecedenceOpe"])));
-    g["PrecedenceOpe"] <=
-        cho(seq(cls("'"),
-                tok(zom(seq(npd(cho(g["Space"], cls("'"))), g["Char"]))),
-                cls("'")),
-            seq(cls("\""),
-                tok(zom(seq(npd(cho(g["Space"], cls("\""))), g["Char"]))),
-                cls("\"")),
-            tok(oom(seq(npd(cho(g["PrecedenceAssoc"], g["Space"], chr('}'))),
-                        dot()))));
-    g["PrecedenceAssoc"] <= cls("LR");
+inline std::any &SemanticValues::shared_ast_nodes() const {
+  assert(c_);
+  return c_->shared_ast_nodes;
+}
 
-    // Error message instruction
-    g["ErrorMessage"] <= seq(lit("error_message"), g["SpacesOom"],
-                             g["LiteralD"], g["SpacesZom"]);
+inline void ErrorInfo::output_log(const Log &log, const char *s, size_t n) {
+  if (message_pos) {
+    if (message_pos > last_output_pos) {
+      last_output_pos = message_pos;
+      auto line = line_info(s, message_pos);
+      std::string msg;
+      if (auto unexpected_token = heuristic_error_token(s, n, message_pos);
+          !unexpected_token.empty()) {
+        msg = replace_all(message, "%t", unexpected_token);
 
-    // No Ast node optimization instruction
-    g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
+        auto unexpected_char = unexpected_token.substr(
+            0,
+            codepoint_length(unexpected_token.data(), unexpected_token.size()));
 
-    // Set definition names
-    for (auto &x : g) {
-      x.second.name = x.first;
+        msg = replace_all(msg, "%c", unexpected_char);
+      } else {
+        msg = message;
+      }
+      log(line.first, line.second, msg, label);
     }
-  }
-
-  void setup_actions() {
-    g["Definition"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
+  } else if (error_pos) {
+    if (error_pos > last_output_pos) {
+      last_output_pos = error_pos;
+      auto line = line_info(s, error_pos);
 
-      auto is_macro = vs.choice() == 0;
-      auto ignore = std::any_cast<bool>(vs[0]);
-      auto name = std::any_cast<std::string>(vs[1]);
+      std::string msg;
+      if (expected_tokens.empty()) {
+        msg = "syntax error.";
+      } else {
+        msg = "syntax error";
 
-      std::vector<std::string> params;
-      std::shared_ptr<Ope> ope;
-      auto has_instructions = false;
+        // unexpected token
+        if (auto unexpected_token = heuristic_error_token(s, n, error_pos);
+            !unexpected_token.empty()) {
+          msg += ", unexpected '";
+          msg += unexpected_token;
+          msg += "'";
+        }
 
-      if (is_macro) {
-        params = std::any_cast<std::vector<std::string>>(vs[2]);
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[4]);
-        if (vs.size() == 6) { has_instructions = true; }
-      } else {
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[3]);
-        if (vs.size() == 5) { has_instructions = true; }
-      }
+        auto first_item = true;
+        size_t i = 0;
+        while (i < expected_tokens.size()) {
+          auto [error_literal, error_rule] = expected_tokens[i];
 
-      if (has_instructions) {
-        auto index = is_macro ? 5 : 4;
-        std::unordered_set<std::string> types;
-        for (const auto &instruction :
-             std::any_cast<std::vector<Instruction>>(vs[index])) {
-          const auto &type = instruction.type;
-          if (types.find(type) == types.end()) {
-            data.instructions[name].push_back(instruction);
-            types.insert(instruction.type);
-            if (type == "declare_symbol" || type == "check_symbol") {
-              if (!TokenChecker::is_token(*ope)) { ope = tok(ope); }
+          // Skip rules start with '_'
+          if (!(error_rule && error_rule->name[0] == '_')) {
+            msg += (first_item ? ", expecting " : ", ");
+            if (error_literal) {
+              msg += "'";
+              msg += error_literal;
+              msg += "'";
+            } else {
+              msg += "<" + error_rule->name + ">";
+              if (label.empty()) { label = error_rule->name; }
             }
-          } else {
-            data.duplicates_of_instruction.emplace_back(type,
-                                                        instruction.sv.data());
+            first_item = false;
           }
+
+          i++;
         }
+        msg += ".";
       }
+      log(line.first, line.second, msg, label);
+    }
+  }
+}
 
-      auto &grammar = *data.grammar;
-      if (!grammar.count(name)) {
-        auto &rule = grammar[name];
-        rule <= ope;
-        rule.name = name;
-        rule.s_ = vs.sv().data();
-        rule.line_ = line_info(vs.ss, rule.s_);
-        rule.ignoreSemanticValue = ignore;
-        rule.is_macro = is_macro;
-        rule.params = params;
+inline void Context::set_error_pos(const char *a_s, const char *literal) {
+  if (log) {
+    if (error_info.error_pos <= a_s) {
+      if (error_info.error_pos < a_s || !error_info.keep_previous_token) {
+        error_info.error_pos = a_s;
+        error_info.expected_tokens.clear();
+      }
 
-        if (data.start.empty()) {
-          data.start = rule.name;
-          data.start_pos = rule.s_;
+      const char *error_literal = nullptr;
+      const Definition *error_rule = nullptr;
+
+      if (literal) {
+        error_literal = literal;
+      } else if (!rule_stack.empty()) {
+        auto rule = rule_stack.back();
+        auto ope = rule->get_written_operator();
+        if (auto token = FindLiteralToken::token(*ope);
+            token && token[0] != '\0') {
+          error_literal = token;
         }
-      } else {
-        data.duplicates_of_definition.emplace_back(name, vs.sv().data());
       }
-    };
 
-    g["Definition"].enter = [](const Context & /*c*/, const char * /*s*/,
-                               size_t /*n*/, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
-      data.captures_in_current_definition.clear();
-    };
+      for (auto r : rule_stack) {
+        error_rule = r;
+        if (r->is_token()) { break; }
+      }
 
-    g["Expression"] = [&](const SemanticValues &vs) {
-      if (vs.size() == 1) {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      } else {
-        std::vector<std::shared_ptr<Ope>> opes;
-        for (auto i = 0u; i < vs.size(); i++) {
-          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(vs[i]));
+      if (error_literal || error_rule) {
+        error_info.add(error_literal, error_rule);
+      }
+    }
+  }
+}
+
+inline void Context::trace_enter(const Ope &ope, const char *a_s, size_t n,
+                                 const SemanticValues &vs, std::any &dt) {
+  trace_ids.push_back(next_trace_id++);
+  tracer_enter(ope, a_s, n, vs, *this, dt, trace_data);
+}
+
+inline void Context::trace_leave(const Ope &ope, const char *a_s, size_t n,
+                                 const SemanticValues &vs, std::any &dt,
+                                 size_t len) {
+  tracer_leave(ope, a_s, n, vs, *this, dt, len, trace_data);
+  trace_ids.pop_back();
+}
+
+inline bool Context::is_traceable(const Ope &ope) const {
+  if (tracer_enter && tracer_leave) {
+    if (ignore_trace_state) { return false; }
+    return !dynamic_cast<const peg::Reference *>(&ope);
+  }
+  return false;
+}
+
+inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
+                         Context &c, std::any &dt) const {
+  if (!c.steps_until_check-- && !c.check_limits(s)) {
+    return static_cast<size_t>(-1);
+  }
+  if (c.is_traceable(*this)) {
+    c.trace_enter(*this, s, n, vs, dt);
+    auto len = parse_core(s, n, vs, c, dt);
+    c.trace_leave(*this, s, n, vs, dt, len);
+    return len;
+  }
+  return parse_core(s, n, vs, c, dt);
+}
+
+inline size_t Dictionary::parse_core(const char *s, size_t n,
+                                     SemanticValues &vs, Context &c,
+                                     std::any &dt) const {
+  size_t id;
+  auto i = trie_.match(s, n, id, &c.reached_end);
+
+  if (i == 0) {
+    c.set_error_pos(s);
+    return static_cast<size_t>(-1);
+  }
+
+  vs.choice_count_ = trie_.size();
+  vs.choice_ = id;
+
+  // Word check
+  if (c.wordOpe) {
+    auto save_ignore_trace_state = c.ignore_trace_state;
+    c.ignore_trace_state = !c.verbose_trace;
+    auto se =
+        scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+
+    {
+      if (i == n) { c.reached_end = true; }
+
+      SemanticValues dummy_vs;
+      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, false,
+                      false, nullptr, nullptr, nullptr, false, nullptr);
+      std::any dummy_dt;
+
+      NotPredicate ope(c.wordOpe);
+      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
+      if (fail(len)) {
+        c.set_error_pos(s);
+        return len;
+      }
+      i += len;
+    }
+  }
+
+  // Skip whitespace
+  if (!c.in_token_boundary_count && c.whitespaceOpe) {
+    auto len = skip_whitespace(s + i, n - i, vs, c, dt);
+    if (fail(len)) { return len; }
+    i += len;
+  }
+
+  return i;
+}
+
+inline size_t LiteralString::parse_core(const char *s, size_t n,
+                                        SemanticValues &vs, Context &c,
+                                        std::any &dt) const {
+  return parse_literal(s, n, vs, c, dt, lit_, folded_, init_is_word_, is_word_,
+                       ignore_case_);
+}
+
+inline size_t TokenBoundary::parse_core(const char *s, size_t n,
+                                        SemanticValues &vs, Context &c,
+                                        std::any &dt) const {
+  auto save_ignore_trace_state = c.ignore_trace_state;
+  c.ignore_trace_state = !c.verbose_trace;
+  auto se =
+      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+
+  size_t len;
+  {
+    c.in_token_boundary_count++;
+    auto se = scope_exit([&]() { c.in_token_boundary_count--; });
+    len = ope_->parse(s, n, vs, c, dt);
+  }
+
+  if (success(len)) {
+    if (c.event_sink) {
+      // Only the first token is kept, which is what token() reports
+      if (!c.in_whitespace && !c.rule_stack.empty()) {
+        c.event_sink->token(c.rule_stack.back()->id,
+                            static_cast<size_t>(s - c.s), len);
+        c.event_count++;
+      }
+      if (vs.tokens.empty()) { vs.tokens.emplace_back(s, len); }
+    } else {
+      vs.tokens.emplace_back(std::string_view(s, len));
+      c.charge_values(vs, s + len);
+    }
+
+    if (!c.in_token_boundary_count) {
+      if (c.whitespaceOpe) {
+        auto l = skip_whitespace(s + len, n - len, vs, c, dt);
+        if (fail(l)) { return l; }
+        len += l;
+      }
+    }
+  }
+  return len;
+}
+
+inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
+                                 Context &c, std::any &dt) const {
+  if (!ope_) {
+    throw std::logic_error("Uninitialized definition ope was used...");
+  }
+
+  // Macro reference
+  if (outer_->is_macro) {
+    c.rule_stack.push_back(outer_);
+    auto len = ope_->parse(s, n, vs, c, dt);
+    c.rule_stack.pop_back();
+    return len;
+  }
+
+  size_t len;
+  std::any val;
+
+  // Binary operator of a precedence climbing loop (its token is needed, so
+  // it isn't memoized)
+  auto is_binop = outer_ == c.binop_rule;
+  if (is_binop) { c.binop_rule = nullptr; }
+
+  auto report = c.event_sink && !c.in_whitespace;
+  auto offset = static_cast<size_t>(s - c.s);
+
+  auto fn = [&](std::any &a_val) {
+    if (report) {
+      c.event_sink->enter(outer_->id, offset);
+      c.event_count++;
+    }
+    if (outer_->enter) { outer_->enter(c, s, n, dt); }
+    auto &chvs = c.push_semantic_values_scope();
+    auto se = scope_exit([&]() {
+      c.pop_semantic_values_scope();
+      if (outer_->leave) { outer_->leave(c, s, n, len, a_val, dt); }
+      if (report) {
+        c.event_sink->leave(outer_->id, offset, len);
+        c.event_count++;
+      }
+    });
+
+    const auto &ope = c.log && unoptimized_ ? unoptimized_ : ope_;
+    c.rule_stack.push_back(outer_);
+    len = ope->parse(s, n, chvs, c, dt);
+    c.rule_stack.pop_back();
+
+    // Invoke action
+    if (success(len)) {
+      chvs.sv_ = std::string_view(s, len);
+      chvs.name_ = outer_->name;
+
+      auto ope_ptr = ope.get();
+      {
+        auto tok_ptr = dynamic_cast<const peg::TokenBoundary *>(ope_ptr);
+        if (tok_ptr) { ope_ptr = tok_ptr->ope_.get(); }
+        auto dfa_ptr = dynamic_cast<const peg::Dfa *>(ope_ptr);
+        if (dfa_ptr) { ope_ptr = dfa_ptr->ope_.get(); }
+      }
+      if (!dynamic_cast<const peg::PrioritizedChoice *>(ope_ptr) &&
+          !dynamic_cast<const peg::FactoredChoice *>(ope_ptr) &&
+          !dynamic_cast<const peg::Dictionary *>(ope_ptr)) {
+        chvs.choice_count_ = 0;
+        chvs.choice_ = 0;
+      }
+
+      std::string msg;
+      if (outer_->predicate && !outer_->predicate(chvs, dt, msg)) {
+        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
+          c.error_info.message_pos = s;
+          c.error_info.message = msg;
+          c.error_info.label = outer_->name;
         }
-        const std::shared_ptr<Ope> ope =
-            std::make_shared<PrioritizedChoice>(opes);
-        return ope;
+        len = static_cast<size_t>(-1);
       }
-    };
 
-    g["Sequence"] = [&](const SemanticValues &vs) {
-      if (vs.empty()) {
-        return npd(lit(""));
-      } else if (vs.size() == 1) {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      } else {
-        std::vector<std::shared_ptr<Ope>> opes;
-        for (const auto &x : vs) {
-          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(x));
-        }
-        const std::shared_ptr<Ope> ope = std::make_shared<Sequence>(opes);
-        return ope;
-      }
-    };
+      if (success(len)) {
+        if (is_binop) { c.binop_token = chvs.token(); }
+        if (!c.recovered && !c.event_sink) { a_val = reduce(chvs, dt); }
+      } else {
+        if (c.log && !msg.empty() && c.error_info.message_pos < s) {
+          c.error_info.message_pos = s;
+          c.error_info.message = msg;
+          c.error_info.label = outer_->name;
+        }
+      }
+    } else {
+      if (c.log && !outer_->error_message.empty() &&
+          c.error_info.message_pos < s) {
+        c.error_info.message_pos = s;
+        c.error_info.message = outer_->error_message;
+        c.error_info.label = outer_->name;
+      }
+    }
+  };
+
+  if (is_binop) {
+    fn(val);
+  } else {
+    c.packrat(s, outer_->id, len, val, fn);
+  }
+
+  if (success(len)) {
+    if (!outer_->ignoreSemanticValue && !c.event_sink) {
+      vs.emplace_back(std::move(val));
+      vs.tags.emplace_back(str2tag(outer_->name));
+      c.charge_values(vs, s + len);
+    }
+  }
+
+  return len;
+}
+
+inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
+  if (outer_->action && !outer_->disable_action) {
+    return outer_->action(vs, dt);
+  } else if (vs.empty()) {
+    return std::any();
+  } else {
+    return std::move(vs.front());
+  }
+}
+
+inline const std::string &Holder::name() const { return outer_->name; }
+
+inline const std::string &Holder::trace_name() const {
+  std::call_once(trace_name_init_,
+                 [this]() { trace_name_ = "[" + outer_->name + "]"; });
+  return trace_name_;
+}
+
+inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
+                                    Context &c, std::any &dt) const {
+  auto save_ignore_trace_state = c.ignore_trace_state;
+  if (rule_ && rule_->ignoreSemanticValue) {
+    c.ignore_trace_state = !c.verbose_trace;
+  }
+  auto se =
+      scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
+
+  if (rule_) {
+    // Reference rule
+    if (rule_->is_macro) {
+      // Macro
+      FindReference vis(c.top_args(), c.rule_stack.back()->params);
+
+      // Collect arguments
+      std::vector<std::shared_ptr<Ope>> args;
+      for (auto arg : args_) {
+        arg->accept(vis);
+        args.emplace_back(std::move(vis.found_ope));
+      }
+
+      c.push_args(std::move(args));
+      auto se = scope_exit([&]() { c.pop_args(); });
+      auto ope = get_core_operator();
+      return ope->parse(s, n, vs, c, dt);
+    } else {
+      // Definition
+      c.push_args(std::vector<std::shared_ptr<Ope>>());
+      auto se = scope_exit([&]() { c.pop_args(); });
+      auto ope = get_core_operator();
+      return ope->parse(s, n, vs, c, dt);
+    }
+  } else {
+    // Reference parameter in macro
+    const auto &args = c.top_args();
+    return args[iarg_]->parse(s, n, vs, c, dt);
+  }
+}
+
+inline std::shared_ptr<Ope> Reference::get_core_operator() const {
+  return rule_->holder_;
+}
+
+inline size_t BackReference::parse_core(const char *s, size_t n,
+                                        SemanticValues &vs, Context &c,
+                                        std::any &dt) const {
+  if (auto lit = c.find_capture(name_)) {
+    std::once_flag init_is_word;
+    auto is_word = false;
+    return parse_literal(s, n, vs, c, dt, *lit, *lit, init_is_word, is_word,
+                         false);
+  }
+
+  c.error_info.message_pos = s;
+  c.error_info.message = "undefined back reference '$" + name_ + "'...";
+  return static_cast<size_t>(-1);
+}
+
+inline Definition &
+PrecedenceClimbing::get_reference_for_binop(Context &c) const {
+  if (rule_.is_macro) {
+    // Reference parameter in macro
+    const auto &args = c.top_args();
+    auto iarg = dynamic_cast<Reference &>(*binop_).iarg_;
+    auto arg = args[iarg];
+    return *dynamic_cast<Reference &>(*arg).rule_;
+  }
+
+  return *dynamic_cast<Reference &>(*binop_).rule_;
+}
+
+inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
+                                                   SemanticValues &vs,
+                                                   Context &c, std::any &dt,
+                                                   size_t min_prec) const {
+  auto len = atom_->parse(s, n, vs, c, dt);
+  if (fail(len)) { return len; }
+
+  // The Holder of the binary operator rule reports its token through the
+  // context (see Holder::parse_core)
+  auto &rule = get_reference_for_binop(c);
+
+  auto i = len;
+  c.push_backtrack_point(s + i);
+  auto bp = scope_exit([&]() { c.pop_backtrack_point(); });
+
+  while (i < n) {
+    c.update_backtrack_point(s + i);
+
+    // Rollback marks
+    auto save_size = vs.size();
+    auto save_tokens_size = vs.tokens.size();
+    auto mark = c.rollback_mark();
+
+    const BinOpeTable::Entry *ope = nullptr;
+    {
+      auto save_binop_rule = c.binop_rule;
+      c.binop_rule = &rule;
+      c.binop_token = std::string_view();
+
+      auto &chvs = c.push_semantic_values_scope();
+      auto se = scope_exit([&]() {
+        c.pop_semantic_values_scope();
+        c.binop_rule = save_binop_rule;
+      });
+
+      auto chlen = binop_->parse(s + i, n - i, chvs, c, dt);
+      if (fail(chlen)) {
+        c.rollback(mark);
+        break;
+      }
+
+      // An operator of a lower level is parsed again by the caller
+      ope = table_.find(c.binop_token);
+      if (!ope || ope->level < min_prec) {
+        c.rollback(mark);
+        break;
+      }
+
+      i += chlen;
+      if (!c.event_sink) {
+        vs.emplace_back(std::move(chvs[0]));
+        c.charge_values(vs, s + i);
+      }
+    }
+
+    auto next_min_prec = ope->level;
+    if (ope->assoc == 'L') { next_min_prec = ope->level + 1; }
+
+    {
+      auto &chvs = c.push_semantic_values_scope();
+      auto se = scope_exit([&]() { c.pop_semantic_values_scope(); });
+
+      auto chlen = parse_expression(s + i, n - i, chvs, c, dt, next_min_prec);
+      if (fail(chlen)) {
+        vs.erase(vs.begin() + static_cast<std::ptrdiff_t>(save_size),
+                 vs.end());
+        vs.tokens.resize(save_tokens_size);
+        c.rollback(mark);
+        i = chlen;
+        break;
+      }
+
+      if (c.event_sink) {
+        i += chlen;
+        continue;
+      }
+
+      vs.emplace_back(std::move(chvs[0]));
+      i += chlen;
+      c.charge_values(vs, s + i);
+    }
+
+    std::any val;
+    if (rule_.action) {
+      vs.sv_ = std::string_view(s, i);
+      val = rule_.action(vs, dt);
+    } else if (!vs.empty()) {
+      val = vs[0];
+    }
+    vs.clear();
+    vs.emplace_back(std::move(val));
+  }
+
+  return i;
+}
+
+inline size_t Recovery::parse_core(const char *s, size_t n,
+                                   SemanticValues & /*vs*/, Context &c,
+                                   std::any & /*dt*/) const {
+  const auto &rule = dynamic_cast<Reference &>(*ope_);
+
+  // Custom error message
+  if (c.log) {
+    auto label = dynamic_cast<Reference *>(rule.args_[0].get());
+    if (label && !label->rule_->error_message.empty()) {
+      c.error_info.message_pos = s;
+      c.error_info.message = label->rule_->error_message;
+      c.error_info.label = label->rule_->name;
+    }
+  }
+
+  // Recovery
+  auto len = static_cast<size_t>(-1);
+  {
+    auto save_log = c.log;
+    c.log = nullptr;
+    auto se = scope_exit([&]() { c.log = save_log; });
+
+    SemanticValues dummy_vs;
+    std::any dummy_dt;
+
+    len = rule.parse(s, n, dummy_vs, c, dummy_dt);
+  }
+
+  if (success(len)) {
+    c.recovered = true;
+
+    if (c.log) {
+      c.error_info.output_log(c.log, c.s, c.l);
+      c.error_info.clear();
+    }
+  }
+
+  // Cut
+  if (!c.cut_stack.empty()) {
+    c.cut_stack.back() = true;
+    if (success(len)) { c.prune_cache(s + len); }
+  }
+
+  return len;
+}
+
+inline void Sequence::accept(Visitor &v) { v.visit(*this); }
+inline void PrioritizedChoice::accept(Visitor &v) { v.visit(*this); }
+inline void FactoredChoice::accept(Visitor &v) { v.visit(*this); }
+inline void Repetition::accept(Visitor &v) { v.visit(*this); }
+inline void AndPredicate::accept(Visitor &v) { v.visit(*this); }
+inline void NotPredicate::accept(Visitor &v) { v.visit(*this); }
+inline void Dictionary::accept(Visitor &v) { v.visit(*this); }
+inline void LiteralString::accept(Visitor &v) { v.visit(*this); }
+inline void CharacterClass::accept(Visitor &v) { v.visit(*this); }
+inline void Character::accept(Visitor &v) { v.visit(*this); }
+inline void AnyCharacter::accept(Visitor &v) { v.visit(*this); }
+inline void Dfa::accept(Visitor &v) { v.visit(*this); }
+inline void CaptureScope::accept(Visitor &v) { v.visit(*this); }
+inline void Capture::accept(Visitor &v) { v.visit(*this); }
+inline void TokenBoundary::accept(Visitor &v) { v.visit(*this); }
+inline void Ignore::accept(Visitor &v) { v.visit(*this); }
+inline void User::accept(Visitor &v) { v.visit(*this); }
+inline void WeakHolder::accept(Visitor &v) { v.visit(*this); }
+inline void Holder::accept(Visitor &v) { v.visit(*this); }
+inline void Reference::accept(Visitor &v) { v.visit(*this); }
+inline void Whitespace::accept(Visitor &v) { v.visit(*this); }
+inline void BackReference::accept(Visitor &v) { v.visit(*this); }
+inline void PrecedenceClimbing::accept(Visitor &v) { v.visit(*this); }
+inline void Recovery::accept(Visitor &v) { v.visit(*this); }
+inline void Cut::accept(Visitor &v) { v.visit(*this); }
+
+inline void AssignIDToDefinition::visit(Holder &ope) {
+  auto p = static_cast<void *>(ope.outer_);
+  if (ids.count(p)) { return; }
+  auto id = ids.size();
+  ids[p] = id;
+  ope.outer_->id = id;
+  ope.ope_->accept(*this);
+}
+
+inline void AssignIDToDefinition::visit(Reference &ope) {
+  if (ope.rule_) {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+    ope.rule_->accept(*this);
+  }
+}
+
+inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
+  ope.atom_->accept(*this);
+  ope.binop_->accept(*this);
+}
+
+inline void TokenChecker::visit(Reference &ope) {
+  if (ope.is_macro_) {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  } else {
+    has_rule_ = true;
+  }
+}
+
+inline void FindLiteralToken::visit(Reference &ope) {
+  if (ope.is_macro_) {
+    ope.rule_->accept(*this);
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+}
+
+inline void ComputeFirstSet::visit(Reference &ope) {
+  if (ope.is_macro_ || !ope.rule_ || refs_.count(ope.name_)) {
+    set_any();
+    return;
+  }
+
+  auto it = cache_.find(ope.name_);
+  if (it != cache_.end()) {
+    first = it->second;
+    return;
+  }
+
+  refs_.insert(ope.name_);
+  ope.rule_->accept(*this);
+  refs_.erase(ope.name_);
+  cache_[ope.name_] = first;
+}
+
+inline void DetectLeftRecursion::visit(Reference &ope) {
+  if (ope.name_ == name_) {
+    error_s = ope.s_;
+  } else if (!refs_.count(ope.name_)) {
+    refs_.insert(ope.name_);
+    if (ope.rule_) {
+      ope.rule_->accept(*this);
+      if (done_ == false) { return; }
+    }
+  }
+  done_ = true;
+}
+
+inline void HasEmptyElement::visit(Sequence &ope) {
+  auto save_is_empty = false;
+  const char *save_error_s = nullptr;
+  std::string save_error_name;
+
+  auto it = ope.opes_.begin();
+  while (it != ope.opes_.end()) {
+    (*it)->accept(*this);
+    if (!is_empty) {
+      ++it;
+      while (it != ope.opes_.end()) {
+        DetectInfiniteLoop vis(refs_, has_error_cache_);
+        (*it)->accept(vis);
+        if (vis.has_error) {
+          is_empty = true;
+          error_s = vis.error_s;
+          error_name = vis.error_name;
+        }
+        ++it;
+      }
+      return;
+    }
+
+    save_is_empty = is_empty;
+    save_error_s = error_s;
+    save_error_name = error_name;
+
+    is_empty = false;
+    error_name.clear();
+    ++it;
+  }
+
+  is_empty = save_is_empty;
+  error_s = save_error_s;
+  error_name = save_error_name;
+}
+
+inline void HasEmptyElement::visit(Reference &ope) {
+  auto it = std::find_if(refs_.begin(), refs_.end(),
+                         [&](const std::pair<const char *, std::string> &ref) {
+                           return ope.name_ == ref.second;
+                         });
+  if (it != refs_.end()) { return; }
+
+  if (ope.rule_) {
+    refs_.emplace_back(ope.s_, ope.name_);
+    ope.rule_->accept(*this);
+    refs_.pop_back();
+  }
+}
+
+inline void DetectInfiniteLoop::visit(Reference &ope) {
+  auto it = std::find_if(refs_.begin(), refs_.end(),
+                         [&](const std::pair<const char *, std::string> &ref) {
+                           return ope.name_ == ref.second;
+                         });
+  if (it != refs_.end()) { return; }
+
+  if (ope.rule_) {
+    auto it = has_error_cache_.find(ope.name_);
+    if (it != has_error_cache_.end()) {
+      has_error = it->second;
+    } else {
+      refs_.emplace_back(ope.s_, ope.name_);
+      ope.rule_->accept(*this);
+      refs_.pop_back();
+      has_error_cache_[ope.name_] = has_error;
+    }
+  }
+
+  if (ope.is_macro_) {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+}
+
+inline void ReferenceChecker::visit(Reference &ope) {
+  auto it = std::find(params_.begin(), params_.end(), ope.name_);
+  if (it != params_.end()) { return; }
+
+  if (!grammar_.count(ope.name_)) {
+    error_s[ope.name_] = ope.s_;
+    error_message[ope.name_] = "'" + ope.name_ + "' is not defined.";
+  } else {
+    if (!referenced.count(ope.name_)) { referenced.insert(ope.name_); }
+    const auto &rule = grammar_.at(ope.name_);
+    if (rule.is_macro) {
+      if (!ope.is_macro_ || ope.args_.size() != rule.params.size()) {
+        error_s[ope.name_] = ope.s_;
+        error_message[ope.name_] = "incorrect number of arguments.";
+      }
+    } else if (ope.is_macro_) {
+      error_s[ope.name_] = ope.s_;
+      error_message[ope.name_] = "'" + ope.name_ + "' is not macro.";
+    }
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+}
+
+inline void LinkReferences::visit(Reference &ope) {
+  // Check if the reference is a macro parameter
+  auto found_param = false;
+  for (size_t i = 0; i < params_.size(); i++) {
+    const auto &param = params_[i];
+    if (param == ope.name_) {
+      ope.iarg_ = i;
+      found_param = true;
+      break;
+    }
+  }
+
+  // Check if the reference is a definition rule
+  if (!found_param && grammar_.count(ope.name_)) {
+    auto &rule = grammar_.at(ope.name_);
+    ope.rule_ = &rule;
+    referenced.push_back(&rule);
+  }
+
+  for (auto arg : ope.args_) {
+    arg->accept(*this);
+  }
+}
+
+inline void FindReference::visit(Reference &ope) {
+  for (size_t i = 0; i < args_.size(); i++) {
+    const auto &name = params_[i];
+    if (name == ope.name_) {
+      found_ope = args_[i];
+      return;
+    }
+  }
+  found_ope = ope.shared_from_this();
+}
+
+inline void OptimizeGrammar::visit(Reference &ope) {
+  if (!ope.rule_ || ope.is_macro_ || !ope.args_.empty()) {
+    pushes_ = true;
+    return;
+  }
+
+  const auto &rule = *ope.rule_;
+  auto body = rule.get_core_operator();
+  MeasureOpe measure(whitespace_pushes_);
+  body->accept(measure);
+
+  // The rule's own value (or, when ignored, the values its body would add)
+  // must not be missed by the caller
+  auto invisible = discard_ || (rule.ignoreSemanticValue && !measure.pushes);
+
+  if (&rule == &rule_ || inlining_.count(&rule) || rule.action ||
+      rule.predicate || rule.enter || rule.leave || rule.is_macro ||
+      !rule.error_message.empty() || measure.count > max_inline_size ||
+      !invisible || (top_ && keep_choice_ && is_choice(*body))) {
+    pushes_ |= !rule.ignoreSemanticValue;
+    return;
+  }
+
+  inlining_.insert(&rule);
+  auto o = optimize(body);
+  inlining_.erase(&rule);
+
+  note(result_.inlined, "inlined '" + rule.name + "'");
+  found_ope = o;
+}
+
+inline void CollectTrailingRepetitions::visit(Reference &ope) {
+  if (ope.rule_ && !ope.is_macro_ && visited_.insert(ope.rule_).second) {
+    ope.rule_->get_core_operator()->accept(*this);
+  }
+}
+
+inline void OptimizeGrammar::note(size_t &counter, const std::string &what) {
+  counter++;
+  result_.changes.push_back(rule_.name + ": " + what);
+}
+
+/*-----------------------------------------------------------------------------
+ *  PEG parser generator
+ *---------------------------------------------------------------------------*/
+
+using Rules = std::unordered_map<std::string, std::shared_ptr<Ope>>;
+
+class ParserGenerator {
+public:
+  struct ParserContext {
+    std::shared_ptr<Grammar> grammar;
+    std::string start;
+    bool enablePackratParsing = false;
+  };
+
+  static ParserContext parse(const char *s, size_t n, const Rules &rules,
+                             Log log, std::string_view start) {
+    return get_instance().perform_core(s, n, rules, log, std::string(start));
+  }
+
+  // For debugging purpose
+  static Grammar &grammar() { return get_instance().g; }
+
+private:
+  static ParserGenerator &get_instance() {
+    static ParserGenerator instance;
+    return instance;
+  }
+
+  ParserGenerator() {
+    make_grammar();
+    setup_actions();
+  }
+
+  struct Instruction {
+    std::string type;
+    std::any data;
+    std::string_view sv;
+  };
+
+  struct Data {
+    std::shared_ptr<Grammar> grammar;
+    std::string start;
+    const char *start_pos = nullptr;
+
+    std::vector<std::pair<std::string, const char *>> duplicates_of_definition;
+
+    std::vector<std::pair<std::string, const char *>> duplicates_of_instruction;
+    std::map<std::string, std::vector<Instruction>> instructions;
+
+    std::vector<std::pair<std::string, const char *>> undefined_back_references;
+    std::vector<std::set<std::string_view>> captures_stack{{}};
+
+    std::set<std::string_view> captures_in_current_definition;
+    bool enablePackratParsing = true;
+    bool enableCaptures = false;
+    bool enableCachePruning = false;
+
+    Data() : grammar(std::make_shared<Grammar>()) {}
+  };
+
+  void make_grammar() {
+    // Setup PEG syntax parser
+    g["Grammar"] <= seq(g["Spacing"], oom(g["Definition"]), g["EndOfFile"]);
+    g["Grammar"].enableCaptures = false;
+    g["Definition"] <=
+        cho(seq(g["Ignore"], g["IdentCont"], g["Parameters"], g["LEFTARROW"],
+                g["Expression"], opt(g["Instruction"])),
+            seq(g["Ignore"], g["Identifier"], g["LEFTARROW"], g["Expression"],
+                opt(g["Instruction"])));
+    g["Expression"] <= seq(g["Sequence"], zom(seq(g["SLASH"], g["Sequence"])));
+    g["Sequence"] <= zom(cho(g["CUT"], g["Prefix"]));
+    g["Prefix"] <= seq(opt(cho(g["AND"], g["NOT"])), g["SuffixWithLabel"]);
+    g["SuffixWithLabel"] <=
+        seq(g["Suffix"], opt(seq(g["LABEL"], g["Identifier"])));
+    g["Suffix"] <= seq(g["Primary"], opt(g["Loop"]));
+    g["Loop"] <= cho(g["QUESTION"], g["STAR"], g["PLUS"], g["Repetition"]);
+    g["Primary"] <= cho(seq(g["Ignore"], g["IdentCont"], g["Arguments"],
+                            npd(g["LEFTARROW"])),
+                        seq(g["Ignore"], g["Identifier"],
+                            npd(seq(opt(g["Parameters"]), g["LEFTARROW"]))),
+                        seq(g["OPEN"], g["Expression"], g["CLOSE"]),
+                        seq(g["BeginTok"], g["Expression"], g["EndTok"]),
+                        g["CapScope"],
+                        seq(g["BeginCap"], g["Expression"], g["EndCap"]),
+                        g["BackRef"], g["DictionaryI"], g["LiteralI"],
+                        g["Dictionary"], g["Literal"], g["NegatedClassI"],
+                        g["NegatedClass"], g["ClassI"], g["Class"], g["DOT"]);
+
+    g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
+    g["IdentCont"] <= tok(seq(g["IdentStart"], zom(g["IdentRest"])));
+
+    const static std::vector<std::pair<char32_t, char32_t>> range = {
+        {0x0080, 0xFFFF}};
+    g["IdentStart"] <= seq(npd(lit(u8(u8"↑"))), npd(lit(u8(u8"⇑"))),
+                           cho(cls("a-zA-Z_%"), cls(range)));
+
+    g["IdentRest"] <= cho(g["IdentStart"], cls("0-9"));
+
+    g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
+
+    g["DictionaryI"] <=
+        seq(g["LiteralID"], oom(seq(g["PIPE"], g["LiteralID"])));
+
+    auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
+                           cls("'"), g["Spacing"]),
+                       seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
+                           cls("\""), g["Spacing"]));
+    g["Literal"] <= lit_ope;
+    g["LiteralD"] <= lit_ope;
+
+    auto lit_case_ignore_ope =
+        cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
+                g["Spacing"]),
+            seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
+                g["Spacing"]));
+    g["LiteralI"] <= lit_case_ignore_ope;
+    g["LiteralID"] <= lit_case_ignore_ope;
+
+    // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
+    g["Class"] <= seq(chr('['), npd(chr('^')),
+                      tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
+                      g["Spacing"]);
+    g["ClassI"] <= seq(chr('['), npd(chr('^')),
+                       tok(oom(seq(npd(chr(']')), g["Range"]))), lit("]i"),
+                       g["Spacing"]);
+
+    g["NegatedClass"] <= seq(lit("[^"),
+                             tok(oom(seq(npd(chr(']')), g["Range"]))), chr(']'),
+                             g["Spacing"]);
+    g["NegatedClassI"] <= seq(lit("[^"),
+                              tok(oom(seq(npd(chr(']')), g["Range"]))),
+                              lit("]i"), g["Spacing"]);
+
+    // NOTE: This is different from The original Brian Ford's paper, and this
+    // modification allows us to specify `[+-]` as a valid char class.
+    g["Range"] <=
+        cho(seq(g["Char"], chr('-'), npd(chr(']')), g["Char"]), g["Char"]);
+
+    g["Char"] <=
+        cho(seq(chr('\\'), cls("fnrtv'\"[]\\^")),
+            seq(chr('\\'), cls("0-3"), cls("0-7"), cls("0-7")),
+            seq(chr('\\'), cls("0-7"), opt(cls("0-7"))),
+            seq(lit("\\x"), cls("0-9a-fA-F"), opt(cls("0-9a-fA-F"))),
+            seq(lit("\\u"),
+                cho(seq(cho(seq(chr('0'), cls("0-9a-fA-F")), lit("10")),
+                        rep(cls("0-9a-fA-F"), 4, 4)),
+                    rep(cls("0-9a-fA-F"), 4, 5))),
+            seq(npd(chr('\\')), dot()));
+
+    g["Repetition"] <=
+        seq(g["BeginBracket"], g["RepetitionRange"], g["EndBracket"]);
+    g["RepetitionRange"] <= cho(seq(g["Number"], g["COMMA"], g["Number"]),
+                                seq(g["Number"], g["COMMA"]), g["Number"],
+                                seq(g["COMMA"], g["Number"]));
+    g["Number"] <= seq(oom(cls("0-9")), g["Spacing"]);
+
+    g["CapScope"] <= seq(g["BeginCapScope"], g["Expression"], g["EndCapScope"]);
+
+    g["LEFTARROW"] <= seq(cho(lit("<-"), lit(u8(u8"←"))), g["Spacing"]);
+    ~g["SLASH"] <= seq(chr('/'), g["Spacing"]);
+    ~g["PIPE"] <= seq(chr('|'), g["Spacing"]);
+    g["AND"] <= seq(chr('&'), g["Spacing"]);
+    g["NOT"] <= seq(chr('!'), g["Spacing"]);
+    g["QUESTION"] <= seq(chr('?'), g["Spacing"]);
+    g["STAR"] <= seq(chr('*'), g["Spacing"]);
+    g["PLUS"] <= seq(chr('+'), g["Spacing"]);
+    ~g["OPEN"] <= seq(chr('('), g["Spacing"]);
+    ~g["CLOSE"] <= seq(chr(')'), g["Spacing"]);
+    g["DOT"] <= seq(chr('.'), g["Spacing"]);
+
+    g["CUT"] <= seq(lit(u8(u8"↑")), g["Spacing"]);
+    ~g["LABEL"] <= seq(cho(chr('^'), lit(u8(u8"⇑"))), g["Spacing"]);
+
+    ~g["Spacing"] <= zom(cho(g["Space"], g["Comment"]));
+    g["Comment"] <=
+        seq(chr('#'), zom(seq(npd(g["EndOfLine"]), dot())), g["EndOfLine"]);
+    g["Space"] <= cho(chr(' '), chr('\t'), g["EndOfLine"]);
+    g["EndOfLine"] <= cho(lit("\r\n"), chr('\n'), chr('\r'));
+    g["EndOfFile"] <= npd(dot());
+
+    ~g["BeginTok"] <= seq(chr('<'), g["Spacing"]);
+    ~g["EndTok"] <= seq(chr('>'), g["Spacing"]);
+
+    ~g["BeginCapScope"] <= seq(chr('$'), chr('('), g["Spacing"]);
+    ~g["EndCapScope"] <= seq(chr(')'), g["Spacing"]);
+
+    g["BeginCap"] <= seq(chr('$'), tok(g["IdentCont"]), chr('<'), g["Spacing"]);
+    ~g["EndCap"] <= seq(chr('>'), g["Spacing"]);
+
+    g["BackRef"] <= seq(chr('$'), tok(g["IdentCont"]), g["Spacing"]);
+
+    g["IGNORE"] <= chr('~');
+
+    g["Ignore"] <= opt(g["IGNORE"]);
+    g["Parameters"] <= seq(g["OPEN"], g["Identifier"],
+                           zom(seq(g["COMMA"], g["Identifier"])), g["CLOSE"]);
+    g["Arguments"] <= seq(g["OPEN"], g["Expression"],
+                          zom(seq(g["COMMA"], g["Expression"])), g["CLOSE"]);
+    ~g["COMMA"] <= seq(chr(','), g["Spacing"]);
+
+    // Instruction grammars
+    g["Instruction"] <=
+        seq(g["BeginBracket"],
+            opt(seq(g["InstructionItem"], zom(seq(g["InstructionItemSeparator"],
+                                                  g["InstructionItem"])))),
+            g["EndBracket"]);
+    g["InstructionItem"] <=
+        cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"]);
+    ~g["InstructionItemSeparator"] <= seq(chr(';'), g["Spacing"]);
+
+    ~g["SpacesZom"] <= zom(g["Space"]);
+    ~g["SpacesOom"] <= oom(g["Space"]);
+    ~g["BeginBracket"] <= seq(chr('{'), g["Spacing"]);
+    ~g["EndBracket"] <= seq(chr('}'), g["Spacing"]);
+
+    // PrecedenceClimbing instruction
+    g["PrecedenceClimbing"] <=
+        seq(lit("precedence"), g["SpacesOom"], g["PrecedenceInfo"],
+            zom(seq(g["SpacesOom"], g["PrecedenceInfo"])), g["SpacesZom"]);
+    g["PrecedenceInfo"] <=
+        seq(g["PrecedenceAssoc"],
+            oom(seq(ign(g["SpacesOom"]), g["PrecedenceOpe"])));
+    g["PrecedenceOpe"] <=
+        cho(seq(cls("'"),
+                tok(zom(seq(npd(cho(g["Space"], cls("'"))), g["Char"]))),
+                cls("'")),
+            seq(cls("\""),
+                tok(zom(seq(npd(cho(g["Space"], cls("\""))), g["Char"]))),
+                cls("\"")),
+            tok(oom(seq(npd(cho(g["PrecedenceAssoc"], g["Space"], chr('}'))),
+                        dot()))));
+    g["PrecedenceAssoc"] <= cls("LR");
+
+    // Error message instruction
+    g["ErrorMessage"] <= seq(lit("error_message"), g["SpacesOom"],
+                             g["LiteralD"], g["SpacesZom"]);
+
+    // No Ast node optimization instruction
+    g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
+
+    // Set definition names
+    for (auto &x : g) {
+      x.second.name = x.first;
+    }
+  }
+
+  void setup_actions() {
+    g["Definition"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+
+      auto is_macro = vs.choice() == 0;
+      auto ignore = std::any_cast<bool>(vs[0]);
+      auto name = std::any_cast<std::string>(vs[1]);
+
+      std::vector<std::string> params;
+      std::shared_ptr<Ope> ope;
+      auto has_instructions = false;
+
+      if (is_macro) {
+        params = std::any_cast<std::vector<std::string>>(vs[2]);
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[4]);
+        if (vs.size() == 6) { has_instructions = true; }
+      } else {
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[3]);
+        if (vs.size() == 5) { has_instructions = true; }
+      }
+
+      if (has_instructions) {
+        auto index = is_macro ? 5 : 4;
+        std::unordered_set<std::string> types;
+        for (const auto &instruction :
+             std::any_cast<std::vector<Instruction>>(vs[index])) {
+          const auto &type = instruction.type;
+          if (types.find(type) == types.end()) {
+            data.instructions[name].push_back(instruction);
+            types.insert(instruction.type);
+            if (type == "declare_symbol" || type == "check_symbol") {
+              if (!TokenChecker::is_token(*ope)) { ope = tok(ope); }
+            }
+          } else {
+            data.duplicates_of_instruction.emplace_back(type,
+                                                        instruction.sv.data());
+          }
+        }
+      }
+
+      auto &grammar = *data.grammar;
+      if (!grammar.count(name)) {
+        auto &rule = grammar[name];
+        rule <= ope;
+        rule.name = name;
+        rule.s_ = vs.sv().data();
+        // Scanning from the top for every rule would be quadratic
+        auto col_ptr = rule.s_;
+        while (col_ptr > vs.ss && col_ptr[-1] != '\n') {
+          col_ptr--;
+        }
+        rule.line_ = {vs.line_info().first, line_info(col_ptr, rule.s_).second};
+        rule.ignoreSemanticValue = ignore;
+        rule.is_macro = is_macro;
+        rule.params = params;
+
+        if (data.start.empty()) {
+          data.start = rule.name;
+          data.start_pos = rule.s_;
+        }
+      } else {
+        data.duplicates_of_definition.emplace_back(name, vs.sv().data());
+      }
+    };
+
+    g["Definition"].enter = [](const Context & /*c*/, const char * /*s*/,
+                               size_t /*n*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.captures_in_current_definition.clear();
+    };
+
+    g["Expression"] = [&](const SemanticValues &vs) {
+      if (vs.size() == 1) {
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      } else {
+        std::vector<std::shared_ptr<Ope>> opes;
+        for (auto i = 0u; i < vs.size(); i++) {
+          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(vs[i]));
+        }
+        const std::shared_ptr<Ope> ope =
+            std::make_shared<PrioritizedChoice>(opes);
+        return ope;
+      }
+    };
+
+    g["Sequence"] = [&](const SemanticValues &vs) {
+      if (vs.empty()) {
+        return npd(lit(""));
+      } else if (vs.size() == 1) {
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      } else {
+        std::vector<std::shared_ptr<Ope>> opes;
+        for (const auto &x : vs) {
+          opes.emplace_back(std::any_cast<std::shared_ptr<Ope>>(x));
+        }
+        const std::shared_ptr<Ope> ope = std::make_shared<Sequence>(opes);
+        return ope;
+      }
+    };
+
+    g["Prefix"] = [&](const SemanticValues &vs) {
+      std::shared_ptr<Ope> ope;
+      if (vs.size() == 1) {
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      } else {
+        assert(vs.size() == 2);
+        auto tok = std::any_cast<char>(vs[0]);
+        ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+        if (tok == '&') {
+          ope = apd(ope);
+        } else { // '!'
+          ope = npd(ope);
+        }
+      }
+      return ope;
+    };
+
+    g["SuffixWithLabel"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      if (vs.size() == 1) {
+        return ope;
+      } else {
+        assert(vs.size() == 2);
+        auto &data = *std::any_cast<Data *>(dt);
+        const auto &ident = std::any_cast<std::string>(vs[1]);
+        auto label = ref(*data.grammar, ident, vs.sv().data(), false, {});
+        auto recovery = rec(ref(*data.grammar, RECOVER_DEFINITION_NAME,
+                                vs.sv().data(), true, {label}));
+        data.enableCachePruning = true;
+        return cho4label_(ope, recovery);
+      }
+    };
+
+    struct Loop {
+      enum class Type { opt = 0, zom, oom, rep };
+      Type type;
+      std::pair<size_t, size_t> range;
+    };
+
+    g["Suffix"] = [&](const SemanticValues &vs) {
+      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      if (vs.size() == 1) {
+        return ope;
+      } else {
+        assert(vs.size() == 2);
+        auto loop = std::any_cast<Loop>(vs[1]);
+        switch (loop.type) {
+        case Loop::Type::opt: return opt(ope);
+        case Loop::Type::zom: return zom(ope);
+        case Loop::Type::oom: return oom(ope);
+        default: // Regex-like repetition
+          return rep(ope, loop.range.first, loop.range.second);
+        }
+      }
+    };
+
+    g["Loop"] = [&](const SemanticValues &vs) {
+      switch (vs.choice()) {
+      case 0: // Option
+        return Loop{Loop::Type::opt, std::pair<size_t, size_t>()};
+      case 1: // Zero or More
+        return Loop{Loop::Type::zom, std::pair<size_t, size_t>()};
+      case 2: // One or More
+        return Loop{Loop::Type::oom, std::pair<size_t, size_t>()};
+      default: // Regex-like repetition
+        return Loop{Loop::Type::rep,
+                    std::any_cast<std::pair<size_t, size_t>>(vs[0])};
+      }
+    };
+
+    g["Primary"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+
+      switch (vs.choice()) {
+      case 0:   // Macro Reference
+      case 1: { // Reference
+        auto is_macro = vs.choice() == 0;
+        auto ignore = std::any_cast<bool>(vs[0]);
+        const auto &ident = std::any_cast<std::string>(vs[1]);
+
+        std::vector<std::shared_ptr<Ope>> args;
+        if (is_macro) {
+          args = std::any_cast<std::vector<std::shared_ptr<Ope>>>(vs[2]);
+        }
+
+        auto ope = ref(*data.grammar, ident, vs.sv().data(), is_macro, args);
+        if (ident == RECOVER_DEFINITION_NAME) {
+          ope = rec(ope);
+          data.enableCachePruning = true;
+        }
+
+        if (ignore) {
+          return ign(ope);
+        } else {
+          return ope;
+        }
+      }
+      case 2: { // (Expression)
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      }
+      case 3: { // TokenBoundary
+        return tok(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+      }
+      case 4: { // CaptureScope
+        data.enableCaptures = true;
+        return csc(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+      }
+      case 5: { // Capture
+        const auto &name = std::any_cast<std::string_view>(vs[0]);
+        auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+
+        data.captures_stack.back().insert(name);
+        data.captures_in_current_definition.insert(name);
+        data.enableCaptures = true;
+
+        return cap(ope, [name](const char *a_s, size_t a_n, Context &c) {
+          c.set_capture(name, a_s, a_n);
+        });
+      }
+      default: {
+        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+      }
+      }
+    };
+
+    g["IdentCont"] = [](const SemanticValues &vs) {
+      return std::string(vs.sv().data(), vs.sv().length());
+    };
+
+    g["Dictionary"] = [](const SemanticValues &vs) {
+      auto items = vs.transform<std::string>();
+      return dic(items, false);
+    };
+    g["DictionaryI"] = [](const SemanticValues &vs) {
+      auto items = vs.transform<std::string>();
+      return dic(items, true);
+    };
+
+    g["Literal"] = [](const SemanticValues &vs) {
+      const auto &tok = vs.tokens.front();
+      return lit(resolve_escape_sequence(tok.data(), tok.size()));
+    };
+    g["LiteralI"] = [](const SemanticValues &vs) {
+      const auto &tok = vs.tokens.front();
+      return liti(resolve_escape_sequence(tok.data(), tok.size()));
+    };
+    g["LiteralD"] = [](const SemanticValues &vs) {
+      auto &tok = vs.tokens.front();
+      return resolve_escape_sequence(tok.data(), tok.size());
+    };
+    g["LiteralID"] = [](const SemanticValues &vs) {
+      auto &tok = vs.tokens.front();
+      return resolve_escape_sequence(tok.data(), tok.size());
+    };
+
+    g["Class"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return cls(ranges);
+    };
+    g["ClassI"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return cls(ranges, true);
+    };
+    g["NegatedClass"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return ncls(ranges);
+    };
+    g["NegatedClassI"] = [](const SemanticValues &vs) {
+      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
+      return ncls(ranges, true);
+    };
+    g["Range"] = [](const SemanticValues &vs) {
+      switch (vs.choice()) {
+      case 0: {
+        auto s1 = std::any_cast<std::string>(vs[0]);
+        auto s2 = std::any_cast<std::string>(vs[1]);
+        auto cp1 = decode_codepoint(s1.data(), s1.length());
+        auto cp2 = decode_codepoint(s2.data(), s2.length());
+        return std::pair(cp1, cp2);
+      }
+      case 1: {
+        auto s = std::any_cast<std::string>(vs[0]);
+        auto cp = decode_codepoint(s.data(), s.length());
+        return std::pair(cp, cp);
+      }
+      }
+      return std::pair<char32_t, char32_t>(0, 0);
+    };
+    g["Char"] = [](const SemanticValues &vs) {
+      return resolve_escape_sequence(vs.sv().data(), vs.sv().length());
+    };
+
+    g["RepetitionRange"] = [&](const SemanticValues &vs) {
+      switch (vs.choice()) {
+      case 0: { // Number COMMA Number
+        auto min = std::any_cast<size_t>(vs[0]);
+        auto max = std::any_cast<size_t>(vs[1]);
+        return std::pair(min, max);
+      }
+      case 1: // Number COMMA
+        return std::pair(std::any_cast<size_t>(vs[0]),
+                         std::numeric_limits<size_t>::max());
+      case 2: { // Number
+        auto n = std::any_cast<size_t>(vs[0]);
+        return std::pair(n, n);
+      }
+      default: // COMMA Number
+        return std::pair(std::numeric_limits<size_t>::min(),
+                         std::any_cast<size_t>(vs[0]));
+      }
+    };
+    g["Number"] = [&](const SemanticValues &vs) {
+      return vs.token_to_number<size_t>();
+    };
+
+    g["CapScope"].enter = [](const Context & /*c*/, const char * /*s*/,
+                             size_t /*n*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.captures_stack.emplace_back();
+    };
+    g["CapScope"].leave = [](const Context & /*c*/, const char * /*s*/,
+                             size_t /*n*/, size_t /*matchlen*/,
+                             std::any & /*value*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.captures_stack.pop_back();
+    };
+
+    g["AND"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["NOT"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["QUESTION"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["STAR"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    g["PLUS"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+
+    g["DOT"] = [](const SemanticValues & /*vs*/) { return dot(); };
+
+    g["CUT"] = [](const SemanticValues & /*vs*/, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+      data.enableCachePruning = true;
+      return cut();
+    };
+
+    g["BeginCap"] = [](const SemanticValues &vs) { return vs.token(); };
+
+    g["BackRef"] = [&](const SemanticValues &vs, std::any &dt) {
+      auto &data = *std::any_cast<Data *>(dt);
+
+      // Undefined back reference check
+      {
+        auto found = false;
+        auto it = data.captures_stack.rbegin();
+        while (it != data.captures_stack.rend()) {
+          if (it->find(vs.token()) != it->end()) {
+            found = true;
+            break;
+          }
+          ++it;
+        }
+        if (!found) {
+          auto ptr = vs.token().data() - 1; // include '$' symbol
+          data.undefined_back_references.emplace_back(vs.token(), ptr);
+        }
+      }
+
+      // NOTE: Disable packrat parsing if a back reference is not defined in
+      // captures in the current definition rule.
+      if (data.captures_in_current_definition.find(vs.token()) ==
+          data.captures_in_current_definition.end()) {
+        data.enablePackratParsing = false;
+      }
+
+      data.enableCaptures = true;
+
+      return bkr(vs.token_to_string());
+    };
+
+    g["Ignore"] = [](const SemanticValues &vs) { return vs.size() > 0; };
+
+    g["Parameters"] = [](const SemanticValues &vs) {
+      return vs.transform<std::string>();
+    };
+
+    g["Arguments"] = [](const SemanticValues &vs) {
+      return vs.transform<std::shared_ptr<Ope>>();
+    };
+
+    g["PrecedenceClimbing"] = [](const SemanticValues &vs) {
+      PrecedenceClimbing::BinOpeInfo binOpeInfo;
+      size_t level = 1;
+      for (auto v : vs) {
+        auto tokens = std::any_cast<std::vector<std::string_view>>(v);
+        auto assoc = tokens[0][0];
+        for (size_t i = 1; i < tokens.size(); i++) {
+          binOpeInfo[tokens[i]] = std::pair(level, assoc);
+        }
+        level++;
+      }
+      Instruction instruction;
+      instruction.type = "precedence";
+      instruction.data = binOpeInfo;
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+    g["PrecedenceInfo"] = [](const SemanticValues &vs) {
+      return vs.transform<std::string_view>();
+    };
+    g["PrecedenceOpe"] = [](const SemanticValues &vs) { return vs.token(); };
+    g["PrecedenceAssoc"] = [](const SemanticValues &vs) { return vs.token(); };
+
+    g["ErrorMessage"] = [](const SemanticValues &vs) {
+      Instruction instruction;
+      instruction.type = "error_message";
+      instruction.data = std::any_cast<std::string>(vs[0]);
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+
+    g["NoAstOpt"] = [](const SemanticValues &vs) {
+      Instruction instruction;
+      instruction.type = "no_ast_opt";
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+
+    g["Instruction"] = [](const SemanticValues &vs) {
+      return vs.transform<Instruction>();
+    };
+  }
+
+  bool apply_precedence_instruction(Definition &rule,
+                                    const PrecedenceClimbing::BinOpeInfo &info,
+                                    const char *s, Log log) {
+    try {
+      auto &seq = dynamic_cast<Sequence &>(*rule.get_core_operator());
+      auto atom = seq.opes_[0];
+      auto &rep = dynamic_cast<Repetition &>(*seq.opes_[1]);
+      auto &seq1 = dynamic_cast<Sequence &>(*rep.ope_);
+      auto binop = seq1.opes_[0];
+      auto atom1 = seq1.opes_[1];
+
+      auto atom_name = dynamic_cast<Reference &>(*atom).name_;
+      auto binop_name = dynamic_cast<Reference &>(*binop).name_;
+      auto atom1_name = dynamic_cast<Reference &>(*atom1).name_;
+
+      if (!rep.is_zom() || atom_name != atom1_name || atom_name == binop_name) {
+        if (log) {
+          auto line = line_info(s, rule.s_);
+          log(line.first, line.second,
+              "'precedence' instruction cannot be applied to '" + rule.name +
+                  "'.",
+              "");
+        }
+        return false;
+      }
+
+      rule.holder_->ope_ = pre(atom, binop, info, rule);
+      rule.disable_action = true;
+    } catch (...) {
+      if (log) {
+        auto line = line_info(s, rule.s_);
+        log(line.first, line.second,
+            "'precedence' instruction cannot be applied to '" + rule.name +
+                "'.",
+            "");
+      }
+      return false;
+    }
+    return true;
+  }
+
+  ParserContext perform_core(const char *s, size_t n, const Rules &rules,
+                             Log log, std::string requested_start) {
+    Data data;
+    auto &grammar = *data.grammar;
+
+    // Built-in macros
+    {
+      // `%recover`
+      {
+        auto &rule = grammar[RECOVER_DEFINITION_NAME];
+        rule <= ref(grammar, "x", "", false, {});
+        rule.name = RECOVER_DEFINITION_NAME;
+        rule.s_ = "[native]";
+        rule.ignoreSemanticValue = true;
+        rule.is_macro = true;
+        rule.params = {"x"};
+      }
+    }
+
+    std::any dt = &data;
+    auto r = g["Grammar"].parse(s, n, dt, nullptr, log);
+
+    if (!r.ret) {
+      if (log) {
+        if (r.error_info.message_pos) {
+          auto line = line_info(s, r.error_info.message_pos);
+          log(line.first, line.second, r.error_info.message,
+              r.error_info.label);
+        } else {
+          auto line = line_info(s, r.error_info.error_pos);
+          log(line.first, line.second, "syntax error", r.error_info.label);
+        }
+      }
+      return {};
+    }
+
+    // User provided rules
+    for (auto [user_name, user_rule] : rules) {
+      auto name = user_name;
+      auto ignore = false;
+      if (!name.empty() && name[0] == '~') {
+        ignore = true;
+        name.erase(0, 1);
+      }
+      if (!name.empty()) {
+        auto &rule = grammar[name];
+        rule <= user_rule;
+        rule.name = name;
+        rule.ignoreSemanticValue = ignore;
+      }
+    }
+
+    // Check duplicated definitions
+    auto ret = true;
+
+    if (!data.duplicates_of_definition.empty()) {
+      for (const auto &[name, ptr] : data.duplicates_of_definition) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second,
+              "The definition '" + name + "' is already defined.", "");
+        }
+      }
+      ret = false;
+    }
+
+    // Check duplicated instructions
+    if (!data.duplicates_of_instruction.empty()) {
+      for (const auto &[type, ptr] : data.duplicates_of_instruction) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second,
+              "The instruction '" + type + "' is already defined.", "");
+        }
+      }
+      ret = false;
+    }
+
+    // Check undefined back references
+    if (!data.undefined_back_references.empty()) {
+      for (const auto &[name, ptr] : data.undefined_back_references) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second,
+              "The back reference '" + name + "' is undefined.", "");
+        }
+      }
+      ret = false;
+    }
+
+    // Set root definition
+    auto start = data.start;
+
+    if (!requested_start.empty()) {
+      if (grammar.count(requested_start)) {
+        start = requested_start;
+      } else {
+        if (log) {
+          auto line = line_info(s, s);
+          log(line.first, line.second,
+              "The specified start rule '" + requested_start + "' is undefined.",
+              "");
+        }
+        ret = false;
+      }
+    }
+
+    if (!ret) { return {}; }
+
+    auto &start_rule = grammar[start];
+
+    // Check if the start rule has ignore operator
+    {
+      if (start_rule.ignoreSemanticValue) {
+        if (log) {
+          auto line = line_info(s, start_rule.s_);
+          log(line.first, line.second,
+              "Ignore operator cannot be applied to '" + start_rule.name + "'.",
+              "");
+        }
+        ret = false;
+      }
+    }
+
+    if (!ret) { return {}; }
+
+    // Check missing definitions
+    auto referenced = std::unordered_set<std::string>{
+        WHITESPACE_DEFINITION_NAME,
+        WORD_DEFINITION_NAME,
+        RECOVER_DEFINITION_NAME,
+        start_rule.name,
+    };
+
+    for (auto &[_, rule] : grammar) {
+      ReferenceChecker vis(grammar, rule.params);
+      rule.accept(vis);
+      referenced.insert(vis.referenced.begin(), vis.referenced.end());
+      for (const auto &[name, ptr] : vis.error_s) {
+        if (log) {
+          auto line = line_info(s, ptr);
+          log(line.first, line.second, vis.error_message[name], "");
+        }
+        ret = false;
+      }
+    }
+
+    for (auto &[name, rule] : grammar) {
+      if (!referenced.count(name)) {
+        if (log) {
+          auto line = line_info(s, rule.s_);
+          auto msg = "'" + name + "' is not referenced.";
+          log(line.first, line.second, msg, "");
+        }
+      }
+    }
+
+    if (!ret) { return {}; }
+
+    // Link references
+    std::vector<Definition *> rule_list;
+    std::unordered_map<const Definition *, size_t> rule_ids;
+    for (auto &[_, rule] : grammar) {
+      rule_ids[&rule] = rule_list.size();
+      rule_list.push_back(&rule);
+    }
+
+    std::vector<std::vector<size_t>> reference_graph(rule_list.size());
+    for (size_t i = 0; i < rule_list.size(); i++) {
+      auto &rule = *rule_list[i];
+      LinkReferences vis(grammar, rule.params);
+      rule.accept(vis);
+      for (auto ref : vis.referenced) {
+        reference_graph[i].push_back(rule_ids[ref]);
+      }
+    }
+
+    // Only the rules the summaries suspect get the full checks
+    auto summary = summarize_rules(rule_list, rule_ids, reference_graph);
+
+    // Check left recursion
+    ret = true;
+
+    for (auto &[name, rule] : grammar) {
+      if (!summary.left_recursive.count(&rule)) { continue; }
+      DetectLeftRecursion vis(name);
+      rule.accept(vis);
+      if (vis.error_s) {
+        if (log) {
+          auto line = line_info(s, vis.error_s);
+          log(line.first, line.second, "'" + name + "' is left recursive.", "");
+        }
+        ret = false;
+      }
+    }
+
+    if (!ret) { return {}; }
+
+    // Check infinite loop
+    if (summary.has_empty_loop &&
+        detect_infiniteLoop(data, start_rule, log, s)) {
+      return {};
+    }
+
+    // Automatic whitespace skipping
+    if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
+      for (auto &x : grammar) {
+        auto &rule = x.second;
+        auto ope = rule.get_core_operator();
+        if (IsLiteralToken::check(*ope)) { rule <= tok(ope); }
+      }
+
+      auto &rule = grammar[WHITESPACE_DEFINITION_NAME];
+      start_rule.whitespaceOpe = wsp(rule.get_core_operator());
+
+      if (summary.has_empty_loop && detect_infiniteLoop(data, rule, log, s)) {
+        return {};
+      }
+    }
+
+    // Capture scopes are only maintained when the grammar (or a user provided
+    // rule, which may contain its own captures) needs them
+    start_rule.enableCaptures = data.enableCaptures || !rules.empty();
+
+    // Cuts (and recoveries, which act as cuts) let packrat parsing release
+    // memo entries the parser can no longer backtrack to
+    start_rule.enableCachePruning = data.enableCachePruning;
+
+    // Word expression
+    if (grammar.count(WORD_DEFINITION_NAME)) {
+      auto &rule = grammar[WORD_DEFINITION_NAME];
+      start_rule.wordOpe = rule.get_core_operator();
+
+      if (summary.has_empty_loop && detect_infiniteLoop(data, rule, log, s)) {
+        return {};
+      }
+    }
+
+    // Apply instructions
+    for (const auto &[name, instructions] : data.instructions) {
+      auto &rule = grammar[name];
+
+      for (const auto &instruction : instructions) {
+        if (instruction.type == "precedence") {
+          const auto &info =
+              std::any_cast<PrecedenceClimbing::BinOpeInfo>(instruction.data);
+
+          if (!apply_precedence_instruction(rule, info, s, log)) { return {}; }
+        } else if (instruction.type == "error_message") {
+          rule.error_message = std::any_cast<std::string>(instruction.data);
+        } else if (instruction.type == "no_ast_opt") {
+          rule.no_ast_opt = true;
+        }
+      }
+    }
+
+    return {data.grammar, start, data.enablePackratParsing};
+  }
+
+  struct GrammarSummary {
+    std::unordered_set<const Definition *> left_recursive; // May be
+    bool has_empty_loop = false;
+  };
+
+  // Summarizes each rule once, callees first, then finds the cycles of calls
+  // made before consuming input. Only mutually recursive rules are summarized
+  // again, until their nullability settles.
+  GrammarSummary summarize_rules(
+      const std::vector<Definition *> &rule_list,
+      const std::unordered_map<const Definition *, size_t> &rule_ids,
+      const std::vector<std::vector<size_t>> &reference_graph) const {
+    GrammarSummary result;
+    std::unordered_map<const Definition *, bool> nullable;
+    std::vector<std::vector<size_t>> left_graph(rule_list.size());
+
+    for (const auto &component :
+         strongly_connected_components(reference_graph)) {
+      auto changed = true;
+      while (changed) {
+        changed = false;
+        for (auto i : component) {
+          auto rule = rule_list[i];
+          SummarizeRule vis(nullable);
+          rule->accept(vis);
+
+          auto &edges = left_graph[i];
+          edges.clear();
+          for (auto ref : vis.left_referenced) {
+            edges.push_back(rule_ids.at(ref));
+          }
+          result.has_empty_loop |= vis.empty_loop;
+
+          auto it = nullable.find(rule);
+          if (it == nullable.end() || it->second != vis.nullable) {
+            nullable[rule] = vis.nullable;
+            changed = component.size() > 1 ||
+                      std::count(reference_graph[i].begin(),
+                                 reference_graph[i].end(), i);
+          }
+        }
+      }
+    }
+
+    for (const auto &component : strongly_connected_components(left_graph)) {
+      auto v = component[0];
+      if (component.size() > 1 ||
+          std::count(left_graph[v].begin(), left_graph[v].end(), v)) {
+        for (auto i : component) {
+          result.left_recursive.insert(rule_list[i]);
+        }
+      }
+    }
+
+    return result;
+  }
+
+  bool detect_infiniteLoop(const Data &data, Definition &rule, const Log &log,
+                           const char *s) const {
+    std::vector<std::pair<const char *, std::string>> refs;
+    std::unordered_map<std::string, bool> has_error_cache;
+    DetectInfiniteLoop vis(data.start_pos, rule.name, refs, has_error_cache);
+    rule.accept(vis);
+    if (vis.has_error) {
+      if (log) {
+        auto line = line_info(s, vis.error_s);
+        log(line.first, line.second,
+            "infinite loop is detected in '" + vis.error_name + "'.", "");
+      }
+      return true;
+    }
+    return false;
+  }
+
+  Grammar g;
+};
+
+/*-----------------------------------------------------------------------------
+ *  AST
+ *---------------------------------------------------------------------------*/
+
+/*
+ * Line, column and path of an AST node. They read like the plain fields they
+ * used to be, but take no space in the node: they sit in the padding after
+ * `is_token`, find their node from their own address, and look the value up
+ * in the node's line index.
+ */
+template <typename Node, bool Column> class AstLineField {
+public:
+  AstLineField() = default;
+  AstLineField(const AstLineField &) = delete;
+  AstLineField &operator=(const AstLineField &) = delete;
+
+  operator size_t() const {
+    auto info = Node::of(this).line_info();
+    return Column ? info.second : info.first;
+  }
+};
+
+template <typename Node> class AstPathField {
+public:
+  AstPathField() = default;
+  AstPathField(const AstPathField &) = delete;
+  AstPathField &operator=(const AstPathField &) = delete;
+
+  operator const std::string &() const { return Node::of(this).source_path(); }
+  const char *c_str() const { return Node::of(this).source_path().c_str(); }
+  bool empty() const { return Node::of(this).source_path().empty(); }
+};
+
+template <typename Annotation> struct AstBase : public Annotation {
+  AstBase(const LineIndex *line_index, const char *name,
+          const std::vector<std::shared_ptr<AstBase>> &nodes,
+          size_t position = 0, size_t length = 0, size_t choice_count = 0,
+          size_t choice = 0)
+      : line_index(line_index), name(name), position(position),
+        length(length), choice_count(choice_count), choice(choice),
+        original_name(name), original_choice_count(choice_count),
+        original_choice(choice), tag(str2tag(name)), original_tag(tag),
+        is_token(false), nodes(nodes) {}
+
+  AstBase(const LineIndex *line_index, const char *name,
+          const std::string_view &token, size_t position = 0, size_t length = 0,
+          size_t choice_count = 0, size_t choice = 0)
+      : line_index(line_index), name(name), position(position),
+        length(length), choice_count(choice_count), choice(choice),
+        original_name(name), original_choice_count(choice_count),
+        original_choice(choice), tag(str2tag(name)), original_tag(tag),
+        is_token(true), token(token) {}
+
+  AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
+          size_t length = 0, size_t original_choice_count = 0,
+          size_t original_choice = 0)
+      : line_index(ast.line_index), name(ast.name), position(position),
+        length(length), choice_count(ast.choice_count), choice(ast.choice),
+        original_name(original_name),
+        original_choice_count(original_choice_count),
+        original_choice(original_choice), tag(ast.tag),
+        original_tag(str2tag(original_name)), is_token(ast.is_token),
+        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+
+  AstBase(const AstBase &ast)
+      : Annotation(ast), line_index(ast.line_index), name(ast.name),
+        position(ast.position), length(ast.length),
+        choice_count(ast.choice_count), choice(ast.choice),
+        original_name(ast.original_name),
+        original_choice_count(ast.original_choice_count),
+        original_choice(ast.original_choice), tag(ast.tag),
+        original_tag(ast.original_tag), is_token(ast.is_token),
+        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+
+  // A copy of `ast` without children, for a copy of its source that
+  // `line_index` indexes
+  AstBase(const AstBase &ast, const LineIndex *line_index,
+          const std::string_view &token)
+      : Annotation(ast), line_index(line_index), name(ast.name),
+        position(ast.position), length(ast.length),
+        choice_count(ast.choice_count), choice(ast.choice),
+        original_name(ast.original_name),
+        original_choice_count(ast.original_choice_count),
+        original_choice(ast.original_choice), tag(ast.tag),
+        original_tag(ast.original_tag), is_token(ast.is_token), token(token) {}
+
+  // Line number and column are computed on demand from the line index of the
+  // parse, which the root of the AST owns (see keep_line_index). So a node
+  // must not outlive its root, as it must not outlive the source text for
+  // `token` anyway.
+  std::pair<size_t, size_t> line_info() const {
+    if (!line_index) { return std::pair(1, 1); }
+    return line_index->line_info(position);
+  }
+
+  const std::string &source_path() const {
+    static const std::string none;
+    return line_index ? line_index->path : none;
+  }
+
+  const LineIndex *const line_index;
+
+  const std::string name;
+  size_t position;
+  size_t length;
+  const size_t choice_count;
+  const size_t choice;
+  const std::string original_name;
+  const size_t original_choice_count;
+  const size_t original_choice;
+  const unsigned int tag;
+  const unsigned int original_tag;
+
+  const bool is_token;
+  const AstLineField<AstBase, false> line;
+  const AstLineField<AstBase, true> column;
+  const AstPathField<AstBase> path;
+  const std::string_view token;
+
+  std::vector<std::shared_ptr<AstBase<Annotation>>> nodes;
+  std::weak_ptr<AstBase<Annotation>> parent;
+
+  std::string token_to_string() const {
+    assert(is_token);
+    return std::string(token);
+  }
+
+  template <typename T> T token_to_number() const {
+    return token_to_number_<T>(token);
+  }
+
+private:
+  friend class AstLineField<AstBase, false>;
+  friend class AstLineField<AstBase, true>;
+  friend class AstPathField<AstBase>;
+
+  // The node a field is a member of. AstBase isn't standard-layout, but it
+  // has no virtual bases, which is what offsetof can't handle.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+#endif
+  template <typename Field> static const AstBase &of(const Field *field) {
+    size_t offset;
+    if constexpr (std::is_same_v<Field, AstLineField<AstBase, false>>) {
+      offset = offsetof(AstBase, line);
+    } else if constexpr (std::is_same_v<Field, AstLineField<AstBase, true>>) {
+      offset = offsetof(AstBase, column);
+    } else {
+      offset = offsetof(AstBase, path);
+    }
+    return *reinterpret_cast<const AstBase *>(
+        reinterpret_cast<const char *>(field) - offset);
+  }
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+};
+
+// Copies an AST parsed from `from` onto the same text at `to`, so that its
+// tokens and line numbers refer to `to`. Shared subtrees stay shared.
+template <typename T>
+std::shared_ptr<T> rebase_ast(const std::shared_ptr<T> &ast, const char *from,
+                              const char *to, size_t n, const char *path) {
+  auto line_index = std::make_shared<LineIndex>(path, to, n);
+  std::unordered_map<const T *, std::shared_ptr<T>> copies;
+
+  std::function<std::shared_ptr<T>(const std::shared_ptr<T> &)> copy;
+  copy = [&](const std::shared_ptr<T> &node) {
+    // Only a node with several owners can be reached twice
+    auto shared = node.use_count() > 1;
+    if (shared) {
+      auto it = copies.find(node.get());
+      if (it != copies.end()) { return it->second; }
+    }
+
+    auto token = node->is_token
+                     ? std::string_view(to + (node->token.data() - from),
+                                        node->token.size())
+                     : std::string_view();
+    auto result = std::make_shared<T>(*node, line_index.get(), token);
+    if (shared) { copies.emplace(node.get(), result); }
+    result->nodes.reserve(node->nodes.size());
+    for (const auto &child : node->nodes) {
+      auto child_copy = copy(child);
+      if (child->parent.lock() == node) { child_copy->parent = result; }
+      result->nodes.push_back(std::move(child_copy));
+    }
+    return result;
+  };
+  if (!ast) { return ast; }
+  auto root = copy(ast);
+  keep_line_index(root, line_index);
+  return root;
+}
+
+template <typename T>
+void ast_to_s_core(const std::shared_ptr<T> &ptr, std::string &s, int level,
+                   std::function<std::string(const T &ast, int level)> fn) {
+  const auto &ast = *ptr;
+  for (auto i = 0; i < level; i++) {
+    s += "  ";
+  }
+  auto name = ast.original_name;
+  if (ast.original_choice_count > 0) {
+    name += "/" + std::to_string(ast.original_choice);
+  }
+  if (ast.name != ast.original_name) { name += "[" + ast.name + "]"; }
+  if (ast.is_token) {
+    s += "- " + name + " (";
+    s += ast.token;
+    s += ")\n";
+  } else {
+    s += "+ " + name + "\n";
+  }
+  if (fn) { s += fn(ast, level + 1); }
+  for (auto node : ast.nodes) {
+    ast_to_s_core(node, s, level + 1, fn);
+  }
+}
+
+template <typename T>
+std::string
+ast_to_s(const std::shared_ptr<T> &ptr,
+         std::function<std::string(const T &ast, int level)> fn = nullptr) {
+  std::string s;
+  ast_to_s_core(ptr, s, 0, fn);
+  return s;
+}
+
+struct AstOptimizer {
+  AstOptimizer(bool mode, const std::vector<std::string> &rules = {})
+      : mode_(mode), rules_(rules) {}
+
+  template <typename T>
+  std::shared_ptr<T> optimize(std::shared_ptr<T> original,
+                              std::shared_ptr<T> parent = nullptr) {
+    auto found =
+        std::find(rules_.begin(), rules_.end(), original->name) != rules_.end();
+    auto opt = mode_ ? !found : found;
+
+    if (opt && original->nodes.size() == 1) {
+      auto child = optimize(original->nodes[0], parent);
+      auto ast = std::make_shared<T>(*child, original->name.data(),
+                                     original->position, original->length,
+                                     original->choice_count, original->choice);
+      for (auto node : ast->nodes) {
+        node->parent = ast;
+      }
+      return ast;
+    }
+
+    auto ast = std::make_shared<T>(*original);
+    ast->parent = parent;
+    ast->nodes.clear();
+    for (auto node : original->nodes) {
+      auto child = optimize(node, ast);
+      ast->nodes.push_back(child);
+    }
+    return ast;
+  }
+
+private:
+  const bool mode_;
+  const std::vector<std::string> rules_;
+};
+
+/*
+ * Hash-consing for the AST builder: token nodes with the same rule, choice
+ * and token, and other nodes with the same rule, choice and children, are
+ * made once per parse and shared. Since a shared node has several parents,
+ * `parent` is left empty, and the position, line and column of a node are
+ * those of its first occurrence.
+ */
+template <typename T> class SharedAstNodes {
+public:
+  static SharedAstNodes &of(const SemanticValues &vs) {
+    auto &any = vs.shared_ast_nodes();
+    auto nodes = std::any_cast<SharedAstNodes>(&any);
+    if (!nodes) { nodes = &any.emplace<SharedAstNodes>(); }
+    return *nodes;
+  }
+
+  std::shared_ptr<T> token(const Definition &rule, const SemanticValues &vs) {
+    auto token = vs.token();
+    auto hash = hash_of(rule, vs, std::hash<std::string_view>{}(token));
+    for (auto [it, end] = table_.equal_range(hash); it != end; ++it) {
+      const auto &ast = *it->second;
+      if (ast.is_token && same(ast, rule, vs) && ast.token == token) {
+        return it->second;
+      }
+    }
+
+    vs.account_memory(MemoryCategory::Ast, sizeof(T) + entry_size);
+    auto ast = std::make_shared<T>(
+        vs.line_index().get(), rule.name.data(), token,
+        std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
+        vs.choice_count(), vs.choice());
+    table_.emplace(hash, ast);
+    return ast;
+  }
+
+  std::shared_ptr<T> node(const Definition &rule, const SemanticValues &vs,
+                          const std::vector<std::shared_ptr<T>> &nodes) {
+    // Children are shared already, so they are compared by address
+    size_t seed = nodes.size();
+    for (const auto &node : nodes) {
+      seed = combine(seed, std::hash<const T *>{}(node.get()));
+    }
+    auto hash = hash_of(rule, vs, seed);
+    for (auto [it, end] = table_.equal_range(hash); it != end; ++it) {
+      const auto &ast = *it->second;
+      if (!ast.is_token && same(ast, rule, vs) && ast.nodes == nodes) {
+        return it->second;
+      }
+    }
+
+    auto ast = std::make_shared<T>(
+        vs.line_index().get(), rule.name.data(), nodes,
+        std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
+        vs.choice_count(), vs.choice());
+    vs.account_memory(MemoryCategory::Ast,
+                      sizeof(T) + entry_size +
+                          ast->nodes.capacity() * sizeof(std::shared_ptr<T>));
+    table_.emplace(hash, ast);
+    return ast;
+  }
+
+private:
+  using Table = std::unordered_multimap<size_t, std::shared_ptr<T>>;
+
+  // A table node: the entry and the bucket and next pointers
+  static constexpr size_t entry_size =
+      sizeof(typename Table::value_type) + 2 * sizeof(void *);
+
+  static size_t combine(size_t h, size_t v) {
+    return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2));
+  }
+
+  static size_t hash_of(const Definition &rule, const SemanticValues &vs,
+                        size_t seed) {
+    auto h = std::hash<const Definition *>{}(&rule);
+    h = combine(h, vs.choice_count());
+    h = combine(h, vs.choice());
+    return combine(h, seed);
+  }
+
+  static bool same(const T &ast, const Definition &rule,
+                   const SemanticValues &vs) {
+    return ast.choice_count == vs.choice_count() && ast.choice == vs.choice() &&
+           ast.name == rule.name;
+  }
+
+  Table table_;
+};
+
+struct EmptyType {};
+using Ast = AstBase<EmptyType>;
+
+// With share_subtrees, identical nodes are shared (see SharedAstNodes)
+template <typename T = Ast>
+void add_ast_action(Definition &rule, bool share_subtrees = false) {
+  rule.action = [&rule, share_subtrees](const SemanticValues &vs) {
+    if (share_subtrees) {
+      auto &shared = SharedAstNodes<T>::of(vs);
+      if (rule.is_token()) { return shared.token(rule, vs); }
+      return shared.node(rule, vs, vs.transform<std::shared_ptr<T>>());
+    }
+
+    // Nodes dropped on backtracking are not subtracted again
+    if (rule.is_token()) {
+      vs.account_memory(MemoryCategory::Ast, sizeof(T));
+      return std::make_shared<T>(
+          vs.line_index().get(), rule.name.data(), vs.token(),
+          std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
+          vs.choice_count(), vs.choice());
+    }
+
+    auto ast = std::make_shared<T>(
+        vs.line_index().get(), rule.name.data(),
+        vs.transform<std::shared_ptr<T>>(),
+        std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
+        vs.choice_count(), vs.choice());
+    vs.account_memory(MemoryCategory::Ast,
+                      sizeof(T) + ast->nodes.capacity() *
+                                      sizeof(std::shared_ptr<T>));
+
+    for (auto node : ast->nodes) {
+      node->parent = ast;
+    }
+    return ast;
+  };
+}
+
+/*
+ * Binary AST format, for caching parse results between runs. A file holds a
+ * header, a node table, the children lists, and a string table of the rule
+ * names. Tokens are stored as offsets into the source text, which is kept
+ * separately. Shared subtrees are stored once. Numbers are 32-bit, in the
+ * byte order of the machine that wrote the file.
+ */
+struct AstFileHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t node_count;
+  uint32_t child_count;
+  uint32_t string_count;
+  uint32_t string_bytes;
+  uint32_t source_length;
+};
+
+struct AstFileNode {
+  uint32_t name;
+  uint32_t original_name;
+  uint32_t choice_count;
+  uint32_t choice;
+  uint32_t original_choice_count;
+  uint32_t original_choice;
+  uint32_t position;
+  uint32_t length;
+  uint32_t is_token;
+  uint32_t token_offset;
+  uint32_t token_length;
+  uint32_t first_child; // Index into the children lists
+  uint32_t child_count;
+};
+
+static const char AST_FILE_MAGIC[8] = {'P', 'E', 'G', 'A', 'S', 'T', '0', '1'};
+static const uint32_t AST_FILE_BYTE_ORDER = 0x01020304;
+
+// Returns an empty string if the AST doesn't fit in the format, or has a
+// token outside of the source. The root is node 0, and every node comes
+// after all of its parents.
+template <typename T>
+std::string serialize_ast(const std::shared_ptr<T> &ast,
+                          std::string_view source) {
+  constexpr size_t max = (std::numeric_limits<uint32_t>::max)();
+  if (!ast || source.size() > max) { return std::string(); }
+
+  // Counts the parents of each node, as a node may be shared
+  std::vector<const T *> found{ast.get()};
+  std::unordered_map<const T *, size_t> parents{{ast.get(), 0}};
+  for (size_t i = 0; i < found.size(); i++) {
+    for (const auto &child : found[i]->nodes) {
+      auto [it, inserted] = parents.emplace(child.get(), 0);
+      if (inserted) { found.push_back(child.get()); }
+      it->second++;
+    }
+  }
+  if (found.size() > max) { return std::string(); }
+
+  // Breadth first, but a shared node only after its last parent
+  std::vector<const T *> order{ast.get()};
+  std::unordered_map<const T *, uint32_t> indices{{ast.get(), 0}};
+  for (size_t i = 0; i < order.size(); i++) {
+    for (const auto &child : order[i]->nodes) {
+      if (--parents[child.get()] == 0) {
+        indices.emplace(child.get(), static_cast<uint32_t>(order.size()));
+        order.push_back(child.get());
+      }
+    }
+  }
+
+  std::vector<uint32_t> children;
+  std::vector<std::string_view> strings;
+  std::unordered_map<std::string_view, uint32_t> string_ids;
+  std::vector<AstFileNode> nodes;
+
+  auto intern = [&](const std::string &s) {
+    auto [it, inserted] =
+        string_ids.emplace(s, static_cast<uint32_t>(strings.size()));
+    if (inserted) { strings.push_back(s); }
+    return it->second;
+  };
+
+  // A node's children are listed together
+  for (size_t i = 0; i < order.size(); i++) {
+    const auto &node = *order[i];
+    if (children.size() > max) { return std::string(); }
+
+    AstFileNode rec{};
+    rec.name = intern(node.name);
+    rec.original_name = intern(node.original_name);
+    rec.choice_count = static_cast<uint32_t>(node.choice_count);
+    rec.choice = static_cast<uint32_t>(node.choice);
+    rec.original_choice_count =
+        static_cast<uint32_t>(node.original_choice_count);
+    rec.original_choice = static_cast<uint32_t>(node.original_choice);
+    rec.position = static_cast<uint32_t>(node.position);
+    rec.length = static_cast<uint32_t>(node.length);
+    if (node.position > source.size() ||
+        node.length > source.size() - node.position) {
+      return std::string();
+    }
+
+    if (node.is_token) {
+      auto offset = node.token.data() - source.data();
+      if (offset < 0 || static_cast<size_t>(offset) > source.size() ||
+          node.token.size() > source.size() - static_cast<size_t>(offset)) {
+        return std::string();
+      }
+      rec.is_token = 1;
+      rec.token_offset = static_cast<uint32_t>(offset);
+      rec.token_length = static_cast<uint32_t>(node.token.size());
+    }
+
+    rec.first_child = static_cast<uint32_t>(children.size());
+    rec.child_count = static_cast<uint32_t>(node.nodes.size());
+    for (const auto &child : node.nodes) {
+      children.push_back(indices[child.get()]);
+    }
+    nodes.push_back(rec);
+  }
+
+  std::vector<uint32_t> string_offsets{0};
+  size_t string_bytes = 0;
+  for (auto s : strings) {
+    string_bytes += s.size();
+    if (string_bytes > max) { return std::string(); }
+    string_offsets.push_back(static_cast<uint32_t>(string_bytes));
+  }
+
+  AstFileHeader header{};
+  std::memcpy(header.magic, AST_FILE_MAGIC, sizeof(header.magic));
+  header.byte_order = AST_FILE_BYTE_ORDER;
+  header.node_count = static_cast<uint32_t>(nodes.size());
+  header.child_count = static_cast<uint32_t>(children.size());
+  header.string_count = static_cast<uint32_t>(strings.size());
+  header.string_bytes = static_cast<uint32_t>(string_bytes);
+  header.source_length = static_cast<uint32_t>(source.size());
+
+  std::string out;
+  out.reserve(sizeof(header) + nodes.size() * sizeof(AstFileNode) +
+              (children.size() + string_offsets.size()) * sizeof(uint32_t) +
+              string_bytes);
+  auto append = [&](const void *p, size_t n) {
+    out.append(static_cast<const char *>(p), n);
+  };
+  append(&header, sizeof(header));
+  append(nodes.data(), nodes.size() * sizeof(AstFileNode));
+  append(children.data(), children.size() * sizeof(uint32_t));
+  append(string_offsets.data(), string_offsets.size() * sizeof(uint32_t));
+  for (auto s : strings) {
+    out += s;
+  }
+  return out;
+}
+
+/*
+ * A read-only AST over a buffer in the binary AST format, such as a
+ * MappedFile. Opening one only checks the header and the section sizes, and
+ * nodes are read in place, so it takes the same time for any AST. Both the
+ * buffer and the source text must outlive the view. Call validate() before
+ * walking a file that may be damaged.
+ */
+class AstView {
+public:
+  class Node {
+  public:
+    std::string_view name() const { return view_->string(rec().name); }
+    std::string_view original_name() const {
+      return view_->string(rec().original_name);
+    }
+    size_t position() const { return rec().position; }
+    size_t length() const { return rec().length; }
+    size_t choice_count() const { return rec().choice_count; }
+    size_t choice() const { return rec().choice; }
+    size_t original_choice_count() const {
+      return rec().original_choice_count;
+    }
+    size_t original_choice() const { return rec().original_choice; }
+    unsigned int tag() const { return str2tag(name()); }
+    unsigned int original_tag() const { return str2tag(original_name()); }
+
+    bool is_token() const { return rec().is_token != 0; }
+    std::string_view token() const {
+      return view_->source_.substr(rec().token_offset, rec().token_length);
+    }
+    std::string token_to_string() const {
+      assert(is_token());
+      return std::string(token());
+    }
+    template <typename T> T token_to_number() const {
+      return token_to_number_<T>(token());
+    }
+
+    std::pair<size_t, size_t> line_info() const {
+      return view_->line_index_->line_info(position());
+    }
+    size_t line() const { return line_info().first; }
+    size_t column() const { return line_info().second; }
+
+    // Children
+    size_t size() const { return rec().child_count; }
+    bool empty() const { return size() == 0; }
+    Node operator[](size_t i) const {
+      return Node(view_, view_->children_[rec().first_child + i]);
+    }
+
+    size_t index() const { return index_; }
+
+  private:
+    friend class AstView;
+
+    Node(const AstView *view, size_t index) : view_(view), index_(index) {}
+
+    const AstFileNode &rec() const { return view_->nodes_[index_]; }
+
+    const AstView *view_;
+    size_t index_;
+  };
+
+  AstView(std::string_view data, std::string_view source,
+          const char *path = nullptr)
+      : source_(source),
+        line_index_(
+            std::make_shared<LineIndex>(path, source.data(), source.size())) {
+    AstFileHeader header;
+    if (data.size() < sizeof(header) ||
+        reinterpret_cast<uintptr_t>(data.data()) % alignof(AstFileNode)) {
+      return;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, AST_FILE_MAGIC, sizeof(header.magic)) ||
+        header.byte_order != AST_FILE_BYTE_ORDER || header.node_count == 0 ||
+        header.source_length != source.size()) {
+      return;
+    }
+
+    uint64_t size = sizeof(header);
+    auto nodes_at = size;
+    size += uint64_t(header.node_count) * sizeof(AstFileNode);
+    auto children_at = size;
+    size += uint64_t(header.child_count) * sizeof(uint32_t);
+    auto offsets_at = size;
+    size += (uint64_t(header.string_count) + 1) * sizeof(uint32_t);
+    auto strings_at = size;
+    size += header.string_bytes;
+    if (size != data.size()) { return; }
+
+    auto p = data.data();
+    nodes_ = reinterpret_cast<const AstFileNode *>(p + nodes_at);
+    children_ = reinterpret_cast<const uint32_t *>(p + children_at);
+    string_offsets_ = reinterpret_cast<const uint32_t *>(p + offsets_at);
+    strings_ = p + strings_at;
+    header_ = header;
+    ok_ = true;
+  }
+
+  operator bool() const { return ok_; }
+
+  Node root() const {
+    assert(ok_);
+    return Node(this, 0);
+  }
+
+  size_t node_count() const { return ok_ ? header_.node_count : 0; }
+
+  // Checks every index and offset in the file, in time linear in its size
+  bool validate() const {
+    if (!ok_) { return false; }
+    for (uint32_t i = 0; i < header_.string_count; i++) {
+      if (string_offsets_[i] > string_offsets_[i + 1]) { return false; }
+    }
+    if (string_offsets_[0] != 0 ||
+        string_offsets_[header_.string_count] != header_.string_bytes) {
+      return false;
+    }
+    // The children lists follow each other in node order, and a child comes
+    // after its parent, so a walk from the root always ends
+    uint64_t next_child = 0;
+    for (uint32_t i = 0; i < header_.node_count; i++) {
+      const auto &rec = nodes_[i];
+      if (rec.name >= header_.string_count ||
+          rec.original_name >= header_.string_count ||
+          uint64_t(rec.position) + rec.length > source_.size() ||
+          uint64_t(rec.token_offset) + rec.token_length > source_.size() ||
+          rec.first_child != next_child ||
+          next_child + rec.child_count > header_.child_count) {
+        return false;
+      }
+      for (uint32_t j = 0; j < rec.child_count; j++) {
+        auto child = children_[rec.first_child + j];
+        if (child <= i || child >= header_.node_count) { return false; }
+      }
+      next_child += rec.child_count;
+    }
+    return next_child == header_.child_count;
+  }
+
+private:
+  std::string_view string(uint32_t id) const {
+    auto begin = string_offsets_[id];
+    return std::string_view(strings_ + begin, string_offsets_[id + 1] - begin);
+  }
+
+  std::string_view source_;
+  std::shared_ptr<LineIndex> line_index_;
+  AstFileHeader header_{};
+  const AstFileNode *nodes_ = nullptr;
+  const uint32_t *children_ = nullptr;
+  const uint32_t *string_offsets_ = nullptr;
+  const char *strings_ = nullptr;
+  bool ok_ = false;
+};
+
+inline void ast_to_s_core(const AstView::Node &ast, std::string &s,
+                          int level) {
+  for (auto i = 0; i < level; i++) {
+    s += "  ";
+  }
+  auto name = std::string(ast.original_name());
+  if (ast.original_choice_count() > 0) {
+    name += "/" + std::to_string(ast.original_choice());
+  }
+  if (ast.name() != ast.original_name()) {
+    name += "[" + std::string(ast.name()) + "]";
+  }
+  if (ast.is_token()) {
+    s += "- " + name + " (";
+    s += ast.token();
+    s += ")\n";
+  } else {
+    s += "+ " + name + "\n";
+  }
+  for (size_t i = 0; i < ast.size(); i++) {
+    ast_to_s_core(ast[i], s, level + 1);
+  }
+}
+
+inline std::string ast_to_s(const AstView &view) {
+  std::string s;
+  if (view) { ast_to_s_core(view.root(), s, 0); }
+  return s;
+}
+
+/*
+ * A read-only file mapped into memory, or read into a buffer where mmap
+ * isn't available.
+ */
+class MappedFile {
+public:
+  MappedFile(const char *path) {
+#if defined(CPPPEGLIB_MMAP)
+    auto fd = ::open(path, O_RDONLY);
+    if (fd < 0) { return; }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      auto size = static_cast<size_t>(st.st_size);
+      auto addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr != MAP_FAILED) {
+        data_ = static_cast<const char *>(addr);
+        size_ = size;
+      }
+    }
+    ::close(fd);
+#else
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) { return; }
+    buffer_.assign(std::istreambuf_iterator<char>(ifs),
+                   std::istreambuf_iterator<char>());
+    if (!ifs.bad() && !buffer_.empty()) {
+      data_ = buffer_.data();
+      size_ = buffer_.size();
+    }
+#endif
+  }
+
+  ~MappedFile() {
+#if defined(CPPPEGLIB_MMAP)
+    if (data_) { ::munmap(const_cast<char *>(data_), size_); }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  operator bool() const { return data_ != nullptr; }
+
+  std::string_view view() const { return std::string_view(data_, size_); }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+#if !defined(CPPPEGLIB_MMAP)
+  std::string buffer_;
+#endif
+};
+
+#define PEG_EXPAND(...) __VA_ARGS__
+#define PEG_CONCAT(a, b) a##b
+#define PEG_CONCAT2(a, b) PEG_CONCAT(a, b)
+
+#define PEG_PICK(                                                              \
+    a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16, \
+    a17, a18, a19, a20, a21, a22, a23, a24, a25, a26, a27, a28, a29, a30, a31, \
+    a32, a33, a34, a35, a36, a37, a38, a39, a40, a41, a42, a43, a44, a45, a46, \
+    a47, a48, a49, a50, a51, a52, a53, a54, a55, a56, a57, a58, a59, a60, a61, \
+    a62, a63, a64, a65, a66, a67, a68, a69, a70, a71, a72, a73, a74, a75, a76, \
+    a77, a78, a79, a80, a81, a82, a83, a84, a85, a86, a87, a88, a89, a90, a91, \
+    a92, a93, a94, a95, a96, a97, a98, a99, a100, ...)                         \
+  a100
+
+#define PEG_COUNT(...)                                                         \
+  PEG_EXPAND(PEG_PICK(                                                         \
+      __VA_ARGS__, 100, 99, 98, 97, 96, 95, 94, 93, 92, 91, 90, 89, 88, 87,    \
+      86, 85, 84, 83, 82, 81, 80, 79, 78, 77, 76, 75, 74, 73, 72, 71, 70, 69,  \
+      68, 67, 66, 65, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51,  \
+      50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33,  \
+      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,  \
+      14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))
+
+#define PEG_DEF_1(r)                                                           \
+  peg::Definition r;                                                           \
+  r.name = #r;                                                                 \
+  peg::add_ast_action(r);
+
+#define PEG_DEF_2(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_1(__VA_ARGS__))
+#define PEG_DEF_3(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_2(__VA_ARGS__))
+#define PEG_DEF_4(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_3(__VA_ARGS__))
+#define PEG_DEF_5(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_4(__VA_ARGS__))
+#define PEG_DEF_6(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_5(__VA_ARGS__))
+#define PEG_DEF_7(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_6(__VA_ARGS__))
+#define PEG_DEF_8(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_7(__VA_ARGS__))
+#define PEG_DEF_9(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_8(__VA_ARGS__))
+#define PEG_DEF_10(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_9(__VA_ARGS__))
+#define PEG_DEF_11(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_10(__VA_ARGS__))
+#define PEG_DEF_12(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_11(__VA_ARGS__))
+#define PEG_DEF_13(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_12(__VA_ARGS__))
+#define PEG_DEF_14(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_13(__VA_ARGS__))
+#define PEG_DEF_15(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_14(__VA_ARGS__))
+#define PEG_DEF_16(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_15(__VA_ARGS__))
+#define PEG_DEF_17(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_16(__VA_ARGS__))
+#define PEG_DEF_18(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_17(__VA_ARGS__))
+#define PEG_DEF_19(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_18(__VA_ARGS__))
+#define PEG_DEF_20(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_19(__VA_ARGS__))
+#define PEG_DEF_21(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_20(__VA_ARGS__))
+#define PEG_DEF_22(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_21(__VA_ARGS__))
+#define PEG_DEF_23(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_22(__VA_ARGS__))
+#define PEG_DEF_24(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_23(__VA_ARGS__))
+#define PEG_DEF_25(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_24(__VA_ARGS__))
+#define PEG_DEF_26(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_25(__VA_ARGS__))
+#define PEG_DEF_27(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_26(__VA_ARGS__))
+#define PEG_DEF_28(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_27(__VA_ARGS__))
+#define PEG_DEF_29(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_28(__VA_ARGS__))
+#define PEG_DEF_30(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_29(__VA_ARGS__))
+#define PEG_DEF_31(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_30(__VA_ARGS__))
+#define PEG_DEF_32(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_31(__VA_ARGS__))
+#define PEG_DEF_33(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_32(__VA_ARGS__))
+#define PEG_DEF_34(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_33(__VA_ARGS__))
+#define PEG_DEF_35(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_34(__VA_ARGS__))
+#define PEG_DEF_36(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_35(__VA_ARGS__))
+#define PEG_DEF_37(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_36(__VA_ARGS__))
+#define PEG_DEF_38(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_37(__VA_ARGS__))
+#define PEG_DEF_39(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_38(__VA_ARGS__))
+#define PEG_DEF_40(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_39(__VA_ARGS__))
+#define PEG_DEF_41(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_40(__VA_ARGS__))
+#define PEG_DEF_42(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_41(__VA_ARGS__))
+#define PEG_DEF_43(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_42(__VA_ARGS__))
+#define PEG_DEF_44(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_43(__VA_ARGS__))
+#define PEG_DEF_45(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_44(__VA_ARGS__))
+#define PEG_DEF_46(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_45(__VA_ARGS__))
+#define PEG_DEF_47(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_46(__VA_ARGS__))
+#define PEG_DEF_48(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_47(__VA_ARGS__))
+#define PEG_DEF_49(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_48(__VA_ARGS__))
+#define PEG_DEF_50(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_49(__VA_ARGS__))
+#define PEG_DEF_51(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_50(__VA_ARGS__))
+#define PEG_DEF_52(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_51(__VA_ARGS__))
+#define PEG_DEF_53(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_52(__VA_ARGS__))
+#define PEG_DEF_54(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_53(__VA_ARGS__))
+#define PEG_DEF_55(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_54(__VA_ARGS__))
+#define PEG_DEF_56(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_55(__VA_ARGS__))
+#define PEG_DEF_57(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_56(__VA_ARGS__))
+#define PEG_DEF_58(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_57(__VA_ARGS__))
+#define PEG_DEF_59(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_58(__VA_ARGS__))
+#define PEG_DEF_60(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_59(__VA_ARGS__))
+#define PEG_DEF_61(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_60(__VA_ARGS__))
+#define PEG_DEF_62(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_61(__VA_ARGS__))
+#define PEG_DEF_63(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_62(__VA_ARGS__))
+#define PEG_DEF_64(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_63(__VA_ARGS__))
+#define PEG_DEF_65(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_64(__VA_ARGS__))
+#define PEG_DEF_66(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_65(__VA_ARGS__))
+#define PEG_DEF_67(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_66(__VA_ARGS__))
+#define PEG_DEF_68(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_67(__VA_ARGS__))
+#define PEG_DEF_69(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_68(__VA_ARGS__))
+#define PEG_DEF_70(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_69(__VA_ARGS__))
+#define PEG_DEF_71(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_70(__VA_ARGS__))
+#define PEG_DEF_72(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_71(__VA_ARGS__))
+#define PEG_DEF_73(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_72(__VA_ARGS__))
+#define PEG_DEF_74(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_73(__VA_ARGS__))
+#define PEG_DEF_75(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_74(__VA_ARGS__))
+#define PEG_DEF_76(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_75(__VA_ARGS__))
+#define PEG_DEF_77(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_76(__VA_ARGS__))
+#define PEG_DEF_78(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_77(__VA_ARGS__))
+#define PEG_DEF_79(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_78(__VA_ARGS__))
+#define PEG_DEF_80(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_79(__VA_ARGS__))
+#define PEG_DEF_81(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_80(__VA_ARGS__))
+#define PEG_DEF_82(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_81(__VA_ARGS__))
+#define PEG_DEF_83(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_82(__VA_ARGS__))
+#define PEG_DEF_84(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_83(__VA_ARGS__))
+#define PEG_DEF_85(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_84(__VA_ARGS__))
+#define PEG_DEF_86(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_85(__VA_ARGS__))
+#define PEG_DEF_87(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_86(__VA_ARGS__))
+#define PEG_DEF_88(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_87(__VA_ARGS__))
+#define PEG_DEF_89(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_88(__VA_ARGS__))
+#define PEG_DEF_90(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_89(__VA_ARGS__))
+#define PEG_DEF_91(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_90(__VA_ARGS__))
+#define PEG_DEF_92(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_91(__VA_ARGS__))
+#define PEG_DEF_93(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_92(__VA_ARGS__))
+#define PEG_DEF_94(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_93(__VA_ARGS__))
+#define PEG_DEF_95(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_94(__VA_ARGS__))
+#define PEG_DEF_96(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_95(__VA_ARGS__))
+#define PEG_DEF_97(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_96(__VA_ARGS__))
+#define PEG_DEF_98(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_97(__VA_ARGS__))
+#define PEG_DEF_99(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_98(__VA_ARGS__))
+#define PEG_DEF_100(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_99(__VA_ARGS__))
+
+#define AST_DEFINITIONS(...)                                                   \
+  PEG_EXPAND(PEG_CONCAT2(PEG_DEF_, PEG_COUNT(__VA_ARGS__))(__VA_ARGS__))
+
+/*-----------------------------------------------------------------------------
+ *  parser
+ *---------------------------------------------------------------------------*/
+
+struct CutSuggestion {
+  std::string rule;
+  size_t line;
+  size_t column;
+  size_t alternative; // 0 based index in the choice
+};
+
+/*
+ * Whether parse values of type T own all of their data, so that ParseCache
+ * may keep them once the input is gone. True for arithmetic types, enums and
+ * std::string. Specialize it as std::true_type for a type that holds no
+ * string_view, pointer or std::any, directly or in its members.
+ */
+template <typename T>
+struct parse_cache_owns
+    : std::bool_constant<std::is_arithmetic_v<T> || std::is_enum_v<T> ||
+                         std::is_same_v<T, std::string>> {};
 
-    g["Prefix"] = [&](const SemanticValues &vs) {
-      std::shared_ptr<Ope> ope;
-      if (vs.size() == 1) {
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      } else {
-        assert(vs.size() == 2);
-        auto tok = std::any_cast<char>(vs[0]);
-        ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
-        if (tok == '&') {
-          ope = apd(ope);
-        } else { // '!'
-          ope = npd(ope);
+/*
+ * Values of successful parses, keyed by a hash of the grammar, the path and
+ * the input (see parser::enable_parse_cache). Entries keep a copy of the
+ * input, which a hit is checked against. Only values that own their data
+ * are cached (see parse_cache_owns), and ASTs.
+ *
+ * An AST is stored rebased onto the entry's copy of the input, and each hit
+ * gets its own copy rebased onto the caller's input, as if it had been
+ * parsed from it. That copy takes time linear in the number of nodes, which
+ * bench_cache measures at about a fifth of a parse. Least recently used
+ * entries are evicted past the byte limit.
+ */
+class ParseCache {
+public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  using ValueSize = std::function<size_t(const std::any &value)>;
+
+  ParseCache(size_t max_bytes, ValueSize value_size)
+      : max_bytes_(max_bytes), value_size_(std::move(value_size)) {}
+
+  // Whether values of type T can be cached (no value at all, for nullptr_t)
+  template <typename T> static constexpr bool can_cache() {
+    if constexpr (std::is_same_v<T, std::nullptr_t> || is_ast<T>::value) {
+      return true;
+    } else {
+      return parse_cache_owns<T>::value && std::is_copy_constructible_v<T>;
+    }
+  }
+
+  static Hash128 key(uint64_t grammar, const char *path, const char *s,
+                     size_t n) {
+    auto seed = grammar * 0x9e3779b97f4a7c15ull;
+    if (path) { seed ^= std::hash<std::string_view>{}(path); }
+    return hash128(s, n, seed);
+  }
+
+  // Sets `val`, unless it is null, to the value stored for the input. An
+  // entry without a value of type T is a miss.
+  template <typename T>
+  bool find(const Hash128 &key, const char *s, size_t n, const char *path,
+            T *val) {
+    // A stored AST is never changed, so it is copied after unlocking
+    std::shared_ptr<const std::string> input;
+    std::conditional_t<is_ast<T>::value, T, std::nullptr_t> ast{};
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = index_.find(key);
+      if (it == index_.end() || !matches(*it->second, s, n, path) ||
+          (val && !std::any_cast<T>(&it->second->value))) {
+        stats_.misses++;
+        return false;
+      }
+      if (val) {
+        if constexpr (is_ast<T>::value) {
+          input = it->second->input;
+          ast = *std::any_cast<T>(&it->second->value);
+        } else {
+          *val = *std::any_cast<T>(&it->second->value);
         }
       }
-      return ope;
-    };
+      lru_.splice(lru_.begin(), lru_, it->second);
+      stats_.hits++;
+    }
+    if constexpr (is_ast<T>::value) {
+      if (val) { *val = rebase_ast(ast, input->data(), s, n, path); }
+    }
+    return true;
+  }
 
-    g["SuffixWithLabel"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      if (vs.size() == 1) {
-        return ope;
-      } else {
-        assert(vs.size() == 2);
-        auto &data = *std::any_cast<Data *>(dt);
-        const auto &ident = std::any_cast<std::string>(vs[1]);
-        auto label = ref(*data.grammar, ident, vs.sv().data(), false, {});
-        auto recovery = rec(ref(*data.grammar, RECOVER_DEFINITION_NAME,
-                                vs.sv().data(), true, {label}));
-        return cho4label_(ope, recovery);
+  // Stores the value parsed from the input (none if `val` is null)
+  template <typename T>
+  void store(const Hash128 &key, const char *s, size_t n, const char *path,
+             const T *val) {
+    auto input = std::make_shared<const std::string>(s, n);
+    Entry entry{key, input, path ? path : "", std::any(), 0};
+    if (val) { entry.value = rebase(*val, s, input->data(), n, path); }
+    entry.bytes = sizeof(Entry) + node_overhead + entry.input->size() +
+                  entry.path.size() +
+                  (val && value_size_ ? value_size_(entry.value) : 0);
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) { erase(it->second); }
+    if (entry.bytes > max_bytes_) { return; }
+
+    stats_.bytes += entry.bytes;
+    stats_.entries++;
+    lru_.push_front(std::move(entry));
+    index_[key] = lru_.begin();
+
+    while (stats_.bytes > max_bytes_) {
+      erase(std::prev(lru_.end()));
+      stats_.evictions++;
+    }
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    lru_.clear();
+    index_.clear();
+    stats_.entries = 0;
+    stats_.bytes = 0;
+  }
+
+  Stats stats() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return stats_;
+  }
+
+private:
+  struct Entry {
+    Hash128 key;
+    std::shared_ptr<const std::string> input;
+    std::string path;
+    std::any value;
+    size_t bytes;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Hash128 &key) const {
+      return static_cast<size_t>(key.low);
+    }
+  };
+
+  // A list node and a hash table node
+  static constexpr size_t node_overhead = 5 * sizeof(void *);
+
+  static bool matches(const Entry &entry, const char *s, size_t n,
+                      const char *path) {
+    return entry.input->size() == n && entry.path == (path ? path : "") &&
+           !std::memcmp(entry.input->data(), s, n);
+  }
+
+  // ASTs point into the input they were parsed from
+  template <typename T>
+  static T rebase(const T &value, const char *from, const char *to, size_t n,
+                  const char *path) {
+    if constexpr (is_ast<T>::value) {
+      return rebase_ast(value, from, to, n, path);
+    } else {
+      return value;
+    }
+  }
+
+  void erase(std::list<Entry>::iterator it) {
+    stats_.bytes -= it->bytes;
+    stats_.entries--;
+    index_.erase(it->key);
+    lru_.erase(it);
+  }
+
+  const size_t max_bytes_;
+  const ValueSize value_size_;
+  mutable std::mutex mutex_;
+  std::list<Entry> lru_;
+  std::unordered_map<Hash128, std::list<Entry>::iterator, KeyHash> index_;
+  Stats stats_;
+};
+
+/*
+ * A shared_ptr that one thread can replace while others read it. A reader
+ * gets a snapshot that stays valid for as long as it holds on to it, and the
+ * object is released with the last snapshot.
+ *
+ * std::atomic<std::shared_ptr> and std::atomic_load take a lock in the
+ * common standard libraries, so the pointer is kept in one of two slots
+ * instead. A reader counts itself in the current slot, checks that it is
+ * still current and copies it: it never waits. A writer fills the other
+ * slot, makes it current, and waits for the readers still copying the old
+ * one before releasing it. Writers are serialized by a mutex.
+ */
+template <typename T> class AtomicSharedPtr {
+public:
+  AtomicSharedPtr() = default;
+  AtomicSharedPtr(const AtomicSharedPtr &rhs) { store(rhs.load()); }
+  AtomicSharedPtr &operator=(const AtomicSharedPtr &rhs) {
+    store(rhs.load());
+    return *this;
+  }
+
+  std::shared_ptr<T> load() const {
+    for (;;) {
+      auto i = current_.load();
+      auto &slot = slots_[i];
+      slot.readers++;
+      if (current_.load() == i) {
+        auto ptr = slot.ptr;
+        slot.readers--;
+        return ptr;
       }
-    };
+      slot.readers--; // A writer made the other slot current meanwhile
+    }
+  }
 
-    struct Loop {
-      enum class Type { opt = 0, zom, oom, rep };
-      Type type;
-      std::pair<size_t, size_t> range;
-    };
+  void store(std::shared_ptr<T> ptr) {
+    std::lock_guard<std::mutex> guard(write_mutex_);
+    auto old = current_.load();
+    auto next = 1 - old;
+    drain(slots_[next]);
+    slots_[next].ptr = std::move(ptr);
+    current_.store(next);
+    drain(slots_[old]);
+    slots_[old].ptr = nullptr;
+  }
 
-    g["Suffix"] = [&](const SemanticValues &vs) {
-      auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[0]);
-      if (vs.size() == 1) {
-        return ope;
-      } else {
-        assert(vs.size() == 2);
-        auto loop = std::any_cast<Loop>(vs[1]);
-        switch (loop.type) {
-        case Loop::Type::opt: return opt(ope);
-        case Loop::Type::zom: return zom(ope);
-        case Loop::Type::oom: return oom(ope);
-        default: // Regex-like repetition
-          return rep(ope, loop.range.first, loop.range.second);
-        }
+private:
+  struct Slot {
+    std::shared_ptr<T> ptr;
+    std::atomic<size_t> readers{0};
+  };
+
+  // Waits for the readers that counted themselves in a slot before it
+  // stopped being current. They only copy a pointer, so this is short.
+  static void drain(const Slot &slot) {
+    while (slot.readers.load() != 0) {
+#ifndef CPPPEGLIB_NO_THREADS
+      std::this_thread::yield();
+#endif
+    }
+  }
+
+  mutable Slot slots_[2];
+  std::atomic<size_t> current_{0};
+  std::mutex write_mutex_;
+};
+
+class parser {
+public:
+  parser() = default;
+
+  parser(const char *s, size_t n, const Rules &rules,
+         std::string_view start = {}) {
+    load_grammar(s, n, rules, start);
+  }
+
+  parser(const char *s, size_t n, std::string_view start = {})
+      : parser(s, n, Rules(), start) {}
+
+  parser(std::string_view sv, const Rules &rules, std::string_view start = {})
+      : parser(sv.data(), sv.size(), rules, start) {}
+
+  parser(std::string_view sv, std::string_view start = {})
+      : parser(sv.data(), sv.size(), Rules(), start) {}
+
+#if defined(__cpp_lib_char8_t)
+  parser(std::u8string_view sv, const Rules &rules, std::string_view start = {})
+      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), rules,
+               start) {}
+
+  parser(std::u8string_view sv, std::string_view start = {})
+      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), Rules(),
+               start) {}
+#endif
+
+  operator bool() const { return version_.load() != nullptr; }
+
+  // Builds the grammar and publishes it at once, dropping any draft. If the
+  // grammar has errors, nothing changes.
+  bool load_grammar(const char *s, size_t n, const Rules &rules,
+                    std::string_view start = {}) {
+    auto version = build_version(s, n, rules, start);
+    if (version == nullptr) { return false; }
+    version_.store(version);
+    draft_ = nullptr;
+    warn_backtracking();
+    return true;
+  }
+
+  bool load_grammar(const char *s, size_t n, std::string_view start = {}) {
+    return load_grammar(s, n, Rules(), start);
+  }
+
+  bool load_grammar(std::string_view sv, const Rules &rules,
+                    std::string_view start = {}) {
+    return load_grammar(sv.data(), sv.size(), rules, start);
+  }
+
+  bool load_grammar(std::string_view sv, std::string_view start = {}) {
+    return load_grammar(sv.data(), sv.size(), start);
+  }
+
+  // Builds the grammar as a draft, which the functions below (actions,
+  // enable_ast, optimize_grammar...) set up while parses go on with the
+  // current one. commit() then publishes it in one step. If the grammar has
+  // errors, nothing changes.
+  bool load_draft(const char *s, size_t n, const Rules &rules,
+                  std::string_view start = {}) {
+    auto version = build_version(s, n, rules, start);
+    if (version == nullptr) { return false; }
+    draft_ = version;
+    warn_backtracking();
+    return true;
+  }
+
+  bool load_draft(const char *s, size_t n, std::string_view start = {}) {
+    return load_draft(s, n, Rules(), start);
+  }
+
+  bool load_draft(std::string_view sv, const Rules &rules,
+                  std::string_view start = {}) {
+    return load_draft(sv.data(), sv.size(), rules, start);
+  }
+
+  bool load_draft(std::string_view sv, std::string_view start = {}) {
+    return load_draft(sv.data(), sv.size(), start);
+  }
+
+  // Publishes the grammar loaded by load_draft and set up since. Parses in
+  // flight finish with the grammar they started with, which is released after
+  // the last of them. Returns false if there is none.
+  bool commit() {
+    if (draft_ == nullptr) { return false; }
+    version_.store(draft_);
+    draft_ = nullptr;
+    return true;
+  }
+
+  // Publishes the grammar of `next`, as commit() does. Set up `next`
+  // (actions, enable_ast, optimize_grammar...) before, since the two parsers
+  // share the grammar afterwards.
+  bool hot_swap(const parser &next) {
+    auto version = next.version_.load();
+    if (version == nullptr) { return false; }
+    version_.store(version);
+    return true;
+  }
+
+  bool parse_n(const char *s, size_t n, const char *path = nullptr) const {
+    auto parse = [&](const char *s, size_t n) {
+      if (auto v = version_.load()) {
+        const auto &rule = (*v->grammar)[v->start];
+        auto result = rule.parse(s, n, path, log_);
+        return post_process(s, n, result);
       }
+      return false;
     };
+    if (cache_) {
+      return parse_cached(s, n, static_cast<std::nullptr_t *>(nullptr), path,
+                          parse);
+    }
+    return parse(s, n);
+  }
 
-    g["Loop"] = [&](const SemanticValues &vs) {
-      switch (vs.choice()) {
-      case 0: // Option
-        return Loop{Loop::Type::opt, std::pair<size_t, size_t>()};
-      case 1: // Zero or More
-        return Loop{Loop::Type::zom, std::pair<size_t, size_t>()};
-      case 2: // One or More
-        return Loop{Loop::Type::oom, std::pair<size_t, size_t>()};
-      default: // Regex-like repetition
-        return Loop{Loop::Type::rep,
-                    std::any_cast<std::pair<size_t, size_t>>(vs[0])};
+  bool parse_n(const char *s, size_t n, std::any &dt,
+               const char *path = nullptr) const {
+    if (auto v = version_.load()) {
+      const auto &rule = (*v->grammar)[v->start];
+      auto result = rule.parse(s, n, dt, path, log_);
+      return post_process(s, n, result);
+    }
+    return false;
+  }
+
+  template <typename T>
+  bool parse_n(const char *s, size_t n, T &val,
+               const char *path = nullptr) const {
+    auto parse = [&](const char *s, size_t n) {
+      if (auto v = version_.load()) {
+        const auto &rule = (*v->grammar)[v->start];
+        auto result = rule.parse_and_get_value(s, n, val, path, log_);
+        return post_process(s, n, result);
       }
+      return false;
     };
+    if constexpr (ParseCache::can_cache<T>()) {
+      if (cache_) { return parse_cached(s, n, &val, path, parse); }
+    }
+    return parse(s, n);
+  }
 
-    g["Primary"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
+  template <typename T>
+  bool parse_n(const char *s, size_t n, std::any &dt, T &val,
+               const char *path = nullptr) const {
+    if (auto v = version_.load()) {
+      const auto &rule = (*v->grammar)[v->start];
+      auto result = rule.parse_and_get_value(s, n, dt, val, path, log_);
+      return post_process(s, n, result);
+    }
+    return false;
+  }
 
-      switch (vs.choice()) {
-      case 0:   // Macro Reference
-      case 1: { // Reference
-        auto is_macro = vs.choice() == 0;
-        auto ignore = std::any_cast<bool>(vs[0]);
-        const auto &ident = std::any_cast<std::string>(vs[1]);
+  bool parse(std::string_view sv, const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), path);
+  }
 
-        std::vector<std::shared_ptr<Ope>> args;
-        if (is_macro) {
-          args = std::any_cast<std::vector<std::shared_ptr<Ope>>>(vs[2]);
-        }
+  // Streams enter/leave/token events to `sink` instead of building semantic
+  // values, so memory is bounded by the nesting depth of the grammar rather
+  // than the input size. Actions are not called and packrat parsing is off.
+  bool parse_events(std::string_view sv, EventSink &sink,
+                    const char *path = nullptr) const {
+    std::any dt;
+    return parse_events(sv, sink, dt, path);
+  }
+
+  bool parse_events(std::string_view sv, EventSink &sink, std::any &dt,
+                    const char *path = nullptr) const {
+    if (auto v = version_.load()) {
+      const auto &rule = (*v->grammar)[v->start];
+      auto result =
+          rule.parse_events(sv.data(), sv.size(), sink, dt, path, log_);
+      return post_process(sv.data(), sv.size(), result);
+    }
+    return false;
+  }
+
+  // Parses the input as a sequence of `item_rule` matches (items) on several
+  // threads, with the whitespace of the start rule between them, and returns
+  // the value of each item. The input is read as `Item*` would be, which is
+  // what parse() accepts only for a start rule like `Doc <- Item*`; by
+  // default the item rule is the start rule itself.
+  //
+  // The input is split right after matches of `sync_rule` near evenly spaced
+  // offsets, and the segments are parsed speculatively. Where a split point
+  // turns out not to be an item boundary, the items are parsed again
+  // sequentially until they line up with a speculated item. Actions run
+  // concurrently, so they must not share state through `dt`. An exception
+  // thrown by an action is rethrown here once all the threads are done.
+  // With CPPPEGLIB_NO_THREADS, the input is parsed on the calling thread.
+  template <typename T>
+  bool parse_parallel(std::string_view sv, const char *sync_rule,
+                      std::vector<T> &vals, size_t threads = 0,
+                      const char *path = nullptr) const {
+    return parse_parallel(sv, nullptr, sync_rule, vals, threads, path);
+  }
 
-        auto ope = ref(*data.grammar, ident, vs.sv().data(), is_macro, args);
-        if (ident == RECOVER_DEFINITION_NAME) { ope = rec(ope); }
+  template <typename T>
+  bool parse_parallel(std::string_view sv, const char *item_rule,
+                      const char *sync_rule, std::vector<T> &vals,
+                      size_t threads = 0, const char *path = nullptr) const {
+    auto v = version_.load();
+    if (v == nullptr) { return false; }
+    const auto &rule = (*v->grammar)[v->start];
+    const auto &sync = (*v->grammar)[sync_rule];
+    auto s = sv.data();
+    auto n = sv.size();
+
+#ifdef CPPPEGLIB_NO_THREADS
+    threads = 1;
+#else
+    if (threads == 0) {
+      threads = (std::max)(1u, std::thread::hardware_concurrency());
+    }
+#endif
 
-        if (ignore) {
-          return ign(ope);
-        } else {
-          return ope;
+    // Validated once here, so segments can skip it
+    auto is_ascii = false;
+    auto validated = utf8_error_offset(s, n, is_ascii) == n;
+
+    Definition::ItemOptions opts;
+    opts.validated = validated;
+    if (item_rule) { opts.item = &(*v->grammar)[item_rule]; }
+    // One line index for all the parses, which the values own
+    opts.line_index = std::make_shared<LineIndex>(path, s, n);
+
+    // Split points, probed with the bare sync expression (no packrat, so rule
+    // ids don't matter)
+    std::vector<size_t> bounds{0};
+    if (validated && threads > 1) {
+      auto sync_ope = sync.get_core_operator();
+      Context c(path, s, n, 0, nullptr, nullptr, false, false, false, nullptr,
+                nullptr, nullptr, false, nullptr);
+      c.is_ascii = is_ascii;
+      std::any dt;
+
+      for (size_t k = 1; k < threads; k++) {
+        auto pos = (std::max)(bounds.back(), n / threads * k);
+        for (; pos < n; pos++) {
+          SemanticValues vs;
+          auto len = sync_ope->parse(s + pos, n - pos, vs, c, dt);
+          if (success(len) && len > 0) {
+            pos += len;
+            break;
+          }
         }
+        if (pos >= n) { break; }
+        if (pos > bounds.back()) { bounds.push_back(pos); }
       }
-      case 2: { // (Expression)
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+    }
+    bounds.push_back(n);
+
+    struct Segment {
+      std::vector<size_t> starts;
+      std::vector<size_t> ends;
+      std::vector<std::any> values;
+      std::exception_ptr exception; // thrown by the item at exception_pos
+      size_t exception_pos = 0;
+    };
+    std::vector<Segment> segs(bounds.size() - 1);
+
+    auto parse_segment = [&](size_t k) {
+      auto seg_opts = opts;
+      seg_opts.offset = bounds[k];
+      seg_opts.until = bounds[k + 1];
+      std::any dt;
+      auto &seg = segs[k];
+      auto start = bounds[k];
+      try {
+        rule.parse_items(s, n, seg_opts, dt,
+                         [&](SemanticValues &vs, size_t end) {
+                           seg.starts.push_back(start);
+                           seg.ends.push_back(end);
+                           seg.values.emplace_back(
+                               vs.empty() ? std::any() : std::move(vs[0]));
+                           start = end;
+                           return true;
+                         },
+                         path);
+      } catch (...) {
+        seg.exception = std::current_exception();
+        seg.exception_pos = start;
       }
-      case 3: { // TokenBoundary
-        return tok(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+    };
+
+#ifdef CPPPEGLIB_NO_THREADS
+    for (size_t k = 0; k < segs.size(); k++) {
+      parse_segment(k);
+    }
+#else
+    {
+      // The threads started are joined even if starting another one throws
+      std::vector<std::thread> workers;
+      auto join = scope_exit([&]() {
+        for (auto &worker : workers) {
+          worker.join();
+        }
+      });
+      for (size_t k = 1; k < segs.size(); k++) {
+        workers.emplace_back(parse_segment, k);
       }
-      case 4: { // CaptureScope
-        return csc(std::any_cast<std::shared_ptr<Ope>>(vs[0]));
+      parse_segment(0);
+    }
+#endif
+
+    // Stitch the segments together. An exception is rethrown if the item
+    // that threw it turns out to be one of the input's items.
+    std::unordered_map<size_t, std::pair<size_t, size_t>> speculated;
+    std::unordered_map<size_t, std::exception_ptr> thrown;
+    for (size_t k = 0; k < segs.size(); k++) {
+      for (size_t j = 0; j < segs[k].starts.size(); j++) {
+        speculated.emplace(segs[k].starts[j], std::pair(k, j));
       }
-      case 5: { // Capture
-        const auto &name = std::any_cast<std::string_view>(vs[0]);
-        auto ope = std::any_cast<std::shared_ptr<Ope>>(vs[1]);
+      if (segs[k].exception) {
+        thrown.emplace(segs[k].exception_pos, segs[k].exception);
+      }
+    }
 
-        data.captures_stack.back().insert(name);
-        data.captures_in_current_definition.insert(name);
+    vals.clear();
+    auto push_value = [&](std::any &val) {
+      vals.push_back(val.has_value() ? std::any_cast<T>(val) : T());
+      keep_line_index(vals.back(), opts.line_index);
+    };
 
-        return cap(ope, [name](const char *a_s, size_t a_n, Context &c) {
-          auto &cs = c.capture_scope_stack[c.capture_scope_stack_size - 1];
-          cs[name] = std::string(a_s, a_n);
-        });
+    size_t pos = 0;
+    while (pos < n) {
+      auto exception = thrown.find(pos);
+      if (exception != thrown.end()) {
+        std::rethrow_exception(exception->second);
       }
-      default: {
-        return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
+
+      auto it = speculated.find(pos);
+      if (it != speculated.end()) {
+        auto [k, j] = it->second;
+        push_value(segs[k].values[j]);
+        pos = segs[k].ends[j];
+        continue;
       }
+
+      auto seq_opts = opts;
+      seq_opts.offset = pos;
+      std::any dt;
+      auto r = rule.parse_items(
+          s, n, seq_opts, dt,
+          [&](SemanticValues &vs, size_t end) {
+            std::any val = vs.empty() ? std::any() : std::move(vs[0]);
+            push_value(val);
+            return !speculated.count(end) && !thrown.count(end);
+          },
+          path, log_);
+      if (r.ret && r.len < n && !speculated.count(r.len) &&
+          !thrown.count(r.len)) {
+        r.error_info.message_pos = s + r.len;
+        r.error_info.message = "expected end of input";
+        r.ret = false;
       }
-    };
+      if (!r.ret) { return post_process(s, n, r); }
+      pos = r.len;
+    }
+    return true;
+  }
 
-    g["IdentCont"] = [](const SemanticValues &vs) {
-      return std::string(vs.sv().data(), vs.sv().length());
-    };
+  bool parse(std::string_view sv, std::any &dt,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), dt, path);
+  }
 
-    g["Dictionary"] = [](const SemanticValues &vs) {
-      auto items = vs.transform<std::string>();
-      return dic(items, false);
-    };
-    g["DictionaryI"] = [](const SemanticValues &vs) {
-      auto items = vs.transform<std::string>();
-      return dic(items, true);
-    };
+  template <typename T>
+  bool parse(std::string_view sv, T &val, const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), val, path);
+  }
 
-    g["Literal"] = [](const SemanticValues &vs) {
-      const auto &tok = vs.tokens.front();
-      return lit(resolve_escape_sequence(tok.data(), tok.size()));
-    };
-    g["LiteralI"] = [](const SemanticValues &vs) {
-      const auto &tok = vs.tokens.front();
-      return liti(resolve_escape_sequence(tok.data(), tok.size()));
-    };
-    g["LiteralD"] = [](const SemanticValues &vs) {
-      auto &tok = vs.tokens.front();
-      return resolve_escape_sequence(tok.data(), tok.size());
-    };
-    g["LiteralID"] = [](const SemanticValues &vs) {
-      auto &tok = vs.tokens.front();
-      return resolve_escape_sequence(tok.data(), tok.size());
-    };
+  template <typename T>
+  bool parse(std::string_view sv, std::any &dt, T &val,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), dt, val, path);
+  }
 
-    g["Class"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return cls(ranges);
-    };
-    g["ClassI"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return cls(ranges, true);
-    };
-    g["NegatedClass"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return ncls(ranges);
-    };
-    g["NegatedClassI"] = [](const SemanticValues &vs) {
-      auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
-      return ncls(ranges, true);
-    };
-    g["Range"] = [](const SemanticValues &vs) {
-      switch (vs.choice()) {
-      case 0: {
-        auto s1 = std::any_cast<std::string>(vs[0]);
-        auto s2 = std::any_cast<std::string>(vs[1]);
-        auto cp1 = decode_codepoint(s1.data(), s1.length());
-        auto cp2 = decode_codepoint(s2.data(), s2.length());
-        return std::pair(cp1, cp2);
-      }
-      case 1: {
-        auto s = std::any_cast<std::string>(vs[0]);
-        auto cp = decode_codepoint(s.data(), s.length());
-        return std::pair(cp, cp);
-      }
-      }
-      return std::pair<char32_t, char32_t>(0, 0);
-    };
-    g["Char"] = [](const SemanticValues &vs) {
-      return resolve_escape_sequence(vs.sv().data(), vs.sv().length());
-    };
+#if defined(__cpp_lib_char8_t)
+  bool parse(std::u8string_view sv, const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), path);
+  }
 
-    g["RepetitionRange"] = [&](const SemanticValues &vs) {
-      switch (vs.choice()) {
-      case 0: { // Number COMMA Number
-        auto min = std::any_cast<size_t>(vs[0]);
-        auto max = std::any_cast<size_t>(vs[1]);
-        return std::pair(min, max);
-      }
-      case 1: // Number COMMA
-        return std::pair(std::any_cast<size_t>(vs[0]),
-                         std::numeric_limits<size_t>::max());
-      case 2: { // Number
-        auto n = std::any_cast<size_t>(vs[0]);
-        return std::pair(n, n);
+  bool parse(std::u8string_view sv, std::any &dt,
+             const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
+                   path);
+  }
+
+  template <typename T>
+  bool parse(std::u8string_view sv, T &val, const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), val,
+                   path);
+  }
+
+  template <typename T>
+  bool parse(std::u8string_view sv, std::any &dt, T &val,
+             const char *path = nullptr) const {
+    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
+                   val, path);
+  }
+#endif
+
+  // The functions below read and set up the draft from load_draft, or else
+  // the current grammar. The current one is shared with the parses in
+  // flight, so only set it up before parsing starts: to change a grammar in
+  // use, load_draft it, set it up and commit() it.
+  Definition &operator[](const char *s) {
+    return (*setup_version()->grammar)[s];
+  }
+
+  const Definition &operator[](const char *s) const {
+    return (*setup_version()->grammar)[s];
+  }
+
+  const Grammar &get_grammar() const { return *setup_version()->grammar; }
+
+  void disable_eoi_check() {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.eoi_check = false;
+    }
+  }
+
+  void disable_utf8_check() {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.utf8_check = false;
+    }
+  }
+
+  void enable_packrat_parsing() {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.enablePackratParsing = v->enablePackratParsing;
+    }
+  }
+
+  // Aborts a parse once it holds more than `bytes` (0 for no limit). `hook`
+  // sees each increase in usage and may abort the parse itself.
+  void set_memory_limit(size_t bytes, MemoryHook hook = nullptr) {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.memory_limit = bytes;
+      rule.memory_hook = std::move(hook);
+    }
+  }
+
+  // Stops a parse that calls more operators, fails more choice alternatives
+  // or runs longer than `limits` allow, for input that could backtrack
+  // exponentially
+  void set_parse_limits(const ParseLimits &limits) {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.limits = limits;
+    }
+  }
+
+  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.tracer_enter = tracer_enter;
+      rule.tracer_leave = tracer_leave;
+    }
+  }
+
+  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave,
+                    TracerStartOrEnd tracer_start,
+                    TracerStartOrEnd tracer_end) {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.tracer_enter = tracer_enter;
+      rule.tracer_leave = tracer_leave;
+      rule.tracer_start = tracer_start;
+      rule.tracer_end = tracer_end;
+    }
+  }
+
+  void set_verbose_trace(bool verbose_trace) {
+    if (auto v = setup_version()) {
+      auto &rule = (*v->grammar)[v->start];
+      rule.verbose_trace = verbose_trace;
+    }
+  }
+
+  // With share_subtrees, identical subtrees are built once per parse and
+  // shared (see SharedAstNodes), for inputs that repeat themselves a lot.
+  // Their `parent` is left empty, and optimize_ast copies them back into a
+  // tree.
+  template <typename T = Ast> parser &enable_ast(bool share_subtrees = false) {
+    auto v = setup_version();
+    for (auto &[_, rule] : *v->grammar) {
+      if (!rule.action) { add_ast_action<T>(rule, share_subtrees); }
+    }
+    return *this;
+  }
+
+  template <typename T>
+  std::shared_ptr<T> optimize_ast(std::shared_ptr<T> ast,
+                                  bool opt_mode = true) const {
+    auto optimized =
+        AstOptimizer(opt_mode, get_no_ast_opt_rules()).optimize(ast);
+    if (ast->line_index) {
+      keep_line_index(optimized, ast->line_index->weak_from_this().lock());
+    }
+    return optimized;
+  }
+
+  void set_logger(Log log) { log_ = log; }
+
+  void set_logger(
+      std::function<void(size_t line, size_t col, const std::string &msg)>
+          log) {
+    log_ = [log](size_t line, size_t col, const std::string &msg,
+                 const std::string & /*rule*/) { log(line, col, msg); };
+  }
+
+  // Rewrites the grammar into an equivalent one that parses faster (see
+  // OptimizeGrammar) and reports what changed; the report prints with <<.
+  // Call it after actions are set (and after enable_ast), since a rule's
+  // action decides what must be kept. Error messages depend on the shape of
+  // the grammar, so parses with a logger still run the rules as written and
+  // don't get faster. Given a sample, it is parsed before and after, actions
+  // included and without a logger, to measure the speedup.
+  GrammarOptimization optimize_grammar(std::string_view sample = {}) {
+    GrammarOptimization result;
+    auto v = setup_version();
+    if (v == nullptr) { return result; }
+    auto &grammar = *v->grammar;
+    const auto &start = grammar[v->start];
+
+    if (!sample.empty()) { result.before_ms = time_parse(*v, sample); }
+
+    // Token rules make token AST nodes, so settle that before any rewrite
+    for (auto &[_, rule] : grammar) {
+      rule.is_token();
+    }
+
+    // Binary operator rules report their token to precedence climbing
+    std::unordered_set<const Definition *> binops;
+    for (auto &[_, rule] : grammar) {
+      auto ope = rule.get_core_operator();
+      if (auto pc = dynamic_cast<PrecedenceClimbing *>(ope.get())) {
+        auto ref = dynamic_cast<Reference *>(pc->binop_.get());
+        if (ref && ref->rule_) { binops.insert(ref->rule_); }
       }
-      default: // COMMA Number
-        return std::pair(std::numeric_limits<size_t>::min(),
-                         std::any_cast<size_t>(vs[0]));
+    }
+
+    auto whitespace_pushes = false;
+    if (start.whitespaceOpe) {
+      MeasureOpe measure(false);
+      grammar[WHITESPACE_DEFINITION_NAME].get_core_operator()->accept(measure);
+      whitespace_pushes = measure.pushes;
+    }
+
+    for (auto &[name, rule] : grammar) {
+      if (name == WHITESPACE_DEFINITION_NAME || name == WORD_DEFINITION_NAME ||
+          rule.is_macro) {
+        continue;
       }
-    };
-    g["Number"] = [&](const SemanticValues &vs) {
-      return vs.token_to_number<size_t>();
-    };
 
-    g["CapScope"].enter = [](const Context & /*c*/, const char * /*s*/,
-                             size_t /*n*/, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
-      data.captures_stack.emplace_back();
-    };
-    g["CapScope"].leave = [](const Context & /*c*/, const char * /*s*/,
-                             size_t /*n*/, size_t /*matchlen*/,
-                             std::any & /*value*/, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
-      data.captures_stack.pop_back();
-    };
+      auto keep_choice = rule.action || rule.predicate;
+      auto keep_tokens = keep_choice || binops.count(&rule);
+      OptimizeGrammar vis(rule, keep_choice, keep_tokens,
+                          start.whitespaceOpe != nullptr,
+                          start.wordOpe != nullptr, whitespace_pushes, result);
+
+      auto ope = rule.get_core_operator();
+      auto optimized = vis.optimize(ope);
+      if (optimized != ope) { rule.optimize(optimized); }
+    }
+
+    if (!sample.empty()) {
+      result.after_ms = time_parse(*v, sample);
+      if (result.after_ms > 0) {
+        result.speedup = result.before_ms / result.after_ms;
+      }
+    }
 
-    g["AND"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["NOT"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["QUESTION"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["STAR"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
-    g["PLUS"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+    return result;
+  }
 
-    g["DOT"] = [](const SemanticValues & /*vs*/) { return dot(); };
+  // Left-factors the choices of the grammar. Given a sample, the sample is
+  // parsed before and after the rewrite, actions included, to measure the
+  // speedup.
+  ChoiceFactoring factor_choices(std::string_view sample = {}) {
+    ChoiceFactoring result;
+    auto v = setup_version();
+    if (v == nullptr) { return result; }
+    auto &grammar = *v->grammar;
 
-    g["CUT"] = [](const SemanticValues & /*vs*/) { return cut(); };
+    if (!sample.empty()) { result.before_ms = time_parse(*v, sample); }
 
-    g["BeginCap"] = [](const SemanticValues &vs) { return vs.token(); };
+    for (auto &[_, rule] : grammar) {
+      rule.is_token();
+    }
 
-    g["BackRef"] = [&](const SemanticValues &vs, std::any &dt) {
-      auto &data = *std::any_cast<Data *>(dt);
+    for (auto &[name, rule] : grammar) {
+      if (rule.is_macro) { continue; }
 
-      // Undefined back reference check
-      {
-        auto found = false;
-        auto it = data.captures_stack.rbegin();
-        while (it != data.captures_stack.rend()) {
-          if (it->find(vs.token()) != it->end()) {
-            found = true;
-            break;
-          }
-          ++it;
-        }
-        if (!found) {
-          auto ptr = vs.token().data() - 1; // include '$' symbol
-          data.undefined_back_references.emplace_back(vs.token(), ptr);
-        }
-      }
+      FactorChoices vis(name, result);
+      auto ope = rule.get_core_operator();
+      auto factored = vis.factor(ope);
+      if (factored != ope) { rule <= factored; }
+    }
 
-      // NOTE: Disable packrat parsing if a back reference is not defined in
-      // captures in the current definition rule.
-      if (data.captures_in_current_definition.find(vs.token()) ==
-          data.captures_in_current_definition.end()) {
-        data.enablePackratParsing = false;
+    if (!sample.empty()) {
+      result.after_ms = time_parse(*v, sample);
+      if (result.after_ms > 0) {
+        result.speedup = result.before_ms / result.after_ms;
       }
+    }
 
-      return bkr(vs.token_to_string());
+    return result;
+  }
+
+  // Compiles token expressions into DFAs (see CompileDfa): the contents of
+  // token boundaries, token rules and the whitespace and word rules, where
+  // every choice and repetition is decided by the next byte. Returns how many
+  // were compiled. The grammar accepts the same input with the same errors.
+  size_t compile_tokens() {
+    size_t count = 0;
+    auto v = setup_version();
+    if (v == nullptr) { return count; }
+    auto &grammar = *v->grammar;
+    auto &start = grammar[v->start];
+    auto word = start.wordOpe != nullptr;
+
+    auto compile = [&](std::shared_ptr<Ope> &ope, bool literals) {
+      if (auto dfa = CompileDfa::compile(ope, literals)) {
+        ope = dfa;
+        count++;
+      }
     };
 
-    g["Ignore"] = [](const SemanticValues &vs) { return vs.size() > 0; };
+    for (auto &[_, rule] : grammar) {
+      rule.is_token();
+    }
 
-    g["Parameters"] = [](const SemanticValues &vs) {
-      return vs.transform<std::string>();
-    };
+    for (auto &[name, rule] : grammar) {
+      if (name == WHITESPACE_DEFINITION_NAME || name == WORD_DEFINITION_NAME ||
+          rule.is_macro) {
+        continue;
+      }
 
-    g["Arguments"] = [](const SemanticValues &vs) {
-      return vs.transform<std::shared_ptr<Ope>>();
-    };
+      // Literals in token boundaries skip no whitespace, but check %word
+      CollectTokenBoundaries vis;
+      rule.accept(vis);
+      for (auto tb : vis.boundaries) {
+        compile(tb->ope_, !word);
+      }
 
-    g["PrecedenceClimbing"] = [](const SemanticValues &vs) {
-      PrecedenceClimbing::BinOpeInfo binOpeInfo;
-      size_t level = 1;
-      for (auto v : vs) {
-        auto tokens = std::any_cast<std::vector<std::string_view>>(v);
-        auto assoc = tokens[0][0];
-        for (size_t i = 1; i < tokens.size(); i++) {
-          binOpeInfo[tokens[i]] = std::pair(level, assoc);
-        }
-        level++;
+      if (vis.boundaries.empty() && rule.is_token()) {
+        auto ope = rule.get_core_operator();
+        compile(ope, !word && !start.whitespaceOpe);
+        if (ope != rule.get_core_operator()) { rule <= ope; }
       }
-      Instruction instruction;
-      instruction.type = "precedence";
-      instruction.data = binOpeInfo;
-      instruction.sv = vs.sv();
-      return instruction;
-    };
-    g["PrecedenceInfo"] = [](const SemanticValues &vs) {
-      return vs.transform<std::string_view>();
-    };
-    g["PrecedenceOpe"] = [](const SemanticValues &vs) { return vs.token(); };
-    g["PrecedenceAssoc"] = [](const SemanticValues &vs) { return vs.token(); };
+    }
 
-    g["ErrorMessage"] = [](const SemanticValues &vs) {
-      Instruction instruction;
-      instruction.type = "error_message";
-      instruction.data = std::any_cast<std::string>(vs[0]);
-      instruction.sv = vs.sv();
-      return instruction;
-    };
+    // The word rule is run without %word or whitespace
+    if (auto ws = dynamic_cast<Whitespace *>(start.whitespaceOpe.get())) {
+      compile(ws->ope_, !word);
+    }
+    if (start.wordOpe) { compile(start.wordOpe, true); }
 
-    g["NoAstOpt"] = [](const SemanticValues &vs) {
-      Instruction instruction;
-      instruction.type = "no_ast_opt";
-      instruction.sv = vs.sv();
-      return instruction;
-    };
+    return count;
+  }
 
-    g["Instruction"] = [](const SemanticValues &vs) {
-      return vs.transform<Instruction>();
+  // Choice alternatives that could commit with a cut ('↑') right after their
+  // first element without changing what the grammar accepts: the element
+  // always consumes input and no later alternative can start with the same
+  // byte. Cuts let packrat parsing release memo entries behind them.
+  std::vector<CutSuggestion> suggest_cuts() const {
+    std::vector<CutSuggestion> suggestions;
+    auto v = setup_version();
+    if (v == nullptr) { return suggestions; }
+
+    std::unordered_map<std::string, FirstSet> cache;
+    auto first_set = [&](Ope &ope) {
+      ComputeFirstSet vis(cache);
+      ope.accept(vis);
+      return vis.first;
     };
-  }
 
-  bool apply_precedence_instruction(Definition &rule,
-                                    const PrecedenceClimbing::BinOpeInfo &info,
-                                    const char *s, Log log) {
-    try {
-      auto &seq = dynamic_cast<Sequence &>(*rule.get_core_operator());
-      auto atom = seq.opes_[0];
-      auto &rep = dynamic_cast<Repetition &>(*seq.opes_[1]);
-      auto &seq1 = dynamic_cast<Sequence &>(*rep.ope_);
-      auto binop = seq1.opes_[0];
-      auto atom1 = seq1.opes_[1];
+    for (auto &[name, rule] : *v->grammar) {
+      if (rule.is_macro) { continue; }
 
-      auto atom_name = dynamic_cast<Reference &>(*atom).name_;
-      auto binop_name = dynamic_cast<Reference &>(*binop).name_;
-      auto atom1_name = dynamic_cast<Reference &>(*atom1).name_;
+      CollectChoices vis;
+      rule.accept(vis);
 
-      if (!rep.is_zom() || atom_name != atom1_name || atom_name == binop_name) {
-        if (log) {
-          auto line = line_info(s, rule.s_);
-          log(line.first, line.second,
-              "'precedence' instruction cannot be applied to '" + rule.name +
-                  "'.",
-              "");
+      for (auto choice : vis.choices) {
+        const auto &opes = choice->opes_;
+        auto count = opes.size();
+
+        // First sets of the alternatives after each one
+        std::vector<FirstSet> rest(count);
+        for (auto i = count; i-- > 1;) {
+          auto fs = first_set(*opes[i]);
+          rest[i - 1].chars = rest[i].chars | fs.chars;
+          rest[i - 1].nullable = rest[i].nullable || fs.nullable;
         }
-        return false;
-      }
 
-      rule.holder_->ope_ = pre(atom, binop, info, rule);
-      rule.disable_action = true;
-    } catch (...) {
-      if (log) {
-        auto line = line_info(s, rule.s_);
-        log(line.first, line.second,
-            "'precedence' instruction cannot be applied to '" + rule.name +
-                "'.",
-            "");
-      }
-      return false;
-    }
-    return true;
-  }
+        for (size_t i = 0; i + 1 < count; i++) {
+          if (rest[i].nullable) { break; }
+
+          auto head = opes[i];
+          if (auto seq = dynamic_cast<Sequence *>(head.get())) {
+            auto has_cut = std::any_of(
+                seq->opes_.begin(), seq->opes_.end(), [](const auto &op) {
+                  return dynamic_cast<Cut *>(op.get()) != nullptr;
+                });
+            if (has_cut || seq->opes_.size() < 2) { continue; }
+            head = seq->opes_[0];
+          } else {
+            continue;
+          }
 
-  ParserContext perform_core(const char *s, size_t n, const Rules &rules,
-                             Log log, std::string requested_start) {
-    Data data;
-    auto &grammar = *data.grammar;
+          auto fs = first_set(*head);
+          if (fs.nullable || (fs.chars & rest[i].chars).any()) { continue; }
 
-    // Built-in macros
-    {
-      // `%recover`
-      {
-        auto &rule = grammar[RECOVER_DEFINITION_NAME];
-        rule <= ref(grammar, "x", "", false, {});
-        rule.name = RECOVER_DEFINITION_NAME;
-        rule.s_ = "[native]";
-        rule.ignoreSemanticValue = true;
-        rule.is_macro = true;
-        rule.params = {"x"};
+          suggestions.push_back(
+              {name, rule.line_.first, rule.line_.second, i});
+        }
       }
     }
 
-    std::any dt = &data;
-    auto r = g["Grammar"].parse(s, n, dt, nullptr, log);
+    std::sort(suggestions.begin(), suggestions.end(),
+              [](const auto &a, const auto &b) {
+                return std::tie(a.line, a.column, a.rule, a.alternative) <
+                       std::tie(b.line, b.column, b.rule, b.alternative);
+              });
+    return suggestions;
+  }
+
+  // The worst backtracking hotspot of each rule, most expensive first. Rules
+  // are analyzed callees first, so that recursion is found by strongly
+  // connected component.
+  std::vector<BacktrackingHotspot> find_backtracking_hotspots() const {
+    std::vector<BacktrackingHotspot> hotspots;
+    auto v = setup_version();
+    if (v == nullptr) { return hotspots; }
+
+    std::vector<Definition *> rule_list;
+    std::unordered_map<const Definition *, size_t> rule_ids;
+    for (auto &[_, rule] : *v->grammar) {
+      rule_ids[&rule] = rule_list.size();
+      rule_list.push_back(&rule);
+    }
 
-    if (!r.ret) {
-      if (log) {
-        if (r.error_info.message_pos) {
-          auto line = line_info(s, r.error_info.message_pos);
-          log(line.first, line.second, r.error_info.message,
-              r.error_info.label);
-        } else {
-          auto line = line_info(s, r.error_info.error_pos);
-          log(line.first, line.second, "syntax error", r.error_info.label);
-        }
+    std::unordered_set<const Definition *> no_rules;
+    std::unordered_map<const Definition *, bool> unbounded;
+    std::vector<std::vector<size_t>> reference_graph(rule_list.size());
+    for (size_t i = 0; i < rule_list.size(); i++) {
+      ReachRules vis(no_rules, unbounded);
+      rule_list[i]->accept(vis);
+      for (auto ref : vis.referenced) {
+        auto it = rule_ids.find(ref);
+        if (it != rule_ids.end()) { reference_graph[i].push_back(it->second); }
       }
-      return {};
     }
 
-    // User provided rules
-    for (auto [user_name, user_rule] : rules) {
-      auto name = user_name;
-      auto ignore = false;
-      if (!name.empty() && name[0] == '~') {
-        ignore = true;
-        name.erase(0, 1);
-      }
-      if (!name.empty()) {
-        auto &rule = grammar[name];
-        rule <= user_rule;
-        rule.name = name;
-        rule.ignoreSemanticValue = ignore;
+    std::unordered_map<std::string, FirstSet> first_sets;
+    for (const auto &component :
+         strongly_connected_components(reference_graph)) {
+      std::unordered_set<const Definition *> rules;
+      for (auto i : component) {
+        rules.insert(rule_list[i]);
       }
-    }
 
-    // Check duplicated definitions
-    auto ret = true;
+      for (auto i : component) {
+        ReachRules vis(rules, unbounded);
+        rule_list[i]->accept(vis);
+        unbounded[rule_list[i]] = vis.unbounded;
+      }
 
-    if (!data.duplicates_of_definition.empty()) {
-      for (const auto &[name, ptr] : data.duplicates_of_definition) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second,
-              "The definition '" + name + "' is already defined.", "");
+      for (auto i : component) {
+        auto &rule = *rule_list[i];
+        if (rule.is_macro) { continue; }
+
+        FindBacktracking vis(rules, unbounded, first_sets);
+        rule.accept(vis);
+        if (vis.found) {
+          auto hotspot = vis.hotspot;
+          hotspot.rule = rule.name;
+          hotspot.line = rule.line_.first;
+          hotspot.column = rule.line_.second;
+          hotspots.push_back(std::move(hotspot));
         }
       }
-      ret = false;
     }
 
-    // Check duplicated instructions
-    if (!data.duplicates_of_instruction.empty()) {
-      for (const auto &[type, ptr] : data.duplicates_of_instruction) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second,
-              "The instruction '" + type + "' is already defined.", "");
-        }
-      }
-      ret = false;
+    std::sort(hotspots.begin(), hotspots.end(),
+              [](const auto &a, const auto &b) {
+                return std::tie(b.growth, b.parses, a.line, a.column) <
+                       std::tie(a.growth, a.parses, b.line, b.column);
+              });
+    return hotspots;
+  }
+
+  // Makes load_grammar log what find_backtracking_hotspots reports. Call it
+  // before load_grammar, as set_logger.
+  void enable_backtracking_warnings() { warn_backtracking_ = true; }
+
+  // Caches the values of successful parses by input (see ParseCache), up to
+  // `max_bytes` of inputs and bookkeeping, plus what `value_size` reports
+  // for each value. Parses that take user data (`dt`) aren't cached, since
+  // actions may depend on it. Set up actions before, and clear the cache
+  // after changing them.
+  void enable_parse_cache(size_t max_bytes = 64 * 1024 * 1024,
+                          ParseCache::ValueSize value_size = nullptr) {
+    cache_ = std::make_shared<ParseCache>(max_bytes, std::move(value_size));
+  }
+
+  void clear_parse_cache() {
+    if (cache_) { cache_->clear(); }
+  }
+
+  ParseCache::Stats parse_cache_stats() const {
+    return cache_ ? cache_->stats() : ParseCache::Stats();
+  }
+
+private:
+  // Looks the input up in the cache, or has `parse` parse it and caches the
+  // result
+  template <typename T, typename F>
+  bool parse_cached(const char *s, size_t n, T *val, const char *path,
+                    F parse) const {
+    auto v = version_.load();
+    if (v == nullptr) { return false; }
+
+    auto key = ParseCache::key(v->id, path, s, n);
+    if (cache_->find(key, s, n, path, val)) { return true; }
+
+    if (!parse(s, n)) { return false; }
+    // Not if the grammar was swapped meanwhile
+    if (version_.load() == v) { cache_->store(key, s, n, path, val); }
+    return true;
+  }
+
+  bool post_process(const char *s, size_t n, Definition::Result &r) const {
+    if (log_ && !r.ret) { r.error_info.output_log(log_, s, n); }
+    return r.ret && !r.recovered;
+  }
+
+  std::vector<std::string> get_no_ast_opt_rules() const {
+    std::vector<std::string> rules;
+    auto v = version_.load();
+    for (auto &[name, rule] : *v->grammar) {
+      if (rule.no_ast_opt) { rules.push_back(name); }
     }
+    return rules;
+  }
 
-    // Check undefined back references
-    if (!data.undefined_back_references.empty()) {
-      for (const auto &[name, ptr] : data.undefined_back_references) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second,
-              "The back reference '" + name + "' is undefined.", "");
-        }
-      }
-      ret = false;
+  friend class item_streamer;
+  template <typename Value> friend class typed_parser;
+
+  struct Version {
+    std::shared_ptr<Grammar> grammar;
+    std::string start;
+    bool enablePackratParsing = false;
+    uint64_t id = next_id(); // Keys the parse cache
+
+    static uint64_t next_id() {
+      static std::atomic<uint64_t> id{0};
+      return ++id;
     }
+  };
 
-    // Set root definition
-    auto start = data.start;
+  // The grammar set up by the functions above: the one load_draft built
+  // until commit() publishes it, or else the current one
+  std::shared_ptr<Version> setup_version() const {
+    return draft_ ? draft_ : version_.load();
+  }
 
-    if (!requested_start.empty()) {
-      if (grammar.count(requested_start)) {
-        start = requested_start;
-      } else {
-        if (log) {
-          auto line = line_info(s, s);
-          log(line.first, line.second,
-              "The specified start rule '" + requested_start + "' is undefined.",
-              "");
-        }
-        ret = false;
-      }
+  std::shared_ptr<Version> build_version(const char *s, size_t n,
+                                         const Rules &rules,
+                                         std::string_view start) {
+    auto cxt = ParserGenerator::parse(s, n, rules, log_, start);
+    if (cxt.grammar == nullptr) { return nullptr; }
+    return std::make_shared<Version>(
+        Version{cxt.grammar, cxt.start, cxt.enablePackratParsing});
+  }
+
+  void warn_backtracking() const {
+    if (!warn_backtracking_ || !log_) { return; }
+    for (const auto &hotspot : find_backtracking_hotspots()) {
+      log_(hotspot.line, hotspot.column,
+           "'" + hotspot.rule + "' may take " + hotspot.cost() +
+               " without packrat parsing: " + hotspot.construct + "; " +
+               hotspot.suggestion + ".",
+           hotspot.rule);
     }
+  }
 
-    if (!ret) { return {}; }
+  // Best of three parses of `sample` with a grammar, which may not be
+  // published yet. No logger, which would run the rules as written.
+  double time_parse(const Version &v, std::string_view sample) const {
+    const auto &rule = (*v.grammar)[v.start];
+    auto best = (std::numeric_limits<double>::max)();
+    for (auto i = 0; i < 3; i++) {
+      auto start = std::chrono::steady_clock::now();
+      rule.parse(sample.data(), sample.size());
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      best = (std::min)(best, elapsed.count());
+    }
+    return best;
+  }
 
-    auto &start_rule = grammar[start];
+  AtomicSharedPtr<Version> version_;
+  std::shared_ptr<Version> draft_; // Loaded, not yet committed
+  Log log_;
+  bool warn_backtracking_ = false;
+  std::shared_ptr<ParseCache> cache_;
+};
 
-    // Check if the start rule has ignore operator
-    {
-      if (start_rule.ignoreSemanticValue) {
-        if (log) {
-          auto line = line_info(s, start_rule.s_);
-          log(line.first, line.second,
-              "Ignore operator cannot be applied to '" + start_rule.name + "'.",
-              "");
-        }
-        ret = false;
+/*-----------------------------------------------------------------------------
+ *  item_streamer
+ *---------------------------------------------------------------------------*/
+
+/*
+ * Parses input that arrives in chunks as a sequence of matches of one rule
+ * (items), such as the records of a log stream or the messages of a
+ * protocol: the input is read as `Item*` would be, with the whitespace of the
+ * grammar between items. The item rule is the start rule unless one is
+ * named, so a grammar like `Doc <- Item*` is streamed with "Item".
+ *
+ * It is not a suspendable parser. An item is handed over once it has been
+ * matched without looking past the end of the buffered input, since more
+ * input can't change it then, and only the unfinished item is buffered. Each
+ * chunk parses that item again from its start, so input is rescanned once
+ * per chunk that arrives while an item is unfinished: keep items small
+ * compared to the chunks.
+ *
+ * An item rule that ends with a repetition of something every item can start
+ * with would only end with the input, so it is rejected.
+ */
+class item_streamer {
+public:
+  using Handler = std::function<void(std::any &val)>;
+
+  item_streamer(const parser &p, Handler handler)
+      : item_streamer(p, std::string_view(), std::move(handler)) {}
+
+  item_streamer(const parser &p, std::string_view item_rule, Handler handler)
+      : parser_(p), version_(p.version_.load()),
+        start_((*version_->grammar)[version_->start]),
+        rule_(find_rule(*version_, item_rule)), handler_(std::move(handler)) {
+    if (!rule_) {
+      if (parser_.log_) {
+        parser_.log_(1, 1, "'" + std::string(item_rule) + "' is not defined.",
+                     std::string(item_rule));
       }
+      failed_ = true;
+    } else if (ends_with_items()) {
+      if (parser_.log_) {
+        parser_.log_(rule_->line_.first, rule_->line_.second,
+                     "'" + rule_->name +
+                         "' ends with a repetition that takes the next item, "
+                         "so no item ends before the input does.",
+                     rule_->name);
+      }
+      failed_ = true;
     }
+  }
 
-    if (!ret) { return {}; }
+  // False once the input has a syntax error, or if the item rule can't be
+  // streamed
+  explicit operator bool() const { return !failed_; }
 
-    // Check missing definitions
-    auto referenced = std::unordered_set<std::string>{
-        WHITESPACE_DEFINITION_NAME,
-        WORD_DEFINITION_NAME,
-        RECOVER_DEFINITION_NAME,
-        start_rule.name,
-    };
+  // Returns false once the input has a syntax error. With `last`, the
+  // buffered input must end with a complete item (or whitespace).
+  bool feed(std::string_view chunk, bool last = false) {
+    if (failed_) { return false; }
+    buf_.append(chunk.data(), chunk.size());
 
-    for (auto &[_, rule] : grammar) {
-      ReferenceChecker vis(grammar, rule.params);
-      rule.accept(vis);
-      referenced.insert(vis.referenced.begin(), vis.referenced.end());
-      for (const auto &[name, ptr] : vis.error_s) {
-        if (log) {
-          auto line = line_info(s, ptr);
-          log(line.first, line.second, vis.error_message[name], "");
-        }
-        ret = false;
+    auto n = buf_.size();
+    if (!last) { n = complete_codepoints_length(buf_.data(), n); }
+
+    Definition::ItemOptions opts;
+    opts.prefix = !last;
+    opts.item = rule_;
+
+    size_t i = 0;
+    auto r = start_.parse_items(
+        buf_.data(), n, opts, dt_,
+        [&](SemanticValues &vs, size_t end) {
+          i = end;
+          if (!vs.empty()) {
+            handler_(vs[0]);
+          } else {
+            std::any val;
+            handler_(val);
+          }
+          return true;
+        },
+        nullptr, parser_.log_);
+
+    if (!r.ret || (last && r.len < n)) {
+      if (r.ret) {
+        r.error_info.message_pos = buf_.data() + r.len;
+        r.error_info.message = "expected end of input";
+        r.ret = false;
+      }
+      // Positions are relative to the buffer, which starts after the items
+      // handed over
+      if (parser_.log_) {
+        r.error_info.output_log(
+            [&](size_t line, size_t col, const std::string &msg,
+                const std::string &rule) {
+              if (line == 1) { col += column_; }
+              parser_.log_(line + line_, col, msg, rule);
+            },
+            buf_.data(), n);
       }
+      failed_ = true;
     }
 
-    for (auto &[name, rule] : grammar) {
-      if (!referenced.count(name)) {
-        if (log) {
-          auto line = line_info(s, rule.s_);
-          auto msg = "'" + name + "' is not referenced.";
-          log(line.first, line.second, msg, "");
+    if (i > 0) {
+      for (size_t j = 0; j < i; j++) {
+        if (buf_[j] == '\n') {
+          line_++;
+          column_ = 0;
+        } else if ((static_cast<uint8_t>(buf_[j]) & 0xc0) != 0x80) {
+          column_++;
         }
       }
+      buf_.erase(0, i);
+      consumed_ += i;
     }
+    return !failed_;
+  }
 
-    if (!ret) { return {}; }
+  // Total length of the input handed over as items so far
+  size_t consumed() const { return consumed_; }
 
-    // Link references
-    for (auto &x : grammar) {
-      auto &rule = x.second;
-      LinkReferences vis(grammar, rule.params);
-      rule.accept(vis);
-    }
+  // Length of the input buffered for the unfinished item
+  size_t buffered() const { return buf_.size(); }
 
-    // Check left recursion
-    ret = true;
+  std::any &dt() { return dt_; }
 
-    for (auto &[name, rule] : grammar) {
-      DetectLeftRecursion vis(name);
-      rule.accept(vis);
-      if (vis.error_s) {
-        if (log) {
-          auto line = line_info(s, vis.error_s);
-          log(line.first, line.second, "'" + name + "' is left recursive.", "");
-        }
-        ret = false;
+private:
+  static const Definition *find_rule(const parser::Version &version,
+                                     std::string_view name) {
+    auto it = version.grammar->find(
+        std::string(name.empty() ? std::string_view(version.start) : name));
+    return it != version.grammar->end() ? &it->second : nullptr;
+  }
+
+  bool ends_with_items() const {
+    std::unordered_map<std::string, FirstSet> cache;
+    auto first_set = [&](Ope &ope) {
+      ComputeFirstSet vis(cache);
+      ope.accept(vis);
+      return vis.first;
+    };
+
+    auto items = first_set(*rule_->get_core_operator()).chars;
+    CollectTrailingRepetitions vis;
+    rule_->get_core_operator()->accept(vis);
+    for (auto rep : vis.repetitions) {
+      if (TokenChecker::is_token(*rep->ope_)) { continue; }
+      auto chars = first_set(*rep->ope_).chars;
+      if (!chars.all() && items.any() && (items & ~chars).none()) {
+        return true;
       }
     }
+    return false;
+  }
 
-    if (!ret) { return {}; }
+  const parser &parser_;
+  std::shared_ptr<parser::Version> version_; // Kept for the whole input
+  const Definition &start_;
+  const Definition *rule_; // Item rule
+  Handler handler_;
+  std::string buf_;
+  size_t consumed_ = 0;
+  size_t line_ = 0;   // Lines handed over
+  size_t column_ = 0; // Codepoints handed over on the current line
+  bool failed_ = false;
+  std::any dt_;
+};
 
-    // Check infinite loop
-    if (detect_infiniteLoop(data, start_rule, log, s)) { return {}; }
+/*-----------------------------------------------------------------------------
+ *  typed_parser
+ *---------------------------------------------------------------------------*/
 
-    // Automatic whitespace skipping
-    if (grammar.count(WHITESPACE_DEFINITION_NAME)) {
-      for (auto &x : grammar) {
-        auto &rule = x.second;
-        auto ope = rule.get_core_operator();
-        if (IsLiteralToken::check(*ope)) { rule <= tok(ope); }
-      }
+/*
+ * Typed semantic values are kept in a per-parse arena. Only the slot index is
+ * passed through std::any, which fits in its small object buffer, so values
+ * are never boxed on the heap; reading a value costs one any_cast of that
+ * index. Without packrat parsing, the values built by alternatives that are
+ * given up are dropped with them. With it, each rule keeps at most one value
+ * per position until the parse ends, as the memo table does. Slot 0 holds a
+ * default constructed value that stands in for rules which produced nothing.
+ */
+struct TypedSlot {
+  size_t index;
+};
 
-      auto &rule = grammar[WHITESPACE_DEFINITION_NAME];
-      start_rule.whitespaceOpe = wsp(rule.get_core_operator());
+template <typename Value> struct TypedArena : public ValueArena {
+  std::vector<Value> values;
+  std::any *dt = nullptr;
 
-      if (detect_infiniteLoop(data, rule, log, s)) { return {}; }
+  size_t size() const override { return values.size(); }
+
+  void truncate(size_t size) override {
+    if (size < values.size()) {
+      values.erase(values.begin() + static_cast<std::ptrdiff_t>(size),
+                   values.end());
     }
+  }
 
-    // Word expression
-    if (grammar.count(WORD_DEFINITION_NAME)) {
-      auto &rule = grammar[WORD_DEFINITION_NAME];
-      start_rule.wordOpe = rule.get_core_operator();
+  // Throws std::bad_any_cast for a value that no typed action made
+  const Value &get(const std::any &a) const {
+    if (!a.has_value()) { return values[0]; }
+    return values[std::any_cast<const TypedSlot &>(a).index];
+  }
+};
 
-      if (detect_infiniteLoop(data, rule, log, s)) { return {}; }
+template <typename Value> class TypedSemanticValues {
+public:
+  TypedSemanticValues(const SemanticValues &vs, TypedArena<Value> &arena)
+      : vs_(vs), arena_(arena) {}
+
+  size_t size() const { return vs_.size(); }
+  bool empty() const { return vs_.empty(); }
+
+  const Value &operator[](size_t id) const { return arena_.get(vs_[id]); }
+
+  std::vector<Value> transform(size_t beg = 0,
+                               size_t end = static_cast<size_t>(-1)) const {
+    std::vector<Value> r;
+    end = (std::min)(end, size());
+    for (size_t i = beg; i < end; i++) {
+      r.emplace_back((*this)[i]);
     }
+    return r;
+  }
 
-    // Apply instructions
-    for (const auto &[name, instructions] : data.instructions) {
-      auto &rule = grammar[name];
+  std::string_view sv() const { return vs_.sv(); }
+  const std::string &name() const { return vs_.name(); }
+  size_t choice_count() const { return vs_.choice_count(); }
+  size_t choice() const { return vs_.choice(); }
+  std::pair<size_t, size_t> line_info() const { return vs_.line_info(); }
 
-      for (const auto &instruction : instructions) {
-        if (instruction.type == "precedence") {
-          const auto &info =
-              std::any_cast<PrecedenceClimbing::BinOpeInfo>(instruction.data);
+  const std::vector<std::string_view> &tokens() const { return vs_.tokens; }
+  std::string_view token(size_t id = 0) const { return vs_.token(id); }
+  std::string token_to_string(size_t id = 0) const {
+    return vs_.token_to_string(id);
+  }
+  template <typename T> T token_to_number() const {
+    return vs_.template token_to_number<T>();
+  }
 
-          if (!apply_precedence_instruction(rule, info, s, log)) { return {}; }
-        } else if (instruction.type == "error_message") {
-          rule.error_message = std::any_cast<std::string>(instruction.data);
-        } else if (instruction.type == "no_ast_opt") {
-          rule.no_ast_opt = true;
-        }
-      }
+  // User data passed to typed_parser::parse
+  std::any &dt() const { return *arena_.dt; }
+
+  // Untyped view
+  const SemanticValues &values() const { return vs_; }
+
+private:
+  const SemanticValues &vs_;
+  TypedArena<Value> &arena_;
+};
+
+template <typename Value> class typed_parser {
+public:
+  using Values = TypedSemanticValues<Value>;
+
+  class TypedRule {
+  public:
+    TypedRule(Definition &rule) : rule_(rule) {}
+
+    template <typename F> void operator=(F fn) {
+      rule_.action = [fn](SemanticValues &vs, std::any &dt) {
+        auto &arena =
+            static_cast<TypedArena<Value> &>(*std::any_cast<ValueArena *>(dt));
+        Values tvs(vs, arena);
+        arena.values.emplace_back(fn(tvs));
+        return std::any(TypedSlot{arena.values.size() - 1});
+      };
     }
 
-    return {data.grammar, start, data.enablePackratParsing};
+    // Access to enter/leave/predicate/error_message etc.
+    Definition *operator->() { return &rule_; }
+
+  private:
+    Definition &rule_;
+  };
+
+  typed_parser() = default;
+
+  typed_parser(std::string_view sv, const Rules &rules,
+               std::string_view start = {})
+      : parser_(sv, rules, start) {}
+
+  typed_parser(std::string_view sv, std::string_view start = {})
+      : parser_(sv, start) {}
+
+  operator bool() const { return static_cast<bool>(parser_); }
+
+  bool load_grammar(std::string_view sv, const Rules &rules,
+                    std::string_view start = {}) {
+    return parser_.load_grammar(sv, rules, start);
   }
 
-  bool detect_infiniteLoop(const Data &data, Definition &rule, const Log &log,
-                           const char *s) const {
-    std::vector<std::pair<const char *, std::string>> refs;
-    std::unordered_map<std::string, bool> has_error_cache;
-    DetectInfiniteLoop vis(data.start_pos, rule.name, refs, has_error_cache);
-    rule.accept(vis);
-    if (vis.has_error) {
-      if (log) {
-        auto line = line_info(s, vis.error_s);
-        log(line.first, line.second,
-            "infinite loop is detected in '" + vis.error_name + "'.", "");
+  bool load_grammar(std::string_view sv, std::string_view start = {}) {
+    return parser_.load_grammar(sv, start);
+  }
+
+  bool load_draft(std::string_view sv, const Rules &rules,
+                  std::string_view start = {}) {
+    return parser_.load_draft(sv, rules, start);
+  }
+
+  bool load_draft(std::string_view sv, std::string_view start = {}) {
+    return parser_.load_draft(sv, start);
+  }
+
+  bool commit() { return parser_.commit(); }
+
+  bool hot_swap(const typed_parser &next) {
+    return parser_.hot_swap(next.parser_);
+  }
+
+  TypedRule operator[](const char *s) { return TypedRule(parser_[s]); }
+
+  bool parse_n(const char *s, size_t n, std::any &dt, Value &val,
+               const char *path = nullptr) const {
+    TypedArena<Value> arena;
+    arena.values.emplace_back();
+    arena.dt = &dt;
+
+    std::any a = static_cast<ValueArena *>(&arena);
+    auto slot = TypedSlot{0};
+    if (!parser_.parse_n(s, n, a, slot, path)) { return false; }
+    val = std::move(arena.values[slot.index]);
+    return true;
+  }
+
+  bool parse_n(const char *s, size_t n, Value &val,
+               const char *path = nullptr) const {
+    auto parse = [&](const char *s, size_t n) {
+      std::any dt;
+      return parse_n(s, n, dt, val, path);
+    };
+    if constexpr (ParseCache::can_cache<Value>()) {
+      if (parser_.cache_) {
+        return parser_.parse_cached(s, n, &val, path, parse);
       }
-      return true;
     }
-    return false;
+    return parse(s, n);
   }
 
-  Grammar g;
-};
-
-/*-----------------------------------------------------------------------------
- *  AST
- *---------------------------------------------------------------------------*/
+  bool parse(std::string_view sv, Value &val,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), val, path);
+  }
 
-template <typename Annotation> struct AstBase : public Annotation {
-  AstBase(const char *path, size_t line, size_t column, const char *name,
-          const std::vector<std::shared_ptr<AstBase>> &nodes,
-          size_t position = 0, size_t length = 0, size_t choice_count = 0,
-          size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
-        original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(false), nodes(nodes) {}
+  bool parse(std::string_view sv, std::any &dt, Value &val,
+             const char *path = nullptr) const {
+    return parse_n(sv.data(), sv.size(), dt, val, path);
+  }
 
-  AstBase(const char *path, size_t line, size_t column, const char *name,
-          const std::string_view &token, size_t position = 0, size_t length = 0,
-          size_t choice_count = 0, size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
-        original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(true), token(token) {}
+  void disable_eoi_check() { parser_.disable_eoi_check(); }
 
-  AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
-          size_t length = 0, size_t original_choice_count = 0,
-          size_t original_choice = 0)
-      : path(ast.path), line(ast.line), column(ast.column), name(ast.name),
-        position(position), length(length), choice_count(ast.choice_count),
-        choice(ast.choice), original_name(original_name),
-        original_choice_count(original_choice_count),
-        original_choice(original_choice), tag(ast.tag),
-        original_tag(str2tag(original_name)), is_token(ast.is_token),
-        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+  void disable_utf8_check() { parser_.disable_utf8_check(); }
 
-  const std::string path;
-  const size_t line = 1;
-  const size_t column = 1;
+  void enable_packrat_parsing() { parser_.enable_packrat_parsing(); }
 
-  const std::string name;
-  size_t position;
-  size_t length;
-  const size_t choice_count;
-  const size_t choice;
-  const std::string original_name;
-  const size_t original_choice_count;
-  const size_t original_choice;
-  const unsigned int tag;
-  const unsigned int original_tag;
+  size_t compile_tokens() { return parser_.compile_tokens(); }
 
-  const bool is_token;
-  const std::string_view token;
+  void enable_parse_cache(size_t max_bytes = 64 * 1024 * 1024,
+                          ParseCache::ValueSize value_size = nullptr) {
+    parser_.enable_parse_cache(max_bytes, std::move(value_size));
+  }
 
-  std::vector<std::shared_ptr<AstBase<Annotation>>> nodes;
-  std::weak_ptr<AstBase<Annotation>> parent;
+  void clear_parse_cache() { parser_.clear_parse_cache(); }
 
-  std::string token_to_string() const {
-    assert(is_token);
-    return std::string(token);
+  ParseCache::Stats parse_cache_stats() const {
+    return parser_.parse_cache_stats();
   }
 
-  template <typename T> T token_to_number() const {
-    return token_to_number_<T>(token);
+  void enable_backtracking_warnings() {
+    parser_.enable_backtracking_warnings();
   }
-};
 
-template <typename T>
-void ast_to_s_core(const std::shared_ptr<T> &ptr, std::string &s, int level,
-                   std::function<std::string(const T &ast, int level)> fn) {
-  const auto &ast = *ptr;
-  for (auto i = 0; i < level; i++) {
-    s += "  ";
+  void set_memory_limit(size_t bytes, MemoryHook hook = nullptr) {
+    parser_.set_memory_limit(bytes, std::move(hook));
   }
-  auto name = ast.original_name;
-  if (ast.original_choice_count > 0) {
-    name += "/" + std::to_string(ast.original_choice);
+
+  void set_parse_limits(const ParseLimits &limits) {
+    parser_.set_parse_limits(limits);
   }
-  if (ast.name != ast.original_name) { name += "[" + ast.name + "]"; }
-  if (ast.is_token) {
-    s += "- " + name + " (";
-    s += ast.token;
-    s += ")\n";
-  } else {
-    s += "+ " + name + "\n";
+
+  void set_logger(Log log) { parser_.set_logger(log); }
+
+  // Untyped parser (actions registered through it see the arena as `dt`)
+  parser &get_parser() { return parser_; }
+  const parser &get_parser() const { return parser_; }
+
+private:
+  parser parser_;
+};
+
+/*-----------------------------------------------------------------------------
+ *  ct (compile-time grammars)
+ *---------------------------------------------------------------------------*/
+
+/*
+ * Grammars that never change can be written as types, so the compiler
+ * inlines and specializes the whole matcher:
+ *
+ *   struct Number {
+ *     using expr = ct::tok<ct::oom<ct::cls<ct::rng<'0', '9'>>>>;
+ *     static int action(const SemanticValues &vs) {
+ *       return vs.token_to_number<int>();
+ *     }
+ *   };
+ *   struct Additive {
+ *     using expr = ct::cho<ct::seq<Number, ct::lit<'+'>, Additive>, Number>;
+ *     static int action(const SemanticValues &vs) { ... }
+ *   };
+ *   ct::parser<Additive, ct::zom<ct::cls<ct::set<' ', '\t'>>>> p;
+ *
+ * A rule is any type with a nested `expr`, and an optional static `action`
+ * (taking `vs`, or `vs` and `dt`) and `name`. As in the runtime parser,
+ * literals and tokens skip the whitespace expression after them, a rule
+ * without an action passes its first value through, and actions see the
+ * same SemanticValues (except line_info(), which needs a runtime Context).
+ */
+namespace ct {
+
+struct Access {
+  static void reset(SemanticValues &vs, const char *ss) {
+    vs.clear();
+    vs.tags.clear();
+    vs.tokens.clear();
+    vs.sv_ = std::string_view();
+    vs.choice_count_ = 0;
+    vs.choice_ = 0;
+    vs.ss = ss;
   }
-  if (fn) { s += fn(ast, level + 1); }
-  for (auto node : ast.nodes) {
-    ast_to_s_core(node, s, level + 1, fn);
+
+  static void set_choice(SemanticValues &vs, size_t count, size_t id) {
+    vs.choice_count_ = count;
+    vs.choice_ = id;
   }
-}
 
-template <typename T>
-std::string
-ast_to_s(const std::shared_ptr<T> &ptr,
-         std::function<std::string(const T &ast, int level)> fn = nullptr) {
-  std::string s;
-  ast_to_s_core(ptr, s, 0, fn);
-  return s;
-}
+  static void set_match(SemanticValues &vs, std::string_view sv,
+                        const char *name) {
+    vs.sv_ = sv;
+    if (name) { vs.name_ = name; }
+  }
+};
 
-struct AstOptimizer {
-  AstOptimizer(bool mode, const std::vector<std::string> &rules = {})
-      : mode_(mode), rules_(rules) {}
+template <typename Whitespace> class MatchContext {
+public:
+  MatchContext(const char *s, size_t l, std::any &dt) : s(s), l(l), dt(dt) {}
 
-  template <typename T>
-  std::shared_ptr<T> optimize(std::shared_ptr<T> original,
-                              std::shared_ptr<T> parent = nullptr) {
-    auto found =
-        std::find(rules_.begin(), rules_.end(), original->name) != rules_.end();
-    auto opt = mode_ ? !found : found;
+  const char *s;
+  const size_t l;
+  std::any &dt;
+  const char *error_pos = nullptr;
+  size_t in_token_boundary_count = 0;
 
-    if (opt && original->nodes.size() == 1) {
-      auto child = optimize(original->nodes[0], parent);
-      auto ast = std::make_shared<T>(*child, original->name.data(),
-                                     original->choice_count, original->position,
-                                     original->length, original->choice);
-      for (auto node : ast->nodes) {
-        node->parent = ast;
-      }
-      return ast;
+  SemanticValues &push() {
+    if (value_stack_size == value_stack.size()) {
+      value_stack.emplace_back(std::make_unique<SemanticValues>());
     }
+    auto &vs = *value_stack[value_stack_size++];
+    Access::reset(vs, s);
+    return vs;
+  }
 
-    auto ast = std::make_shared<T>(*original);
-    ast->parent = parent;
-    ast->nodes.clear();
-    for (auto node : original->nodes) {
-      auto child = optimize(node, ast);
-      ast->nodes.push_back(child);
-    }
-    return ast;
+  void pop() { value_stack_size--; }
+
+  size_t fail(const char *a_s) {
+    if (error_pos < a_s) { error_pos = a_s; }
+    return static_cast<size_t>(-1);
   }
 
+  size_t skip_whitespace(const char *a_s, size_t n);
+
 private:
-  const bool mode_;
-  const std::vector<std::string> rules_;
+  std::vector<std::unique_ptr<SemanticValues>> value_stack;
+  size_t value_stack_size = 0;
 };
 
-struct EmptyType {};
-using Ast = AstBase<EmptyType>;
+template <typename T, typename = void> struct is_rule : std::false_type {};
+template <typename T>
+struct is_rule<T, std::void_t<typename T::expr>> : std::true_type {};
 
-template <typename T = Ast> void add_ast_action(Definition &rule) {
-  rule.action = [&](const SemanticValues &vs) {
-    auto line = vs.line_info();
+template <typename T, typename = void> struct has_action : std::false_type {};
+template <typename T>
+struct has_action<T, std::void_t<decltype(&T::action)>> : std::true_type {};
 
-    if (rule.is_token()) {
-      return std::make_shared<T>(
-          vs.path, line.first, line.second, rule.name.data(), vs.token(),
-          std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
-          vs.choice_count(), vs.choice());
-    }
+template <typename T, typename = void> struct has_name : std::false_type {};
+template <typename T>
+struct has_name<T, std::void_t<decltype(T::name)>> : std::true_type {};
 
-    auto ast =
-        std::make_shared<T>(vs.path, line.first, line.second, rule.name.data(),
-                            vs.transform<std::shared_ptr<T>>(),
-                            std::distance(vs.ss, vs.sv().data()),
-                            vs.sv().length(), vs.choice_count(), vs.choice());
+template <typename E, typename C>
+size_t match(const char *s, size_t n, SemanticValues &vs, C &c);
 
-    for (auto node : ast->nodes) {
-      node->parent = ast;
+// Whether `E` can match without consuming input. `Visiting` holds the rules
+// being looked into, and a rule that refers back to one of them counts as
+// consuming, as only left recursion can reach it without input.
+template <typename E, typename... Visiting> constexpr bool nullable() {
+  if constexpr (is_rule<E>::value) {
+    if constexpr ((std::is_same_v<E, Visiting> || ...)) {
+      return false;
+    } else {
+      return nullable<typename E::expr, E, Visiting...>();
     }
-    return ast;
-  };
+  } else {
+    return E::template nullable<Visiting...>();
+  }
 }
 
-#define PEG_EXPAND(...) __VA_ARGS__
-#define PEG_CONCAT(a, b) a##b
-#define PEG_CONCAT2(a, b) PEG_CONCAT(a, b)
+// Character classes, matched by codepoint as in CharacterClass
+template <char32_t Lo, char32_t Hi> struct rng {
+  static constexpr bool test(char32_t cp) { return Lo <= cp && cp <= Hi; }
+};
 
-#define PEG_PICK(                                                              \
-    a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16, \
-    a17, a18, a19, a20, a21, a22, a23, a24, a25, a26, a27, a28, a29, a30, a31, \
-    a32, a33, a34, a35, a36, a37, a38, a39, a40, a41, a42, a43, a44, a45, a46, \
-    a47, a48, a49, a50, a51, a52, a53, a54, a55, a56, a57, a58, a59, a60, a61, \
-    a62, a63, a64, a65, a66, a67, a68, a69, a70, a71, a72, a73, a74, a75, a76, \
-    a77, a78, a79, a80, a81, a82, a83, a84, a85, a86, a87, a88, a89, a90, a91, \
-    a92, a93, a94, a95, a96, a97, a98, a99, a100, ...)                         \
-  a100
+template <char32_t... Cs> struct set {
+  static constexpr bool test(char32_t cp) { return ((cp == Cs) || ...); }
+};
 
-#define PEG_COUNT(...)                                                         \
-  PEG_EXPAND(PEG_PICK(                                                         \
-      __VA_ARGS__, 100, 99, 98, 97, 96, 95, 94, 93, 92, 91, 90, 89, 88, 87,    \
-      86, 85, 84, 83, 82, 81, 80, 79, 78, 77, 76, 75, 74, 73, 72, 71, 70, 69,  \
-      68, 67, 66, 65, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51,  \
-      50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33,  \
-      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,  \
-      14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0))
+template <typename... Parts> struct cls {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    size_t len = 0;
+    char32_t cp = 0;
+    if (!decode_codepoint(s, n, len, cp) || !(Parts::test(cp) || ...)) {
+      return c.fail(s);
+    }
+    return len;
+  }
 
-#define PEG_DEF_1(r)                                                           \
-  peg::Definition r;                                                           \
-  r.name = #r;                                                                 \
-  peg::add_ast_action(r);
+  template <typename...> static constexpr bool nullable() { return false; }
+};
 
-#define PEG_DEF_2(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_1(__VA_ARGS__))
-#define PEG_DEF_3(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_2(__VA_ARGS__))
-#define PEG_DEF_4(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_3(__VA_ARGS__))
-#define PEG_DEF_5(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_4(__VA_ARGS__))
-#define PEG_DEF_6(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_5(__VA_ARGS__))
-#define PEG_DEF_7(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_6(__VA_ARGS__))
-#define PEG_DEF_8(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_7(__VA_ARGS__))
-#define PEG_DEF_9(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_8(__VA_ARGS__))
-#define PEG_DEF_10(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_9(__VA_ARGS__))
-#define PEG_DEF_11(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_10(__VA_ARGS__))
-#define PEG_DEF_12(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_11(__VA_ARGS__))
-#define PEG_DEF_13(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_12(__VA_ARGS__))
-#define PEG_DEF_14(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_13(__VA_ARGS__))
-#define PEG_DEF_15(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_14(__VA_ARGS__))
-#define PEG_DEF_16(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_15(__VA_ARGS__))
-#define PEG_DEF_17(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_16(__VA_ARGS__))
-#define PEG_DEF_18(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_17(__VA_ARGS__))
-#define PEG_DEF_19(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_18(__VA_ARGS__))
-#define PEG_DEF_20(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_19(__VA_ARGS__))
-#define PEG_DEF_21(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_20(__VA_ARGS__))
-#define PEG_DEF_22(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_21(__VA_ARGS__))
-#define PEG_DEF_23(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_22(__VA_ARGS__))
-#define PEG_DEF_24(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_23(__VA_ARGS__))
-#define PEG_DEF_25(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_24(__VA_ARGS__))
-#define PEG_DEF_26(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_25(__VA_ARGS__))
-#define PEG_DEF_27(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_26(__VA_ARGS__))
-#define PEG_DEF_28(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_27(__VA_ARGS__))
-#define PEG_DEF_29(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_28(__VA_ARGS__))
-#define PEG_DEF_30(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_29(__VA_ARGS__))
-#define PEG_DEF_31(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_30(__VA_ARGS__))
-#define PEG_DEF_32(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_31(__VA_ARGS__))
-#define PEG_DEF_33(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_32(__VA_ARGS__))
-#define PEG_DEF_34(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_33(__VA_ARGS__))
-#define PEG_DEF_35(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_34(__VA_ARGS__))
-#define PEG_DEF_36(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_35(__VA_ARGS__))
-#define PEG_DEF_37(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_36(__VA_ARGS__))
-#define PEG_DEF_38(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_37(__VA_ARGS__))
-#define PEG_DEF_39(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_38(__VA_ARGS__))
-#define PEG_DEF_40(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_39(__VA_ARGS__))
-#define PEG_DEF_41(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_40(__VA_ARGS__))
-#define PEG_DEF_42(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_41(__VA_ARGS__))
-#define PEG_DEF_43(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_42(__VA_ARGS__))
-#define PEG_DEF_44(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_43(__VA_ARGS__))
-#define PEG_DEF_45(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_44(__VA_ARGS__))
-#define PEG_DEF_46(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_45(__VA_ARGS__))
-#define PEG_DEF_47(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_46(__VA_ARGS__))
-#define PEG_DEF_48(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_47(__VA_ARGS__))
-#define PEG_DEF_49(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_48(__VA_ARGS__))
-#define PEG_DEF_50(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_49(__VA_ARGS__))
-#define PEG_DEF_51(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_50(__VA_ARGS__))
-#define PEG_DEF_52(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_51(__VA_ARGS__))
-#define PEG_DEF_53(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_52(__VA_ARGS__))
-#define PEG_DEF_54(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_53(__VA_ARGS__))
-#define PEG_DEF_55(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_54(__VA_ARGS__))
-#define PEG_DEF_56(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_55(__VA_ARGS__))
-#define PEG_DEF_57(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_56(__VA_ARGS__))
-#define PEG_DEF_58(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_57(__VA_ARGS__))
-#define PEG_DEF_59(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_58(__VA_ARGS__))
-#define PEG_DEF_60(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_59(__VA_ARGS__))
-#define PEG_DEF_61(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_60(__VA_ARGS__))
-#define PEG_DEF_62(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_61(__VA_ARGS__))
-#define PEG_DEF_63(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_62(__VA_ARGS__))
-#define PEG_DEF_64(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_63(__VA_ARGS__))
-#define PEG_DEF_65(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_64(__VA_ARGS__))
-#define PEG_DEF_66(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_65(__VA_ARGS__))
-#define PEG_DEF_67(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_66(__VA_ARGS__))
-#define PEG_DEF_68(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_67(__VA_ARGS__))
-#define PEG_DEF_69(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_68(__VA_ARGS__))
-#define PEG_DEF_70(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_69(__VA_ARGS__))
-#define PEG_DEF_71(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_70(__VA_ARGS__))
-#define PEG_DEF_72(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_71(__VA_ARGS__))
-#define PEG_DEF_73(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_72(__VA_ARGS__))
-#define PEG_DEF_74(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_73(__VA_ARGS__))
-#define PEG_DEF_75(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_74(__VA_ARGS__))
-#define PEG_DEF_76(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_75(__VA_ARGS__))
-#define PEG_DEF_77(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_76(__VA_ARGS__))
-#define PEG_DEF_78(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_77(__VA_ARGS__))
-#define PEG_DEF_79(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_78(__VA_ARGS__))
-#define PEG_DEF_80(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_79(__VA_ARGS__))
-#define PEG_DEF_81(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_80(__VA_ARGS__))
-#define PEG_DEF_82(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_81(__VA_ARGS__))
-#define PEG_DEF_83(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_82(__VA_ARGS__))
-#define PEG_DEF_84(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_83(__VA_ARGS__))
-#define PEG_DEF_85(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_84(__VA_ARGS__))
-#define PEG_DEF_86(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_85(__VA_ARGS__))
-#define PEG_DEF_87(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_86(__VA_ARGS__))
-#define PEG_DEF_88(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_87(__VA_ARGS__))
-#define PEG_DEF_89(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_88(__VA_ARGS__))
-#define PEG_DEF_90(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_89(__VA_ARGS__))
-#define PEG_DEF_91(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_90(__VA_ARGS__))
-#define PEG_DEF_92(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_91(__VA_ARGS__))
-#define PEG_DEF_93(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_92(__VA_ARGS__))
-#define PEG_DEF_94(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_93(__VA_ARGS__))
-#define PEG_DEF_95(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_94(__VA_ARGS__))
-#define PEG_DEF_96(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_95(__VA_ARGS__))
-#define PEG_DEF_97(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_96(__VA_ARGS__))
-#define PEG_DEF_98(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_97(__VA_ARGS__))
-#define PEG_DEF_99(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_98(__VA_ARGS__))
-#define PEG_DEF_100(r1, ...) PEG_EXPAND(PEG_DEF_1(r1) PEG_DEF_99(__VA_ARGS__))
+template <typename... Parts> struct ncls {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    size_t len = 0;
+    char32_t cp = 0;
+    if (!decode_codepoint(s, n, len, cp) || (Parts::test(cp) || ...)) {
+      return c.fail(s);
+    }
+    return len;
+  }
 
-#define AST_DEFINITIONS(...)                                                   \
-  PEG_EXPAND(PEG_CONCAT2(PEG_DEF_, PEG_COUNT(__VA_ARGS__))(__VA_ARGS__))
+  template <typename...> static constexpr bool nullable() { return false; }
+};
 
-/*-----------------------------------------------------------------------------
- *  parser
- *---------------------------------------------------------------------------*/
+struct dot {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    auto len = codepoint_length(s, n);
+    if (len < 1) { return c.fail(s); }
+    return len;
+  }
 
-class parser {
-public:
-  parser() = default;
+  template <typename...> static constexpr bool nullable() { return false; }
+};
 
-  parser(const char *s, size_t n, const Rules &rules,
-         std::string_view start = {}) {
-    load_grammar(s, n, rules, start);
+// Literals
+template <char... Cs> struct lit {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    static constexpr char str[] = {Cs...};
+    if (n < sizeof(str) || std::memcmp(s, str, sizeof(str)) != 0) {
+      return c.fail(s);
+    }
+    return sizeof(str) + c.skip_whitespace(s + sizeof(str), n - sizeof(str));
   }
 
-  parser(const char *s, size_t n, std::string_view start = {})
-      : parser(s, n, Rules(), start) {}
-
-  parser(std::string_view sv, const Rules &rules, std::string_view start = {})
-      : parser(sv.data(), sv.size(), rules, start) {}
+  template <typename...> static constexpr bool nullable() {
+    return sizeof...(Cs) == 0;
+  }
+};
 
-  parser(std::string_view sv, std::string_view start = {})
-      : parser(sv.data(), sv.size(), Rules(), start) {}
+#if defined(__cpp_nontype_template_args) &&                                    \
+    __cpp_nontype_template_args >= 201911L
+template <size_t N> struct fixed_string {
+  constexpr fixed_string(const char (&s)[N]) {
+    for (size_t i = 0; i < N; i++) {
+      buf[i] = s[i];
+    }
+  }
+  char buf[N];
+};
 
-#if defined(__cpp_lib_char8_t)
-  parser(std::u8string_view sv, const Rules &rules, std::string_view start = {})
-      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), rules,
-               start) {}
+template <fixed_string S> struct str {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    constexpr auto len = sizeof(S.buf) - 1;
+    if (n < len || std::memcmp(s, S.buf, len) != 0) { return c.fail(s); }
+    return len + c.skip_whitespace(s + len, n - len);
+  }
 
-  parser(std::u8string_view sv, std::string_view start = {})
-      : parser(reinterpret_cast<const char *>(sv.data()), sv.size(), Rules(),
-               start) {}
+  template <typename...> static constexpr bool nullable() {
+    return sizeof(S.buf) == 1;
+  }
+};
 #endif
 
-  operator bool() { return grammar_ != nullptr; }
-
-  bool load_grammar(const char *s, size_t n, const Rules &rules,
-                    std::string_view start = {}) {
-    auto cxt = ParserGenerator::parse(s, n, rules, log_, start);
-    grammar_ = cxt.grammar;
-    start_ = cxt.start;
-    enablePackratParsing_ = cxt.enablePackratParsing;
-    return grammar_ != nullptr;
+// Combinators
+template <typename... Es> struct seq {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &vs, C &c) {
+    size_t i = 0;
+    auto ok = ((step<Es>(s, n, vs, c, i)) && ...);
+    return ok ? i : static_cast<size_t>(-1);
   }
 
-  bool load_grammar(const char *s, size_t n, std::string_view start = {}) {
-    return load_grammar(s, n, Rules(), start);
+  template <typename... Visiting> static constexpr bool nullable() {
+    return (ct::nullable<Es, Visiting...>() && ...);
   }
 
-  bool load_grammar(std::string_view sv, const Rules &rules,
-                    std::string_view start = {}) {
-    return load_grammar(sv.data(), sv.size(), rules, start);
+private:
+  template <typename E, typename C>
+  static bool step(const char *s, size_t n, SemanticValues &vs, C &c,
+                   size_t &i) {
+    auto len = ct::match<E>(s + i, n - i, vs, c);
+    if (fail(len)) { return false; }
+    i += len;
+    return true;
   }
+};
 
-  bool load_grammar(std::string_view sv, std::string_view start = {}) {
-    return load_grammar(sv.data(), sv.size(), start);
+template <typename... Es> struct cho {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &vs, C &c) {
+    auto len = static_cast<size_t>(-1);
+    size_t id = 0;
+    ((attempt<Es>(s, n, vs, c, len) || (id++, false)) || ...);
+    if (success(len)) { Access::set_choice(vs, sizeof...(Es), id); }
+    return len;
   }
 
-  bool parse_n(const char *s, size_t n, const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse(s, n, path, log_);
-      return post_process(s, n, result);
-    }
-    return false;
+  template <typename... Visiting> static constexpr bool nullable() {
+    return (ct::nullable<Es, Visiting...>() || ...);
   }
 
-  bool parse_n(const char *s, size_t n, std::any &dt,
-               const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse(s, n, dt, path, log_);
-      return post_process(s, n, result);
-    }
+private:
+  template <typename E, typename C>
+  static bool attempt(const char *s, size_t n, SemanticValues &vs, C &c,
+                      size_t &len) {
+    auto save_size = vs.size();
+    auto save_tokens_size = vs.tokens.size();
+    len = ct::match<E>(s, n, vs, c);
+    if (success(len)) { return true; }
+    vs.erase(vs.begin() + static_cast<std::ptrdiff_t>(save_size), vs.end());
+    vs.tokens.resize(save_tokens_size);
     return false;
   }
+};
 
-  template <typename T>
-  bool parse_n(const char *s, size_t n, T &val,
-               const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse_and_get_value(s, n, val, path, log_);
-      return post_process(s, n, result);
+template <typename E, size_t Min, size_t Max> struct rep {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &vs, C &c) {
+    // Caught by DetectInfiniteLoop in a runtime grammar
+    static_assert(Max != std::numeric_limits<size_t>::max() ||
+                      !ct::nullable<E>(),
+                  "ct::rep: unbounded repetition of an expression that can "
+                  "match without consuming input");
+    size_t count = 0;
+    size_t i = 0;
+    while (count < Max) {
+      auto save_size = vs.size();
+      auto save_tokens_size = vs.tokens.size();
+      auto len = ct::match<E>(s + i, n - i, vs, c);
+      if (fail(len)) {
+        vs.erase(vs.begin() + static_cast<std::ptrdiff_t>(save_size),
+                 vs.end());
+        vs.tokens.resize(save_tokens_size);
+        break;
+      }
+      i += len;
+      count++;
     }
-    return false;
+    return count < Min ? static_cast<size_t>(-1) : i;
   }
 
-  template <typename T>
-  bool parse_n(const char *s, size_t n, std::any &dt, T &val,
-               const char *path = nullptr) const {
-    if (grammar_ != nullptr) {
-      const auto &rule = (*grammar_)[start_];
-      auto result = rule.parse_and_get_value(s, n, dt, val, path, log_);
-      return post_process(s, n, result);
-    }
-    return false;
+  template <typename... Visiting> static constexpr bool nullable() {
+    return Min == 0 || ct::nullable<E, Visiting...>();
   }
+};
 
-  bool parse(std::string_view sv, const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), path);
-  }
+template <typename E>
+using zom = rep<E, 0, std::numeric_limits<size_t>::max()>;
+template <typename E>
+using oom = rep<E, 1, std::numeric_limits<size_t>::max()>;
+template <typename E> using opt = rep<E, 0, 1>;
 
-  bool parse(std::string_view sv, std::any &dt,
-             const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), dt, path);
+template <typename E> struct apd {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    auto &chvs = c.push();
+    auto len = ct::match<E>(s, n, chvs, c);
+    c.pop();
+    return success(len) ? 0 : len;
   }
 
-  template <typename T>
-  bool parse(std::string_view sv, T &val, const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), val, path);
-  }
+  template <typename...> static constexpr bool nullable() { return true; }
+};
 
-  template <typename T>
-  bool parse(std::string_view sv, std::any &dt, T &val,
-             const char *path = nullptr) const {
-    return parse_n(sv.data(), sv.size(), dt, val, path);
+template <typename E> struct npd {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    auto &chvs = c.push();
+    auto len = ct::match<E>(s, n, chvs, c);
+    c.pop();
+    return success(len) ? c.fail(s) : 0;
   }
 
-#if defined(__cpp_lib_char8_t)
-  bool parse(std::u8string_view sv, const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), path);
+  template <typename...> static constexpr bool nullable() { return true; }
+};
+
+template <typename E> struct tok {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &vs, C &c) {
+    c.in_token_boundary_count++;
+    auto len = ct::match<E>(s, n, vs, c);
+    c.in_token_boundary_count--;
+    if (fail(len)) { return len; }
+    vs.tokens.emplace_back(s, len);
+    return len + c.skip_whitespace(s + len, n - len);
   }
 
-  bool parse(std::u8string_view sv, std::any &dt,
-             const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
-                   path);
+  template <typename... Visiting> static constexpr bool nullable() {
+    return ct::nullable<E, Visiting...>();
   }
+};
 
-  template <typename T>
-  bool parse(std::u8string_view sv, T &val, const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), val,
-                   path);
+template <typename E> struct ign {
+  template <typename C>
+  static size_t match(const char *s, size_t n, SemanticValues &, C &c) {
+    auto &chvs = c.push();
+    auto len = ct::match<E>(s, n, chvs, c);
+    c.pop();
+    return len;
   }
 
-  template <typename T>
-  bool parse(std::u8string_view sv, std::any &dt, T &val,
-             const char *path = nullptr) const {
-    return parse_n(reinterpret_cast<const char *>(sv.data()), sv.size(), dt,
-                   val, path);
+  template <typename... Visiting> static constexpr bool nullable() {
+    return ct::nullable<E, Visiting...>();
   }
-#endif
+};
 
-  Definition &operator[](const char *s) { return (*grammar_)[s]; }
+template <typename T> struct is_cho : std::false_type {};
+template <typename... Es> struct is_cho<cho<Es...>> : std::true_type {};
 
-  const Definition &operator[](const char *s) const { return (*grammar_)[s]; }
+template <typename R, typename C>
+size_t match_rule(const char *s, size_t n, SemanticValues &vs, C &c) {
+  auto &chvs = c.push();
+  auto se = scope_exit([&]() { c.pop(); });
 
-  const Grammar &get_grammar() const { return *grammar_; }
+  auto len = match<typename R::expr>(s, n, chvs, c);
+  if (fail(len)) { return len; }
 
-  void disable_eoi_check() {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.eoi_check = false;
-    }
+  const char *name = nullptr;
+  if constexpr (has_name<R>::value) { name = R::name; }
+  Access::set_match(chvs, std::string_view(s, len), name);
+  if constexpr (!is_cho<typename R::expr>::value) {
+    Access::set_choice(chvs, 0, 0);
   }
 
-  void enable_packrat_parsing() {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.enablePackratParsing = enablePackratParsing_;
+  if constexpr (has_action<R>::value) {
+    if constexpr (argument_count<decltype(&R::action)>::value == 1) {
+      vs.emplace_back(call(R::action, chvs));
+    } else {
+      vs.emplace_back(call(R::action, chvs, c.dt));
     }
+  } else if (chvs.empty()) {
+    vs.emplace_back();
+  } else {
+    vs.emplace_back(std::move(chvs.front()));
   }
+  return len;
+}
 
-  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.tracer_enter = tracer_enter;
-      rule.tracer_leave = tracer_leave;
-    }
+template <typename E, typename C>
+size_t match(const char *s, size_t n, SemanticValues &vs, C &c) {
+  if constexpr (is_rule<E>::value) {
+    return match_rule<E>(s, n, vs, c);
+  } else {
+    return E::match(s, n, vs, c);
   }
+}
 
-  void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave,
-                    TracerStartOrEnd tracer_start,
-                    TracerStartOrEnd tracer_end) {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.tracer_enter = tracer_enter;
-      rule.tracer_leave = tracer_leave;
-      rule.tracer_start = tracer_start;
-      rule.tracer_end = tracer_end;
-    }
+template <typename Whitespace>
+inline size_t MatchContext<Whitespace>::skip_whitespace(const char *a_s,
+                                                       size_t n) {
+  if constexpr (std::is_void_v<Whitespace>) {
+    return 0;
+  } else {
+    if (in_token_boundary_count) { return 0; }
+    in_token_boundary_count++;
+    auto &chvs = push();
+    auto len = ct::match<Whitespace>(a_s, n, chvs, *this);
+    pop();
+    in_token_boundary_count--;
+    return success(len) ? len : 0;
   }
+}
 
-  void set_verbose_trace(bool verbose_trace) {
-    if (grammar_ != nullptr) {
-      auto &rule = (*grammar_)[start_];
-      rule.verbose_trace = verbose_trace;
-    }
-  }
+template <typename Start, typename Whitespace = void> class parser {
+public:
+  struct Result {
+    bool ret;
+    size_t len;
+    const char *error_pos;
+  };
 
-  template <typename T = Ast> parser &enable_ast() {
-    for (auto &[_, rule] : *grammar_) {
-      if (!rule.action) { add_ast_action<T>(rule); }
-    }
-    return *this;
-  }
+  Result parse_n(const char *s, size_t n, SemanticValues &vs,
+                 std::any &dt) const {
+    MatchContext<Whitespace> c(s, n, dt);
+    Access::reset(vs, s);
 
-  template <typename T>
-  std::shared_ptr<T> optimize_ast(std::shared_ptr<T> ast,
-                                  bool opt_mode = true) const {
-    return AstOptimizer(opt_mode, get_no_ast_opt_rules()).optimize(ast);
+    auto i = c.skip_whitespace(s, n);
+    auto len = ct::match<Start>(s + i, n - i, vs, c);
+    if (fail(len)) { return Result{false, i, c.error_pos}; }
+    i += len;
+    if (i < n) { return Result{false, i, std::max(c.error_pos, s + i)}; }
+    return Result{true, i, nullptr};
   }
 
-  void set_logger(Log log) { log_ = log; }
-
-  void set_logger(
-      std::function<void(size_t line, size_t col, const std::string &msg)>
-          log) {
-    log_ = [log](size_t line, size_t col, const std::string &msg,
-                 const std::string & /*rule*/) { log(line, col, msg); };
+  bool parse(std::string_view sv) const {
+    SemanticValues vs;
+    std::any dt;
+    return parse_n(sv.data(), sv.size(), vs, dt).ret;
   }
 
-private:
-  bool post_process(const char *s, size_t n, Definition::Result &r) const {
-    if (log_ && !r.ret) { r.error_info.output_log(log_, s, n); }
-    return r.ret && !r.recovered;
+  template <typename T> bool parse(std::string_view sv, T &val) const {
+    std::any dt;
+    return parse(sv, dt, val);
   }
 
-  std::vector<std::string> get_no_ast_opt_rules() const {
-    std::vector<std::string> rules;
-    for (auto &[name, rule] : *grammar_) {
-      if (rule.no_ast_opt) { rules.push_back(name); }
+  template <typename T>
+  bool parse(std::string_view sv, std::any &dt, T &val) const {
+    SemanticValues vs;
+    auto r = parse_n(sv.data(), sv.size(), vs, dt);
+    if (r.ret && !vs.empty() && vs.front().has_value()) {
+      val = std::any_cast<T>(vs[0]);
     }
-    return rules;
+    return r.ret;
   }
-
-  std::shared_ptr<Grammar> grammar_;
-  std::string start_;
-  bool enablePackratParsing_ = false;
-  Log log_;
 };
 
+} // namespace ct
+
 /*-----------------------------------------------------------------------------
  *  enable_tracing
  *---------------------------------------------------------------------------*/
@@ -4821,6 +10470,173 @@ inline void enable_tracing(parser &parser, std::ostream &os) {
       [&](auto &) {});
 }
 
+/*-----------------------------------------------------------------------------
+ *  enable_trace_recording
+ *---------------------------------------------------------------------------*/
+
+inline void write_json_string(std::ostream &os, std::string_view str) {
+  os << '"';
+  for (auto ch : str) {
+    if (ch == '"' || ch == '\\') {
+      os << '\\' << ch;
+    } else if (static_cast<unsigned char>(ch) < 0x20) {
+      char buff[8];
+      snprintf(buff, sizeof(buff), "\\u%04x", ch);
+      os << buff;
+    } else {
+      os << ch;
+    }
+  }
+  os << '"';
+}
+
+// Records rule enter/leave events into a fixed size ring buffer. Recording
+// does not allocate; only the first sight of a rule copies its name. When the
+// buffer is full the oldest events are overwritten. A recorder must not be
+// shared by parses running at the same time.
+class TraceRecorder {
+public:
+  enum class Kind : uint32_t { Enter, Success, Fail };
+
+  struct Event {
+    uint64_t time;  // nanoseconds since the recorder was created or cleared
+    uint32_t value; // Enter: input position, Success: match length
+    uint32_t rule;  // rule id in the low 30 bits, kind in the high 2 bits
+  };
+
+  explicit TraceRecorder(size_t capacity = 1 << 20)
+      : events_((std::max)(capacity, size_t(1))),
+        start_(std::chrono::steady_clock::now()) {}
+
+  void clear() {
+    head_ = 0;
+    size_ = 0;
+    dropped_ = 0;
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return events_.size(); }
+  size_t dropped() const { return dropped_; }
+
+  const std::string &rule_name(size_t rule) const {
+    static const std::string unknown;
+    return rule < names_.size() ? names_[rule] : unknown;
+  }
+
+  static Kind kind(const Event &e) { return static_cast<Kind>(e.rule >> 30); }
+  static size_t rule(const Event &e) { return e.rule & rule_mask; }
+
+  // Oldest event first
+  template <typename F> void for_each(F fn) const {
+    auto first = (head_ + events_.size() - size_) % events_.size();
+    for (size_t i = 0; i < size_; i++) {
+      fn(events_[(first + i) % events_.size()]);
+    }
+  }
+
+  void record(Kind kind, const Holder &holder, size_t value) {
+    auto id = holder.outer_->id;
+    if (id >= names_.size()) { names_.resize(id + 1); }
+    if (names_[id].empty()) { names_[id] = holder.name(); }
+
+    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_)
+                    .count();
+    events_[head_] = {static_cast<uint64_t>(time),
+                      static_cast<uint32_t>(value),
+                      static_cast<uint32_t>(id & rule_mask) |
+                          (static_cast<uint32_t>(kind) << 30)};
+    head_ = (head_ + 1) % events_.size();
+    if (size_ < events_.size()) {
+      size_++;
+    } else {
+      dropped_++;
+    }
+  }
+
+  // Chrome trace_event JSON with one complete ("X") event per rule span, for
+  // chrome://tracing and Perfetto. Leave events whose enter was overwritten
+  // are skipped, and spans still open are closed at the last event.
+  void write_chrome_trace(std::ostream &os) const {
+    struct Open {
+      uint32_t rule;
+      uint32_t pos;
+      uint64_t time;
+    };
+    std::vector<Open> stack;
+    uint64_t last = 0;
+    auto first = true;
+
+    auto span = [&](const Open &o, uint64_t end, const char *result,
+                    uint32_t len) {
+      char buff[128];
+      os << (first ? "\n" : ",\n") << "{\"name\":";
+      write_json_string(os, rule_name(o.rule));
+      snprintf(buff, sizeof(buff),
+               ",\"cat\":\"rule\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+               "\"pid\":1,\"tid\":1,\"args\":{\"pos\":%u,\"result\":\"%s\"",
+               o.time / 1000.0, (end - o.time) / 1000.0, o.pos, result);
+      os << buff;
+      if (len != static_cast<uint32_t>(-1)) { os << ",\"len\":" << len; }
+      os << "}}";
+      first = false;
+    };
+
+    os << "{\"traceEvents\":[";
+    for_each([&](const Event &e) {
+      last = e.time;
+      if (kind(e) == Kind::Enter) {
+        stack.push_back({e.rule & rule_mask, e.value, e.time});
+      } else if (!stack.empty() && stack.back().rule == (e.rule & rule_mask)) {
+        auto success = kind(e) == Kind::Success;
+        span(stack.back(), e.time, success ? "success" : "fail",
+             success ? e.value : static_cast<uint32_t>(-1));
+        stack.pop_back();
+      }
+    });
+    while (!stack.empty()) {
+      span(stack.back(), last, "open", static_cast<uint32_t>(-1));
+      stack.pop_back();
+    }
+    os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  }
+
+private:
+  static constexpr uint32_t rule_mask = (1u << 30) - 1;
+
+  std::vector<Event> events_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+  size_t dropped_ = 0;
+  std::vector<std::string> names_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+inline void enable_trace_recording(parser &parser, TraceRecorder &recorder) {
+  parser.enable_trace(
+      [](auto &ope, auto s, auto, auto &, auto &c, auto &,
+         std::any &trace_data) {
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          std::any_cast<TraceRecorder *>(trace_data)
+              ->record(TraceRecorder::Kind::Enter, *holder,
+                       static_cast<size_t>(s - c.s));
+        }
+      },
+      [](auto &ope, auto, auto, auto &, auto &, auto &, auto len,
+         std::any &trace_data) {
+        if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
+          auto success = len != static_cast<size_t>(-1);
+          std::any_cast<TraceRecorder *>(trace_data)
+              ->record(success ? TraceRecorder::Kind::Success
+                               : TraceRecorder::Kind::Fail,
+                       *holder, success ? len : 0);
+        }
+      },
+      [&recorder](auto &trace_data) { trace_data = &recorder; },
+      [](auto &) {});
+}
+
 /*-----------------------------------------------------------------------------
  *  enable_profiling
  *---------------------------------------------------------------------------*/
@@ -4851,7 +10667,7 @@ inline void enable_profiling(parser &parser, std::ostream &os) {
           stats.total++;
         }
       },
-      [&](auto &ope, auto, auto, auto &, auto &, auto &, auto len,
+      [&](auto &ope, auto, auto, auto &, auto &c, auto &, auto len,
           std::any &trace_data) {
         if (auto holder = dynamic_cast<const peg::Holder *>(&ope)) {
           auto &stats = *std::any_cast<Stats *>(trace_data);
@@ -4907,6 +10723,20 @@ inline void enable_profiling(parser &parser, std::ostream &os) {
               os << buff << std::endl;
               id++;
             }
+
+            const auto &memory = c.memory;
+            os << std::endl << "        peak     current  memory (bytes)"
+               << std::endl;
+            for (size_t i = 0; i < peg::memory_category_count; i++) {
+              snprintf(buff, BUFSIZ, "  %10zu  %10zu  %s", memory.peak[i],
+                       memory.current[i],
+                       peg::memory_category_name(
+                           static_cast<peg::MemoryCategory>(i)));
+              os << buff << std::endl;
+            }
+            snprintf(buff, BUFSIZ, "  %10zu  %10zu  %s", memory.total_peak,
+                     memory.total, "Total");
+            os << buff << std::endl;
           }
         }
       },
@@ -4920,4 +10750,229 @@ inline void enable_profiling(parser &parser, std::ostream &os) {
         delete stats;
       });
 }
+
+/*-----------------------------------------------------------------------------
+ *  enable_heatmap_profiling
+ *---------------------------------------------------------------------------*/
+
+// Attributes operator invocations, backtracks and failures to the input
+// offsets where they happen, and folds them into per line counters when the
+// parse ends. A backtrack is an operator entered behind the furthest offset
+// already reached. Holds the results of the last parse.
+class HeatMap {
+public:
+  struct Line {
+    size_t line;
+    size_t invocations;
+    size_t backtracks;
+    size_t failures;
+  };
+
+  // A rule invoked more than once at the same offset
+  struct Range {
+    size_t begin;
+    size_t end; // end of the longest match, begin if the rule never matched
+    std::pair<size_t, size_t> from;
+    std::pair<size_t, size_t> to;
+    std::string rule;
+    size_t calls;
+  };
+
+  const std::vector<Line> &lines() const { return lines_; }
+
+  std::vector<Range> top_ranges(size_t count) const {
+    std::vector<const Call *> calls;
+    for (const auto &[key, call] : calls_) {
+      if (call.calls > 1) { calls.push_back(&call); }
+    }
+    auto n = (std::min)(count, calls.size());
+    std::partial_sort(calls.begin(), calls.begin() + n, calls.end(),
+                      [](auto a, auto b) {
+                        if (a->calls != b->calls) { return a->calls > b->calls; }
+                        if (a->pos != b->pos) { return a->pos < b->pos; }
+                        return a->rule < b->rule;
+                      });
+
+    std::vector<Range> ranges;
+    for (size_t i = 0; i < n; i++) {
+      auto &call = *calls[i];
+      ranges.push_back({call.pos, call.pos + call.len, line_info(call.pos),
+                        line_info(call.pos + call.len), names_[call.rule],
+                        call.calls});
+    }
+    return ranges;
+  }
+
+  void write_text(std::ostream &os, size_t top = 10) const {
+    size_t max = 0;
+    for (const auto &line : lines_) {
+      max = (std::max)(max, line.invocations);
+    }
+
+    char buff[BUFSIZ];
+    os << "    line  invocations   backtracks     failures  heat" << std::endl;
+    for (const auto &line : lines_) {
+      if (line.invocations == 0) { continue; }
+      auto width = (line.invocations * 40 + max - 1) / max;
+      snprintf(buff, BUFSIZ, "%8zu  %11zu  %11zu  %11zu  %s", line.line,
+               line.invocations, line.backtracks, line.failures,
+               std::string(width, '#').c_str());
+      os << buff << std::endl;
+    }
+
+    auto ranges = top_ranges(top);
+    if (ranges.empty()) { return; }
+    os << std::endl << "     calls  range                 rule" << std::endl;
+    for (const auto &range : ranges) {
+      auto span = std::to_string(range.from.first) + ":" +
+                  std::to_string(range.from.second) + "-" +
+                  std::to_string(range.to.first) + ":" +
+                  std::to_string(range.to.second);
+      snprintf(buff, BUFSIZ, "%10zu  %-20s  %s", range.calls, span.c_str(),
+               range.rule.c_str());
+      os << buff << std::endl;
+    }
+  }
+
+  void write_json(std::ostream &os, size_t top = 10) const {
+    os << "{\"lines\":[";
+    auto first = true;
+    for (const auto &line : lines_) {
+      if (line.invocations == 0) { continue; }
+      os << (first ? "" : ",") << "\n{\"line\":" << line.line
+         << ",\"invocations\":" << line.invocations
+         << ",\"backtracks\":" << line.backtracks
+         << ",\"failures\":" << line.failures << "}";
+      first = false;
+    }
+    os << "\n],\"ranges\":[";
+    first = true;
+    for (const auto &range : top_ranges(top)) {
+      os << (first ? "" : ",") << "\n{\"begin\":" << range.begin
+         << ",\"end\":" << range.end << ",\"line\":" << range.from.first
+         << ",\"column\":" << range.from.second << ",\"rule\":";
+      write_json_string(os, range.rule);
+      os << ",\"calls\":" << range.calls << "}";
+      first = false;
+    }
+    os << "\n]}\n";
+  }
+
+  // Tracer callbacks used by enable_heatmap_profiling
+  void start() {
+    s_ = nullptr;
+    furthest_ = 0;
+    offsets_.clear();
+    line_starts_.clear();
+    lines_.clear();
+    calls_.clear();
+  }
+
+  void enter(const Ope &ope, const char *s, const Context &c) {
+    if (!s_) {
+      s_ = c.s;
+      offsets_.assign(c.l + 1, Offset{});
+      line_starts_.push_back(0);
+      for (size_t i = 0; i < c.l; i++) {
+        if (c.s[i] == '\n') { line_starts_.push_back(i + 1); }
+      }
+    }
+
+    auto pos = static_cast<size_t>(s - c.s);
+    auto &offset = offsets_[pos];
+    offset.invocations++;
+    if (pos < furthest_) {
+      offset.backtracks++;
+    } else {
+      furthest_ = pos;
+    }
+
+    if (auto holder = dynamic_cast<const Holder *>(&ope)) {
+      auto id = holder->outer_->id;
+      if (id >= names_.size()) { names_.resize(id + 1); }
+      if (names_[id].empty()) { names_[id] = holder->name(); }
+
+      auto &call = calls_[pos * c.def_count + id];
+      call.rule = id;
+      call.pos = pos;
+      call.calls++;
+    }
+  }
+
+  void leave(const Ope &ope, const char *s, const Context &c, size_t len) {
+    auto pos = static_cast<size_t>(s - c.s);
+    if (fail(len)) {
+      offsets_[pos].failures++;
+      return;
+    }
+    furthest_ = (std::max)(furthest_, pos + len);
+
+    if (auto holder = dynamic_cast<const Holder *>(&ope)) {
+      auto &call = calls_[pos * c.def_count + holder->outer_->id];
+      call.len = (std::max)(call.len, len);
+    }
+  }
+
+  void end() {
+    lines_.resize(line_starts_.size());
+    size_t line = 0;
+    for (size_t pos = 0; pos < offsets_.size(); pos++) {
+      while (line + 1 < line_starts_.size() && line_starts_[line + 1] <= pos) {
+        line++;
+      }
+      auto &l = lines_[line];
+      l.line = line + 1;
+      l.invocations += offsets_[pos].invocations;
+      l.backtracks += offsets_[pos].backtracks;
+      l.failures += offsets_[pos].failures;
+    }
+    offsets_.clear();
+    offsets_.shrink_to_fit();
+  }
+
+private:
+  struct Offset {
+    size_t invocations = 0;
+    size_t backtracks = 0;
+    size_t failures = 0;
+  };
+
+  struct Call {
+    size_t rule = 0;
+    size_t pos = 0;
+    size_t len = 0;
+    size_t calls = 0;
+  };
+
+  std::pair<size_t, size_t> line_info(size_t pos) const {
+    auto it = std::upper_bound(line_starts_.begin(), line_starts_.end(), pos);
+    auto line = static_cast<size_t>(std::distance(line_starts_.begin(), it));
+    return std::pair(line, pos - line_starts_[line - 1] + 1);
+  }
+
+  const char *s_ = nullptr;
+  size_t furthest_ = 0;
+  std::vector<Offset> offsets_;
+  std::vector<size_t> line_starts_;
+  std::vector<Line> lines_;
+  std::unordered_map<size_t, Call> calls_;
+  std::vector<std::string> names_;
+};
+
+inline void enable_heatmap_profiling(parser &parser, HeatMap &heatmap) {
+  parser.enable_trace(
+      [](auto &ope, auto s, auto, auto &, auto &c, auto &,
+         std::any &trace_data) {
+        std::any_cast<HeatMap *>(trace_data)->enter(ope, s, c);
+      },
+      [](auto &ope, auto s, auto, auto &, auto &c, auto &, auto len,
+         std::any &trace_data) {
+        std::any_cast<HeatMap *>(trace_data)->leave(ope, s, c, len);
+      },
+      [&heatmap](auto &trace_data) {
+        heatmap.start();
+        trace_data = &heatmap;
+      },
+      [](auto &trace_data) { std::any_cast<HeatMap *>(trace_data)->end(); });
+}
 } // namespace peg